@@ -0,0 +1,1413 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Direct ANSI terminal I/O routines.  This is an alternative to the curses
+ * interface in tty.c (selected with -ansi): everything is drawn into a
+ * screen model of our own, and each frame is sent to the terminal with a
+ * single write() of just the escape sequences needed to bring it up to
+ * date.  The screen layout is the same as tty.c's.
+ */
+
+#include <assert.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include "tetrinet.h"
+#include "tetris.h"
+#include "io.h"
+#include "event.h"
+#include "keys.h"
+#include "textbuf.h"
+
+/*************************************************************************/
+
+/* Screen cells are ints holding a character in the low 8 bits and
+ * attributes above, like curses' chtype.  A color of zero in either field
+ * means the terminal's default. */
+
+#define AT_CHARMASK	0x000FF
+#define AT_FGMASK	0x00F00
+#define AT_BGMASK	0x0F000
+#define AT_FG(c)	(((c)+1) << 8)
+#define AT_BG(c)	(((c)+1) << 12)
+#define AT_BOLD		0x10000
+#define AT_UNDERLINE	0x20000
+#define AT_REVERSE	0x40000
+#define AT_ALTCHARSET	0x80000	/* VT100 line drawing characters */
+#define AT_FLAGS	(AT_BOLD | AT_UNDERLINE | AT_REVERSE)
+
+#define COLOR_BLACK	0
+#define COLOR_RED	1
+#define COLOR_GREEN	2
+#define COLOR_YELLOW	3
+#define COLOR_BLUE	4
+#define COLOR_MAGENTA	5
+#define COLOR_CYAN	6
+#define COLOR_WHITE	7
+
+#define MY_HLINE	(fancy ? 'q' | AT_ALTCHARSET : '-')
+#define MY_VLINE	(fancy ? 'x' | AT_ALTCHARSET : '|')
+#define MY_ULCORNER	(fancy ? 'l' | AT_ALTCHARSET : '+')
+#define MY_URCORNER	(fancy ? 'k' | AT_ALTCHARSET : '+')
+#define MY_LLCORNER	(fancy ? 'm' | AT_ALTCHARSET : '+')
+#define MY_LRCORNER	(fancy ? 'j' | AT_ALTCHARSET : '+')
+
+#define MY_HLINE2	(fancy ? 'q' | AT_ALTCHARSET | AT_BOLD : '=')
+#define MY_BOLD		(fancy ? AT_BOLD : 0)
+
+/*************************************************************************/
+
+/* Size of the screen */
+static int scrwidth, scrheight;
+
+/* The screen as we want it to look, and as the terminal shows it now. */
+static int *screen, *shown;
+
+/* Attributes for drawing characters which don't have their own. */
+static int cur_attr;
+
+/* Where to put the visible cursor, or -1 to hide it. */
+static int cursor_x = -1, cursor_y;
+
+/* What we know about the terminal's state: cursor position, attributes,
+ * cursor visibility.  -1 means unknown. */
+static int term_x = -1, term_y = -1, term_attr = -1, term_cursor = -1;
+
+/* Output waiting to be written. */
+static char *outbuf;
+static int outlen, outsize;
+
+/* Is output being held (see screen_hold())?  Was a refresh skipped?  When
+ * did we last update the terminal? */
+static int screen_held, refresh_pending;
+static struct timespec last_frame;
+
+/* Statistics for -stats: screen updates, cells and bytes sent in all and
+ * since the last update, and the most cells sent for any one update. */
+static long frames, cells_drawn, frame_cells, max_frame_cells, bytes_sent;
+
+/* Terminal settings to restore on exit. */
+static struct termios old_termios;
+
+/*************************************************************************/
+
+/* Text buffers: */
+
+typedef struct {
+    int x, y, width, height;
+    int line;		/* Window line to draw the next line of text on */
+    int scroll;		/* Number of lines scrolled back from the newest */
+    int open;		/* Nonzero if currently displayed */
+    TextRing text;
+} TextBuffer;
+
+static TextBuffer plinebuf, gmsgbuf, attdefbuf;
+
+/*************************************************************************/
+
+/* In-game text window coordinates, and whether it's open: */
+
+static int gmsg_inputopen;
+static int gmsg_inputpos, gmsg_inputheight;
+
+/*************************************************************************/
+/*************************** Screen model ********************************/
+/*************************************************************************/
+
+/* Put a character at the given position.  Attributes not given with the
+ * character are taken from cur_attr. */
+
+static void mvputch(int y, int x, int c)
+{
+    int attr = c & ~AT_CHARMASK;
+
+    if (x < 0 || y < 0 || x >= scrwidth || y >= scrheight)
+	return;
+    if (!(attr & (AT_FGMASK | AT_BGMASK)))
+	attr |= cur_attr & (AT_FGMASK | AT_BGMASK);
+    attr |= cur_attr & (AT_FLAGS | AT_ALTCHARSET);
+    screen[y*scrwidth + x] = (c & AT_CHARMASK) | attr;
+}
+
+static void mvputs(int y, int x, const char *s)
+{
+    while (*s)
+	mvputch(y, x++, (unsigned char) *s++);
+}
+
+static void mvputns(int y, int x, const char *s, int n)
+{
+    while (*s && n-- > 0)
+	mvputch(y, x++, (unsigned char) *s++);
+}
+
+static void hline(int y, int x, int c, int n)
+{
+    while (n-- > 0)
+	mvputch(y, x++, c);
+}
+
+static void vline(int y, int x, int c, int n)
+{
+    while (n-- > 0)
+	mvputch(y++, x, c);
+}
+
+/* Clear a rectangle to blanks in the default colors. */
+
+static void clear_area(int y, int x, int height, int width)
+{
+    int i, j;
+
+    for (j = y; j < y+height && j < scrheight; j++) {
+	for (i = x; i < x+width && i < scrwidth; i++)
+	    screen[j*scrwidth + i] = ' ';
+    }
+}
+
+static void clear_screen(void)
+{
+    clear_area(0, 0, scrheight, scrwidth);
+}
+
+/* Scroll a rectangle up one line, leaving the bottom line blank. */
+
+static void scroll_area(int y, int x, int height, int width)
+{
+    int j;
+
+    for (j = y; j < y+height-1; j++)
+	memcpy(&screen[j*scrwidth + x], &screen[(j+1)*scrwidth + x],
+	       width * sizeof(*screen));
+    clear_area(y+height-1, x, 1, width);
+}
+
+/*************************************************************************/
+
+/* Return a color attribute value. */
+
+static int getcolor(int fg, int bg)
+{
+    if (fg == COLOR_WHITE && bg == COLOR_BLACK)
+	return 0;
+    return AT_FG(fg) | AT_BG(bg);
+}
+
+/*************************************************************************/
+/*************************** Terminal output *****************************/
+/*************************************************************************/
+
+/* Add data to the output buffer. */
+
+static void out(const char *s, int len)
+{
+    if (outlen + len > outsize) {
+	char *new;
+	outsize = (outlen + len) * 2;
+	if (!(new = realloc(outbuf, outsize)))
+	    return;
+	outbuf = new;
+    }
+    memcpy(outbuf+outlen, s, len);
+    outlen += len;
+}
+
+static void outf(const char *fmt, ...)
+{
+    va_list args;
+    char buf[64];
+    int len;
+
+    va_start(args, fmt);
+    len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    out(buf, len);
+}
+
+/* Write out everything in the output buffer. */
+
+static void out_flush(void)
+{
+    int pos = 0, n;
+
+    while (pos < outlen) {
+	n = write(1, outbuf+pos, outlen-pos);
+	if (n < 0) {
+	    if (errno == EINTR)
+		continue;
+	    break;
+	}
+	pos += n;
+    }
+    bytes_sent += pos;
+    outlen = 0;
+}
+
+/*************************************************************************/
+
+/* Switch the terminal to the given attributes.  We only send the changes
+ * unless an attribute has to be turned off, which needs a full reset. */
+
+static void set_attr(int attr)
+{
+    char buf[32];
+    int len = 0;
+
+    if (attr == term_attr)
+	return;
+    if (term_attr < 0 || ((attr ^ term_attr) & AT_ALTCHARSET))
+	out(attr & AT_ALTCHARSET ? "\033(0" : "\033(B", 3);
+    if (term_attr < 0 || (term_attr & AT_FLAGS & ~attr)) {
+	len = sprintf(buf, "\033[0");
+	term_attr = 0;
+    }
+    if ((attr & ~term_attr) & AT_BOLD)
+	len += sprintf(buf+len, len ? ";1" : "\033[1");
+    if ((attr & ~term_attr) & AT_UNDERLINE)
+	len += sprintf(buf+len, len ? ";4" : "\033[4");
+    if ((attr & ~term_attr) & AT_REVERSE)
+	len += sprintf(buf+len, len ? ";7" : "\033[7");
+    if ((attr ^ term_attr) & AT_FGMASK) {
+	int fg = (attr & AT_FGMASK) >> 8;
+	len += sprintf(buf+len, "%s%d", len ? ";" : "\033[",
+		       fg ? 30 + fg-1 : 39);
+    }
+    if ((attr ^ term_attr) & AT_BGMASK) {
+	int bg = (attr & AT_BGMASK) >> 12;
+	len += sprintf(buf+len, "%s%d", len ? ";" : "\033[",
+		       bg ? 40 + bg-1 : 49);
+    }
+    if (len) {
+	buf[len++] = 'm';
+	out(buf, len);
+    }
+    term_attr = attr & ~AT_CHARMASK;
+}
+
+/*************************************************************************/
+
+/* Move the terminal's cursor to the given position, as cheaply as we can.
+ * @row and @shownrow are the screen model and terminal contents of that
+ * line; unchanged characters are cheaper to send again than a cursor
+ * movement sequence if there are only a few of them. */
+
+static void move_to(int y, int x, const int *row, const int *shownrow)
+{
+    int i;
+
+    if (y == term_y && x == term_x)
+	return;
+    if (y == term_y && x > term_x && x - term_x <= 4) {
+	for (i = term_x; i < x; i++) {
+	    if ((row[i] & ~AT_CHARMASK) != term_attr || row[i] != shownrow[i])
+		break;
+	}
+	if (i == x) {
+	    for (i = term_x; i < x; i++) {
+		char c = row[i] & AT_CHARMASK;
+		out(&c, 1);
+	    }
+	} else {
+	    outf("\033[%dC", x - term_x);
+	}
+    } else if (y == term_y && x == 0) {
+	out("\r", 1);
+    } else if (x == 0) {
+	outf("\033[%dH", y+1);
+    } else {
+	outf("\033[%d;%dH", y+1, x+1);
+    }
+    term_x = x;
+    term_y = y;
+}
+
+/*************************************************************************/
+
+/* Clear the terminal, and note that it's now all blank. */
+
+static void term_clear(void)
+{
+    int i;
+
+    term_attr = -1;
+    set_attr(0);
+    out("\033[H\033[2J", 7);
+    term_x = term_y = 0;
+    for (i = 0; i < scrwidth * scrheight; i++)
+	shown[i] = ' ';
+}
+
+/*************************************************************************/
+
+/* Set up the screen stuff. */
+
+static void sighandler(int sig);
+static void screen_cleanup(void);
+
+static void term_setup(void)
+{
+    struct termios t;
+
+    t = old_termios;
+    t.c_lflag &= ~(ICANON | ECHO);
+    t.c_cc[VMIN] = 0;
+    t.c_cc[VTIME] = 0;
+    tcsetattr(0, TCSANOW, &t);
+    out("\033[?1049h", 8);
+    term_cursor = -1;
+    term_clear();
+}
+
+static void term_restore(void)
+{
+    set_attr(0);
+    out("\033(B\033[?25h\033[?1049l", 17);
+    out_flush();
+    term_x = term_y = term_attr = term_cursor = -1;
+    tcsetattr(0, TCSANOW, &old_termios);
+}
+
+static void screen_setup(void)
+{
+    struct winsize ws;
+
+    /* Avoid messy keyfield signals while we're setting up */
+    signal(SIGINT, SIG_IGN);
+    signal(SIGTSTP, SIG_IGN);
+
+    if (ioctl(1, TIOCGWINSZ, &ws) < 0 || !ws.ws_row || !ws.ws_col) {
+	ws.ws_row = getenv("LINES") ? atoi(getenv("LINES")) : 24;
+	ws.ws_col = getenv("COLUMNS") ? atoi(getenv("COLUMNS")) : 80;
+    }
+    scrheight = ws.ws_row;
+    scrwidth = ws.ws_col - 1;  /* Don't draw in last column--this can cause scroll */
+
+    /* don't start with fewer lines */
+    if (scrheight < 50) {
+	fprintf(stderr, "You need at least 50 lines to play tetrinet.\n");
+	exit(1);
+    }
+
+    screen = calloc(scrwidth * scrheight, sizeof(*screen));
+    shown = calloc(scrwidth * scrheight, sizeof(*shown));
+    if (!screen || !shown) {
+	perror("tetrinet");
+	exit(1);
+    }
+    clear_screen();
+
+    /* Set up the text buffers' histories.  If there's not enough memory,
+     * the buffers just stay empty. */
+    textring_init(&plinebuf.text, scrollback);
+    textring_init(&gmsgbuf.text, scrollback);
+    textring_init(&attdefbuf.text, scrollback);
+
+    tcgetattr(0, &old_termios);
+    term_setup();
+
+    /* Cancel all this when we exit. */
+    atexit(screen_cleanup);
+
+    /* Catch signals so we can exit cleanly. */
+    signal(SIGINT, sighandler);
+    signal(SIGTERM, sighandler);
+    signal(SIGHUP, sighandler);
+    signal(SIGUSR1, sighandler);
+    signal(SIGUSR2, sighandler);
+    signal(SIGALRM, sighandler);
+    signal(SIGTSTP, sighandler);
+#ifdef SIGXCPU
+    signal(SIGXCPU, sighandler);
+#endif
+#ifdef SIGXFSZ
+    signal(SIGXFSZ, sighandler);
+#endif
+
+    /* Broken pipes don't want to bother us at all. */
+    signal(SIGPIPE, SIG_IGN);
+}
+
+/*************************************************************************/
+
+/* Clean up the screen on exit. */
+
+static void screen_cleanup(void)
+{
+    move_to(scrheight-1, 0, screen + (scrheight-1)*scrwidth,
+	    shown + (scrheight-1)*scrwidth);
+    term_restore();
+    printf("\n");
+    if (show_stats) {
+	printf("%ld screen updates, %ld cells drawn"
+	       " (%.1f per update, at most %ld), %ld bytes sent\n",
+	       frames, cells_drawn,
+	       frames ? (double) cells_drawn / frames : 0.0, max_frame_cells,
+	       bytes_sent);
+    }
+}
+
+/*************************************************************************/
+
+/* Little signal handler that just does an exit(1) (thereby getting our
+ * cleanup routine called), except for TSTP, which does a clean suspend.
+ */
+
+static void screen_refresh(void);
+
+static void sighandler(int sig)
+{
+    if (sig != SIGTSTP) {
+	term_restore();
+	psignal(sig, "tetrinet");
+	exit(1);
+    }
+    term_restore();
+    signal(SIGTSTP, SIG_DFL);
+    raise(SIGTSTP);
+    term_setup();
+    screen_refresh();
+    signal(SIGTSTP, sighandler);
+}
+
+/*************************************************************************/
+
+/* Send the terminal everything that has changed since the last update. */
+
+static void screen_refresh(void)
+{
+    int x, y;
+
+    if (screen_held) {
+	refresh_pending = 1;
+	return;
+    }
+    refresh_pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+
+    if (term_cursor != 0 && cursor_x < 0) {
+	out("\033[?25l", 6);
+	term_cursor = 0;
+    }
+    for (y = 0; y < scrheight; y++) {
+	const int *row = screen + y*scrwidth;
+	int *shownrow = shown + y*scrwidth;
+	int blank;	/* Where the trailing blanks of the row start */
+
+	if (memcmp(row, shownrow, scrwidth * sizeof(*row)) == 0)
+	    continue;
+	for (blank = scrwidth; blank > 0 && row[blank-1] == ' '; blank--)
+	    ;
+	for (x = 0; x < scrwidth; x++) {
+	    char c;
+	    if (row[x] == shownrow[x])
+		continue;
+	    if (x >= blank && x+4 < scrwidth) {
+		/* Blank out the rest of the line in one go. */
+		move_to(y, x, row, shownrow);
+		set_attr(0);
+		out("\033[K", 3);
+		for (; x < scrwidth; x++) {
+		    if (shownrow[x] != ' ')
+			frame_cells++;
+		    shownrow[x] = ' ';
+		}
+		break;
+	    }
+	    move_to(y, x, row, shownrow);
+	    set_attr(row[x] & ~AT_CHARMASK);
+	    c = row[x] & AT_CHARMASK;
+	    out(&c, 1);
+	    term_x++;
+	    shownrow[x] = row[x];
+	    frame_cells++;
+	}
+    }
+    if (cursor_x >= 0) {
+	move_to(cursor_y, cursor_x, screen + cursor_y*scrwidth,
+		shown + cursor_y*scrwidth);
+	if (term_cursor != 1) {
+	    out("\033[?25h", 6);
+	    term_cursor = 1;
+	}
+    }
+
+    frames++;
+    cells_drawn += frame_cells;
+    if (frame_cells > max_frame_cells)
+	max_frame_cells = frame_cells;
+    frame_cells = 0;
+    out_flush();
+}
+
+/*************************************************************************/
+
+/* Like screen_refresh(), but clear the screen first. */
+
+static void screen_redraw(void)
+{
+    term_clear();
+    screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Return in @ts the earliest time we may next update the terminal. */
+
+static void next_frame(struct timespec *ts)
+{
+    *ts = last_frame;
+    if (max_fps > 0) {
+	ts->tv_nsec += 1000000000 / max_fps;
+	ts->tv_sec += ts->tv_nsec / 1000000000;
+	ts->tv_nsec %= 1000000000;
+    }
+}
+
+/*************************************************************************/
+
+/* Hold and release terminal output, as for the curses interface. */
+
+static void screen_hold(void)
+{
+    screen_held = 1;
+}
+
+static void screen_flush(int urgent)
+{
+    struct timespec now, frame;
+
+    if (!refresh_pending) {
+	screen_held = 0;
+	return;
+    }
+    if (!urgent) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_frame(&frame);
+	if (now.tv_sec < frame.tv_sec
+	 || (now.tv_sec == frame.tv_sec && now.tv_nsec < frame.tv_nsec))
+	    return;
+    }
+    screen_held = 0;
+    screen_refresh();
+}
+
+/*************************************************************************/
+/******************************* Input stuff *****************************/
+/*************************************************************************/
+
+/* Wait for keyboard or server input or for the deadline to pass, and
+ * return the INPUT_* flags for whatever is ready.  If there are changes
+ * waiting for the next frame, wake up in time to draw them too, and
+ * likewise if there's an escape sequence to finish decoding.
+ */
+
+static int wait_for_input(const struct timespec *deadline)
+{
+    struct timespec frame;
+    const struct timespec *esc = key_deadline();
+    int ready;
+
+    if (refresh_pending) {
+	next_frame(&frame);
+	deadline = event_earliest(deadline, &frame);
+    }
+    ready = event_wait(event_earliest(deadline, esc));
+    if (esc)
+	ready |= INPUT_KEY;
+    return ready;
+}
+
+/*************************************************************************/
+
+/* Return the next key pressed as an ASCII code 0-255 or a K_* value, or -1
+ * if there are no more keys waiting.
+ */
+
+static int read_key(void)
+{
+    return key_read(0);
+}
+
+/*************************************************************************/
+/************************* Text buffer routines **************************/
+/*************************************************************************/
+
+/* Return the screen attributes for TEXT_* attributes. */
+
+static int text_attr(int attr)
+{
+    static const int cmap[8] = {
+	COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
+	COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE,
+    };
+    int a = 0, c = attr & TEXT_COLOR;
+
+    if (attr & TEXT_HASCOLOR)
+	a |= getcolor(c == 0 ? COLOR_WHITE : cmap[c % 8], COLOR_BLACK)
+	   | (AT_BOLD * (c / 8));
+    if (attr & TEXT_BOLD)
+	a |= AT_BOLD;
+    if (attr & TEXT_ITALIC)
+	a |= AT_REVERSE;
+    if (attr & TEXT_UNDERLINE)
+	a |= AT_UNDERLINE;
+    return a;
+}
+
+/*************************************************************************/
+
+/* Draw line @n of a wrapped message on the given line of a text buffer's
+ * window. */
+
+static void draw_line(TextBuffer *buf, int y, const TextWrap *wrap, int n)
+{
+    const TextLine *line = &wrap->line[n];
+    const TextSpan *span = &wrap->span[line->first];
+    int i, len, x = line->indent;
+
+    for (i = 0; i < line->nspans && x < buf->width; i++, span++) {
+	len = span->len < buf->width - x ? span->len : buf->width - x;
+	cur_attr = text_attr(span->attr);
+	mvputns(buf->y + y, buf->x + x, span->s, len);
+	x += len;
+    }
+    cur_attr = 0;
+}
+
+/*************************************************************************/
+
+/* Put line @n of a wrapped message at the bottom of a text buffer's
+ * window. */
+
+static void outline(TextBuffer *buf, const TextWrap *wrap, int n)
+{
+    if (buf->line == buf->height) {
+	scroll_area(buf->y, buf->x, buf->height, buf->width);
+	buf->line--;
+    }
+    draw_line(buf, buf->line, wrap, n);
+    buf->line++;
+}
+
+/*************************************************************************/
+
+/* Return the text buffer for a BUFFER_* number, or NULL if none. */
+
+static TextBuffer *get_textbuf(int bufnum)
+{
+    switch (bufnum) {
+	case BUFFER_PLINE:  return &plinebuf;
+	case BUFFER_GMSG:   return &gmsgbuf;
+	case BUFFER_ATTDEF: return &attdefbuf;
+	default:            return NULL;
+    }
+}
+
+/*************************************************************************/
+
+static void draw_text(int bufnum, const char *s)
+{
+    TextWrap wrap;
+    int i, n;
+    TextBuffer *buf;
+
+    if (!(buf = get_textbuf(bufnum)) || !buf->text.data)
+	return;
+    textring_add(&buf->text, s);
+    if (!buf->open)
+	return;
+    n = text_wrap(s, buf->width, &wrap);
+    if (buf->scroll) {
+	/* Leave the window showing what it was. */
+	buf->scroll += n;
+	return;
+    }
+    for (i = 0; i < n; i++)
+	outline(buf, &wrap, i);
+    screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Clear the contents of a text buffer. */
+
+static void clear_text(int bufnum)
+{
+    TextBuffer *buf;
+
+    if (!(buf = get_textbuf(bufnum)))
+	return;
+    if (buf->text.data)
+	textring_clear(&buf->text);
+    buf->line = 0;
+    buf->scroll = 0;
+    if (buf->open) {
+	clear_area(buf->y, buf->x, buf->height, buf->width);
+	screen_refresh();
+    }
+}
+
+/*************************************************************************/
+
+/* Redraw the window for the given text buffer from its history, wrapping
+ * the messages to the window's current width and leaving out the newest
+ * buf->scroll lines.
+ */
+
+static void restore_text(TextBuffer *buf)
+{
+    TextWrap wrap;
+    const char *s;
+    int total = 0, first, oldest, i, n;
+
+    clear_area(buf->y, buf->x, buf->height, buf->width);
+    buf->line = 0;
+    /* Find how many lines the messages we need take up... */
+    for (oldest = 0; total < buf->height + buf->scroll; oldest++) {
+	if (!(s = textring_get(&buf->text, oldest)))
+	    break;
+	total += text_wrap(s, buf->width, &wrap);
+    }
+    if (buf->scroll > total - buf->height)
+	buf->scroll = total > buf->height ? total - buf->height : 0;
+    first = total - buf->height - buf->scroll;
+    /* ...and draw them, oldest first. */
+    total = 0;
+    while (--oldest >= 0) {
+	n = text_wrap(textring_get(&buf->text, oldest), buf->width, &wrap);
+	for (i = 0; i < n && buf->line < buf->height; i++, total++) {
+	    if (total >= first)
+		outline(buf, &wrap, i);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Scroll a text buffer back or forward through its history. */
+
+static void scroll_text(int bufnum, int pages)
+{
+    TextBuffer *buf;
+
+    if (!(buf = get_textbuf(bufnum)) || !buf->text.data)
+	return;
+    buf->scroll += pages * (buf->height > 2 ? buf->height - 1 : 1);
+    if (buf->scroll < 0)
+	buf->scroll = 0;
+    if (buf->open) {
+	restore_text(buf);
+	screen_refresh();
+    }
+}
+
+/*************************************************************************/
+
+/* Open a window for the given text buffer. */
+
+static void open_textwin(TextBuffer *buf)
+{
+    if (buf->height <= 0 || buf->width <= 0) {
+	char str[256];
+	snprintf(str, sizeof(str), "ERROR: bad textwin size (%d,%d)",
+			buf->width, buf->height);
+	mvputs(scrheight-1, 0, str);
+	screen_refresh();
+	exit(1);
+    }
+    buf->open = 1;
+    if (buf->text.data)
+	restore_text(buf);
+}
+
+/*************************************************************************/
+
+/* Close the window for the given text buffer, if it's open. */
+
+static void close_textwin(TextBuffer *buf)
+{
+    buf->open = 0;
+}
+
+/*************************************************************************/
+/************************ Field drawing routines *************************/
+/*************************************************************************/
+
+/* Are we on a wide screen (>=92 columns)? */
+static int wide_screen = 0;
+
+/* Field display X/Y coordinates. */
+static const int own_coord[2] = {1,0};
+static int other_coord[5][2] =	/* Recomputed based on screen width */
+    { {30,0}, {47,0}, {64,0}, {47,24}, {64,24} };
+
+/* Position of the status window. */
+static const int status_coord[2]     = {29,25};
+static const int next_coord[2]       = {41,24};
+static const int alt_status_coord[2] = {29,2};
+static const int alt_next_coord[2]   = {30,8};
+
+/* Position of the attacks/defenses window. */
+static const int attdef_coord[2] = {28,28};
+static const int alt_attdef_coord[2] = {28,24};
+
+/* Position of the text window.  X coordinate is ignored. */
+static const int field_text_coord[2] = {0,47};
+
+/* Information for drawing blocks.  Color attributes are added to blocks in
+ * the setup_fields() routine. */
+static int tile_chars[15] =
+    { ' ',' ',' ',' ',' ',' ','a','c','n','r','s','b','g','q','o' };
+
+/* Are we redrawing the entire display? */
+static int field_redraw = 0;
+
+/*************************************************************************/
+
+/* Draw the status line at the bottom of the screen. */
+
+static void draw_keys_line(void)
+{
+    hline(scrheight-2, 0, MY_HLINE2, scrwidth);
+    cur_attr = MY_BOLD;
+    mvputs(scrheight-1, 0, "F1=Show Fields  F2=Partyline  F3=Winlist");
+    mvputs(scrheight-1, scrwidth-8, "F10=Quit");
+    cur_attr = 0;
+}
+
+/*************************************************************************/
+
+/* Draw a player's name and team down the side of their field. */
+
+static void draw_player_name(int player, int x, int y, int team_x)
+{
+    char buf[32];
+    int i;
+
+    sprintf(buf, "%d", player);
+    mvputs(y, x-1, buf);
+    if (players[player-1]) {
+	for (i = 0; i < FIELD_HEIGHT-2 && players[player-1][i]; i++)
+	    mvputch(y+i+2, x-1, (unsigned char) players[player-1][i]);
+	if (teams[player-1]) {
+	    mvputs(y, team_x, "T");
+	    for (i = 0; i < FIELD_HEIGHT-2 && teams[player-1][i]; i++)
+		mvputch(y+i+2, team_x, (unsigned char) teams[player-1][i]);
+	}
+    }
+}
+
+/*************************************************************************/
+
+static void draw_own_field(void);
+static void draw_other_field(int player);
+static void draw_status(void);
+static void draw_specials(void);
+static void draw_gmsg_input(const char *s, int pos);
+
+static void setup_fields(void)
+{
+    int i, j, x, y, base, delta, attdefbot;
+
+    if (!(tile_chars[1] & AT_BOLD)) {
+	for (i = 1; i < 15; i++)
+	    tile_chars[i] |= AT_BOLD;
+	tile_chars[1] |= getcolor(COLOR_BLUE, COLOR_BLUE);
+	tile_chars[2] |= getcolor(COLOR_YELLOW, COLOR_YELLOW);
+	tile_chars[3] |= getcolor(COLOR_GREEN, COLOR_GREEN);
+	tile_chars[4] |= getcolor(COLOR_MAGENTA, COLOR_MAGENTA);
+	tile_chars[5] |= getcolor(COLOR_RED, COLOR_RED);
+    }
+
+    field_redraw = 1;
+    cursor_x = -1;
+    close_textwin(&plinebuf);
+    cur_attr = 0;
+    clear_screen();
+
+    if (scrwidth >= 92) {
+	wide_screen = 1;
+	base = 41;
+    } else {
+	base = 28;
+    }
+    delta = (scrwidth - base) / 3;
+    base += 2 + (delta - (FIELD_WIDTH+5)) / 2;
+    other_coord[0][0] = base;
+    other_coord[1][0] = base + delta;
+    other_coord[2][0] = base + delta*2;
+    other_coord[3][0] = base + delta;
+    other_coord[4][0] = base + delta*2;
+
+    attdefbot = field_text_coord[1] - 1;
+    if (scrheight - field_text_coord[1] > 3) {
+	hline(field_text_coord[1], 0, MY_HLINE2, scrwidth);
+	attdefbot--;
+	if (scrheight - field_text_coord[1] > 5) {
+	    draw_keys_line();
+	    gmsgbuf.y = field_text_coord[1]+1;
+	    gmsgbuf.height = scrheight - field_text_coord[1] - 3;
+	} else {
+	    gmsgbuf.y = field_text_coord[1]+1;
+	    gmsgbuf.height = scrheight - field_text_coord[1] - 1;
+	}
+    } else {
+	gmsgbuf.y = field_text_coord[1];
+	gmsgbuf.height = scrheight - field_text_coord[1];
+    }
+    gmsgbuf.x = field_text_coord[0];
+    gmsgbuf.width = scrwidth;
+    open_textwin(&gmsgbuf);
+
+    x = own_coord[0];
+    y = own_coord[1];
+    draw_player_name(my_playernum, x, y, x+FIELD_WIDTH*2+2);
+    vline(y, x, MY_VLINE, FIELD_HEIGHT);
+    vline(y, x+FIELD_WIDTH*2+1, MY_VLINE, FIELD_HEIGHT);
+    mvputch(y+FIELD_HEIGHT, x, MY_LLCORNER);
+    hline(y+FIELD_HEIGHT, x+1, MY_HLINE, FIELD_WIDTH*2);
+    mvputch(y+FIELD_HEIGHT, x+FIELD_WIDTH*2+1, MY_LRCORNER);
+    mvputs(y+FIELD_HEIGHT+2, x, "Specials:");
+    draw_own_field();
+    draw_specials();
+
+    for (j = 0; j < 5; j++) {
+	int player = j+1 >= my_playernum ? j+2 : j+1;
+
+	x = other_coord[j][0];
+	y = other_coord[j][1];
+	vline(y, x, MY_VLINE, FIELD_HEIGHT);
+	vline(y, x+FIELD_WIDTH+1, MY_VLINE, FIELD_HEIGHT);
+	mvputch(y+FIELD_HEIGHT, x, MY_LLCORNER);
+	hline(y+FIELD_HEIGHT, x+1, MY_HLINE, FIELD_WIDTH);
+	mvputch(y+FIELD_HEIGHT, x+FIELD_WIDTH+1, MY_LRCORNER);
+	draw_player_name(player, x, y, x+FIELD_WIDTH+2);
+	draw_other_field(player);
+    }
+
+    if (wide_screen) {
+	x = alt_status_coord[0];
+	y = alt_status_coord[1];
+	mvputs(y, x, "Lines:");
+	mvputs(y+1, x, "Level:");
+	x = alt_next_coord[0];
+	y = alt_next_coord[1];
+	mvputs(y-2, x-1, "Next piece:");
+	mvputch(y-1, x-1, MY_ULCORNER);
+	hline(y-1, x, MY_HLINE, 8);
+	mvputch(y-1, x+8, MY_URCORNER);
+	vline(y, x-1, MY_VLINE, 8);
+	vline(y, x+8, MY_VLINE, 8);
+	mvputch(y+8, x-1, MY_LLCORNER);
+	hline(y+8, x, MY_HLINE, 8);
+	mvputch(y+8, x+8, MY_LRCORNER);
+    } else {
+	x = status_coord[0];
+	y = status_coord[1];
+	mvputs(y-1, x, "Next piece:");
+	mvputs(y, x, "Lines:");
+	mvputs(y+1, x, "Level:");
+    }
+    if (playing_game)
+	draw_status();
+
+    attdefbuf.x = wide_screen ? alt_attdef_coord[0] : attdef_coord[0];
+    attdefbuf.y = wide_screen ? alt_attdef_coord[1] : attdef_coord[1];
+    attdefbuf.width = (other_coord[3][0]-1) - attdefbuf.x;
+    attdefbuf.height = (attdefbot+1) - attdefbuf.y;
+    open_textwin(&attdefbuf);
+
+    if (gmsg_inputopen) {
+	gmsg_inputopen = 0;
+	draw_gmsg_input(NULL, -1);
+    }
+
+    screen_refresh();
+    field_redraw = 0;
+}
+
+/*************************************************************************/
+
+/* Display the player's own field.  Only rows which have changed since the
+ * last time are drawn, unless we're redrawing the entire display; the
+ * screen model takes care of sending only the cells which changed.
+ */
+
+static void draw_own_field(void)
+{
+    int x, y, x0, y0, rows;
+    Field *f = &fields[my_playernum-1];
+
+    if (dispmode != MODE_FIELDS)
+	return;
+
+    rows = field_redraw ? ALL_ROWS : dirty_rows[my_playernum-1];
+    dirty_rows[my_playernum-1] = 0;
+    x0 = own_coord[0]+1;
+    y0 = own_coord[1];
+    for (y = 0; y < 22; y++) {
+	if (!(rows & ROW(y)))
+	    continue;
+	for (x = 0; x < 12; x++) {
+	    int c = tile_chars[(int) (*f)[y][x]];
+
+	    mvputch(y0+y, x0+x*2, c);
+	    mvputch(y0+y, x0+x*2+1, c);
+	}
+    }
+    if (gmsg_inputopen) {
+	gmsg_inputopen = 0;
+	draw_gmsg_input(NULL, -1);
+    }
+    if (!field_redraw)
+	screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Display another player's field. */
+
+static void draw_other_field(int player)
+{
+    int x, y, x0, y0, rows;
+    Field *f;
+
+    if (dispmode != MODE_FIELDS)
+	return;
+    f = &fields[player-1];
+    rows = field_redraw ? ALL_ROWS : dirty_rows[player-1];
+    dirty_rows[player-1] = 0;
+    if (player > my_playernum)
+	player--;
+    player--;
+    x0 = other_coord[player][0]+1;
+    y0 = other_coord[player][1];
+    for (y = 0; y < 22; y++) {
+	if (!(rows & ROW(y)))
+	    continue;
+	for (x = 0; x < 12; x++)
+	    mvputch(y0+y, x0+x, tile_chars[(int) (*f)[y][x]]);
+    }
+    if (gmsg_inputopen) {
+	gmsg_inputopen = 0;
+	draw_gmsg_input(NULL, -1);
+    }
+    if (!field_redraw)
+	screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Display the current game status (level, lines, next piece). */
+
+static void draw_status(void)
+{
+    int x, y, i, j;
+    char buf[32], shape[4][4];
+
+    x = wide_screen ? alt_status_coord[0] : status_coord[0];
+    y = wide_screen ? alt_status_coord[1] : status_coord[1];
+    sprintf(buf, "%d", lines>99999 ? 99999 : lines);
+    mvputs(y, x+7, buf);
+    sprintf(buf, "%d", levels[my_playernum]);
+    mvputs(y+1, x+7, buf);
+    x = wide_screen ? alt_next_coord[0] : next_coord[0];
+    y = wide_screen ? alt_next_coord[1] : next_coord[1];
+    if (get_shape(next_piece, 0, shape) == 0) {
+	for (j = 0; j < 4; j++) {
+	    for (i = 0; i < 4; i++) {
+		int c = tile_chars[(int) shape[j][i]];
+		if (wide_screen) {
+		    mvputch(y+j*2, x+i*2, c);
+		    mvputch(y+j*2, x+i*2+1, c);
+		    mvputch(y+j*2+1, x+i*2, c);
+		    mvputch(y+j*2+1, x+i*2+1, c);
+		} else
+		    mvputch(y+j, x+i, c);
+	    }
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Display the special inventory and description of the current special. */
+
+static const char *descs[] = {
+    "                    ",
+    "Add Line            ",
+    "Clear Line          ",
+    "Nuke Field          ",
+    "Clear Random Blocks ",
+    "Switch Fields       ",
+    "Clear Special Blocks",
+    "Block Gravity       ",
+    "Blockquake          ",
+    "Block Bomb          "
+};
+
+static void draw_specials(void)
+{
+    int x, y, i;
+
+    if (dispmode != MODE_FIELDS)
+	return;
+    x = own_coord[0];
+    y = own_coord[1]+45;
+    mvputs(y, x, descs[specials[0]+1]);
+    i = 0;
+    while (i < special_capacity && specials[i] >= 0 && x < attdef_coord[0]-1) {
+	mvputch(y+1, x+10, tile_chars[specials[i]+6]);
+	i++;
+	x++;
+    }
+    while (x < attdef_coord[0]-1) {
+	mvputch(y+1, x+10, tile_chars[0]);
+	x++;
+    }
+    if (!field_redraw)
+	screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Display an attack/defense message. */
+
+static const char *msgs[][2] = {
+    { "cs1", "1 Line Added to All" },
+    { "cs2", "2 Lines Added to All" },
+    { "cs4", "4 Lines Added to All" },
+    { "a",   "Add Line" },
+    { "c",   "Clear Line" },
+    { "n",   "Nuke Field" },
+    { "r",   "Clear Random Blocks" },
+    { "s",   "Switch Fields" },
+    { "b",   "Clear Special Blocks" },
+    { "g",   "Block Gravity" },
+    { "q",   "Blockquake" },
+    { "o",   "Block Bomb" },
+    { NULL }
+};
+
+static void draw_attdef(const char *type, int from, int to)
+{
+    int i;
+    char buf[512];
+
+    for (i = 0; msgs[i][0]; i++) {
+	if (strcmp(type, msgs[i][0]) == 0)
+	    break;
+    }
+    if (!msgs[i][0])
+	return;
+    strcpy(buf, msgs[i][1]);
+    if (to != 0)
+	sprintf(buf+strlen(buf), " on %s", players[to-1]);
+    if (from == 0)
+	sprintf(buf+strlen(buf), " by Server");
+    else
+	sprintf(buf+strlen(buf), " by %s", players[from-1]);
+    draw_text(BUFFER_ATTDEF, buf);
+}
+
+/*************************************************************************/
+
+/* Display the in-game text window. */
+
+static void draw_gmsg_input(const char *s, int pos)
+{
+    static int start = 0;	/* Start of displayed part of input line */
+    static const char *last_s;
+    static int last_pos;
+    int y;
+
+    if (s)
+	last_s = s;
+    else
+	s = last_s;
+    if (pos >= 0)
+	last_pos = pos;
+    else
+	pos = last_pos;
+
+    cur_attr = 0;
+    if (!gmsg_inputopen) {
+	gmsg_inputpos = scrheight/2 - 1;
+	gmsg_inputheight = 3;
+	clear_area(gmsg_inputpos, 0, gmsg_inputheight, scrwidth);
+	mvputs(gmsg_inputpos+1, 0, "Text>");
+	gmsg_inputopen = 1;
+    }
+    y = gmsg_inputpos+1;
+
+    if (strlen(s) < scrwidth-7) {
+	start = 0;
+	clear_area(y, 6, 1, scrwidth-6);
+	mvputs(y, 6, s);
+    } else {
+	if (pos < start+8) {
+	    start = pos-8;
+	    if (start < 0)
+		start = 0;
+	} else if (pos > start + scrwidth-15) {
+	    start = pos - (scrwidth-15);
+	    if (start > strlen(s) - (scrwidth-7))
+		start = strlen(s) - (scrwidth-7);
+	}
+	mvputns(y, 6, s+start, scrwidth-6);
+    }
+    cursor_x = 6 + (pos-start);
+    cursor_y = y;
+    screen_refresh();
+}
+
+/*************************************************************************/
+
+/* Clear the in-game text window. */
+
+static void clear_gmsg_input(void)
+{
+    if (gmsg_inputopen) {
+	gmsg_inputopen = 0;
+	setup_fields();
+	cursor_x = -1;
+	screen_refresh();
+    }
+}
+
+/*************************************************************************/
+/*************************** Partyline display ***************************/
+/*************************************************************************/
+
+static void setup_partyline(void)
+{
+    close_textwin(&gmsgbuf);
+    close_textwin(&attdefbuf);
+    cur_attr = 0;
+    clear_screen();
+
+    plinebuf.x = plinebuf.y = 0;
+    plinebuf.width = scrwidth;
+    plinebuf.height = scrheight-4;
+    open_textwin(&plinebuf);
+
+    hline(scrheight-4, 0, MY_HLINE, scrwidth);
+    mvputs(scrheight-3, 0, "> ");
+    draw_keys_line();
+
+    cursor_x = 2;
+    cursor_y = scrheight-3;
+    screen_refresh();
+}
+
+/*************************************************************************/
+
+static void draw_partyline_input(const char *s, int pos)
+{
+    static int start = 0;	/* Start of displayed part of input line */
+
+    cur_attr = 0;
+    if (strlen(s) < scrwidth-3) {
+	start = 0;
+	clear_area(scrheight-3, 2, 1, scrwidth-2);
+	mvputs(scrheight-3, 2, s);
+    } else {
+	if (pos < start+8) {
+	    start = pos-8;
+	    if (start < 0)
+		start = 0;
+	} else if (pos > start + scrwidth-11) {
+	    start = pos - (scrwidth-11);
+	    if (start > strlen(s) - (scrwidth-3))
+		start = strlen(s) - (scrwidth-3);
+	}
+	mvputns(scrheight-3, 2, s+start, scrwidth-2);
+    }
+    cursor_x = 2 + (pos-start);
+    cursor_y = scrheight-3;
+    screen_refresh();
+}
+
+/*************************************************************************/
+/**************************** Winlist display ****************************/
+/*************************************************************************/
+
+static void setup_winlist(void)
+{
+    int i, x;
+    char buf[32];
+
+    cursor_x = -1;
+    close_textwin(&plinebuf);
+    cur_attr = 0;
+    clear_screen();
+
+    for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
+	x = scrwidth/2 - strlen(winlist[i].name);
+	if (x < 0)
+	    x = 0;
+	if (winlist[i].team) {
+	    if (x < 4)
+		x = 4;
+	    mvputs(i*2, x-4, "<T>");
+	}
+	mvputs(i*2, x, winlist[i].name);
+	snprintf(buf, sizeof(buf), "%4d", winlist[i].points);
+	if (winlist[i].games) {
+	    int avg100 = winlist[i].points*100 / winlist[i].games;
+	    snprintf(buf+strlen(buf), sizeof(buf)-strlen(buf),
+			"   %d.%02d",avg100/100, avg100%100);
+	}
+	x += strlen(winlist[i].name) + 2;
+	if (x > scrwidth - strlen(buf))
+	    x = scrwidth - strlen(buf);
+	mvputs(i*2, x, buf);
+    }
+
+    draw_keys_line();
+    screen_refresh();
+}
+
+/*************************************************************************/
+/************************** Interface declaration ************************/
+/*************************************************************************/
+
+Interface ansi_interface = {
+
+    wait_for_input,
+    read_key,
+
+    screen_setup,
+    screen_refresh,
+    screen_redraw,
+    screen_hold,
+    screen_flush,
+
+    draw_text,
+    clear_text,
+    scroll_text,
+
+    setup_fields,
+    draw_own_field,
+    draw_other_field,
+    draw_status,
+    draw_specials,
+    draw_attdef,
+    draw_gmsg_input,
+    clear_gmsg_input,
+
+    setup_partyline,
+    draw_partyline_input,
+
+    setup_winlist
+};
+
+/*************************************************************************/
@@ -0,0 +1,1050 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Engine microbenchmarks.  "make bench" builds and runs this; the results
+ * are written to standard output as JSON so they can be compared between
+ * revisions.
+ *
+ * The engine's hot paths are mostly static functions, so rather than
+ * exporting them we build the whole program into this one translation
+ * unit.  Allocations made by the code under test are counted by wrapping
+ * the allocator before the engine sources are included.
+ *
+ * Before timing anything, every set of field kernels the CPU supports is
+ * checked against the plain C kernels, and we bail out if they disagree.
+ */
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/*************************************************************************/
+
+static long nallocs;	/* Allocations since the start of the benchmark */
+
+/* Not every wrapper has a caller in every configuration. */
+#ifdef __GNUC__
+# define MAYBE_UNUSED	__attribute__((unused))
+#else
+# define MAYBE_UNUSED
+#endif
+
+static MAYBE_UNUSED void *bench_malloc(size_t size)
+{
+    nallocs++;
+    return malloc(size);
+}
+
+static MAYBE_UNUSED void *bench_calloc(size_t nmemb, size_t size)
+{
+    nallocs++;
+    return calloc(nmemb, size);
+}
+
+static MAYBE_UNUSED void *bench_realloc(void *ptr, size_t size)
+{
+    nallocs++;
+    return realloc(ptr, size);
+}
+
+static MAYBE_UNUSED char *bench_strdup(const char *s)
+{
+    nallocs++;
+    return strdup(s);
+}
+
+#define malloc(size)		bench_malloc(size)
+#define calloc(nmemb,size)	bench_calloc(nmemb, size)
+#define realloc(ptr,size)	bench_realloc(ptr, size)
+#define strdup(s)		bench_strdup(s)
+
+/* The client and the server both have a main() and an init(). */
+#define main tetrinet_main
+#include "tetrinet.c"
+#undef main
+#include "tetris.c"
+#include "event.c"
+#include "field.c"
+#include "lobby.c"
+#include "msg.c"
+#include "netlog.c"
+#include "query.c"
+#include "record.c"
+#include "rng.c"
+#include "sockets.c"
+#include "textbuf.c"
+#include "reactor.c"
+#include "sched.c"
+#include "timer.c"
+#define init server_init
+#include "server.c"
+#undef init
+
+#undef malloc
+#undef calloc
+#undef realloc
+#undef strdup
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* The benchmarks run with no frontend; every drawing routine is a no-op. */
+
+static int null_wait_for_input(const struct timespec *deadline)
+    { return INPUT_TIMER; }
+static int null_read_key(void) { return -1; }
+static void null_void(void) { }
+static void null_flush(int urgent) { }
+static void null_text(int bufnum, const char *s) { }
+static void null_bufnum(int bufnum) { }
+static void null_scroll(int bufnum, int pages) { }
+static void null_player(int player) { }
+static void null_attdef(const char *type, int from, int to) { }
+static void null_input(const char *s, int pos) { }
+
+static Interface null_interface = {
+    null_wait_for_input,
+    null_read_key,
+    null_void, null_void, null_void, null_void, null_flush,
+    null_text, null_bufnum, null_scroll,
+    null_void, null_void, null_player, null_void, null_void,
+    null_attdef, null_input, null_void,
+    null_void, null_input,
+    null_void
+};
+
+/* tetrinet.c refers to the terminal frontends, which we don't link. */
+Interface tty_interface, ansi_interface;
+
+/*************************************************************************/
+
+/* Fields recorded from real games, in "f" message format.  The first is a
+ * typical mid-game field, the second has four completed lines waiting to
+ * be cleared, and the third is close to topping out.
+ */
+
+static const char *recorded_fields[] = {
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000220000"
+    "003002220010"
+    "033a42113110"
+    "233441113150"
+    "2224411b5550"
+    "5224c3312250"
+    "552433q12250",
+
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000000000000"
+    "000001100000"
+    "133a42113112"
+    "233441113154"
+    "2224411b5553"
+    "5224c3312251"
+    "552433q12254",
+
+    "000000000000"
+    "000440000000"
+    "004410000000"
+    "000510000000"
+    "000551000000"
+    "000251030000"
+    "002252333000"
+    "022212233000"
+    "0221o1223500"
+    "021111443550"
+    "021144431550"
+    "052144433150"
+    "0521n2233150"
+    "032222213150"
+    "033352113150"
+    "031353113150"
+    "003552211150"
+    "033a42113110"
+    "233441113150"
+    "2224411b5550"
+    "5224c3312250"
+    "552433q12250",
+};
+#define NRECORDED	(sizeof(recorded_fields) / sizeof(*recorded_fields))
+
+#define NRANDOM		64	/* Number of randomized fields */
+
+static Field bench_fields[NRECORDED + NRANDOM];
+#define NFIELDS		(sizeof(bench_fields) / sizeof(*bench_fields))
+
+/*************************************************************************/
+
+/* Private generator so that the randomized fields are the same on every
+ * run, independent of whatever the engine does with game_rng.
+ */
+
+static unsigned int bench_seed = 12345;
+
+static int bench_rand(int n)
+{
+    bench_seed = bench_seed * 1103515245 + 12345;
+    return (bench_seed >> 16) % n;
+}
+
+/*************************************************************************/
+
+/* Convert a field in "f" message format to a Field. */
+
+static void load_field(Field *f, const char *s)
+{
+    static const char specials[] = "acnrsbgqo";
+    int x, y;
+
+    for (y = 0; y < FIELD_HEIGHT; y++) {
+	for (x = 0; x < FIELD_WIDTH; x++, s++) {
+	    if (*s >= '0' && *s <= '5')
+		(*f)[y][x] = *s - '0';
+	    else
+		(*f)[y][x] = 6 + (strchr(specials, *s) - specials);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Generate a random field: a ragged stack of blocks with a few specials
+ * and holes, roughly what a field looks like part way through a game.
+ */
+
+static void random_field(Field *f)
+{
+    int x, y, height;
+
+    memset(*f, 0, sizeof(Field));
+    for (x = 0; x < FIELD_WIDTH; x++) {
+	height = 2 + bench_rand(FIELD_HEIGHT-4);
+	for (y = FIELD_HEIGHT-height; y < FIELD_HEIGHT; y++) {
+	    int r = bench_rand(100);
+	    if (r < 8)
+		(*f)[y][x] = 0;
+	    else if (r < 12)
+		(*f)[y][x] = 6 + bench_rand(9);
+	    else
+		(*f)[y][x] = 1 + bench_rand(5);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Build the message for field @f, the same way send_field() does when it
+ * sends a complete field.
+ */
+
+static void field_message(char *buf, int player, Field *f)
+{
+    static const char specials[] = "acnrsbgqo";
+    int x, y;
+    char *s;
+
+    s = buf + sprintf(buf, "f %d ", player);
+    for (y = 0; y < FIELD_HEIGHT; y++) {
+	for (x = 0; x < FIELD_WIDTH; x++) {
+	    if ((*f)[y][x] > 5)
+		*s++ = specials[(*f)[y][x]-6];
+	    else
+		*s++ = (*f)[y][x] + '0';
+	}
+    }
+    *s = 0;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Timing. */
+
+static double now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+#define MIN_TIME	2e8	/* Run each benchmark for at least 0.2s */
+
+static int nresults;
+
+/* Run @func repeatedly, doubling the iteration count until the run takes
+ * at least MIN_TIME, and print the result.  @func is passed the iteration
+ * number so it can cycle through its inputs.
+ */
+
+static void run(const char *name, void (*func)(long))
+{
+    long iters = 1, i;
+    double start, elapsed;
+    long allocs;
+
+    for (;;) {
+	nallocs = 0;
+	start = now_ns();
+	for (i = 0; i < iters; i++)
+	    func(i);
+	elapsed = now_ns() - start;
+	allocs = nallocs;
+	if (elapsed >= MIN_TIME)
+	    break;
+	iters *= 2;
+    }
+    printf("%s\n    {\"name\": \"%s\", \"iterations\": %ld,"
+	   " \"ns_per_op\": %.2f, \"allocs_per_op\": %.2f}",
+	   nresults++ ? "," : "", name, iters, elapsed / iters,
+	   (double) allocs / iters);
+    fflush(stdout);
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* The benchmarks themselves.  Most of them reset our field at the start of
+ * each iteration, since the routine under test changes it.
+ */
+
+static volatile int sink;	/* Keeps results from being optimized out */
+
+static void setup_field(long i)
+{
+    memcpy(fields[my_playernum-1], bench_fields[i % NFIELDS], sizeof(Field));
+}
+
+/*************************************************************************/
+
+static void bench_piece_overlaps(long i)
+{
+    Field *f = &bench_fields[i % NFIELDS];
+
+    memcpy(fields[my_playernum-1], f, sizeof(Field));
+    current_piece = i % 7;
+    current_rotation = (i / 7) % 4;
+    sink += piece_overlaps(1 + i % (FIELD_WIDTH-2), i % FIELD_HEIGHT, -1);
+}
+
+static void bench_clear_lines(long i)
+{
+    setup_field(i);
+    specials[0] = -1;
+    sink += clear_lines(1);
+}
+
+static void bench_place_specials(long i)
+{
+    setup_field(i);
+    place_specials(1 + i % 4);
+}
+
+/*************************************************************************/
+
+static const char *special_type;
+
+static void bench_do_special(long i)
+{
+    setup_field(i);
+    memcpy(fields[1], bench_fields[(i+1) % NFIELDS], sizeof(Field));
+    do_special(special_type, 2, my_playernum);
+}
+
+/*************************************************************************/
+
+static void bench_send_field_diff(long i)
+{
+    Field oldfield;
+
+    setup_field(i);
+    send_dirty = 0;
+    memcpy(&oldfield, fields[my_playernum-1], sizeof(Field));
+    /* A piece lock: four new blocks and a cleared line's worth of
+     * changes, about what step_down() sends. */
+    current_piece = i % 7;
+    current_rotation = 0;
+    current_x = 6;
+    current_y = 2;
+    draw_piece(1);
+    memset(fields[my_playernum-1][FIELD_HEIGHT-1], 0, FIELD_WIDTH);
+    mark_dirty(my_playernum, ROW(FIELD_HEIGHT-1));
+    send_field(&oldfield);
+}
+
+static void bench_send_field_full(long i)
+{
+    setup_field(i);
+    send_field(NULL);
+}
+
+/*************************************************************************/
+
+static char field_msgs[NFIELDS][512];
+static char diff_msgs[NFIELDS][512];
+
+static void bench_parse_f_full(long i)
+{
+    char buf[512];
+
+    strcpy(buf, field_msgs[i % NFIELDS]);
+    parse(buf);
+}
+
+static void bench_parse_f_diff(long i)
+{
+    char buf[512];
+
+    strcpy(buf, diff_msgs[i % NFIELDS]);
+    parse(buf);
+}
+
+/*************************************************************************/
+
+static const FieldKernels *bench_kernels;
+static Field changed_fields[NFIELDS];	/* Fields after a piece lock */
+static unsigned short diff_cells[FIELD_CELLS];
+
+static void bench_field_diff(long i)
+{
+    sink += bench_kernels->diff(&bench_fields[i % NFIELDS],
+				&changed_fields[i % NFIELDS], ALL_ROWS,
+				diff_cells);
+}
+
+static void bench_field_encode(long i)
+{
+    char buf[FIELD_CELLS];
+
+    bench_kernels->encode(&bench_fields[i % NFIELDS], buf);
+    sink += buf[i % FIELD_CELLS];
+}
+
+static void bench_field_decode(long i)
+{
+    bench_kernels->decode(&fields[1], field_msgs[i % NFIELDS] + 4);
+}
+
+/*************************************************************************/
+
+static void bench_pick_piece(long i)
+{
+    sink += pick_piece(&game_rng);
+}
+
+static void bench_pick_special(long i)
+{
+    sink += pick_special(&game_rng);
+}
+
+/*************************************************************************/
+
+static void bench_level_delay(long i)
+{
+    levels[my_playernum-1] = 1 + i % 100;
+    sink += level_delay();
+}
+
+static void bench_tetris_timeout(long i)
+{
+    sink += tetris_timeout();
+}
+
+/*************************************************************************/
+
+/* Encoding the commonest messages, with the typed encoders and with a
+ * format string the way they used to be. */
+
+static int printf_line(char *buf, int size, const char *format, ...)
+{
+    va_list args;
+    int len;
+
+    va_start(args, format);
+    len = vsnprintf(buf, size-1, format, args);
+    va_end(args);
+    if (len < 0)
+	len = 0;
+    else if (len > size-2)
+	len = size-2;
+    buf[len++] = 0xFF;
+    return len;
+}
+
+static void bench_encode_f_printf(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += printf_line(buf, sizeof(buf), "f %d %s", 1 + i%6,
+			diff_msgs[i % NFIELDS] + 4);
+}
+
+static void bench_encode_f(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += msg_f(buf, 1 + i%6, diff_msgs[i % NFIELDS] + 4);
+}
+
+static void bench_encode_sb_printf(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += printf_line(buf, sizeof(buf), "sb %d %s %d", i%7,
+			i%2 ? "a" : "cs2", 1 + i%6);
+}
+
+static void bench_encode_sb(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += msg_sb(buf, i%7, i%2 ? "a" : "cs2", 1 + i%6);
+}
+
+static void bench_encode_lvl_printf(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += printf_line(buf, sizeof(buf), "lvl %d %d", 1 + i%6, i%100);
+}
+
+static void bench_encode_lvl(long i)
+{
+    char buf[MSG_MAX];
+
+    sink += msg_lvl(buf, 1 + i%6, i%100);
+}
+
+/*************************************************************************/
+
+/* Logging a received line, with the traffic logger and with a timestamp,
+ * fprintf() and fflush() the way it used to be done.  There's no writer
+ * thread here; the benchmark empties the ring itself now and then, so
+ * the cost of writing it out is included but records are never dropped. */
+
+static FILE *old_logfile;
+
+static void bench_log_fprintf(long i)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    fprintf(old_logfile, "[%d.%03d] <<< %s\n",
+	    (int) tv.tv_sec, (int) tv.tv_usec/1000, diff_msgs[i % NFIELDS]);
+    fflush(old_logfile);
+}
+
+static void bench_netlog_record(long i)
+{
+    const char *line = diff_msgs[i % NFIELDS];
+
+    netlog_record(NETLOG_RECV, 3, line, strlen(line));
+    if (i % 256 == 255)
+	write_ring(my_ring);
+}
+
+/* Recording a game message.  As above, the benchmark empties the ring
+ * itself; with no game file open, the records are just thrown away. */
+
+static Recorder *bench_recorder;
+
+static void bench_record_line(long i)
+{
+    const char *line = diff_msgs[i % NFIELDS];
+
+    record_line(bench_recorder, line, strlen(line));
+    if (i % 256 == 255)
+	write_records(bench_recorder);
+}
+
+/*************************************************************************/
+
+/* Setting a room's timer, moving it if it was already set, the way
+ * run_timers() does each time the next thing due changes. */
+
+static Timer bench_timers[64];
+
+static void bench_timer_add(long i)
+{
+    timer_add(&bench_timers[i % 64], NULL, 1 + (i * 37) % 5000);
+}
+
+/*************************************************************************/
+
+static char crypt_msgs[16][1024];
+static char crypt_hashes[16][16];
+
+static void bench_decrypt_message(long i)
+{
+    char newbuf[1024];
+
+    decrypt_message(crypt_msgs[i % 16], newbuf, crypt_hashes[i % 16]);
+    sink += newbuf[0];
+}
+
+/*************************************************************************/
+
+/* A long partyline message with some attribute codes, as in a chat flood,
+ * and a ring to keep it in. */
+static char chat_msg[1024];
+static TextRing chat_ring;
+
+static void bench_text_wrap(long i)
+{
+    TextWrap wrap;
+
+    sink += text_wrap(chat_msg, 79 - i%8, &wrap);
+}
+
+static void bench_textring_add(long i)
+{
+    textring_add(&chat_ring, chat_msg + i%512);
+}
+
+/*************************************************************************/
+
+/* Server rooms run on the worker threads.  One room in eight is in a busy
+ * game, with all six players sending field updates; the rest only have a
+ * little chat.  Each iteration wakes every room with a batch of messages to
+ * handle and waits until the workers have got through them all, so with
+ * more threads the busy rooms should be spread out rather than queue up
+ * behind each other.  Everything sent goes to /dev/null.
+ */
+
+#define NROOMS		48
+#define BUSY_MSGS	192	/* Messages per iteration in a busy room */
+#define QUIET_MSGS	6	/* ...and in a quiet one */
+
+typedef struct {
+    SchedTask task;
+    Room room;
+    int nmsgs;
+} BenchRoom;
+
+static BenchRoom bench_rooms[NROOMS];
+
+static void bench_room_run(SchedTask *task)
+{
+    BenchRoom *br = (BenchRoom *) task;
+    char buf[1024];
+    int i, player;
+
+    for (i = 0; i < br->nmsgs; i++) {
+	player = 1 + i%6;
+	if (br->nmsgs == BUSY_MSGS)
+	    snprintf(buf, sizeof(buf), "f %d %s", player,
+		     diff_msgs[i % NFIELDS] + 4);
+	else
+	    snprintf(buf, sizeof(buf), "pline %d %.60s", player, chat_msg);
+	player_line(&br->room, player-1, buf);
+    }
+    room_flush(&br->room);
+}
+
+/* Sending the winlist: a lock-free copy out of shared memory, then
+ * formatting. */
+
+static void bench_winlist_str(long i)
+{
+    char buf[1024];
+
+    sink += winlist_str(buf, sizeof(buf))[1];
+}
+
+/* Answering "listchan" from the answers kept ready, and with a room
+ * changing each time so that they have to be made again.  The answer is
+ * thrown away rather than sent. */
+
+static int query_fd;
+
+static void bench_query_listchan(long i)
+{
+    answer(query_fd, "listchan");
+    conns[query_fd]->out.len = 0;
+}
+
+static void bench_query_listchan_changed(long i)
+{
+    query_room(i % NROOMS, i % 7, QUERY_IDLE);
+    bench_query_listchan(i);
+}
+
+/* The lobby with every room full and a long queue for each of two keys:
+ * each iteration a player leaves, the head of their room's queue takes
+ * the place, and the player goes to the back of a queue, so the time taken
+ * shouldn't depend on how many are waiting. */
+
+#define LOBBY_ROOMS	1024
+#define LOBBY_WAITING	50000
+
+static LobbyEntry lobby_entries[LOBBY_ROOMS*LOBBY_ROOM_SIZE + LOBBY_WAITING];
+
+static void bench_lobby_place(long i)
+{
+    LobbyEntry *given[LOBBY_ROOM_SIZE];
+
+    if (lobby_release(i % LOBBY_ROOMS, given) > 0)
+	lobby_join(given[0], i & 1);
+}
+
+static void bench_rooms_round(long i)
+{
+    int j;
+
+    for (j = 0; j < NROOMS; j++)
+	sched_wake(&bench_rooms[j].task);
+    sched_wait_idle();
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Encrypt a login message the way the client does in init(). */
+
+static void encrypt_message(char *out, const char *msg, const char *iphash)
+{
+    char buf[1024];
+    int i, len = strlen(msg);
+
+    buf[0] = bench_rand(256);
+    for (i = 0; i < len; i++)
+	buf[i+1] = (((buf[i]&0xFF) + (msg[i]&0xFF)) % 255)
+		 ^ iphash[i % strlen(iphash)];
+    len++;
+    for (i = 0; i < len; i++)
+	sprintf(out+i*2, "%02X", buf[i] & 0xFF);
+}
+
+/*************************************************************************/
+
+/* Check each supported set of field kernels against the plain C ones. */
+
+static void kernel_mismatch(const FieldKernels *k, const FieldKernels *ref,
+			    const char *what, int n)
+{
+    fprintf(stderr, "Field kernels \"%s\" disagree with \"%s\" on %s"
+		    " (case %d)\n", k->name, ref->name, what, n);
+    exit(1);
+}
+
+static void check_kernels(void)
+{
+    const FieldKernels *k, *ref;
+    int i, j, n, rows;
+    Field a, b, out1, out2;
+    unsigned short cells1[FIELD_CELLS], cells2[FIELD_CELLS];
+    char enc1[FIELD_CELLS], enc2[FIELD_CELLS], str[FIELD_CELLS*2];
+
+    for (ref = field_kernel_list; ref[1].name; ref++)
+	;
+    for (k = field_kernel_list; k != ref; k++) {
+	if (!k->supported())
+	    continue;
+	for (i = 0; i < 10000; i++) {
+	    /* Diffs between a field and a copy with some cells changed,
+	     * for all rows and for a random set of rows. */
+	    memcpy(a, bench_fields[i % NFIELDS], sizeof(Field));
+	    memcpy(b, a, sizeof(Field));
+	    n = i%3 ? bench_rand(8) : bench_rand(FIELD_CELLS);
+	    for (j = 0; j < n; j++)
+		b[bench_rand(FIELD_HEIGHT)][bench_rand(FIELD_WIDTH)] =
+		    bench_rand(15);
+	    rows = i%2 ? ALL_ROWS : (bench_rand(1<<15)<<7 ^ bench_rand(1<<15))
+				    & ALL_ROWS;
+	    n = ref->diff(&a, &b, rows, cells1);
+	    if (k->diff(&a, &b, rows, cells2) != n
+	     || memcmp(cells1, cells2, n * sizeof(*cells1)) != 0
+	     || k->diff(&a, &b, rows, NULL) != n)
+		kernel_mismatch(k, ref, "diff", i);
+
+	    ref->encode(&b, enc1);
+	    k->encode(&b, enc2);
+	    if (memcmp(enc1, enc2, FIELD_CELLS) != 0)
+		kernel_mismatch(k, ref, "encode", i);
+
+	    /* Decode valid fields, fields with a bad character, and
+	     * strings of the wrong length. */
+	    memcpy(str, enc1, FIELD_CELLS);
+	    n = FIELD_CELLS;
+	    if (i%4 == 1)
+		str[bench_rand(FIELD_CELLS)] = 1 + bench_rand(255);
+	    else if (i%4 == 2)
+		n = bench_rand(FIELD_CELLS*2);
+	    for (j = FIELD_CELLS; j < n; j++)
+		str[j] = field_chars[bench_rand(15)];
+	    str[n] = 0;
+	    memcpy(out1, a, sizeof(Field));
+	    memcpy(out2, a, sizeof(Field));
+	    ref->decode(&out1, str);
+	    k->decode(&out2, str);
+	    if (memcmp(out1, out2, sizeof(Field)) != 0)
+		kernel_mismatch(k, ref, "decode", i);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Set up the engine state the benchmarks expect. */
+
+static void setup(void)
+{
+    static const char tiles[] = "!\"#$%&'()*+,-./";
+    int i, j, x, y;
+
+    io = &null_interface;
+    if ((server_sock = open("/dev/null", O_WRONLY)) < 0) {
+	perror("/dev/null");
+	exit(1);
+    }
+    if (!(old_logfile = fdopen(dup(server_sock), "w"))) {
+	perror("/dev/null");
+	exit(1);
+    }
+    log_fd = server_sock;
+    /* Recording without record_start(), so no file is ever opened. */
+    if (!(bench_recorder = record_new(1))) {
+	perror("record_new()");
+	exit(1);
+    }
+    bench_recorder->active = 1;
+    seed_game(1);
+    init_shapes();
+    field_init();
+
+    my_playernum = 1;
+    players[0] = "bench";
+    players[1] = "other";
+    playing_game = 1;
+    piece_waiting = 1;	/* do_special() must not redraw the piece */
+    special_capacity = 18;
+    special_lines = 1;
+    special_count = 1;
+    lines_per_level = 2;
+    level_inc = 1;
+    initial_level = 1;
+    for (i = 0; i < 7; i++)
+	piecefreq[i] = i==2 || i==6 ? 15 : 14;
+    specialfreq[0] = 18;
+    specialfreq[1] = 18;
+    specialfreq[2] = 3;
+    specialfreq[3] = 12;
+    specialfreq[4] = 0;
+    specialfreq[5] = 16;
+    specialfreq[6] = 3;
+    specialfreq[7] = 12;
+    specialfreq[8] = 18;
+    new_game();
+
+    for (i = 0; i < NRECORDED; i++)
+	load_field(&bench_fields[i], recorded_fields[i]);
+    for (; i < NFIELDS; i++)
+	random_field(&bench_fields[i]);
+
+    for (i = 0; i < NFIELDS; i++) {
+	memcpy(changed_fields[i], bench_fields[i], sizeof(Field));
+	for (j = 4 + bench_rand(12); j > 0; j--) {
+	    changed_fields[i][bench_rand(FIELD_HEIGHT)]
+			     [bench_rand(FIELD_WIDTH)] = 1 + bench_rand(5);
+	}
+    }
+
+    for (i = 0; i < NFIELDS; i++) {
+	char *s;
+	int seen;
+
+	field_message(field_msgs[i], 2, &bench_fields[i]);
+	/* A diff message changing a handful of cells of each of a few
+	 * tile types. */
+	s = diff_msgs[i] + sprintf(diff_msgs[i], "f 2 ");
+	for (j = 0; j < 15; j += 4) {
+	    *s++ = tiles[j];
+	    for (seen = 0; seen < 4; seen++) {
+		x = bench_rand(FIELD_WIDTH);
+		y = bench_rand(FIELD_HEIGHT);
+		*s++ = '3' + x;
+		*s++ = '3' + y;
+	    }
+	}
+	*s = 0;
+    }
+
+    for (i = 0; i < 16; i++) {
+	sprintf(crypt_hashes[i], "%d", bench_rand(35956));
+	encrypt_message(crypt_msgs[i], "tetrisstart benchplayer 1.13",
+			crypt_hashes[i]);
+    }
+
+    for (i = 0; i < sizeof(chat_msg)-1; i++) {
+	j = bench_rand(40);
+	chat_msg[i] = j < 6 ? ' ' : j == 6 ? 1 + bench_rand(31) : 'a' + j%26;
+    }
+    chat_msg[i] = 0;
+    textring_init(&chat_ring, 1000);
+
+    if (winlist_init() < 0) {
+	perror("mmap()");
+	exit(1);
+    }
+    for (i = 0; i < MAXSENDWINLIST; i++) {
+	snprintf(shared->winlist[i].name, sizeof(shared->winlist[i].name),
+		 "player%d", i);
+	shared->winlist[i].points = 100 - i;
+	shared->winlist[i].games = 10;
+    }
+
+    if (timer_init() < 0) {
+	perror("timer_init()");
+	exit(1);
+    }
+
+    if (reactor_init(REACTOR_EPOLL) < 0) {
+	perror("reactor_init()");
+	exit(1);
+    }
+    for (i = 0; i < NROOMS; i++) {
+	BenchRoom *br = &bench_rooms[i];
+	room_init(&br->room);
+	br->task.run = bench_room_run;
+	br->nmsgs = i%8 == 0 ? BUSY_MSGS : QUIET_MSGS;
+	for (j = 0; j < 6; j++) {
+	    /* Each player needs its own descriptor, since output is
+	     * collected per descriptor.  /dev/null can't be watched, so it
+	     * isn't. */
+	    int fd = dup(server_sock);
+	    if (fd < 0 || !new_conn(fd)) {
+		perror("dup()");
+		exit(1);
+	    }
+	    br->room.player_socks[j] = fd;
+	    br->room.players[j] = "bench";
+	}
+    }
+
+    if (query_init(NROOMS) < 0) {
+	perror("query_init()");
+	exit(1);
+    }
+    query_fd = dup(server_sock);
+    if (query_fd < 0 || !new_conn(query_fd)) {
+	perror("dup()");
+	exit(1);
+    }
+
+    if (lobby_init(LOBBY_ROOMS, 2) < 0) {
+	perror("lobby_init()");
+	exit(1);
+    }
+    for (i = 0; i < sizeof(lobby_entries) / sizeof(*lobby_entries); i++)
+	lobby_join(&lobby_entries[i], i & 1);
+}
+
+/*************************************************************************/
+
+int main(int ac, char **av)
+{
+    static const char *types[] = {
+	"a", "c", "n", "r", "s", "b", "g", "q", "o", "cs1", "cs2", "cs4"
+    };
+    const FieldKernels *k;
+    char name[64];
+    int i, ncpus;
+
+    setup();
+    check_kernels();
+
+    printf("{\n  \"version\": \"%s\",\n  \"field_kernels\": \"%s\",\n"
+	   "  \"benchmarks\": [", VERSION, field_kernels->name);
+    run("piece_overlaps", bench_piece_overlaps);
+    run("clear_lines", bench_clear_lines);
+    run("place_specials", bench_place_specials);
+    for (i = 0; i < sizeof(types) / sizeof(*types); i++) {
+	special_type = types[i];
+	snprintf(name, sizeof(name), "do_special_%s", types[i]);
+	run(name, bench_do_special);
+    }
+    run("send_field_diff", bench_send_field_diff);
+    run("send_field_full", bench_send_field_full);
+    run("parse_f_full", bench_parse_f_full);
+    run("parse_f_diff", bench_parse_f_diff);
+    for (k = field_kernel_list; k->name; k++) {
+	if (!k->supported())
+	    continue;
+	bench_kernels = k;
+	snprintf(name, sizeof(name), "field_diff_%s", k->name);
+	run(name, bench_field_diff);
+	snprintf(name, sizeof(name), "field_encode_%s", k->name);
+	run(name, bench_field_encode);
+	snprintf(name, sizeof(name), "field_decode_%s", k->name);
+	run(name, bench_field_decode);
+    }
+    run("pick_piece", bench_pick_piece);
+    run("pick_special", bench_pick_special);
+    run("level_delay", bench_level_delay);
+    run("tetris_timeout", bench_tetris_timeout);
+    run("encode_f_printf", bench_encode_f_printf);
+    run("encode_f", bench_encode_f);
+    run("encode_sb_printf", bench_encode_sb_printf);
+    run("encode_sb", bench_encode_sb);
+    run("encode_lvl_printf", bench_encode_lvl_printf);
+    run("encode_lvl", bench_encode_lvl);
+    run("log_fprintf", bench_log_fprintf);
+    run("netlog_record", bench_netlog_record);
+    run("record_line", bench_record_line);
+    run("timer_add", bench_timer_add);
+    run("decrypt_message", bench_decrypt_message);
+    run("text_wrap", bench_text_wrap);
+    run("textring_add", bench_textring_add);
+    run("winlist_str", bench_winlist_str);
+    run("query_listchan", bench_query_listchan);
+    run("query_listchan_changed", bench_query_listchan_changed);
+    run("lobby_place", bench_lobby_place);
+    ncpus = sched_ncpus();
+    for (i = 1; ; i = i*2 < ncpus ? i*2 : ncpus) {
+	if (sched_start(i) < 0) {
+	    perror("sched_start()");
+	    exit(1);
+	}
+	snprintf(name, sizeof(name), "room_round_%dthreads", i);
+	run(name, bench_rooms_round);
+	sched_stop();
+	if (i == ncpus)
+	    break;
+    }
+    printf("\n  ]\n}\n");
+
+    return 0;
+}
+
+/*************************************************************************/
@@ -0,0 +1,141 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Client event loop.  We wait on the keyboard, the server socket and the
+ * game timer together with epoll; the timer is a timerfd set to the
+ * absolute deadline of the next game action, so it is only touched when
+ * the deadline changes.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "tetrinet.h"
+#include "event.h"
+#include "sockets.h"
+
+/*************************************************************************/
+
+static int epoll_fd = -1;
+static int timer_fd = -1;
+static struct timespec armed;	/* Deadline the timer is set for */
+static int timer_set;		/* Is the timer set at all? */
+
+/*************************************************************************/
+
+/* Add a file descriptor to the epoll set, to be reported as @flag. */
+
+static int watch(int fd, int flag)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.u32 = flag;
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev);
+}
+
+/*************************************************************************/
+
+/* Set up the event loop for the keyboard and the (already connected)
+ * server socket.  Return 0 on success, -1 on failure with errno set.
+ */
+
+int event_init(void)
+{
+    if ((epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	return -1;
+    if ((timer_fd = timerfd_create(CLOCK_MONOTONIC,
+				   TFD_NONBLOCK | TFD_CLOEXEC)) < 0)
+	return -1;
+    if (watch(0, INPUT_KEY) < 0 || watch(server_sock, INPUT_SERVER) < 0
+     || watch(timer_fd, INPUT_TIMER) < 0)
+	return -1;
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Point the timer at @deadline, or stop it if @deadline is NULL. */
+
+static void set_timer(const struct timespec *deadline)
+{
+    struct itimerspec its;
+
+    if (deadline ? (timer_set && deadline->tv_sec == armed.tv_sec
+				&& deadline->tv_nsec == armed.tv_nsec)
+		 : !timer_set)
+	return;
+    memset(&its, 0, sizeof(its));
+    if (deadline) {
+	its.it_value = *deadline;
+	/* A zero it_value would stop the timer instead of firing it. */
+	if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+	    its.it_value.tv_nsec = 1;
+	armed = *deadline;
+    }
+    if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &its, NULL) < 0)
+	perror("Warning: timerfd_settime() failed");
+    timer_set = (deadline != NULL);
+}
+
+/*************************************************************************/
+
+/* Wait until the keyboard or the server has input for us, or until the
+ * given time (on the CLOCK_MONOTONIC clock) if @deadline is not NULL.
+ * Return the INPUT_* flags for everything which is ready, which may be
+ * zero if we were interrupted.  Lines from the server which have already
+ * been read into its buffer count as input, so we don't wait at all if
+ * there are any.
+ */
+
+int event_wait(const struct timespec *deadline)
+{
+    struct epoll_event evs[3];
+    uint64_t expirations;
+    int i, n, ready = 0;
+
+    if (spending(server_sock))
+	ready = INPUT_SERVER;
+    set_timer(deadline);
+    if ((n = epoll_wait(epoll_fd, evs, 3, ready ? 0 : -1)) < 0) {
+	if (errno != EINTR)
+	    perror("Warning: epoll_wait() failed");
+	return ready;
+    }
+    for (i = 0; i < n; i++)
+	ready |= evs[i].data.u32;
+    if (ready & INPUT_TIMER) {
+	/* The timer has fired, so it's no longer set; reading it clears
+	 * its readiness. */
+	if (read(timer_fd, &expirations, sizeof(expirations)) < 0)
+	    ready &= ~INPUT_TIMER;
+	else
+	    timer_set = 0;
+    }
+    return ready;
+}
+
+/*************************************************************************/
+
+/* Return whichever of two deadlines comes first, treating NULL as never. */
+
+const struct timespec *event_earliest(const struct timespec *a,
+				      const struct timespec *b)
+{
+    if (!a)
+	return b;
+    if (!b)
+	return a;
+    if (b->tv_sec < a->tv_sec
+     || (b->tv_sec == a->tv_sec && b->tv_nsec < a->tv_nsec))
+	return b;
+    return a;
+}
+
+/*************************************************************************/
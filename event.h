@@ -0,0 +1,21 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Client event loop declarations.
+ */
+
+#ifndef EVENT_H
+#define EVENT_H
+
+/*************************************************************************/
+
+struct timespec;
+
+extern int event_init(void);
+extern int event_wait(const struct timespec *deadline);
+extern const struct timespec *event_earliest(const struct timespec *a,
+					     const struct timespec *b);
+
+/*************************************************************************/
+
+#endif	/* EVENT_H */
@@ -0,0 +1,389 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Field comparison and encoding kernels.  A field is only 264 bytes, so
+ * on x86 it fits in a handful of vector registers; we use SSE2, SSSE3 or
+ * AVX2 when the CPU has them and fall back to plain C otherwise.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include "tetrinet.h"
+#include "tetris.h"
+#include "field.h"
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+# define HAVE_X86_KERNELS
+# include <immintrin.h>
+#endif
+
+/*************************************************************************/
+
+/* Characters used for each tile in "f" messages, indexed by tile.  This is
+ * exactly 16 bytes long so it can be loaded as a shuffle table. */
+static const char field_chars[16] = "012345acnrsbgqo";
+
+/*************************************************************************/
+/****************************** Plain C code *****************************/
+/*************************************************************************/
+
+static int supported_always(void)
+{
+    return 1;
+}
+
+/*************************************************************************/
+
+static int diff_scalar(const Field *a, const Field *b, int rows,
+		       unsigned short *cells)
+{
+    int x, y, n = 0;
+
+    for (y = 0; rows >> y; y++) {
+	if (!(rows & ROW(y)))
+	    continue;
+	for (x = 0; x < FIELD_WIDTH; x++) {
+	    if ((*a)[y][x] != (*b)[y][x]) {
+		if (cells)
+		    cells[n] = y*FIELD_WIDTH + x;
+		n++;
+	    }
+	}
+    }
+    return n;
+}
+
+/*************************************************************************/
+
+static void encode_scalar(const Field *f, char *buf)
+{
+    const char *p = (const char *) f;
+    int i;
+
+    for (i = 0; i < FIELD_CELLS; i++)
+	buf[i] = field_chars[(int) p[i]];
+}
+
+/*************************************************************************/
+
+static void decode_scalar(Field *f, const char *s)
+{
+    char *ptr = (char *) f, *end = ptr + FIELD_CELLS;
+
+    while (*s && ptr < end) {
+	if (*s <= '5')
+	    *ptr++ = (*s++) - '0';
+	else switch (*s++) {
+	    case 'a': *ptr++ = 6 + SPECIAL_A; break;
+	    case 'b': *ptr++ = 6 + SPECIAL_B; break;
+	    case 'c': *ptr++ = 6 + SPECIAL_C; break;
+	    case 'g': *ptr++ = 6 + SPECIAL_G; break;
+	    case 'n': *ptr++ = 6 + SPECIAL_N; break;
+	    case 'o': *ptr++ = 6 + SPECIAL_O; break;
+	    case 'q': *ptr++ = 6 + SPECIAL_Q; break;
+	    case 'r': *ptr++ = 6 + SPECIAL_R; break;
+	    case 's': *ptr++ = 6 + SPECIAL_S; break;
+	}
+    }
+}
+
+/*************************************************************************/
+/******************************* x86 code ********************************/
+/*************************************************************************/
+
+#ifdef HAVE_X86_KERNELS
+
+/*************************************************************************/
+
+static int supported_sse2(void)
+{
+    return __builtin_cpu_supports("sse2");
+}
+
+static int supported_ssse3(void)
+{
+    return __builtin_cpu_supports("ssse3");
+}
+
+static int supported_avx2(void)
+{
+    return __builtin_cpu_supports("avx2");
+}
+
+/*************************************************************************/
+
+/* The vector diff kernels build a bitmap of differing cells, which is then
+ * turned into a list of cell numbers here.  Bits for cells outside @rows
+ * are dropped.
+ */
+
+static int diff_collect(const uint64_t bits[5], int rows,
+			unsigned short *cells)
+{
+    int i, n = 0;
+
+    for (i = 0; i < 5; i++) {
+	uint64_t word = bits[i];
+	if (!cells && rows == ALL_ROWS) {
+	    n += __builtin_popcountll(word);
+	    continue;
+	}
+	while (word) {
+	    int cell = i*64 + __builtin_ctzll(word);
+	    word &= word - 1;
+	    if (!(rows & ROW(cell / FIELD_WIDTH)))
+		continue;
+	    if (cells)
+		cells[n] = cell;
+	    n++;
+	}
+    }
+    return n;
+}
+
+/*************************************************************************/
+
+/* Compare 16 bytes at offset @i and return a bitmask of differing bytes. */
+
+__attribute__((target("sse2")))
+static inline unsigned int diff16(const char *a, const char *b, int i)
+{
+    __m128i va = _mm_loadu_si128((const __m128i *) (a+i));
+    __m128i vb = _mm_loadu_si128((const __m128i *) (b+i));
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) ^ 0xFFFF;
+}
+
+__attribute__((target("sse2")))
+static int diff_sse2(const Field *a, const Field *b, int rows,
+		     unsigned short *cells)
+{
+    const char *pa = (const char *) a, *pb = (const char *) b;
+    uint64_t bits[5] = {0, 0, 0, 0, 0};
+    int i;
+
+    if (!rows)
+	return 0;
+    for (i = 0; i+16 <= FIELD_CELLS; i += 16)
+	bits[i/64] |= (uint64_t) diff16(pa, pb, i) << (i%64);
+    /* The last 8 cells: compare the last 16 bytes and keep the top half. */
+    bits[4] |= diff16(pa, pb, FIELD_CELLS-16) >> 8;
+    return diff_collect(bits, rows, cells);
+}
+
+__attribute__((target("avx2")))
+static int diff_avx2(const Field *a, const Field *b, int rows,
+		     unsigned short *cells)
+{
+    const char *pa = (const char *) a, *pb = (const char *) b;
+    uint64_t bits[5] = {0, 0, 0, 0, 0};
+    int i;
+
+    if (!rows)
+	return 0;
+    for (i = 0; i+32 <= FIELD_CELLS; i += 32) {
+	__m256i va = _mm256_loadu_si256((const __m256i *) (pa+i));
+	__m256i vb = _mm256_loadu_si256((const __m256i *) (pb+i));
+	uint32_t m = ~(uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(va,vb));
+	bits[i/64] |= (uint64_t) m << (i%64);
+    }
+    bits[4] |= diff16(pa, pb, FIELD_CELLS-16) >> 8;
+    return diff_collect(bits, rows, cells);
+}
+
+/*************************************************************************/
+
+/* Encoding is a single table lookup per cell, which PSHUFB does 16 (or
+ * 32) at a time.  The final partial vector overlaps the previous one.
+ */
+
+__attribute__((target("ssse3")))
+static void encode_ssse3(const Field *f, char *buf)
+{
+    const char *p = (const char *) f;
+    __m128i lut = _mm_loadu_si128((const __m128i *) field_chars);
+    int i;
+
+    for (i = 0; ; i += 16) {
+	if (i+16 > FIELD_CELLS)
+	    i = FIELD_CELLS-16;
+	_mm_storeu_si128((__m128i *) (buf+i), _mm_shuffle_epi8(lut,
+				_mm_loadu_si128((const __m128i *) (p+i))));
+	if (i+16 == FIELD_CELLS)
+	    break;
+    }
+}
+
+__attribute__((target("avx2")))
+static void encode_avx2(const Field *f, char *buf)
+{
+    const char *p = (const char *) f;
+    __m256i lut = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) field_chars));
+    int i;
+
+    for (i = 0; i+32 <= FIELD_CELLS; i += 32) {
+	_mm256_storeu_si256((__m256i *) (buf+i), _mm256_shuffle_epi8(lut,
+				_mm256_loadu_si256((const __m256i *) (p+i))));
+    }
+    _mm_storeu_si128((__m128i *) (buf+FIELD_CELLS-16),
+		     _mm_shuffle_epi8(_mm256_castsi256_si128(lut),
+			_mm_loadu_si128((const __m128i *) (p+FIELD_CELLS-16))));
+}
+
+/*************************************************************************/
+
+/* Decoding splits each character into its high and low nibbles.  The
+ * valid characters all have a high nibble of 3 (digits), 6 or 7 (special
+ * letters), so we look the low nibble up in one table for each of those
+ * and pick the right result by the high nibble.  Anything else comes out
+ * as 0x80, which doesn't encode back to the character it came from; so
+ * checking that the decoded field encodes back to the input validates it.
+ * If it doesn't (or the string isn't exactly one field long), we leave it
+ * to the plain C code to deal with.
+ */
+
+#define X	0x80	/* Invalid character */
+static const char decode_lut3[16] =
+    { 0, 1, 2, 3, 4, 5, X, X, X, X, X, X, X, X, X, X };
+static const char decode_lut6[16] =
+    { X, 6+SPECIAL_A, 6+SPECIAL_B, 6+SPECIAL_C, X, X, X, 6+SPECIAL_G,
+      X, X, X, X, X, X, 6+SPECIAL_N, 6+SPECIAL_O };
+static const char decode_lut7[16] =
+    { X, 6+SPECIAL_Q, 6+SPECIAL_R, 6+SPECIAL_S, X, X, X, X,
+      X, X, X, X, X, X, X, X };
+#undef X
+
+/* Decode 16 characters; return nonzero if they were all valid. */
+
+__attribute__((target("ssse3")))
+static inline int decode16(char *out, const char *s, int i)
+{
+    const __m128i lut3 = _mm_loadu_si128((const __m128i *) decode_lut3);
+    const __m128i lut6 = _mm_loadu_si128((const __m128i *) decode_lut6);
+    const __m128i lut7 = _mm_loadu_si128((const __m128i *) decode_lut7);
+    const __m128i enc = _mm_loadu_si128((const __m128i *) field_chars);
+    const __m128i nibble = _mm_set1_epi8(0x0F);
+    __m128i c, lo, hi, m3, m6, m7, r;
+
+    c = _mm_loadu_si128((const __m128i *) (s+i));
+    lo = _mm_and_si128(c, nibble);
+    hi = _mm_and_si128(_mm_srli_epi16(c, 4), nibble);
+    m3 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(3));
+    m6 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(6));
+    m7 = _mm_cmpeq_epi8(hi, _mm_set1_epi8(7));
+    r = _mm_or_si128(_mm_or_si128(
+		_mm_and_si128(m3, _mm_shuffle_epi8(lut3, lo)),
+		_mm_and_si128(m6, _mm_shuffle_epi8(lut6, lo))),
+	    _mm_or_si128(
+		_mm_and_si128(m7, _mm_shuffle_epi8(lut7, lo)),
+		_mm_andnot_si128(_mm_or_si128(_mm_or_si128(m3, m6), m7),
+				 _mm_set1_epi8((char) 0x80))));
+    _mm_storeu_si128((__m128i *) (out+i), r);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_shuffle_epi8(enc, r), c))
+	   == 0xFFFF;
+}
+
+__attribute__((target("ssse3")))
+static void decode_ssse3(Field *f, const char *s)
+{
+    char tmp[FIELD_CELLS];
+    int i, ok = 1;
+
+    if (strlen(s) != FIELD_CELLS) {
+	decode_scalar(f, s);
+	return;
+    }
+    for (i = 0; i+16 <= FIELD_CELLS; i += 16)
+	ok &= decode16(tmp, s, i);
+    ok &= decode16(tmp, s, FIELD_CELLS-16);
+    if (ok)
+	memcpy(f, tmp, FIELD_CELLS);
+    else
+	decode_scalar(f, s);
+}
+
+__attribute__((target("avx2")))
+static void decode_avx2(Field *f, const char *s)
+{
+    const __m256i lut3 = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) decode_lut3));
+    const __m256i lut6 = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) decode_lut6));
+    const __m256i lut7 = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) decode_lut7));
+    const __m256i enc = _mm256_broadcastsi128_si256(
+			_mm_loadu_si128((const __m128i *) field_chars));
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+    char tmp[FIELD_CELLS];
+    int i, ok = 1;
+
+    if (strlen(s) != FIELD_CELLS) {
+	decode_scalar(f, s);
+	return;
+    }
+    for (i = 0; i+32 <= FIELD_CELLS; i += 32) {
+	__m256i c, lo, hi, m3, m6, m7, r;
+
+	c = _mm256_loadu_si256((const __m256i *) (s+i));
+	lo = _mm256_and_si256(c, nibble);
+	hi = _mm256_and_si256(_mm256_srli_epi16(c, 4), nibble);
+	m3 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(3));
+	m6 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(6));
+	m7 = _mm256_cmpeq_epi8(hi, _mm256_set1_epi8(7));
+	r = _mm256_or_si256(_mm256_or_si256(
+		    _mm256_and_si256(m3, _mm256_shuffle_epi8(lut3, lo)),
+		    _mm256_and_si256(m6, _mm256_shuffle_epi8(lut6, lo))),
+		_mm256_or_si256(
+		    _mm256_and_si256(m7, _mm256_shuffle_epi8(lut7, lo)),
+		    _mm256_andnot_si256(
+			_mm256_or_si256(_mm256_or_si256(m3, m6), m7),
+			_mm256_set1_epi8((char) 0x80))));
+	_mm256_storeu_si256((__m256i *) (tmp+i), r);
+	ok &= (uint32_t) _mm256_movemask_epi8(_mm256_cmpeq_epi8(
+				_mm256_shuffle_epi8(enc, r), c)) == 0xFFFFFFFF;
+    }
+    ok &= decode16(tmp, s, FIELD_CELLS-16);
+    if (ok)
+	memcpy(f, tmp, FIELD_CELLS);
+    else
+	decode_scalar(f, s);
+}
+
+/*************************************************************************/
+
+#endif	/* HAVE_X86_KERNELS */
+
+/*************************************************************************/
+/*************************************************************************/
+
+const FieldKernels field_kernel_list[] = {
+#ifdef HAVE_X86_KERNELS
+    { "avx2", supported_avx2, diff_avx2, encode_avx2, decode_avx2 },
+    { "ssse3", supported_ssse3, diff_sse2, encode_ssse3, decode_ssse3 },
+    { "sse2", supported_sse2, diff_sse2, encode_scalar, decode_scalar },
+#endif
+    { "scalar", supported_always, diff_scalar, encode_scalar, decode_scalar },
+    { NULL }
+};
+
+const FieldKernels *field_kernels =
+	&field_kernel_list[sizeof(field_kernel_list)/sizeof(*field_kernel_list) - 2];
+
+/*************************************************************************/
+
+/* Select the fastest kernels this CPU supports. */
+
+void field_init(void)
+{
+    const FieldKernels *k;
+
+    for (k = field_kernel_list; k->name; k++) {
+	if (k->supported()) {
+	    field_kernels = k;
+	    return;
+	}
+    }
+}
+
+/*************************************************************************/
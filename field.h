@@ -0,0 +1,55 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Field comparison and encoding kernel declarations.  Include tetrinet.h
+ * before this file.
+ */
+
+#ifndef FIELD_H
+#define FIELD_H
+
+/*************************************************************************/
+
+#define FIELD_CELLS	(FIELD_WIDTH * FIELD_HEIGHT)
+
+/* A set of field kernels.  Cells are numbered y*FIELD_WIDTH + x, i.e. in
+ * the order they're stored in (and sent over the network). */
+
+typedef struct {
+    const char *name;
+
+    /* Return nonzero if this CPU can run these kernels. */
+    int (*supported)(void);
+
+    /* Compare the given rows (a ROW() mask) of two fields.  Store the
+     * numbers of the cells which differ in @cells, in ascending order, if
+     * @cells is not NULL, and return how many there are. */
+    int (*diff)(const Field *a, const Field *b, int rows,
+		unsigned short *cells);
+
+    /* Write the FIELD_CELLS-character "f" message form of a field to @buf.
+     * No terminator is added.  Every cell must hold a tile from 0 to 14. */
+    void (*encode)(const Field *f, char *buf);
+
+    /* Set a field from the "f" message form in @s.  Unknown characters
+     * are skipped, and anything past the end of the field is ignored. */
+    void (*decode)(Field *f, const char *s);
+
+} FieldKernels;
+
+/* All kernel sets, fastest first; the last one is portable C and is always
+ * supported.  The list ends with an entry whose name is NULL. */
+extern const FieldKernels field_kernel_list[];
+
+/* The kernels in use; field_init() picks the fastest supported set. */
+extern const FieldKernels *field_kernels;
+
+extern void field_init(void);
+
+#define field_diff(a,b,rows,cells)	(field_kernels->diff(a,b,rows,cells))
+#define field_encode(f,buf)		(field_kernels->encode(f,buf))
+#define field_decode(f,s)		(field_kernels->decode(f,s))
+
+/*************************************************************************/
+
+#endif	/* FIELD_H */
@@ -7,6 +7,13 @@
 #ifndef IO_H
 #define IO_H
 
+/* Input sources, returned by wait_for_input(): */
+#define INPUT_KEY	1	/* Keyboard input is waiting */
+#define INPUT_SERVER	2	/* Server input is waiting */
+#define INPUT_TIMER	4	/* The deadline has passed */
+
+struct timespec;
+
 /* Text buffers: */
 #define BUFFER_PLINE	0
 #define BUFFER_GMSG	1
@@ -14,11 +21,15 @@
 
 typedef struct {
 
-    /**** Input routine. ****/
+    /**** Input routines. ****/
 
-    /* Wait for input and return either an ASCII code, a K_* value, -1 if
-     * server input is waiting, or -2 if we time out. */
-    int (*wait_for_input)(int msec);
+    /* Wait for input or until the given time (on the CLOCK_MONOTONIC
+     * clock; NULL means wait forever), and return the INPUT_* flags for
+     * all sources which are ready. */
+    int (*wait_for_input)(const struct timespec *deadline);
+    /* Return the next key pressed, either as an ASCII code or a K_*
+     * value, or -1 if no more keys are waiting. */
+    int (*read_key)(void);
 
     /**** Output routines. ****/
 
@@ -28,12 +39,23 @@ typedef struct {
     void (*screen_refresh)(void);
     /* Redraw the screen after clearing it. */
     void (*screen_redraw)(void);
-
-    /* Draw text into the given buffer (@s can contain enum tattr fields;
-     * these are the ones with < TATTR_MAX). */
+    /* Stop updating the terminal until screen_flush() is called, so that
+     * a batch of changes is sent in one update. */
+    void (*screen_hold)(void);
+    /* Send any changes made while output was held, and resume updating the
+     * terminal.  Unless @urgent is nonzero, the frontend may keep holding
+     * the changes to limit its frame rate; wait_for_input() then returns
+     * in time for screen_flush() to be called again to send them. */
+    void (*screen_flush)(int urgent);
+
+    /* Draw text into the given buffer.  @s can contain TetriNET text
+     * attribute codes (control characters and 0xFF; see textbuf.c). */
     void (*draw_text)(int bufnum, const char *s);
     /* Clear the given text buffer. */
     void (*clear_text)(int bufnum);
+    /* Scroll the given text buffer back (@pages > 0) or forward (@pages <
+     * 0) through its history by the given number of windowfuls. */
+    void (*scroll_text)(int bufnum, int pages);
 
     /* Set up the fields display. */
     void (*setup_fields)(void);
@@ -62,11 +84,11 @@ typedef struct {
 
 } Interface;
 
-extern Interface tty_interface, xwin_interface;
+extern Interface tty_interface, ansi_interface, xwin_interface;
 
 
-/* Text attributes; note that in strings, they are always encoded with +1 to
- * avoid black terminating the string. */
+/* Text attributes, which text_wrap() decodes the attribute codes in
+ * messages to. */
 
 enum tattr {
     /* Note that TATTR_CBLACK text should be visible on a black background, too. */
@@ -0,0 +1,205 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Keyboard input decoding for the terminal frontends.  Bytes from the
+ * terminal are buffered here and turned into keys without ever blocking:
+ * if an escape sequence hasn't all arrived yet, we return no key and the
+ * game carries on until either the rest turns up or esc_delay milliseconds
+ * pass, at which point a lone ESC is taken to be the Escape key itself.
+ */
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tetrinet.h"
+#include "keys.h"
+
+/*************************************************************************/
+
+/* Bytes read from the terminal but not yet decoded. */
+static unsigned char keybuf[64];
+static int keylen;
+
+/* If keybuf holds an incomplete escape sequence, the time at which we give
+ * up waiting for the rest of it. */
+static struct timespec esc_timeout;
+static int esc_waiting;
+
+/*************************************************************************/
+
+/* Read whatever the terminal has for us without waiting. */
+
+static void fill_keybuf(int fd)
+{
+    struct pollfd pfd;
+    int n;
+
+    pfd.fd = fd;
+    pfd.events = POLLIN;
+    while (keylen < sizeof(keybuf) && poll(&pfd, 1, 0) > 0) {
+	n = read(fd, keybuf+keylen, sizeof(keybuf)-keylen);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n <= 0)
+	    break;
+	keylen += n;
+    }
+}
+
+/* Remove the first @n bytes from the buffer. */
+
+static void eat_keys(int n)
+{
+    memmove(keybuf, keybuf+n, keylen-n);
+    keylen -= n;
+}
+
+/*************************************************************************/
+
+/* Return the key for a complete control sequence (without the leading ESC)
+ * of @len bytes, or K_INVALID if we don't know it.  We understand the
+ * xterm/VT100 cursor, page and function keys and the Linux console's
+ * F1-F5.
+ */
+
+static int escape_key(const unsigned char *s, int len)
+{
+    static const int tilde_keys[] = {
+	/*  5- 6 */ K_PGUP, K_PGDN,
+	/*  7-10 */ K_INVALID, K_INVALID, K_INVALID, K_INVALID,
+	/* 11-15 */ K_F1, K_F2, K_F3, K_F4, K_F5, K_INVALID,
+	/* 17-21 */ K_F6, K_F7, K_F8, K_F9, K_F10, K_INVALID,
+	/* 23-24 */ K_F11, K_F12,
+    };
+    int n;
+
+    if (len == 3 && s[1] == '[' && s[2] >= 'A' && s[2] <= 'E')
+	return K_F1 + (s[2]-'A');
+    switch (s[len-1]) {
+	case 'A': if (len == 2) return K_UP;	break;
+	case 'B': if (len == 2) return K_DOWN;	break;
+	case 'C': if (len == 2) return K_RIGHT;	break;
+	case 'D': if (len == 2) return K_LEFT;	break;
+	case 'P': case 'Q': case 'R': case 'S':
+	    if (s[0] == 'O' && len == 2)
+		return K_F1 + (s[1]-'P');
+	    break;
+	case '~':
+	    n = atoi((const char *) s+1);
+	    if (n >= 5 && n <= 24)
+		return tilde_keys[n-5];
+	    break;
+    }
+    return K_INVALID;
+}
+
+/*************************************************************************/
+
+/* Decode one key from the start of the buffer, removing its bytes.  Return
+ * -1 if the buffer is empty or holds only the start of an escape sequence
+ * (in which case nothing is removed), or K_INVALID for a sequence we don't
+ * know.  @timed_out says whether we've waited long enough for the rest of
+ * an escape sequence to arrive.
+ */
+
+static int decode_key(int timed_out)
+{
+    int c, i;
+
+    if (!keylen)
+	return -1;
+    c = keybuf[0];
+    if (c != 27) {
+	eat_keys(1);
+	if (c >= '1'+0x80 && c <= '9'+0x80)	/* Meta-digit */
+	    return K_F1 + (c-0x80-'1');
+	else if (c == '0'+0x80)
+	    return K_F10;
+	else if (c == 7)   /* ^G */
+	    return 27;  /* Escape */
+	return c;
+    }
+
+    if (keylen < 2) {
+	if (!timed_out)
+	    return -1;
+	eat_keys(1);
+	return 27;
+    }
+    c = keybuf[1];
+    if (c != '[' && c != 'O') {
+	/* ESC followed by a digit stands in for a function key on
+	 * terminals which don't have them; anything else is left for next
+	 * time. */
+	if (c >= '0' && c <= '9') {
+	    eat_keys(2);
+	    return c == '0' ? K_F10 : K_F1 + (c-'1');
+	}
+	eat_keys(1);
+	return 27;
+    }
+
+    for (i = 2; i < keylen; i++) {
+	if (i == 2 && c == '[' && keybuf[i] == '[')
+	    continue;  /* Linux console function key */
+	if (keybuf[i] >= 0x40 && keybuf[i] <= 0x7E) {
+	    c = escape_key(keybuf+1, i);
+	    eat_keys(i+1);
+	    return c;
+	}
+    }
+    if (!timed_out && keylen < sizeof(keybuf))
+	return -1;
+    /* It's not going to be finished; throw away what we've got. */
+    eat_keys(keylen);
+    return K_INVALID;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Return the next key pressed on @fd as an ASCII code 0-255 or a K_* value,
+ * or -1 if there are no more keys waiting.  This never blocks.
+ */
+
+int key_read(int fd)
+{
+    struct timespec now;
+    int timed_out = 0, c;
+
+    if (esc_waiting || !keylen)
+	fill_keybuf(fd);
+    if (esc_waiting) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	timed_out = now.tv_sec > esc_timeout.tv_sec
+		 || (now.tv_sec == esc_timeout.tv_sec
+		     && now.tv_nsec >= esc_timeout.tv_nsec);
+    }
+    c = decode_key(timed_out);
+    if (c >= 0 || !keylen) {
+	esc_waiting = 0;
+    } else if (!esc_waiting) {
+	clock_gettime(CLOCK_MONOTONIC, &esc_timeout);
+	esc_timeout.tv_nsec += (long) (esc_delay % 1000) * 1000000;
+	esc_timeout.tv_sec += esc_delay / 1000 + esc_timeout.tv_nsec / 1000000000;
+	esc_timeout.tv_nsec %= 1000000000;
+	esc_waiting = 1;
+    }
+    return c;
+}
+
+/*************************************************************************/
+
+/* Return the time by which key_read() should be called again to finish off
+ * an incomplete escape sequence, or NULL if there isn't one.
+ */
+
+const struct timespec *key_deadline(void)
+{
+    return esc_waiting ? &esc_timeout : NULL;
+}
+
+/*************************************************************************/
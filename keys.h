@@ -0,0 +1,19 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Keyboard input decoder declarations.
+ */
+
+#ifndef KEYS_H
+#define KEYS_H
+
+/*************************************************************************/
+
+struct timespec;
+
+extern int key_read(int fd);
+extern const struct timespec *key_deadline(void);
+
+/*************************************************************************/
+
+#endif	/* KEYS_H */
@@ -0,0 +1,355 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Load generator for tetrinet-server.  Connects a crowd of players, has
+ * each of them send field updates at a steady rate, and counts how many of
+ * the updates come back out to the other players in their rooms.  Run the
+ * server with "stats 1" in its configuration to have it report how many
+ * system calls it needed for them, and the players' round trip times.
+ *
+ * With more players than the server has room for, the rest wait in its
+ * lobby.  "-fast" has a percentage of the players log in for tetrifaster
+ * games, and "-churn" has that many players a second leave their rooms and
+ * log in again, so that the lobby keeps moving players from its queues
+ * into the places they leave; it reports how long players waited.
+ *
+ * Usage: tetrinet-loadgen [-players N] [-rate N] [-time SECS] [-fast PCT]
+ *                         [-churn N] [host]
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+/*************************************************************************/
+
+typedef struct {
+    int fd;
+    int playernum;		/* 0 until the server tells us */
+    int fast;			/* Logged in for tetrifaster? */
+    long long since;		/* When it last logged in */
+    char buf[4096];		/* Partial line read */
+    int len;
+    long received;		/* Field updates from other players */
+} Player;
+
+static Player *players;
+static int nplayers = 60;	/* How many players to connect */
+static int rate = 10;		/* Field updates per second from each */
+static int seconds = 10;	/* How long to send them for */
+static int fast_pct = 0;	/* Percentage of players playing tetrifaster */
+static int churn = 0;		/* Players a second leaving and coming back */
+static const char *host = "127.0.0.1";
+
+static long sent, skipped;	/* Updates sent, and not sent for lack of room */
+static long placed;		/* Players given a place... */
+static long long wait_ms;	/*    and how long they waited in total */
+
+/*************************************************************************/
+
+/* Return the current time in milliseconds. */
+
+static long long now_ms(void)
+{
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (long long) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+/*************************************************************************/
+
+/* Connect a player and send it off to register.  Return 0 on success, -1
+ * on failure. */
+
+static int connect_player(Player *p, int index, const struct addrinfo *ai)
+{
+    char buf[64];
+    int len;
+
+    p->fd = socket(ai->ai_family, SOCK_STREAM, 0);
+    if (p->fd < 0)
+	return -1;
+    if (connect(p->fd, ai->ai_addr, ai->ai_addrlen) < 0) {
+	close(p->fd);
+	return -1;
+    }
+    len = snprintf(buf, sizeof(buf), "tetri%s load%d 1.13 ping\xFF",
+		   p->fast ? "faster" : "sstart", index);
+    if (write(p->fd, buf, len) != len) {
+	close(p->fd);
+	return -1;
+    }
+    fcntl(p->fd, F_SETFL, fcntl(p->fd, F_GETFL) | O_NONBLOCK);
+    p->playernum = 0;
+    p->len = 0;
+    p->since = now_ms();
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Answer a ping from the server, so it can report round trip times under
+ * load. */
+
+static void send_pong(Player *p, int stamp)
+{
+    char buf[64];
+    int len;
+
+    len = snprintf(buf, sizeof(buf), "pong %d %d %d\xFF", p->playernum,
+		   stamp, (int) (now_ms() & 0x7FFFFFFF));
+    /* If there's no room it's just lost; another ping will come. */
+    if (write(p->fd, buf, len) < 0)
+	return;
+}
+
+/*************************************************************************/
+
+/* Read whatever a player has been sent, and look at each complete line.
+ * Return 0 normally, -1 if the server closed the connection. */
+
+static int read_player(Player *p)
+{
+    char *line, *end;
+    int n;
+
+    for (;;) {
+	n = read(p->fd, p->buf + p->len, sizeof(p->buf) - p->len);
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && errno == EAGAIN)
+	    return 0;
+	if (n <= 0)
+	    return -1;
+	p->len += n;
+	line = p->buf;
+	while ((end = memchr(line, 0xFF, p->buf + p->len - line))) {
+	    *end = 0;
+	    if (line[0] == 'f' && line[1] == ' ')
+		p->received++;
+	    else if (strncmp(line, p->fast ? ")#)(!@(*3 " : "playernum ", 10)
+		     == 0) {
+		p->playernum = atoi(line+10);
+		placed++;
+		wait_ms += now_ms() - p->since;
+	    }
+	    else if (strncmp(line, "ping ", 5) == 0)
+		send_pong(p, atoi(line+5));
+	    else if (strncmp(line, "noconnecting ", 13) == 0)
+		fprintf(stderr, "Server refused player: %s\n", line+13);
+	    line = end+1;
+	}
+	n = p->buf + p->len - line;
+	if (n == sizeof(p->buf))
+	    n = 0;  /* Not a line we care about */
+	memmove(p->buf, line, n);
+	p->len = n;
+    }
+}
+
+/*************************************************************************/
+
+/* Send one field update from a player: a few random cells changed, as a
+ * client would send after a piece lands. */
+
+static void send_update(Player *p)
+{
+    static const char tiles[] = "!\"#$%&'()*+,-./";
+    char buf[64], *s;
+    int i;
+
+    s = buf + sprintf(buf, "f %d %c", p->playernum, tiles[rand() % 6]);
+    for (i = 0; i < 4; i++) {
+	*s++ = '3' + rand() % 12;
+	*s++ = '3' + rand() % 22;
+    }
+    *s++ = 0xFF;
+    if (write(p->fd, buf, s - buf) == s - buf)
+	sent++;
+    else
+	skipped++;  /* The server isn't keeping up; try again next time */
+}
+
+/*************************************************************************/
+
+/* Wait up to @timeout milliseconds for something to read, and read it. */
+
+static void poll_players(int epfd, int timeout)
+{
+    struct epoll_event evs[256];
+    int i, n;
+
+    n = epoll_wait(epfd, evs, sizeof(evs)/sizeof(*evs), timeout);
+    for (i = 0; i < n; i++) {
+	Player *p = evs[i].data.ptr;
+	if (read_player(p) < 0) {
+	    epoll_ctl(epfd, EPOLL_CTL_DEL, p->fd, NULL);
+	    close(p->fd);
+	    p->fd = -1;
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Have player @i leave their room and log in again, to wait in the lobby
+ * for another place.  Return 0 on success, -1 on failure. */
+
+static int rejoin(int epfd, int i, const struct addrinfo *ai)
+{
+    struct epoll_event ev;
+
+    close(players[i].fd);
+    if (connect_player(&players[i], i, ai) < 0) {
+	players[i].fd = -1;
+	return -1;
+    }
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &players[i];
+    epoll_ctl(epfd, EPOLL_CTL_ADD, players[i].fd, &ev);
+    return 0;
+}
+
+/*************************************************************************/
+
+int main(int ac, char **av)
+{
+    struct addrinfo hints, *ai;
+    struct epoll_event ev;
+    struct rlimit rl;
+    long long start, next, next_churn, end;
+    long received = 0;
+    int i, j, epfd, registered, interval;
+
+    for (i = 1; i < ac; i++) {
+	if (strcmp(av[i], "-players") == 0 && i+1 < ac)
+	    nplayers = atoi(av[++i]);
+	else if (strcmp(av[i], "-rate") == 0 && i+1 < ac)
+	    rate = atoi(av[++i]);
+	else if (strcmp(av[i], "-time") == 0 && i+1 < ac)
+	    seconds = atoi(av[++i]);
+	else if (strcmp(av[i], "-fast") == 0 && i+1 < ac)
+	    fast_pct = atoi(av[++i]);
+	else if (strcmp(av[i], "-churn") == 0 && i+1 < ac)
+	    churn = atoi(av[++i]);
+	else if (av[i][0] != '-')
+	    host = av[i];
+	else {
+	    fprintf(stderr, "Usage: %s [-players N] [-rate N] [-time SECS]"
+		    " [-fast PCT] [-churn N] [host]\n", av[0]);
+	    return 1;
+	}
+    }
+    if (nplayers < 1 || rate < 1 || seconds < 1) {
+	fprintf(stderr, "%s: -players, -rate and -time must be positive\n",
+		av[0]);
+	return 1;
+    }
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+	rl.rlim_cur = rl.rlim_max;
+	setrlimit(RLIMIT_NOFILE, &rl);
+    }
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if ((i = getaddrinfo(host, "31457", &hints, &ai)) != 0) {
+	fprintf(stderr, "%s: %s\n", host, gai_strerror(i));
+	return 1;
+    }
+    if (!(players = calloc(nplayers, sizeof(*players)))
+     || (epfd = epoll_create1(0)) < 0) {
+	perror(av[0]);
+	return 1;
+    }
+
+    /* Connect everyone and wait for them all to be given a number, or for
+     * those who won't fit to be left waiting. */
+    for (i = 0; i < nplayers; i++) {
+	players[i].fast = i % 100 < fast_pct;
+	if (connect_player(&players[i], i, ai) < 0) {
+	    perror("connect()");
+	    return 1;
+	}
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.ptr = &players[i];
+	epoll_ctl(epfd, EPOLL_CTL_ADD, players[i].fd, &ev);
+	poll_players(epfd, 0);
+    }
+    end = now_ms() + 5000;
+    do {
+	poll_players(epfd, 100);
+	for (i = registered = 0; i < nplayers; i++) {
+	    if (players[i].playernum)
+		registered++;
+	}
+    } while (registered < nplayers && now_ms() < end);
+    if (registered < nplayers) {
+	fprintf(stderr, "%d of %d players got in, the rest are waiting\n",
+		registered, nplayers);
+    }
+
+    /* Send updates, spreading each round out over the interval between
+     * them, and keep reading what comes back. */
+    interval = 1000 / rate > 0 ? 1000 / rate : 1;
+    start = now_ms();
+    end = start + seconds*1000LL;
+    next = next_churn = start;
+    while (now_ms() < end) {
+	if (now_ms() >= next) {
+	    for (i = 0; i < nplayers; i++) {
+		if (players[i].fd >= 0 && players[i].playernum)
+		    send_update(&players[i]);
+	    }
+	    next += interval;
+	}
+	if (churn && now_ms() >= next_churn) {
+	    for (j = 0; j < churn; j++) {
+		/* Someone in a room, from a random place in the list */
+		int k = rand() % nplayers, n;
+		for (n = 0; n < nplayers; n++, k = (k+1) % nplayers) {
+		    if (players[k].fd >= 0 && players[k].playernum)
+			break;
+		}
+		if (n < nplayers && rejoin(epfd, k, ai) < 0)
+		    perror("connect()");
+	    }
+	    next_churn += 1000;
+	}
+	i = next - now_ms();
+	poll_players(epfd, i > 0 ? i : 0);
+    }
+    /* Give the last updates time to arrive. */
+    end = now_ms() + 500;
+    while (now_ms() < end)
+	poll_players(epfd, end - now_ms());
+
+    freeaddrinfo(ai);
+
+    for (i = 0; i < nplayers; i++)
+	received += players[i].received;
+    printf("%d players, %d updates/s each for %ds\n", nplayers, rate,
+	   seconds);
+    printf("sent %ld updates (%ld skipped), %.0f/s\n", sent, skipped,
+	   (double) sent / seconds);
+    printf("received %ld relayed updates, %.0f/s\n", received,
+	   (double) received / seconds);
+    if (placed) {
+	printf("%ld players given places, average wait %.1f ms\n", placed,
+	       (double) wait_ms / placed);
+    }
+    return 0;
+}
+
+/*************************************************************************/
@@ -0,0 +1,265 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server lobby.  See lobby.h for how it works.
+ */
+
+#include <pthread.h>
+#include <stdlib.h>
+#include "lobby.h"
+
+/*************************************************************************/
+
+/* What the lobby knows about each room.  Full rooms aren't in any list. */
+
+typedef struct {
+    int next, prev;		/* In its list, -1 at either end */
+    int key;			/* -1 while empty */
+    int free;			/* Places not given to anyone */
+} LobbyRoom;
+
+typedef struct {
+    LobbyEntry *head, *tail;
+} Queue;
+
+static pthread_mutex_t lobby_lock = PTHREAD_MUTEX_INITIALIZER;
+static LobbyRoom *lrooms;
+static int *open_rooms;		/* Heads of the lists of rooms with places
+				 *    free, by key and number free */
+static int empty_rooms = -1;	/* Head of the list of empty rooms */
+static Queue *queues;		/* By key */
+static int nkeys;
+static unsigned long next_seq;
+
+long lobby_waited;
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Return the head of the list room @r belongs in, or NULL if it's full. */
+
+static int *list_for(int r)
+{
+    LobbyRoom *room = &lrooms[r];
+
+    if (room->free == LOBBY_ROOM_SIZE)
+	return &empty_rooms;
+    if (room->free > 0)
+	return &open_rooms[room->key * LOBBY_ROOM_SIZE + room->free];
+    return NULL;
+}
+
+static void link_room(int r)
+{
+    int *head = list_for(r);
+
+    if (!head)
+	return;
+    lrooms[r].prev = -1;
+    lrooms[r].next = *head;
+    if (*head >= 0)
+	lrooms[*head].prev = r;
+    *head = r;
+}
+
+static void unlink_room(int r)
+{
+    int *head = list_for(r);
+
+    if (!head)
+	return;
+    if (lrooms[r].prev >= 0)
+	lrooms[lrooms[r].prev].next = lrooms[r].next;
+    else
+	*head = lrooms[r].next;
+    if (lrooms[r].next >= 0)
+	lrooms[lrooms[r].next].prev = lrooms[r].prev;
+}
+
+/*************************************************************************/
+
+static void enqueue(LobbyEntry *e)
+{
+    Queue *q = &queues[e->key];
+
+    e->seq = next_seq++;
+    e->next = NULL;
+    e->prev = q->tail;
+    if (q->tail)
+	q->tail->next = e;
+    else
+	q->head = e;
+    q->tail = e;
+    lobby_waited++;
+}
+
+static void dequeue(LobbyEntry *e)
+{
+    Queue *q = &queues[e->key];
+
+    if (e->prev)
+	e->prev->next = e->next;
+    else
+	q->head = e->next;
+    if (e->next)
+	e->next->prev = e->prev;
+    else
+	q->tail = e->prev;
+}
+
+/*************************************************************************/
+
+/* Give @e a place in room @r. */
+
+static void take_place(int r, LobbyEntry *e)
+{
+    unlink_room(r);
+    if (lrooms[r].free == LOBBY_ROOM_SIZE)
+	lrooms[r].key = e->key;
+    lrooms[r].free--;
+    link_room(r);
+    atomic_set(&e->room, r);
+}
+
+/* Fill room @r's free places from the queues, storing the entries given a
+ * place in @given.  Return how many there were. */
+
+static int fill(int r, LobbyEntry **given)
+{
+    LobbyEntry *e;
+    int n = 0, key, i;
+
+    while (lrooms[r].free > 0) {
+	key = lrooms[r].key;
+	if (key < 0) {
+	    /* An empty room goes to whoever has waited longest. */
+	    for (i = 0; i < nkeys; i++) {
+		if (queues[i].head && (key < 0
+				       || queues[i].head->seq
+				          < queues[key].head->seq))
+		    key = i;
+	    }
+	    if (key < 0)
+		break;
+	}
+	if (!(e = queues[key].head))
+	    break;
+	dequeue(e);
+	take_place(r, e);
+	given[n++] = e;
+    }
+    return n;
+}
+
+/* Free a place in room @r, as for lobby_release().  The caller must hold
+ * lobby_lock. */
+
+static int release(int r, LobbyEntry **given)
+{
+    unlink_room(r);
+    if (++lrooms[r].free == LOBBY_ROOM_SIZE)
+	lrooms[r].key = -1;
+    link_room(r);
+    return fill(r, given);
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Set up the lobby for @nrooms empty rooms and player keys from 0 to
+ * @keys-1.  Return 0 on success, -1 on failure. */
+
+int lobby_init(int nrooms, int keys)
+{
+    int i;
+
+    nkeys = keys;
+    lrooms = malloc(nrooms * sizeof(*lrooms));
+    open_rooms = malloc(nkeys * LOBBY_ROOM_SIZE * sizeof(*open_rooms));
+    queues = calloc(nkeys, sizeof(*queues));
+    if (!lrooms || !open_rooms || !queues) {
+	free(lrooms);
+	free(open_rooms);
+	free(queues);
+	return -1;
+    }
+    for (i = 0; i < nkeys * LOBBY_ROOM_SIZE; i++)
+	open_rooms[i] = -1;
+    /* Linked backwards, so that the first rooms are used first. */
+    for (i = nrooms-1; i >= 0; i--) {
+	lrooms[i].key = -1;
+	lrooms[i].free = LOBBY_ROOM_SIZE;
+	link_room(i);
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Find a place for a new player with key @key, in the fullest room which
+ * has one, or an empty room if none do.  Return the room, or -1 if there
+ * is no place for them yet and they have been put in the queue; the
+ * caller must then keep @entry until it is given a room or cancelled.
+ */
+
+int lobby_join(LobbyEntry *entry, int key)
+{
+    int r = -1, i;
+
+    pthread_mutex_lock(&lobby_lock);
+    entry->key = key;
+    atomic_set(&entry->room, -1);
+    /* If anyone is queued, there's no place for this key. */
+    if (!queues[key].head) {
+	for (i = 1; i < LOBBY_ROOM_SIZE && r < 0; i++)
+	    r = open_rooms[key * LOBBY_ROOM_SIZE + i];
+	if (r < 0)
+	    r = empty_rooms;
+    }
+    if (r >= 0)
+	take_place(r, entry);
+    else
+	enqueue(entry);
+    pthread_mutex_unlock(&lobby_lock);
+    return r;
+}
+
+/*************************************************************************/
+
+/* Say that a player given to lobby_join() has gone away: take them out of
+ * the queue, or if they were given a room in the meantime, free their
+ * place as for lobby_release().  Return the number of entries in @given.
+ */
+
+int lobby_cancel(LobbyEntry *entry, LobbyEntry **given)
+{
+    int n = 0;
+
+    pthread_mutex_lock(&lobby_lock);
+    if (entry->room < 0)
+	dequeue(entry);
+    else
+	n = release(entry->room, given);
+    pthread_mutex_unlock(&lobby_lock);
+    return n;
+}
+
+/*************************************************************************/
+
+/* Free a place in room @r, when its player leaves.  It may be given
+ * straight to players waiting, whose entries are stored in @given (which
+ * must have room for LOBBY_ROOM_SIZE); the caller must then wake their
+ * tasks.  Return the number of entries in @given.
+ */
+
+int lobby_release(int r, LobbyEntry **given)
+{
+    int n;
+
+    pthread_mutex_lock(&lobby_lock);
+    n = release(r, given);
+    pthread_mutex_unlock(&lobby_lock);
+    return n;
+}
+
+/*************************************************************************/
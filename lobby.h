@@ -0,0 +1,51 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server lobby declarations.
+ */
+
+#ifndef LOBBY_H
+#define LOBBY_H
+
+#include "sched.h"
+
+/*************************************************************************/
+
+/* The lobby finds new players a place in a room, or keeps them waiting
+ * until one comes free.  Players are grouped by a key (the server makes it
+ * from their game mode and skill), and a room only takes players with the
+ * key of whoever it was given to first, until it empties again.
+ *
+ * Rooms with free places are kept in a list for each key and number of
+ * places free, and empty rooms in a list of their own, so finding a player
+ * the fullest room they can go in only means looking at the heads of a
+ * few lists.  Players who can't be placed wait in a queue for their key.
+ * A place coming free goes to the head of its room's queue; a room
+ * emptying goes to whichever queue has waited longest, taking as many
+ * from it as it can.  Everything is done with the lobby's lock held, and
+ * takes time independent of the number of rooms and players waiting.
+ */
+
+#define LOBBY_ROOM_SIZE	6	/* Places in a room */
+
+typedef struct LobbyEntry LobbyEntry;
+struct LobbyEntry {
+    LobbyEntry *next, *prev;	/* In its queue, while waiting */
+    SchedTask *task;		/* For the caller to wake when given a room */
+    int key;
+    int room;			/* Room given, -1 while waiting (read with
+				 *    atomic_get() outside the lobby) */
+    unsigned long seq;		/* Order of joining the queues */
+};
+
+extern int lobby_init(int nrooms, int nkeys);
+extern int lobby_join(LobbyEntry *entry, int key);
+extern int lobby_cancel(LobbyEntry *entry, LobbyEntry **given);
+extern int lobby_release(int room, LobbyEntry **given);
+
+/* Number of players who have had to wait for a place, for statistics. */
+extern long lobby_waited;
+
+/*************************************************************************/
+
+#endif	/* LOBBY_H */
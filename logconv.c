@@ -0,0 +1,67 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Converts a network traffic log (see netlog.h) to text, one line per
+ * message: the time in brackets, ">>>" for lines sent or "<<<" for lines
+ * received, and the line itself.  With -c, each line also shows which
+ * connection it was on, for server logs.
+ *
+ * Usage: tetrinet-logconv [-c] logfile
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include "netlog.h"
+
+/*************************************************************************/
+
+int main(int ac, char **av)
+{
+    NetLogRecord rec;
+    char magic[8], buf[65536];
+    const char *filename = NULL;
+    int show_conn = 0, i;
+    FILE *f;
+
+    for (i = 1; i < ac; i++) {
+	if (strcmp(av[i], "-c") == 0)
+	    show_conn = 1;
+	else if (!filename && av[i][0] != '-')
+	    filename = av[i];
+	else
+	    break;
+    }
+    if (!filename || i < ac) {
+	fprintf(stderr, "Usage: %s [-c] logfile\n", av[0]);
+	return 1;
+    }
+    if (!(f = fopen(filename, "rb"))) {
+	perror(filename);
+	return 1;
+    }
+    if (fread(magic, sizeof(magic), 1, f) != 1
+     || memcmp(magic, NETLOG_MAGIC, sizeof(magic)) != 0) {
+	fprintf(stderr, "%s: not a Tetrinet traffic log\n", filename);
+	return 1;
+    }
+
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+	if (rec.len && fread(buf, rec.len, 1, f) != 1) {
+	    fprintf(stderr, "%s: truncated record\n", filename);
+	    return 1;
+	}
+	printf("[%u.%03u] ", rec.sec, rec.usec / 1000);
+	if (rec.dir == NETLOG_DROPPED) {
+	    printf("*** %d lines not logged\n", rec.conn);
+	    continue;
+	}
+	if (show_conn)
+	    printf("%d ", rec.conn);
+	printf("%s %.*s\n", rec.dir == NETLOG_SEND ? ">>>" : "<<<",
+	       (int) rec.len, buf);
+    }
+    fclose(f);
+    return 0;
+}
+
+/*************************************************************************/
@@ -0,0 +1,165 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Protocol message encoders.
+ */
+
+#include <string.h>
+#include "msg.h"
+
+/*************************************************************************/
+
+/* Append a string at @p, stopping short of @end, and return the new end.
+ * NULL is taken as an empty string. */
+
+static char *put_text(char *p, const char *s, const char *end)
+{
+    int len;
+
+    if (!s)
+	return p;
+    len = strlen(s);
+    if (len > end - p)
+	len = end - p;
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/*************************************************************************/
+
+char *msg_put_str(char *p, const char *s)
+{
+    int len = strlen(s);
+
+    memcpy(p, s, len);
+    return p + len;
+}
+
+/*************************************************************************/
+
+char *msg_put_int(char *p, int n)
+{
+    char digits[10], *d = digits;
+    unsigned int u = n;
+
+    if (n < 0) {
+	*p++ = '-';
+	u = -u;
+    }
+    do {
+	*d++ = '0' + u%10;
+	u /= 10;
+    } while (u);
+    while (d > digits)
+	*p++ = *--d;
+    return p;
+}
+
+/*************************************************************************/
+
+int msg_end(char *buf, char *p)
+{
+    *p++ = 0xFF;
+    return p - buf;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* "cmd" */
+
+int msg_cmd(char *buf, const char *cmd)
+{
+    return msg_end(buf, put_text(buf, cmd, buf+MSG_MAX-1));
+}
+
+/* "cmd n" */
+
+int msg_cmd_int(char *buf, const char *cmd, int n)
+{
+    char *p = msg_put_str(buf, cmd);
+
+    *p++ = ' ';
+    return msg_end(buf, msg_put_int(p, n));
+}
+
+/* "cmd n1 n2" */
+
+int msg_cmd_int_int(char *buf, const char *cmd, int n1, int n2)
+{
+    char *p = msg_put_str(buf, cmd);
+
+    *p++ = ' ';
+    p = msg_put_int(p, n1);
+    *p++ = ' ';
+    return msg_end(buf, msg_put_int(p, n2));
+}
+
+/* "cmd n1 n2 n3" */
+
+int msg_cmd_int_int_int(char *buf, const char *cmd, int n1, int n2, int n3)
+{
+    char *p = msg_put_str(buf, cmd);
+
+    *p++ = ' ';
+    p = msg_put_int(p, n1);
+    *p++ = ' ';
+    p = msg_put_int(p, n2);
+    *p++ = ' ';
+    return msg_end(buf, msg_put_int(p, n3));
+}
+
+/* "cmd n s" */
+
+int msg_cmd_int_str(char *buf, const char *cmd, int n, const char *s)
+{
+    char *p = msg_put_str(buf, cmd);
+
+    *p++ = ' ';
+    p = msg_put_int(p, n);
+    *p++ = ' ';
+    return msg_end(buf, put_text(p, s, buf+MSG_MAX-1));
+}
+
+/* "cmd s" */
+
+int msg_cmd_str(char *buf, const char *cmd, const char *s)
+{
+    char *p = msg_put_str(buf, cmd);
+
+    *p++ = ' ';
+    return msg_end(buf, put_text(p, s, buf+MSG_MAX-1));
+}
+
+/*************************************************************************/
+
+/* "sb to type from": special @type sent to player @to (0 for all) by
+ * player @from. */
+
+int msg_sb(char *buf, int to, const char *type, int from)
+{
+    char *p = msg_put_str(buf, "sb ");
+
+    p = msg_put_int(p, to);
+    *p++ = ' ';
+    p = put_text(p, type, buf+MSG_MAX-13);
+    *p++ = ' ';
+    return msg_end(buf, msg_put_int(p, from));
+}
+
+/*************************************************************************/
+
+/* A game message from a player: "gmsg <nick> text", or for an action,
+ * "gmsg * nick text". */
+
+int msg_gmsg_from(char *buf, const char *nick, const char *text, int action)
+{
+    const char *end = buf+MSG_MAX-1;
+    char *p = msg_put_str(buf, action ? "gmsg * " : "gmsg <");
+
+    p = put_text(p, nick, end-2);
+    p = msg_put_str(p, action ? " " : "> ");
+    return msg_end(buf, put_text(p, text, end));
+}
+
+/*************************************************************************/
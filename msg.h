@@ -0,0 +1,77 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Protocol message encoder declarations.
+ */
+
+#ifndef MSG_H
+#define MSG_H
+
+/*************************************************************************/
+
+/* Each encoder writes one complete message, 0xFF terminator included, into
+ * a buffer of MSG_MAX bytes and returns its length.  Text which would not
+ * fit is cut short.  There is no format string to get out of step with the
+ * arguments; each kind of message has its own encoder, defined below in
+ * terms of a few general ones for messages of the same shape.
+ */
+
+#define MSG_MAX		1024
+
+extern int msg_cmd(char *buf, const char *cmd);
+extern int msg_cmd_int(char *buf, const char *cmd, int n);
+extern int msg_cmd_int_int(char *buf, const char *cmd, int n1, int n2);
+extern int msg_cmd_int_int_int(char *buf, const char *cmd, int n1, int n2,
+			       int n3);
+extern int msg_cmd_int_str(char *buf, const char *cmd, int n, const char *s);
+extern int msg_cmd_str(char *buf, const char *cmd, const char *s);
+extern int msg_sb(char *buf, int to, const char *type, int from);
+extern int msg_gmsg_from(char *buf, const char *nick, const char *text,
+			 int action);
+
+/* For messages built by hand (field updates): append a string or a
+ * decimal number at @p and return the new end, and add the terminator at
+ * @p and return the length of the message starting at @buf.  The caller
+ * must make sure there is room. */
+extern char *msg_put_str(char *p, const char *s);
+extern char *msg_put_int(char *p, int n);
+extern int msg_end(char *buf, char *p);
+
+/* Server to client: */
+#define msg_endgame(buf)	msg_cmd(buf, "endgame")
+#define msg_ingame(buf)		msg_cmd(buf, "ingame")
+#define msg_playernum(buf,n,fast) \
+	msg_cmd_int(buf, (fast) ? ")#)(!@(*3" : "playernum", n)
+#define msg_playerjoin(buf,n,nick) msg_cmd_int_str(buf, "playerjoin", n, nick)
+#define msg_playerleave(buf,n)	msg_cmd_int(buf, "playerleave", n)
+#define msg_playerwon(buf,n)	msg_cmd_int(buf, "playerwon", n)
+#define msg_newgame(buf,fast,settings) \
+	msg_cmd_str(buf, (fast) ? "*******" : "newgame", settings)
+#define msg_pause(buf,paused)	msg_cmd_int(buf, "pause", paused)
+#define msg_winlist(buf,list)	msg_cmd_str(buf, "winlist", list)
+#define msg_noconnecting(buf,why) msg_cmd_str(buf, "noconnecting", why)
+#define msg_gmsg(buf,text)	msg_cmd_str(buf, "gmsg", text)
+
+/* Client to server: */
+#define msg_startgame(buf,start,n) msg_cmd_int_int(buf, "startgame", start, n)
+#define msg_pause_from(buf,paused,n) msg_cmd_int_int(buf, "pause", paused, n)
+#define msg_playerlost(buf,n)	msg_cmd_int(buf, "playerlost", n)
+
+/* Our extension, for clients which add "ping" after the version in
+ * "tetrisstart": the server sends "ping" with a stamp of its own, and the
+ * client answers at once with "pong", the same stamp and the time of day
+ * on its own clock (milliseconds, modulo 2^31). */
+#define msg_ping(buf,stamp)	msg_cmd_int(buf, "ping", stamp)
+#define msg_pong(buf,n,stamp,clock) \
+	msg_cmd_int_int_int(buf, "pong", n, stamp, clock)
+
+/* Both ways: */
+#define msg_f(buf,n,field)	msg_cmd_int_str(buf, "f", n, field)
+#define msg_lvl(buf,n,level)	msg_cmd_int_int(buf, "lvl", n, level)
+#define msg_team(buf,n,team)	msg_cmd_int_str(buf, "team", n, team)
+#define msg_pline(buf,n,text)	msg_cmd_int_str(buf, "pline", n, text)
+#define msg_plineact(buf,n,text) msg_cmd_int_str(buf, "plineact", n, text)
+
+/*************************************************************************/
+
+#endif	/* MSG_H */
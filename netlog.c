@@ -0,0 +1,223 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Network traffic log.  See netlog.h for the file format.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#include "netlog.h"
+
+/*************************************************************************/
+
+#define RING_SIZE	(1<<20)	/* Bytes of log each thread can have waiting;
+				 * must be a power of 2 */
+#define WRITE_INTERVAL	10	/* Milliseconds between looks at the rings */
+
+/* Each thread which logs anything gets a ring of its own, so that it is
+ * the only one ever adding to it and the writer thread the only one ever
+ * taking from it, and neither needs a lock.  Rings are never freed. */
+
+typedef struct Ring Ring;
+struct Ring {
+    Ring *next;			/* Next in the list of all rings */
+    unsigned int head;		/* Owner: where the next record goes */
+    unsigned int tail;		/* Writer: where the next one to write is */
+    unsigned int dropped;	/* Owner: records which didn't fit */
+    unsigned int reported;	/* Writer: ...and have been logged as such */
+    char data[RING_SIZE];
+};
+
+static int log_fd = -1;
+static Ring *rings;		/* All rings, newest first */
+static __thread Ring *my_ring;
+static pthread_t writer;
+static int running;		/* Cleared to stop the writer */
+
+/*************************************************************************/
+
+/* Set up the calling thread's ring, and return it (NULL if out of
+ * memory). */
+
+static Ring *new_ring(void)
+{
+    Ring *r = malloc(sizeof(*r));
+
+    if (!r)
+	return NULL;
+    r->head = r->tail = r->dropped = r->reported = 0;
+    r->next = __atomic_load_n(&rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&rings, &r->next, r, 0,
+					__ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+	;
+    return my_ring = r;
+}
+
+/* Copy @len bytes into a ring at (unwrapped) position @pos. */
+
+static void ring_put(Ring *r, unsigned int pos, const void *data, int len)
+{
+    int off = pos & (RING_SIZE-1), n = RING_SIZE - off;
+
+    if (n > len)
+	n = len;
+    memcpy(r->data + off, data, n);
+    memcpy(r->data, (const char *) data + n, len - n);
+}
+
+/*************************************************************************/
+
+/* Fill in a record header with the current time. */
+
+static void stamp(NetLogRecord *rec, int dir, int conn, int len)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    rec->sec = ts.tv_sec;
+    rec->usec = ts.tv_nsec / 1000;
+    rec->conn = conn;
+    rec->len = len;
+    rec->dir = dir;
+    rec->pad = 0;
+}
+
+/*************************************************************************/
+
+/* Write out everything waiting in a ring.  Return whether there was
+ * anything. */
+
+static int write_ring(Ring *r)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    struct iovec iov[3];
+    NetLogRecord rec;
+    int n = 0, off, len;
+
+    if (head == r->tail && dropped == r->reported)
+	return 0;
+    off = r->tail & (RING_SIZE-1);
+    len = head - r->tail;
+    if (len > 0) {
+	iov[n].iov_base = r->data + off;
+	iov[n++].iov_len = len < RING_SIZE-off ? len : RING_SIZE-off;
+	if (len > RING_SIZE-off) {
+	    iov[n].iov_base = r->data;
+	    iov[n++].iov_len = len - (RING_SIZE-off);
+	}
+    }
+    if (dropped != r->reported) {
+	stamp(&rec, NETLOG_DROPPED, dropped - r->reported, 0);
+	iov[n].iov_base = &rec;
+	iov[n++].iov_len = sizeof(rec);
+	r->reported = dropped;
+    }
+    /* One call, so that processes sharing the file never interleave
+     * partial records.  If it fails there's nobody to tell, so the
+     * records are just lost. */
+    writev(log_fd, iov, n);
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+    return 1;
+}
+
+/*************************************************************************/
+
+static void *writer_thread(void *unused)
+{
+    struct timespec ts = {0, WRITE_INTERVAL * 1000000};
+    Ring *r;
+    int stop;
+
+    do {
+	/* Look once more after being told to stop, to get the last of
+	 * the records. */
+	stop = !__atomic_load_n(&running, __ATOMIC_ACQUIRE);
+	for (r = __atomic_load_n(&rings, __ATOMIC_ACQUIRE); r; r = r->next)
+	    write_ring(r);
+	if (!stop)
+	    nanosleep(&ts, NULL);
+    } while (!stop);
+    return NULL;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Start logging to the given file, appending if it already exists (so
+ * several server processes can share one).  Return 0 on success, -1 on
+ * error (with errno set).
+ */
+
+int netlog_open(const char *filename)
+{
+    int fd = open(filename, O_WRONLY | O_APPEND | O_CREAT | O_EXCL, 0644);
+
+    if (fd >= 0) {
+	if (write(fd, NETLOG_MAGIC, 8) != 8) {
+	    close(fd);
+	    return -1;
+	}
+    } else if (errno != EEXIST
+	       || (fd = open(filename, O_WRONLY | O_APPEND)) < 0) {
+	return -1;
+    }
+    log_fd = fd;
+    running = 1;
+    if ((errno = pthread_create(&writer, NULL, writer_thread, NULL)) != 0) {
+	close(fd);
+	log_fd = -1;
+	return -1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Write out everything logged so far and stop logging.  No other thread
+ * may be logging anything at the time. */
+
+void netlog_close(void)
+{
+    if (log_fd < 0)
+	return;
+    __atomic_store_n(&running, 0, __ATOMIC_RELEASE);
+    pthread_join(writer, NULL);
+    close(log_fd);
+    log_fd = -1;
+}
+
+/*************************************************************************/
+
+/* Log a line sent or received (@dir is NETLOG_SEND or NETLOG_RECV).  If
+ * there's no room for it, it is dropped. */
+
+void netlog_record(int dir, int conn, const char *data, int len)
+{
+    Ring *r = my_ring;
+    NetLogRecord rec;
+    unsigned int head, tail;
+
+    if (log_fd < 0 || (!r && !(r = new_ring())))
+	return;
+    if (len > 65535)
+	len = 65535;
+    head = r->head;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (sizeof(rec) + len > RING_SIZE - (head - tail)) {
+	__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+	return;
+    }
+    stamp(&rec, dir, conn, len);
+    ring_put(r, head, &rec, sizeof(rec));
+    ring_put(r, head + sizeof(rec), data, len);
+    __atomic_store_n(&r->head, head + sizeof(rec) + len, __ATOMIC_RELEASE);
+}
+
+/*************************************************************************/
@@ -0,0 +1,46 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Network traffic log declarations.
+ */
+
+#ifndef NETLOG_H
+#define NETLOG_H
+
+#include <stdint.h>
+
+/*************************************************************************/
+
+/* With -log (or "log" in the server's configuration), every line sent or
+ * received is recorded.  Recording just copies the line into a ring
+ * buffer belonging to the calling thread; a background thread writes the
+ * rings out to the log file.  If a ring fills up because the disk can't
+ * keep up, lines are dropped rather than holding up the game, and the
+ * number dropped is recorded in their place.
+ *
+ * The log file starts with NETLOG_MAGIC, followed by records each made up
+ * of a NetLogRecord and then its @len bytes of payload (the line without
+ * its 0xFF terminator).  tetrinet-logconv turns a log into text.
+ */
+
+#define NETLOG_MAGIC	"TNETLOG1"
+
+#define NETLOG_RECV	0	/* A line received on @conn */
+#define NETLOG_SEND	1	/* A line sent on @conn */
+#define NETLOG_DROPPED	2	/* @conn lines were dropped here */
+
+typedef struct {
+    uint32_t sec, usec;		/* Time of day */
+    int32_t conn;		/* Connection (file descriptor) */
+    uint16_t len;		/* Length of the payload */
+    uint8_t dir;		/* NETLOG_* */
+    uint8_t pad;
+} NetLogRecord;
+
+extern int netlog_open(const char *filename);
+extern void netlog_close(void);
+extern void netlog_record(int dir, int conn, const char *data, int len);
+
+/*************************************************************************/
+
+#endif	/* NETLOG_H */
@@ -0,0 +1,245 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Query port.  See query.h for the protocol.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "query.h"
+#include "reactor.h"
+#include "sched.h"
+#include "version.h"
+
+/*************************************************************************/
+
+/* What each room has told us, shared by all server processes.  Each entry
+ * is only changed by its own room, and seq is changed after every change,
+ * so anyone who reads seq before the entries can tell from a later look at
+ * it whether what they read is still up to date. */
+
+typedef struct {
+    unsigned int seq;
+    int nrooms;
+    struct {
+	int players, state;
+    } rooms[];
+} RoomStatus;
+
+static RoomStatus *room_status;
+
+/* The answers to each query, one after the other, as of room_status->seq
+ * being answers_seq.  They are made again by the first query after a
+ * change. */
+
+#define ANSWER_PLAYERS	0
+#define ANSWER_VERSION	1
+#define ANSWER_LISTCHAN	2
+
+#define LISTCHAN_LINE	64	/* Room for one room's "listchan" line */
+
+static pthread_mutex_t answer_lock = PTHREAD_MUTEX_INITIALIZER;
+static char *answers;
+static int answer_pos[4];	/* Where each starts, and where the last ends */
+static unsigned int answers_seq;
+static int answers_made;	/* Have they been made at all yet? */
+
+/* A connection on the query port, which is its own task until it has sent
+ * its query and had its answer.  These are never freed, only put back in
+ * the free list, since the reactor may wake one a last time after its
+ * connection has closed. */
+
+#define QUERY_MAX	32	/* Longest query we wait for */
+
+typedef struct Query Query;
+struct Query {
+    SchedTask task;		/* Must be first */
+    Query *next;		/* Next in the free list */
+    int fd;			/* -1 while free */
+    int len;
+    char buf[QUERY_MAX];
+};
+
+static pthread_mutex_t free_lock = PTHREAD_MUTEX_INITIALIZER;
+static Query *free_queries;
+
+long queries_answered;
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Make the answers from the current state of the rooms.  The caller must
+ * hold answer_lock. */
+
+static void make_answers(void)
+{
+    unsigned int seq = atomic_get(&room_status->seq);
+    char *s = answers;
+    int i, total = 0;
+
+    for (i = 0; i < room_status->nrooms; i++)
+	total += atomic_get(&room_status->rooms[i].players);
+    answer_pos[ANSWER_PLAYERS] = 0;
+    s += sprintf(s, "Number of players logged in: %d\n", total);
+    answer_pos[ANSWER_VERSION] = s - answers;
+    s += sprintf(s, "tetrinet-server %s\n+OK\n", VERSION);
+    answer_pos[ANSWER_LISTCHAN] = s - answers;
+    for (i = 0; i < room_status->nrooms; i++) {
+	s += sprintf(s, "\"#room%d\" \"Room %d\" %d 6 0 %d\n", i+1, i+1,
+		     atomic_get(&room_status->rooms[i].players),
+		     atomic_get(&room_status->rooms[i].state));
+    }
+    s += sprintf(s, "+OK\n");
+    answer_pos[ANSWER_LISTCHAN+1] = s - answers;
+    answers_seq = seq;
+    answers_made = 1;
+}
+
+/*************************************************************************/
+
+/* Send the answer to @query on @fd, if it's one we know. */
+
+static void answer(int fd, const char *query)
+{
+    int which;
+
+    if (strcmp(query, "playerquery") == 0)
+	which = ANSWER_PLAYERS;
+    else if (strcmp(query, "version") == 0)
+	which = ANSWER_VERSION;
+    else if (strcmp(query, "listchan") == 0)
+	which = ANSWER_LISTCHAN;
+    else
+	return;
+    pthread_mutex_lock(&answer_lock);
+    if (!answers_made || answers_seq != atomic_get(&room_status->seq))
+	make_answers();
+    reactor_send(fd, answers + answer_pos[which],
+		 answer_pos[which+1] - answer_pos[which]);
+    pthread_mutex_unlock(&answer_lock);
+    atomic_add(&queries_answered, 1);
+}
+
+/*************************************************************************/
+
+static void free_query(Query *q)
+{
+    q->len = 0;
+    pthread_mutex_lock(&free_lock);
+    atomic_set(&q->fd, -1);
+    q->next = free_queries;
+    free_queries = q;
+    pthread_mutex_unlock(&free_lock);
+}
+
+/*************************************************************************/
+
+/* Read a query connection's query, answer it and close the connection. */
+
+static void query_run(SchedTask *task)
+{
+    Query *q = (Query *) task;
+    int fd = atomic_get(&q->fd), n;
+    char *end;
+
+    if (fd < 0)
+	return;  /* Already finished with */
+    for (;;) {
+	n = reactor_recv(fd, q->buf + q->len, sizeof(q->buf) - 1 - q->len);
+	if (n < 0)
+	    return;  /* Wait for the rest */
+	if (n == 0)
+	    break;
+	q->len += n;
+	for (end = q->buf; end < q->buf + q->len; end++) {
+	    if (*end == '\xFF' || *end == '\n' || *end == '\r')
+		break;
+	}
+	if (end < q->buf + q->len) {
+	    *end = 0;
+	    answer(fd, q->buf);
+	    break;
+	}
+	if (q->len == sizeof(q->buf) - 1)
+	    break;  /* Too long to be a query */
+    }
+    reactor_close(fd);
+    free_query(q);
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Set up the state shared by all server processes, for @nrooms rooms in
+ * all, and the space for the answers.  Must be called before the server
+ * processes are started.  Return 0 on success, -1 on failure.
+ */
+
+int query_init(int nrooms)
+{
+    size_t size = sizeof(*room_status) + nrooms * sizeof(*room_status->rooms);
+    int i;
+
+    room_status = mmap(NULL, size, PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (room_status == MAP_FAILED) {
+	room_status = NULL;
+	return -1;
+    }
+    room_status->nrooms = nrooms;
+    for (i = 0; i < nrooms; i++)
+	room_status->rooms[i].state = QUERY_IDLE;
+    if (!(answers = malloc(256 + (nrooms+1) * LISTCHAN_LINE))) {
+	munmap(room_status, size);
+	room_status = NULL;
+	return -1;
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Note that room @id (counting from 0 across all processes) now has
+ * @players players and is in state @state (QUERY_*).  Only that room may
+ * call this. */
+
+void query_room(int id, int players, int state)
+{
+    if (!room_status || id < 0 || id >= room_status->nrooms)
+	return;
+    atomic_set(&room_status->rooms[id].players, players);
+    atomic_set(&room_status->rooms[id].state, state);
+    atomic_add(&room_status->seq, 1);
+}
+
+/*************************************************************************/
+
+/* Take a new connection on the query port. */
+
+void query_accept(int fd)
+{
+    Query *q;
+
+    pthread_mutex_lock(&free_lock);
+    if ((q = free_queries))
+	free_queries = q->next;
+    pthread_mutex_unlock(&free_lock);
+    if (!q) {
+	if (!(q = calloc(1, sizeof(*q)))) {
+	    close(fd);
+	    return;
+	}
+	q->task.run = query_run;
+    }
+    atomic_set(&q->fd, fd);
+    if (reactor_add(fd, &q->task) < 0) {
+	close(fd);
+	free_query(q);
+    }
+}
+
+/*************************************************************************/
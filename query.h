@@ -0,0 +1,42 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Query port declarations.
+ */
+
+#ifndef QUERY_H
+#define QUERY_H
+
+/*************************************************************************/
+
+/* With "queryport" set, the server answers server browsers on that port,
+ * without the login handshake and without taking up a place in a room.
+ * A query is one line, ended by 0xFF or a newline, and the server sends
+ * its answer and closes the connection:
+ *
+ *   playerquery:  "Number of players logged in: <n>\n"
+ *   version:      "<server version>\n+OK\n"
+ *   listchan:     a line for each room, then "+OK\n":
+ *                     "#room<n>" "Room <n>" <players> 6 0 <state>\n
+ *                 where <state> is one of the QUERY_* values below.
+ *
+ * Each room tells us its number of players and state whenever they
+ * change, in memory shared by all server processes.  The answers are kept
+ * ready in each process and only made again when something has changed,
+ * so answering a query is just a copy.
+ */
+
+#define QUERY_IDLE	1	/* No game being played */
+#define QUERY_PLAYING	2
+#define QUERY_PAUSED	3
+
+extern int query_init(int nrooms);
+extern void query_room(int id, int players, int state);
+extern void query_accept(int fd);
+
+/* Number of queries answered so far, for statistics. */
+extern long queries_answered;
+
+/*************************************************************************/
+
+#endif	/* QUERY_H */
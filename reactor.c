@@ -0,0 +1,1068 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server network I/O, with epoll or io_uring.  See reactor.h for how it is
+ * used.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+#include <linux/io_uring.h>
+#include "reactor.h"
+
+/*************************************************************************/
+
+#define MAX_UNREAD	65536	/* Unread input before we give up on a client */
+#define MAX_UNSENT	262144	/* Unsent output before we give up on one */
+
+typedef struct {
+    char *data;
+    int len, size;
+} Buffer;
+
+/* State for one connection, indexed by file descriptor.  Which thread may
+ * use each field is noted; "owner" means whichever thread is running the
+ * connection's task, and "reactor" the thread calling reactor_wait().
+ */
+
+typedef struct {
+    SchedTask *task;		/* Woken when there is input */
+    Buffer out;			/* Owner: written but not yet flushed (with
+				 *    epoll, or not yet sent) */
+
+    /* epoll only: */
+    int want_out;		/* Owner: also woken when it can be written */
+
+    /* io_uring only: */
+    pthread_mutex_t lock;	/* Protects the fields up to the next comment */
+    Buffer in;			/* Received but not yet read */
+    Buffer pending;		/* Flushed but not yet sent */
+    int eof;			/* Nothing more will be received */
+    int closing;		/* The owner has finished with it */
+    int queued;			/* In the flush queue */
+
+    Buffer sending;		/* Reactor: being sent */
+    int sendpos;		/* Reactor: how much of it has gone */
+    int nops;			/* Reactor: operations in flight */
+    int receiving;		/* Reactor: a recv is in flight */
+    int cancelled;		/* Reactor: ...and we've asked it to stop */
+    int closed;			/* Reactor: the close is in flight */
+} Conn;
+
+static int backend = REACTOR_EPOLL;
+static int tick_fd = -1;	/* Timerfd to watch, if any */
+static void (*tick_cb)(void);	/* ...and what to call when it fires */
+static uint64_t tick_count;	/* Where it is read to */
+static Conn **conns;
+static int maxconns;
+
+/* Listen sockets, and what to call with each connection accepted on one. */
+typedef struct {
+    int sock;
+    void (*func)(int fd);
+} Listener;
+static Listener listeners[4];
+static int nlisteners;
+
+long reactor_syscalls;
+
+#define COUNT_SYSCALL()	__atomic_add_fetch(&reactor_syscalls, 1, \
+					   __ATOMIC_RELAXED)
+
+/*************************************************************************/
+
+/* Make room for @len more bytes in a buffer.  Return 0 on success, -1 if
+ * out of memory (in which case the buffer is left alone). */
+
+static int buf_reserve(Buffer *b, int len)
+{
+    if (b->len + len > b->size) {
+	int newsize = b->size ? b->size : 256;
+	char *new;
+	while (newsize < b->len + len)
+	    newsize *= 2;
+	if (!(new = realloc(b->data, newsize)))
+	    return -1;
+	b->data = new;
+	b->size = newsize;
+    }
+    return 0;
+}
+
+/* Append @len bytes to a buffer.  Return 0 on success, -1 if out of
+ * memory (in which case the buffer is left alone). */
+
+static int buf_append(Buffer *b, const char *data, int len)
+{
+    if (buf_reserve(b, len) < 0)
+	return -1;
+    memcpy(b->data + b->len, data, len);
+    b->len += len;
+    return 0;
+}
+
+/* Move everything in @from to the end of @to.  If @to is empty, this just
+ * swaps the two buffers. */
+
+static void buf_move(Buffer *to, Buffer *from)
+{
+    if (!to->len) {
+	Buffer temp = *to;
+	*to = *from;
+	*from = temp;
+    } else {
+	buf_append(to, from->data, from->len);
+    }
+    from->len = 0;
+}
+
+/*************************************************************************/
+
+/* Return the state for a new connection on @fd, cleared out except for
+ * buffer memory, or NULL if there can't be one. */
+
+static Conn *new_conn(int fd)
+{
+    Conn *c;
+
+    if (fd < 0 || fd >= maxconns)
+	return NULL;
+    if (!(c = conns[fd])) {
+	if (!(c = calloc(1, sizeof(*c))))
+	    return NULL;
+	pthread_mutex_init(&c->lock, NULL);
+	conns[fd] = c;
+    }
+    c->out.len = c->in.len = c->pending.len = c->sending.len = 0;
+    c->eof = c->closing = c->queued = c->want_out = 0;
+    c->sendpos = c->nops = c->receiving = c->cancelled = c->closed = 0;
+    return c;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* The epoll backend.  Input wakes the owner, who reads and writes the
+ * socket directly. */
+
+static int epoll_set = -1;
+
+/*************************************************************************/
+
+static int epoll_init(void)
+{
+    if ((epoll_set = epoll_create1(EPOLL_CLOEXEC)) < 0)
+	return -1;
+    return 0;
+}
+
+static int epoll_listen(Listener *l)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = l;
+    return epoll_ctl(epoll_set, EPOLL_CTL_ADD, l->sock, &ev);
+}
+
+/* Sockets are watched for new input rather than for being readable, so the
+ * owner must read each one dry when woken. */
+
+static int epoll_timer(void)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN;
+    ev.data.ptr = &tick_fd;
+    return epoll_ctl(epoll_set, EPOLL_CTL_ADD, tick_fd, &ev);
+}
+
+static int epoll_watch(Conn *c, int fd, int op)
+{
+    struct epoll_event ev;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = EPOLLIN | EPOLLRDHUP | EPOLLET | (c->want_out ? EPOLLOUT : 0);
+    ev.data.ptr = c->task;
+    COUNT_SYSCALL();
+    return epoll_ctl(epoll_set, op, fd, &ev);
+}
+
+static int epoll_wait_once(const sigset_t *sigs)
+{
+    struct epoll_event evs[64];
+    int i, n, fd;
+
+    n = epoll_pwait(epoll_set, evs, sizeof(evs)/sizeof(*evs), -1, sigs);
+    COUNT_SYSCALL();
+    if (n < 0)
+	return -1;
+    for (i = 0; i < n; i++) {
+	Listener *l = evs[i].data.ptr;
+	if (l >= listeners && l < listeners + nlisteners) {
+	    fd = accept(l->sock, NULL, NULL);
+	    COUNT_SYSCALL();
+	    if (fd >= 0) {
+		/* See epoll_flush() */
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+		COUNT_SYSCALL();
+		COUNT_SYSCALL();
+		l->func(fd);
+	    }
+	} else if (evs[i].data.ptr == &tick_fd) {
+	    COUNT_SYSCALL();
+	    if (read(tick_fd, &tick_count, sizeof(tick_count)) > 0)
+		tick_cb();
+	} else {
+	    sched_wake(evs[i].data.ptr);
+	}
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+static int epoll_recv(int fd, char *buf, int len)
+{
+    int n;
+
+    do {
+	n = recv(fd, buf, len, MSG_DONTWAIT);
+	COUNT_SYSCALL();
+    } while (n < 0 && errno == EINTR);
+    if (n < 0)
+	return errno == EAGAIN || errno == EWOULDBLOCK ? -1 : 0;
+    return n;
+}
+
+/* Sockets are non-blocking, so a client which stops reading can't hold up
+ * its owner.  What can't be sent yet is kept, and the owner is woken when
+ * it can be, to flush again; if too much piles up, the connection is shut
+ * down, and the owner finds it closed on its next read. */
+
+static void epoll_flush(Conn *c, int fd)
+{
+    int pos = 0, n, want_out;
+
+    while (pos < c->out.len) {
+	n = write(fd, c->out.data + pos, c->out.len - pos);
+	COUNT_SYSCALL();
+	if (n < 0 && errno == EINTR)
+	    continue;
+	if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+	    break;
+	if (n <= 0) {
+	    pos = c->out.len;  /* The next read will find out what went wrong */
+	    break;
+	}
+	pos += n;
+    }
+    c->out.len -= pos;
+    if (c->out.len > MAX_UNSENT) {
+	shutdown(fd, SHUT_RDWR);
+	COUNT_SYSCALL();
+	c->out.len = 0;
+    } else if (c->out.len) {
+	memmove(c->out.data, c->out.data + pos, c->out.len);
+    }
+    want_out = c->out.len > 0;
+    if (want_out != c->want_out) {
+	c->want_out = want_out;
+	epoll_watch(c, fd, EPOLL_CTL_MOD);
+    }
+}
+
+static void epoll_close(Conn *c, int fd)
+{
+    epoll_flush(c, fd);
+    shutdown(fd, 2);
+    close(fd);
+    COUNT_SYSCALL();
+    COUNT_SYSCALL();
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* The io_uring backend.  Everything is done by the reactor thread: it
+ * keeps a multishot accept on each listen socket and a multishot recv on
+ * each connection, with the kernel picking receive buffers from a ring we
+ * hand them back to as soon as we've copied them out.  Owners flush output
+ * by putting their connection in a queue; each time round, the reactor
+ * takes the whole queue and starts a send for every connection in it.  All
+ * the new requests go to the kernel in the same system call that waits for
+ * the next completions, so under load one system call deals with many
+ * messages.  The reactor always has a read pending on an eventfd, which
+ * owners write to if it might be waiting when they queue something.
+ */
+
+/* What a completion is for, in the low bits of its user_data; the file
+ * descriptor (for accepts, the listener number) is in the rest. */
+enum { OP_ACCEPT, OP_RECV, OP_SEND, OP_CANCEL, OP_CLOSE, OP_WAKE, OP_TICK };
+#define USER_DATA(fd,op)	((uint64_t)(fd) << 8 | (op))
+
+#define RING_ENTRIES	1024
+#define RECV_BUFS	512	/* Must be a power of 2 */
+#define RECV_BUFSIZE	2048
+#define RECV_GROUP	0
+#define BATCH_CQES	32	/* Completions to wait for when busy... */
+#define BATCH_USEC	1000	/* ...but for no longer than this */
+
+static int ring_fd = -1;
+static unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+static unsigned int sq_entries, sq_next;
+static struct io_uring_sqe *sqes;
+static unsigned int *cq_head, *cq_tail, *cq_mask;
+static struct io_uring_cqe *cqes;
+
+static struct io_uring_buf_ring *recv_ring;
+static char *recv_bufs;
+static unsigned short recv_tail;
+
+static int wake_fd = -1;
+static uint64_t wake_count;	/* Where the eventfd is read to */
+static int may_sleep;		/* Set while the reactor may be waiting */
+static int can_batch;		/* Can we wait with a timeout? */
+static int busy;		/* Were completions coming in quickly? */
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static int *queue, queue_len, queue_size;  /* Connections with output */
+static int *taken, taken_size;	/* Reactor: the queue we're working on */
+
+/*************************************************************************/
+
+/* Submit whatever requests we've set up.  If @sigs is not NULL, also wait
+ * for a completion with @sigs as the signal mask; if @batch is nonzero,
+ * wait up to BATCH_USEC for that many instead of returning at the first.
+ */
+
+static int uring_submit(const sigset_t *sigs, int batch)
+{
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned int n, wait = 0, flags = 0;
+    const void *argp = sigs;
+    size_t argsize = _NSIG/8;
+
+    __atomic_store_n(sq_tail, sq_next, __ATOMIC_RELEASE);
+    n = sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE);
+    if (sigs) {
+	wait = 1;
+	flags = IORING_ENTER_GETEVENTS;
+	if (batch) {
+	    memset(&arg, 0, sizeof(arg));
+	    arg.sigmask = (uintptr_t) sigs;
+	    arg.sigmask_sz = _NSIG/8;
+	    ts.tv_sec = 0;
+	    ts.tv_nsec = BATCH_USEC * 1000;
+	    arg.ts = (uintptr_t) &ts;
+	    wait = batch;
+	    flags |= IORING_ENTER_EXT_ARG;
+	    argp = &arg;
+	    argsize = sizeof(arg);
+	}
+    } else if (!n) {
+	return 0;
+    }
+    COUNT_SYSCALL();
+    return syscall(SYS_io_uring_enter, ring_fd, n, wait, flags, argp,
+		   argsize) < 0 ? -1 : 0;
+}
+
+/* Return a cleared submission queue entry for a new request.  If the queue
+ * is full, the requests in it are submitted first. */
+
+static struct io_uring_sqe *get_sqe(void)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int index;
+
+    while (sq_next - __atomic_load_n(sq_head, __ATOMIC_ACQUIRE) >= sq_entries)
+	uring_submit(NULL, 0);
+    index = sq_next++ & *sq_mask;
+    sq_array[index] = index;
+    sqe = &sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/*************************************************************************/
+
+/* Give receive buffer @bid back to the kernel. */
+
+static void give_recv_buf(int bid)
+{
+    struct io_uring_buf *buf = &recv_ring->bufs[recv_tail & (RECV_BUFS-1)];
+
+    buf->addr = (uintptr_t) (recv_bufs + bid*RECV_BUFSIZE);
+    buf->len = RECV_BUFSIZE;
+    buf->bid = bid;
+    __atomic_store_n(&recv_ring->tail, ++recv_tail, __ATOMIC_RELEASE);
+}
+
+/*************************************************************************/
+
+static void start_accept(int n)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listeners[n].sock;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK;
+    sqe->user_data = USER_DATA(n, OP_ACCEPT);
+}
+
+static void start_recv(Conn *c, int fd)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = RECV_GROUP;
+    sqe->user_data = USER_DATA(fd, OP_RECV);
+    c->receiving = 1;
+    c->nops++;
+}
+
+static void start_wake_read(void)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = (uintptr_t) &wake_count;
+    sqe->len = sizeof(wake_count);
+    sqe->user_data = USER_DATA(wake_fd, OP_WAKE);
+}
+
+static void start_tick_read(void)
+{
+    struct io_uring_sqe *sqe = get_sqe();
+
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = tick_fd;
+    sqe->addr = (uintptr_t) &tick_count;
+    sqe->len = sizeof(tick_count);
+    sqe->user_data = USER_DATA(tick_fd, OP_TICK);
+}
+
+/*************************************************************************/
+
+/* Start sending whatever a connection has waiting, and once a connection
+ * being closed has nothing left to send or receive, close it.  The last
+ * send and the close go in as a linked pair, so the close only happens
+ * once everything has been sent. */
+
+static void kick(Conn *c, int fd)
+{
+    struct io_uring_sqe *sqe;
+    int closing;
+
+    if (c->sending.len || c->closed)
+	return;
+    pthread_mutex_lock(&c->lock);
+    buf_move(&c->sending, &c->pending);
+    closing = c->closing;
+    pthread_mutex_unlock(&c->lock);
+
+    if (closing && c->receiving && !c->cancelled) {
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_ASYNC_CANCEL;
+	sqe->addr = USER_DATA(fd, OP_RECV);
+	sqe->user_data = USER_DATA(fd, OP_CANCEL);
+	c->cancelled = 1;
+	c->nops++;
+    }
+    if (c->sending.len) {
+	c->sendpos = 0;
+	sqe = get_sqe();
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) c->sending.data;
+	sqe->len = c->sending.len;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = USER_DATA(fd, OP_SEND);
+	c->nops++;
+	if (!closing || c->receiving)
+	    return;
+	sqe->flags = IOSQE_IO_LINK;
+    } else if (!closing || c->nops) {
+	return;
+    }
+    sqe = get_sqe();
+    sqe->opcode = IORING_OP_CLOSE;
+    sqe->fd = fd;
+    sqe->user_data = USER_DATA(fd, OP_CLOSE);
+    c->closed = 1;
+    c->nops++;
+}
+
+/*************************************************************************/
+
+/* Tell a connection's owner there is new input or it has gone away. */
+
+static void wake_owner(Conn *c)
+{
+    SchedTask *task;
+    int closing;
+
+    pthread_mutex_lock(&c->lock);
+    closing = c->closing;
+    task = c->task;
+    pthread_mutex_unlock(&c->lock);
+    if (!closing)
+	sched_wake(task);
+}
+
+/*************************************************************************/
+
+static void handle_recv(Conn *c, int fd, int res, unsigned int flags)
+{
+    if (res > 0) {
+	char *data = recv_bufs + (flags >> IORING_CQE_BUFFER_SHIFT)*RECV_BUFSIZE;
+	pthread_mutex_lock(&c->lock);
+	if (c->in.len + res > MAX_UNREAD || buf_append(&c->in, data, res) < 0)
+	    c->eof = 1;
+	pthread_mutex_unlock(&c->lock);
+	give_recv_buf(flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    if (!(flags & IORING_CQE_F_MORE)) {
+	/* The recv has stopped: because it ran out of buffers, or because
+	 * the connection or the recv itself ended. */
+	c->receiving = 0;
+	c->nops--;
+	if ((res > 0 || res == -ENOBUFS) && !c->cancelled) {
+	    start_recv(c, fd);
+	} else {
+	    pthread_mutex_lock(&c->lock);
+	    c->eof = 1;
+	    pthread_mutex_unlock(&c->lock);
+	}
+	kick(c, fd);
+    }
+    wake_owner(c);
+}
+
+static void handle_send(Conn *c, int fd, int res)
+{
+    c->nops--;
+    if (res > 0 && c->sendpos + res < c->sending.len) {
+	/* Partly sent; send the rest. */
+	struct io_uring_sqe *sqe = get_sqe();
+	c->sendpos += res;
+	sqe->opcode = IORING_OP_SEND;
+	sqe->fd = fd;
+	sqe->addr = (uintptr_t) (c->sending.data + c->sendpos);
+	sqe->len = c->sending.len - c->sendpos;
+	sqe->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+	sqe->user_data = USER_DATA(fd, OP_SEND);
+	c->nops++;
+	return;
+    }
+    c->sending.len = 0;
+    if (res < 0) {
+	/* The connection is broken, so nothing more will get through. */
+	pthread_mutex_lock(&c->lock);
+	c->pending.len = 0;
+	c->eof = 1;
+	pthread_mutex_unlock(&c->lock);
+	wake_owner(c);
+    }
+    kick(c, fd);
+}
+
+static void handle_close(Conn *c, int fd, int res)
+{
+    c->nops--;
+    c->closed = 0;
+    if (res == -ECANCELED) {
+	/* The send linked to it was cut short; try again after the rest
+	 * has gone. */
+	kick(c, fd);
+    } else {
+	new_conn(fd);
+    }
+}
+
+/*************************************************************************/
+
+/* Take the queue of connections with output to send, and send it. */
+
+static void take_queue(void)
+{
+    int i, n, *temp, tsize;
+
+    pthread_mutex_lock(&queue_lock);
+    temp = queue;
+    tsize = queue_size;
+    n = queue_len;
+    queue = taken;
+    queue_size = taken_size;
+    atomic_set(&queue_len, 0);
+    pthread_mutex_unlock(&queue_lock);
+    taken = temp;
+    taken_size = tsize;
+
+    for (i = 0; i < n; i++) {
+	Conn *c = conns[taken[i]];
+	pthread_mutex_lock(&c->lock);
+	c->queued = 0;
+	pthread_mutex_unlock(&c->lock);
+	kick(c, taken[i]);
+    }
+}
+
+/* Add a connection to the flush queue, and wake the reactor if it might be
+ * waiting.  The reactor sets may_sleep before checking the queue, and we
+ * add to the queue before checking may_sleep, so one of us sees the other.
+ */
+
+static void queue_conn(int fd)
+{
+    pthread_mutex_lock(&queue_lock);
+    if (queue_len == queue_size) {
+	int newsize = queue_size ? queue_size*2 : 256;
+	int *new = realloc(queue, newsize * sizeof(*new));
+	/* As in sched.c, there's nothing to do without memory but wait. */
+	while (!new) {
+	    sleep(1);
+	    new = realloc(queue, newsize * sizeof(*new));
+	}
+	queue = new;
+	queue_size = newsize;
+    }
+    queue[queue_len] = fd;
+    atomic_set(&queue_len, queue_len+1);
+    pthread_mutex_unlock(&queue_lock);
+    if (atomic_get(&may_sleep) && atomic_swap(&may_sleep, 0)) {
+	uint64_t one = 1;
+	COUNT_SYSCALL();
+	if (write(wake_fd, &one, sizeof(one)) < 0)
+	    perror("eventfd write()");
+    }
+}
+
+/*************************************************************************/
+
+/* Set up the ring, its receive buffers and the eventfd.  Return 0 on
+ * success, -1 on failure. */
+
+static int uring_init(void)
+{
+    struct io_uring_params p;
+    struct io_uring_buf_reg reg;
+    char *sq, *cq;
+    size_t sqsize, cqsize;
+    int i;
+
+    memset(&p, 0, sizeof(p));
+    ring_fd = syscall(SYS_io_uring_setup, RING_ENTRIES, &p);
+    if (ring_fd < 0)
+	return -1;
+    if (!(p.features & IORING_FEAT_NODROP)) {
+	/* Too old to keep completions we haven't had room for yet. */
+	goto fail;
+    }
+    can_batch = (p.features & IORING_FEAT_EXT_ARG) != 0;
+    sqsize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    cqsize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if ((p.features & IORING_FEAT_SINGLE_MMAP) && cqsize > sqsize)
+	sqsize = cqsize;
+    sq = mmap(NULL, sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+	      ring_fd, IORING_OFF_SQ_RING);
+    if (sq == MAP_FAILED)
+	goto fail;
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+	cq = sq;
+    } else {
+	cq = mmap(NULL, cqsize, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+	if (cq == MAP_FAILED)
+	    goto fail;
+    }
+    sqes = mmap(NULL, p.sq_entries * sizeof(*sqes), PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (sqes == MAP_FAILED)
+	goto fail;
+    sq_head = (unsigned int *) (sq + p.sq_off.head);
+    sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    sq_mask = (unsigned int *) (sq + p.sq_off.ring_mask);
+    sq_array = (unsigned int *) (sq + p.sq_off.array);
+    sq_entries = p.sq_entries;
+    sq_next = *sq_tail;
+    cq_head = (unsigned int *) (cq + p.cq_off.head);
+    cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    cq_mask = (unsigned int *) (cq + p.cq_off.ring_mask);
+    cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    recv_ring = mmap(NULL, RECV_BUFS * sizeof(struct io_uring_buf),
+		     PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    recv_bufs = malloc(RECV_BUFS * RECV_BUFSIZE);
+    if (recv_ring == MAP_FAILED || !recv_bufs)
+	goto fail;
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uintptr_t) recv_ring;
+    reg.ring_entries = RECV_BUFS;
+    reg.bgid = RECV_GROUP;
+    if (syscall(SYS_io_uring_register, ring_fd, IORING_REGISTER_PBUF_RING,
+		&reg, 1) < 0)
+	goto fail;
+    for (i = 0; i < RECV_BUFS; i++)
+	give_recv_buf(i);
+
+    if ((wake_fd = eventfd(0, EFD_CLOEXEC)) < 0)
+	goto fail;
+    start_wake_read();
+    return 0;
+
+  fail:
+    /* Whatever we've mapped goes away with the process. */
+    close(ring_fd);
+    ring_fd = -1;
+    return -1;
+}
+
+/*************************************************************************/
+
+static int uring_add(Conn *c, int fd)
+{
+    start_recv(c, fd);
+    return 0;
+}
+
+static int uring_wait_once(const sigset_t *sigs)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    struct timespec start, end;
+    Conn *c;
+    int fd, wait;
+
+    /* While completions are coming in quickly, wait for several at once
+     * (or a moment, whichever is sooner) rather than being woken for each
+     * one.  Queued output can wait that moment as well, so owners needn't
+     * wake us for it. */
+    if (!busy)
+	atomic_set(&may_sleep, 1);
+    wait = !atomic_get(&queue_len);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (uring_submit(wait ? sigs : NULL, busy ? BATCH_CQES : 0) < 0
+     && errno != EINTR && errno != EBUSY && errno != EAGAIN
+     && errno != ETIME) {
+	return -1;
+    }
+    atomic_set(&may_sleep, 0);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    busy = can_batch && wait
+	&& (end.tv_sec - start.tv_sec) * 1000000
+	   + (end.tv_nsec - start.tv_nsec) / 1000 < BATCH_USEC;
+    head = *cq_head;
+    tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+	cqe = &cqes[head & *cq_mask];
+	fd = cqe->user_data >> 8;
+	c = fd < maxconns ? conns[fd] : NULL;
+	switch (cqe->user_data & 0xFF) {
+	  case OP_ACCEPT:
+	    if (cqe->res >= 0)
+		listeners[fd].func(cqe->res);
+	    if (!(cqe->flags & IORING_CQE_F_MORE))
+		start_accept(fd);
+	    break;
+	  case OP_RECV:
+	    handle_recv(c, fd, cqe->res, cqe->flags);
+	    break;
+	  case OP_SEND:
+	    handle_send(c, fd, cqe->res);
+	    break;
+	  case OP_CANCEL:
+	    c->nops--;
+	    kick(c, fd);
+	    break;
+	  case OP_CLOSE:
+	    handle_close(c, fd, cqe->res);
+	    break;
+	  case OP_WAKE:
+	    start_wake_read();
+	    break;
+	  case OP_TICK:
+	    if (cqe->res > 0)
+		tick_cb();
+	    start_tick_read();
+	    break;
+	}
+    }
+    __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+    take_queue();
+    return 0;
+}
+
+/*************************************************************************/
+
+static int uring_recv(Conn *c, char *buf, int len)
+{
+    int n;
+
+    pthread_mutex_lock(&c->lock);
+    if (c->in.len) {
+	n = c->in.len < len ? c->in.len : len;
+	memcpy(buf, c->in.data, n);
+	memmove(c->in.data, c->in.data + n, c->in.len - n);
+	c->in.len -= n;
+    } else {
+	n = c->eof ? 0 : -1;
+    }
+    pthread_mutex_unlock(&c->lock);
+    return n;
+}
+
+/* Hand over the connection's output to the reactor, and if @close is
+ * nonzero, the connection too. */
+
+static void uring_flush(Conn *c, int fd, int close)
+{
+    int queue_it;
+
+    pthread_mutex_lock(&c->lock);
+    buf_move(&c->pending, &c->out);
+    if (close)
+	c->closing = 1;
+    queue_it = !c->queued;
+    c->queued = 1;
+    pthread_mutex_unlock(&c->lock);
+    if (queue_it)
+	queue_conn(fd);
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Set up the given backend, or epoll if it's REACTOR_URING but io_uring
+ * isn't available.  Return the backend used, or -1 on failure. */
+
+int reactor_init(int which)
+{
+    struct rlimit rl;
+
+    /* Every player needs a descriptor, so allow as many as we can. */
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0) {
+	if (rl.rlim_cur < rl.rlim_max) {
+	    rl.rlim_cur = rl.rlim_max;
+	    setrlimit(RLIMIT_NOFILE, &rl);
+	}
+	maxconns = rl.rlim_cur > 1<<20 ? 1<<20 : rl.rlim_cur;
+    } else {
+	maxconns = 1024;
+    }
+    if (!(conns = calloc(maxconns, sizeof(*conns))))
+	return -1;
+
+    if (which == REACTOR_URING && uring_init() == 0)
+	backend = REACTOR_URING;
+    else if (epoll_init() == 0)
+	backend = REACTOR_EPOLL;
+    else
+	return -1;
+    return backend;
+}
+
+/*************************************************************************/
+
+/* Return the name of the backend in use. */
+
+const char *reactor_name(void)
+{
+    return backend == REACTOR_URING ? "io_uring" : "epoll";
+}
+
+/*************************************************************************/
+
+/* Accept connections on the listen socket @sock, calling @func with each
+ * new one.  Return 0 on success, -1 on failure. */
+
+int reactor_listen(int sock, void (*func)(int fd))
+{
+    Listener *l = &listeners[nlisteners];
+
+    if (nlisteners == sizeof(listeners)/sizeof(*listeners))
+	return -1;
+    l->sock = sock;
+    l->func = func;
+    if (backend == REACTOR_URING) {
+	start_accept(nlisteners++);
+	return 0;
+    }
+    if (epoll_listen(l) < 0)
+	return -1;
+    nlisteners++;
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Watch the timerfd @fd, calling @func from reactor_wait() each time it
+ * fires.  Only one can be watched.  Return 0 on success, -1 on failure. */
+
+int reactor_timer(int fd, void (*func)(void))
+{
+    tick_fd = fd;
+    tick_cb = func;
+    if (backend == REACTOR_URING) {
+	start_tick_read();
+	return 0;
+    }
+    return epoll_timer();
+}
+
+/*************************************************************************/
+
+/* Start watching a new connection, waking @task when there is something
+ * for it to read.  Return 0 on success, -1 on failure (and the caller
+ * should close it). */
+
+int reactor_add(int fd, SchedTask *task)
+{
+    Conn *c = new_conn(fd);
+
+    if (!c)
+	return -1;
+    c->task = task;
+    if (backend == REACTOR_URING)
+	return uring_add(c, fd);
+    return epoll_watch(c, fd, EPOLL_CTL_ADD);
+}
+
+/*************************************************************************/
+
+/* Hand a connection over to @task, which is woken from now on instead of
+ * the current owner.  Input may already be waiting, so the caller should
+ * see that @task runs and reads it.  Only the current owner may call this,
+ * and it may not use the connection afterwards.  Return 0 on success, -1
+ * on failure.
+ */
+
+int reactor_give(int fd, SchedTask *task)
+{
+    Conn *c = conns[fd];
+
+    if (backend == REACTOR_URING) {
+	pthread_mutex_lock(&c->lock);
+	c->task = task;
+	pthread_mutex_unlock(&c->lock);
+	return 0;
+    }
+    c->task = task;
+    return epoll_watch(c, fd, EPOLL_CTL_MOD);
+}
+
+/*************************************************************************/
+
+/* Wait for something to happen, and deal with it: accept new connections,
+ * wake the tasks with input and run the timers.  @sigs is the signal mask
+ * to use while waiting.  Return 0 on success, -1 on error or if a signal
+ * arrived.
+ */
+
+int reactor_wait(const sigset_t *sigs)
+{
+    if (backend == REACTOR_URING)
+	return uring_wait_once(sigs);
+    return epoll_wait_once(sigs);
+}
+
+/*************************************************************************/
+
+/* Read up to @len bytes from a connection.  Return the number of bytes
+ * read, 0 if the connection has closed or failed, or -1 if there is
+ * nothing to read yet.  Only the connection's owner may call this, or the
+ * other functions below.
+ */
+
+int reactor_recv(int fd, char *buf, int len)
+{
+    if (backend == REACTOR_URING)
+	return uring_recv(conns[fd], buf, len);
+    return epoll_recv(fd, buf, len);
+}
+
+/*************************************************************************/
+
+/* Add @len bytes to a connection's output. */
+
+void reactor_send(int fd, const char *buf, int len)
+{
+    buf_append(&conns[fd]->out, buf, len);
+}
+
+/*************************************************************************/
+
+/* Return space for up to @len bytes at the end of a connection's output,
+ * to be written directly and then added with reactor_commit(), or NULL if
+ * out of memory.  The space is only good until the next call for the same
+ * connection. */
+
+char *reactor_reserve(int fd, int len)
+{
+    Buffer *b = &conns[fd]->out;
+
+    if (buf_reserve(b, len) < 0)
+	return NULL;
+    return b->data + b->len;
+}
+
+/* Add the first @len bytes written to space from reactor_reserve() to a
+ * connection's output. */
+
+void reactor_commit(int fd, int len)
+{
+    conns[fd]->out.len += len;
+}
+
+/*************************************************************************/
+
+/* Send a connection's output. */
+
+void reactor_flush(int fd)
+{
+    Conn *c = conns[fd];
+
+    if (!c->out.len)
+	return;
+    if (backend == REACTOR_URING)
+	uring_flush(c, fd, 0);
+    else
+	epoll_flush(c, fd);
+}
+
+/*************************************************************************/
+
+/* Send a connection's output, then close it.  The descriptor may not be
+ * used again by the caller. */
+
+void reactor_close(int fd)
+{
+    if (backend == REACTOR_URING)
+	uring_flush(conns[fd], fd, 1);
+    else
+	epoll_close(conns[fd], fd);
+}
+
+/*************************************************************************/
@@ -0,0 +1,54 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server network I/O declarations.
+ */
+
+#ifndef REACTOR_H
+#define REACTOR_H
+
+#include <signal.h>
+#include "sched.h"
+
+/*************************************************************************/
+
+/* The server's connections are all watched by one thread, which accepts
+ * new ones and wakes the task owning a connection when there is input for
+ * it.  The owning task reads and writes the connection itself, always
+ * through the functions here, so that how the I/O is actually done can be
+ * chosen when the server starts:
+ *
+ *   - REACTOR_EPOLL: the owner calls recv() and write() itself.
+ *   - REACTOR_URING: the watching thread does all I/O through an io_uring,
+ *     receiving into buffers the kernel picks and sending everything
+ *     flushed since its last look with a single system call.
+ *
+ * Output is collected per connection and only sent on reactor_flush(), so
+ * a task should flush each connection it wrote to before it finishes.
+ * Connections are identified by their file descriptors.
+ */
+
+#define REACTOR_EPOLL	0
+#define REACTOR_URING	1
+
+extern int reactor_init(int backend);
+extern const char *reactor_name(void);
+extern int reactor_listen(int sock, void (*func)(int fd));
+extern int reactor_timer(int fd, void (*func)(void));
+extern int reactor_add(int fd, SchedTask *task);
+extern int reactor_give(int fd, SchedTask *task);
+extern int reactor_wait(const sigset_t *sigs);
+
+extern int reactor_recv(int fd, char *buf, int len);
+extern void reactor_send(int fd, const char *buf, int len);
+extern char *reactor_reserve(int fd, int len);
+extern void reactor_commit(int fd, int len);
+extern void reactor_flush(int fd);
+extern void reactor_close(int fd);
+
+/* Number of system calls made for network I/O so far, for statistics. */
+extern long reactor_syscalls;
+
+/*************************************************************************/
+
+#endif	/* REACTOR_H */
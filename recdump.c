@@ -0,0 +1,173 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Prints a game recording (see record.h) as text, one record per line
+ * with its time in brackets; keyframes show each player's field.  With
+ * -at, starts from the last keyframe at or before the given number of
+ * seconds into the game, found through the file's index, after showing
+ * the game's settings and players.
+ *
+ * Usage: tetrinet-recdump [-at seconds] recordfile
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "tetrinet.h"
+#include "record.h"
+
+/*************************************************************************/
+
+static const char field_chars[16] = ".12345acnrsbgqo";
+
+/*************************************************************************/
+
+/* Print a keyframe. */
+
+static void print_keyframe(const RecKeyframe *k)
+{
+    int i, x, y;
+
+    printf("keyframe\n");
+    for (i = 0; i < 6; i++) {
+	const char *p = (const char *) k->fields[i];
+	for (x = 0; x < FIELD_WIDTH*FIELD_HEIGHT && !p[x]; x++)
+	    ;
+	printf("    player %d: level %d", i+1, k->levels[i]);
+	if (k->lost[i])
+	    printf(", lost (%d)", k->lost[i]);
+	if (x == FIELD_WIDTH*FIELD_HEIGHT) {
+	    printf(", empty field\n");
+	    continue;
+	}
+	putchar('\n');
+	for (y = 0; y < FIELD_HEIGHT; y++) {
+	    printf("        ");
+	    for (x = 0; x < FIELD_WIDTH; x++)
+		putchar(field_chars[k->fields[i][y][x] & 15]);
+	    putchar('\n');
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Read and print one record.  Return its type, or -1 once the game has
+ * ended (or the file has). */
+
+static int print_record(FILE *f, const char *filename)
+{
+    static char buf[65536];
+    RecHeader h;
+    uint32_t n;
+
+    if (fread(&h, sizeof(h), 1, f) != 1)
+	return -1;
+    if (h.len && fread(buf, h.len, 1, f) != 1) {
+	fprintf(stderr, "%s: truncated record\n", filename);
+	return -1;
+    }
+    printf("[%u.%03u] ", h.ms / 1000, h.ms % 1000);
+    switch (h.type) {
+      case REC_START:
+	memcpy(&n, buf, sizeof(n));
+	printf("start seed %u settings %.*s\n", n,
+	       (int) (h.len - sizeof(n)), buf + sizeof(n));
+	break;
+      case REC_LINE:
+	printf("%.*s\n", (int) h.len, buf);
+	break;
+      case REC_KEYFRAME:
+	if (h.len != sizeof(RecKeyframe)) {
+	    printf("bad keyframe\n");
+	    break;
+	}
+	print_keyframe((const RecKeyframe *) buf);
+	break;
+      case REC_GAP:
+	memcpy(&n, buf, sizeof(n));
+	printf("*** %u records not recorded\n", n);
+	break;
+      case REC_END:
+	printf("end\n");
+	return -1;
+      default:
+	printf("unknown record type %d\n", h.type);
+	break;
+    }
+    return h.type;
+}
+
+/*************************************************************************/
+
+int main(int ac, char **av)
+{
+    RecTrailer trailer;
+    RecIndexEntry entry;
+    char magic[8];
+    const char *filename = NULL;
+    long at = -1, first = 0, offset = 0;
+    uint32_t n;
+    int i;
+    FILE *f;
+
+    for (i = 1; i < ac; i++) {
+	if (strcmp(av[i], "-at") == 0 && i+1 < ac)
+	    at = atof(av[++i]) * 1000;
+	else if (!filename && av[i][0] != '-')
+	    filename = av[i];
+	else
+	    break;
+    }
+    if (!filename || i < ac) {
+	fprintf(stderr, "Usage: %s [-at seconds] recordfile\n", av[0]);
+	return 1;
+    }
+    if (!(f = fopen(filename, "rb"))) {
+	perror(filename);
+	return 1;
+    }
+    if (fread(magic, sizeof(magic), 1, f) != 1
+     || memcmp(magic, RECORD_MAGIC, sizeof(magic)) != 0) {
+	fprintf(stderr, "%s: not a Tetrinet game recording\n", filename);
+	return 1;
+    }
+
+    if (at >= 0) {
+	/* Find the keyframe to start from in the index. */
+	if (fseek(f, -(long) sizeof(trailer), SEEK_END) != 0
+	 || fread(&trailer, sizeof(trailer), 1, f) != 1
+	 || memcmp(trailer.magic, RECORD_INDEX_MAGIC,
+		   sizeof(trailer.magic)) != 0
+	 || fseek(f, trailer.offset, SEEK_SET) != 0) {
+	    fprintf(stderr, "%s: no index (game not finished?)\n", filename);
+	    return 1;
+	}
+	first = trailer.offset;
+	for (n = 0; n < trailer.count; n++) {
+	    if (fread(&entry, sizeof(entry), 1, f) != 1)
+		break;
+	    if (n == 0)
+		first = entry.offset;
+	    if (entry.ms > at)
+		break;
+	    offset = entry.offset;
+	}
+	/* Show the settings and players, which come before the first
+	 * keyframe. */
+	fseek(f, sizeof(magic), SEEK_SET);
+	while (ftell(f) < first && print_record(f, filename) >= 0)
+	    ;
+	if (offset)
+	    fseek(f, offset, SEEK_SET);
+	else
+	    printf("(no keyframe before %ld.%03ld)\n", at / 1000, at % 1000);
+    }
+
+    while (print_record(f, filename) >= 0)
+	;
+    fclose(f);
+    return 0;
+}
+
+/*************************************************************************/
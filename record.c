@@ -0,0 +1,361 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Game recorder.  See record.h for the file format.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "tetrinet.h"
+#include "record.h"
+
+/*************************************************************************/
+
+#define REC_RING_SIZE	(1<<15)	/* Bytes of records each room can have
+				 * waiting; must be a power of 2 */
+#define REC_INTERVAL	50	/* Milliseconds between looks at the rings */
+
+/* A room's recorder.  Only the room adds to the ring, and only the writer
+ * thread takes from it, so neither needs a lock.  The fields each uses
+ * are noted. */
+
+struct Recorder {
+    Recorder *next;		/* Next in the list of all recorders */
+    int id;			/* Room number, for file names */
+
+    unsigned int head;		/* Room: where the next record goes */
+    int active;			/* Room: a game is being recorded */
+    struct timespec start;	/* Room: when it started */
+    uint32_t now;		/* Room: time of the last record */
+    uint32_t last_keyframe;	/* Room: ...and of the last keyframe */
+    int want_keyframe;		/* Room: take one as soon as possible */
+    unsigned int dropped;	/* Room: records which didn't fit */
+
+    unsigned int tail;		/* Writer: where the next one to write is */
+    unsigned int reported;	/* Writer: dropped records written as such */
+    FILE *file;			/* Writer: file for the current game */
+    uint32_t last_ms;		/* Writer: time of the last record written */
+    RecIndexEntry *index;	/* Writer: keyframes in the current file */
+    int nindex, index_size;
+
+    char ring[REC_RING_SIZE];
+};
+
+static const char *rec_dir;
+static int keyframe_ms;
+static Recorder *recorders;
+static pthread_t rec_writer;
+static int rec_running;		/* Cleared to stop the writer */
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Copy @len bytes into or out of a ring at (unwrapped) position @pos. */
+
+static void rec_put(Recorder *r, unsigned int pos, const void *data, int len)
+{
+    int off = pos & (REC_RING_SIZE-1), n = REC_RING_SIZE - off;
+
+    if (n > len)
+	n = len;
+    memcpy(r->ring + off, data, n);
+    memcpy(r->ring, (const char *) data + n, len - n);
+}
+
+static void rec_get(Recorder *r, unsigned int pos, void *data, int len)
+{
+    int off = pos & (REC_RING_SIZE-1), n = REC_RING_SIZE - off;
+
+    if (n > len)
+	n = len;
+    memcpy(data, r->ring + off, n);
+    memcpy((char *) data + n, r->ring, len - n);
+}
+
+/*************************************************************************/
+
+/* Add a record whose payload is @len1 bytes from @data1 followed by @len2
+ * from @data2.  Return 0 on success, -1 if there was no room for it. */
+
+static int rec_push(Recorder *r, int type, const void *data1, int len1,
+		const void *data2, int len2)
+{
+    unsigned int head = r->head, tail;
+    struct timespec ts;
+    RecHeader h;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    r->now = (ts.tv_sec - r->start.tv_sec) * 1000
+	   + (ts.tv_nsec - r->start.tv_nsec) / 1000000;
+    tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (sizeof(h) + len1 + len2 > REC_RING_SIZE - (head - tail)) {
+	__atomic_add_fetch(&r->dropped, 1, __ATOMIC_RELAXED);
+	r->want_keyframe = 1;
+	return -1;
+    }
+    h.ms = r->now;
+    h.len = len1 + len2;
+    h.type = type;
+    h.pad = 0;
+    rec_put(r, head, &h, sizeof(h));
+    rec_put(r, head + sizeof(h), data1, len1);
+    rec_put(r, head + sizeof(h) + len1, data2, len2);
+    __atomic_store_n(&r->head, head + sizeof(h) + h.len, __ATOMIC_RELEASE);
+    return 0;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Writer: start a file for a new game. */
+
+static void open_file(Recorder *r)
+{
+    char path[1024];
+    time_t t = time(NULL);
+    struct tm tm;
+
+    localtime_r(&t, &tm);
+    snprintf(path, sizeof(path), "%s/%04d%02d%02d-%02d%02d%02d-%d-%d.tnr",
+	     rec_dir, tm.tm_year+1900, tm.tm_mon+1, tm.tm_mday,
+	     tm.tm_hour, tm.tm_min, tm.tm_sec, (int) getpid(), r->id);
+    if (!(r->file = fopen(path, "wb"))) {
+	perror(path);
+	return;
+    }
+    fwrite(RECORD_MAGIC, 8, 1, r->file);
+    r->nindex = 0;
+}
+
+/* Writer: end the current file with its index.  If the game's REC_END
+ * record never arrived, add one. */
+
+static void finish_file(Recorder *r, int ended)
+{
+    RecTrailer trailer;
+    RecHeader h;
+
+    if (!r->file)
+	return;
+    if (!ended) {
+	h.ms = r->last_ms;
+	h.len = 0;
+	h.type = REC_END;
+	h.pad = 0;
+	fwrite(&h, sizeof(h), 1, r->file);
+    }
+    trailer.count = r->nindex;
+    trailer.offset = ftell(r->file);
+    memcpy(trailer.magic, RECORD_INDEX_MAGIC, sizeof(trailer.magic));
+    fwrite(r->index, sizeof(*r->index), r->nindex, r->file);
+    fwrite(&trailer, sizeof(trailer), 1, r->file);
+    fclose(r->file);
+    r->file = NULL;
+}
+
+/* Writer: note a keyframe about to be written, if there's room in the
+ * index (which is only a problem if we're out of memory). */
+
+static void add_index(Recorder *r, uint32_t ms)
+{
+    if (r->nindex >= r->index_size) {
+	int newsize = r->index_size ? r->index_size*2 : 64;
+	RecIndexEntry *new = realloc(r->index, newsize * sizeof(*new));
+	if (!new)
+	    return;
+	r->index = new;
+	r->index_size = newsize;
+    }
+    r->index[r->nindex].ms = ms;
+    r->index[r->nindex].offset = ftell(r->file);
+    r->nindex++;
+}
+
+/*************************************************************************/
+
+/* Writer: write out everything waiting in a room's ring. */
+
+static void write_records(Recorder *r)
+{
+    unsigned int head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    unsigned int dropped = __atomic_load_n(&r->dropped, __ATOMIC_RELAXED);
+    unsigned int pos = r->tail, off, len;
+    RecHeader h;
+
+    while (pos != head) {
+	rec_get(r, pos, &h, sizeof(h));
+	if (h.type == REC_START) {
+	    finish_file(r, 0);
+	    open_file(r);
+	}
+	if (r->file) {
+	    if (h.type == REC_KEYFRAME)
+		add_index(r, h.ms);
+	    off = pos & (REC_RING_SIZE-1);
+	    len = sizeof(h) + h.len;
+	    if (len > REC_RING_SIZE - off) {
+		fwrite(r->ring + off, REC_RING_SIZE - off, 1, r->file);
+		fwrite(r->ring, len - (REC_RING_SIZE - off), 1, r->file);
+	    } else {
+		fwrite(r->ring + off, len, 1, r->file);
+	    }
+	    r->last_ms = h.ms;
+	}
+	if (h.type == REC_END)
+	    finish_file(r, 1);
+	pos += sizeof(h) + h.len;
+    }
+
+    /* Records are only dropped when the ring is full, so the ones lost
+     * came after everything in it. */
+    if (dropped != r->reported && r->file) {
+	uint32_t count = dropped - r->reported;
+	h.ms = r->last_ms;
+	h.len = sizeof(count);
+	h.type = REC_GAP;
+	h.pad = 0;
+	fwrite(&h, sizeof(h), 1, r->file);
+	fwrite(&count, sizeof(count), 1, r->file);
+    }
+    r->reported = dropped;
+    __atomic_store_n(&r->tail, head, __ATOMIC_RELEASE);
+}
+
+/*************************************************************************/
+
+static void *rec_writer_thread(void *unused)
+{
+    struct timespec ts = {0, REC_INTERVAL * 1000000};
+    Recorder *r;
+    int stop;
+
+    do {
+	stop = !__atomic_load_n(&rec_running, __ATOMIC_ACQUIRE);
+	for (r = __atomic_load_n(&recorders, __ATOMIC_ACQUIRE); r; r = r->next)
+	    write_records(r);
+	if (!stop)
+	    nanosleep(&ts, NULL);
+    } while (!stop);
+    for (r = recorders; r; r = r->next)
+	finish_file(r, 0);
+    return NULL;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Start recording games to files in @dir, with a keyframe every
+ * @keyframe_secs seconds.  Return 0 on success, -1 on error (with errno
+ * set).
+ */
+
+int record_init(const char *dir, int keyframe_secs)
+{
+    if (access(dir, W_OK) < 0)
+	return -1;
+    rec_dir = dir;
+    keyframe_ms = (keyframe_secs > 0 ? keyframe_secs : 1) * 1000;
+    rec_running = 1;
+    errno = pthread_create(&rec_writer, NULL, rec_writer_thread, NULL);
+    if (errno != 0)
+	return -1;
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Return a new recorder for room number @id, or NULL if out of memory.
+ * Only the thread which called record_init() may call this. */
+
+Recorder *record_new(int id)
+{
+    Recorder *r = calloc(1, sizeof(*r));
+
+    if (!r)
+	return NULL;
+    r->id = id;
+    r->next = recorders;
+    __atomic_store_n(&recorders, r, __ATOMIC_RELEASE);
+    return r;
+}
+
+/*************************************************************************/
+
+/* Write out everything recorded so far, finish any files still open, and
+ * stop recording.  No room may be running at the time. */
+
+void record_stop(void)
+{
+    if (!rec_dir)
+	return;
+    __atomic_store_n(&rec_running, 0, __ATOMIC_RELEASE);
+    pthread_join(rec_writer, NULL);
+    rec_dir = NULL;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Start recording a game.  @settings is what is sent with "newgame". */
+
+void record_start(Recorder *r, uint32_t seed, const char *settings)
+{
+    if (!r)
+	return;
+    record_end(r);
+    clock_gettime(CLOCK_MONOTONIC, &r->start);
+    r->active = 1;
+    r->last_keyframe = 0;
+    r->want_keyframe = 1;
+    rec_push(r, REC_START, &seed, sizeof(seed), settings, strlen(settings));
+}
+
+/*************************************************************************/
+
+/* Record a message of @len bytes (without terminator). */
+
+void record_line(Recorder *r, const char *line, int len)
+{
+    if (r && r->active)
+	rec_push(r, REC_LINE, line, len, NULL, 0);
+}
+
+/*************************************************************************/
+
+/* Return whether it's time for record_keyframe(). */
+
+int record_keyframe_due(Recorder *r)
+{
+    return r && r->active
+	&& (r->want_keyframe || r->now - r->last_keyframe >= keyframe_ms);
+}
+
+/*************************************************************************/
+
+void record_keyframe(Recorder *r, const RecKeyframe *k)
+{
+    if (r && r->active
+     && rec_push(r, REC_KEYFRAME, k, sizeof(*k), NULL, 0) == 0) {
+	r->last_keyframe = r->now;
+	r->want_keyframe = 0;
+    }
+}
+
+/*************************************************************************/
+
+/* Stop recording the current game, if any. */
+
+void record_end(Recorder *r)
+{
+    if (r && r->active) {
+	rec_push(r, REC_END, NULL, 0, NULL, 0);
+	r->active = 0;
+    }
+}
+
+/*************************************************************************/
@@ -0,0 +1,90 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Game recorder declarations.  Include tetrinet.h before this file.
+ */
+
+#ifndef RECORD_H
+#define RECORD_H
+
+#include <stdint.h>
+
+/*************************************************************************/
+
+/* With "recorddir" set, the server records each game played in each room
+ * to a file of its own in that directory.  A room adds records to a ring
+ * buffer set aside for it when the server starts, and a separate thread
+ * writes them out, so recording never waits for the disk or allocates
+ * memory.  If a room's ring fills up, records are lost (the file says how
+ * many) and a keyframe is taken as soon as there is room again.
+ *
+ * A file starts with RECORD_MAGIC, followed by records each made up of a
+ * RecHeader and @len bytes of payload:
+ *
+ *   REC_START:    the game's random seed (uint32_t), then the settings
+ *                 sent with "newgame".  Always the first record.
+ *   REC_LINE:     a message sent to the players, or the "playerlost" one
+ *                 received, without its terminator.  The players in the
+ *                 game at the start are given as "playerjoin" and "team"
+ *                 messages just after REC_START.
+ *   REC_KEYFRAME: a RecKeyframe with the state of every field, taken at
+ *                 the start and then every few seconds (the "keyframe"
+ *                 setting), so that a game can be shown from any point
+ *                 without playing through everything before it.
+ *   REC_GAP:      the number (uint32_t) of records lost here.
+ *   REC_END:      the end of the game.  Always the last record.
+ *
+ * After the REC_END record comes an index of the keyframes: a
+ * RecIndexEntry for each, then a RecTrailer at the very end of the file
+ * saying where the index starts.
+ */
+
+#define RECORD_MAGIC	"TNRECRD1"
+#define RECORD_INDEX_MAGIC "TNRINDX1"
+
+#define REC_START	0
+#define REC_LINE	1
+#define REC_KEYFRAME	2
+#define REC_GAP		3
+#define REC_END		4
+
+typedef struct {
+    uint32_t ms;		/* Milliseconds since the start of the game */
+    uint16_t len;		/* Length of the payload */
+    uint8_t type;		/* REC_* */
+    uint8_t pad;
+} RecHeader;
+
+typedef struct {
+    Field fields[6];
+    uint8_t levels[6];		/* Capped at 255 */
+    uint8_t lost[6];		/* Order of losing, 0 if still in */
+} RecKeyframe;
+
+typedef struct {
+    uint32_t ms;		/* Time of the keyframe */
+    uint32_t offset;		/* Offset of its RecHeader in the file */
+} RecIndexEntry;
+
+typedef struct {
+    uint32_t count;		/* Number of RecIndexEntries */
+    uint32_t offset;		/* Offset of the first */
+    char magic[8];		/* RECORD_INDEX_MAGIC */
+} RecTrailer;
+
+typedef struct Recorder Recorder;
+
+extern int record_init(const char *dir, int keyframe_secs);
+extern Recorder *record_new(int id);
+extern void record_stop(void);
+
+/* The rest may only be called by the room owning the recorder. */
+extern void record_start(Recorder *r, uint32_t seed, const char *settings);
+extern void record_line(Recorder *r, const char *line, int len);
+extern int record_keyframe_due(Recorder *r);
+extern void record_keyframe(Recorder *r, const RecKeyframe *k);
+extern void record_end(Recorder *r);
+
+/*************************************************************************/
+
+#endif	/* RECORD_H */
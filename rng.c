@@ -0,0 +1,89 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Random number generator.  This is PCG32 (see http://www.pcg-random.org/):
+ * small, fast, and with independent streams, which we use to give each
+ * player in a game a different sequence from the same seed.
+ */
+
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include "rng.h"
+
+/*************************************************************************/
+
+/* Seed a generator.  Generators with the same seed but different streams
+ * produce unrelated sequences.
+ */
+
+void rng_seed(Rng *rng, uint32_t seed, uint32_t stream)
+{
+    rng->state = 0;
+    rng->inc = ((uint64_t) stream << 1) | 1;
+    rng_next(rng);
+    rng->state += seed;
+    rng_next(rng);
+}
+
+/*************************************************************************/
+
+/* Return the next 32 random bits. */
+
+uint32_t rng_next(Rng *rng)
+{
+    uint64_t old = rng->state;
+    uint32_t xorshifted, rot;
+
+    rng->state = old * 6364136223846793005ULL + rng->inc;
+    xorshifted = ((old >> 18) ^ old) >> 27;
+    rot = old >> 59;
+    return (xorshifted >> rot) | (xorshifted << (-rot & 31));
+}
+
+/*************************************************************************/
+
+/* Return a random number from 0 to n-1, without the bias of taking the
+ * next number modulo n.  This uses Lemire's multiply-and-shift method,
+ * which only needs a division in the rare case of a rejected sample.
+ */
+
+int rng_range(Rng *rng, int n)
+{
+    uint64_t m = (uint64_t) rng_next(rng) * (uint32_t) n;
+    uint32_t low = (uint32_t) m;
+
+    if (low < (uint32_t) n) {
+	uint32_t threshold = -(uint32_t) n % (uint32_t) n;
+	while (low < threshold) {
+	    m = (uint64_t) rng_next(rng) * (uint32_t) n;
+	    low = (uint32_t) m;
+	}
+    }
+    return m >> 32;
+}
+
+/*************************************************************************/
+
+/* Return a seed which is different each time, for when nobody has given
+ * us one.  Take it from the kernel if possible, else from the clock.
+ */
+
+uint32_t rng_entropy(void)
+{
+    FILE *f;
+    uint32_t seed;
+    struct timeval tv;
+
+    if ((f = fopen("/dev/urandom", "r")) != NULL) {
+	int ok = fread(&seed, sizeof(seed), 1, f) == 1;
+	fclose(f);
+	if (ok)
+	    return seed;
+    }
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec ^ tv.tv_usec << 12 ^ (uint32_t) getpid() << 20;
+}
+
+/*************************************************************************/
@@ -0,0 +1,30 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Random number generator declarations.
+ */
+
+#ifndef RNG_H
+#define RNG_H
+
+#include <stdint.h>
+
+/*************************************************************************/
+
+/* State of a PCG32 generator.  Each game gets its own, seeded from a value
+ * the server sends with the game settings, so the same seed and player
+ * number always produce the same pieces, garbage and specials. */
+
+typedef struct {
+    uint64_t state;
+    uint64_t inc;	/* Selects the stream; always odd */
+} Rng;
+
+extern void rng_seed(Rng *rng, uint32_t seed, uint32_t stream);
+extern uint32_t rng_next(Rng *rng);
+extern int rng_range(Rng *rng, int n);
+extern uint32_t rng_entropy(void);
+
+/*************************************************************************/
+
+#endif	/* RNG_H */
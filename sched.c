@@ -0,0 +1,302 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Worker thread pool with work stealing.  Each worker has its own queue of
+ * tasks to run; a worker which runs out takes tasks from the others' queues
+ * before going to sleep.  A task is only ever in one queue and run by one
+ * worker at a time, so whatever state it owns needs no locking.
+ */
+
+#include <errno.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "sched.h"
+
+/*************************************************************************/
+
+/* Task states. */
+#define TASK_IDLE	0	/* Not queued or running */
+#define TASK_QUEUED	1	/* In some worker's queue */
+#define TASK_RUNNING	2	/* Being run */
+#define TASK_RERUN	3	/* Being run, and woken again since it started */
+
+typedef struct {
+    pthread_t thread;
+    pthread_mutex_t lock;	/* Protects the queue */
+    SchedTask **queue;		/* Ring of queued tasks */
+    int size, head, count;
+    unsigned int seed;		/* For picking a worker to steal from */
+} Worker;
+
+static Worker *workers;
+static int nworkers;
+static __thread Worker *self;	/* The worker this thread is, if any */
+
+static pthread_mutex_t sleep_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t sleep_cond = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t idle_cond = PTHREAD_COND_INITIALIZER;
+static int nsleeping;		/* Workers waiting on sleep_cond */
+static int nqueued;		/* Tasks in all queues together */
+static int nactive;		/* Tasks queued or running */
+static int stopping;
+static unsigned int next_worker;  /* For tasks woken outside the pool */
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Add a task to the end of a worker's queue, and wake a sleeping worker
+ * to run it if there is one. */
+
+static void push(Worker *w, SchedTask *task)
+{
+    pthread_mutex_lock(&w->lock);
+    if (w->count == w->size) {
+	int newsize = w->size ? w->size*2 : 64, i;
+	SchedTask **new = malloc(newsize * sizeof(*new));
+	/* We can't drop the task, so if there's no memory there is
+	 * nothing sensible to do but wait for some. */
+	while (!new) {
+	    sleep(1);
+	    new = malloc(newsize * sizeof(*new));
+	}
+	for (i = 0; i < w->count; i++)
+	    new[i] = w->queue[(w->head + i) % w->size];
+	free(w->queue);
+	w->queue = new;
+	w->size = newsize;
+	w->head = 0;
+    }
+    w->queue[(w->head + w->count) % w->size] = task;
+    atomic_set(&w->count, w->count+1);
+    pthread_mutex_unlock(&w->lock);
+
+    /* A worker about to sleep counts itself in nsleeping before checking
+     * nqueued, so either it sees this task or we see it. */
+    atomic_add(&nqueued, 1);
+    if (atomic_get(&nsleeping)) {
+	pthread_mutex_lock(&sleep_lock);
+	pthread_cond_signal(&sleep_cond);
+	pthread_mutex_unlock(&sleep_lock);
+    }
+}
+
+/*************************************************************************/
+
+/* Take a task from a worker's queue: the oldest if it's our own, so every
+ * task gets its turn, or the newest if we're stealing it, since that's the
+ * one its owner would have got to last.  Return NULL if the queue is
+ * empty. */
+
+static SchedTask *take(Worker *w, int steal)
+{
+    SchedTask *task = NULL;
+
+    /* Don't bother locking a queue we can see is empty. */
+    if (!atomic_get(&w->count))
+	return NULL;
+    pthread_mutex_lock(&w->lock);
+    if (w->count) {
+	atomic_set(&w->count, w->count-1);
+	if (steal) {
+	    task = w->queue[(w->head + w->count) % w->size];
+	} else {
+	    task = w->queue[w->head];
+	    w->head = (w->head + 1) % w->size;
+	}
+    }
+    pthread_mutex_unlock(&w->lock);
+    if (task)
+	atomic_add(&nqueued, -1);
+    return task;
+}
+
+/* Find a task for worker @w to run, from its own queue or another's. */
+
+static SchedTask *find_task(Worker *w)
+{
+    SchedTask *task;
+    int i, start;
+
+    if ((task = take(w, 0)) != NULL)
+	return task;
+    start = rand_r(&w->seed) % nworkers;
+    for (i = 0; i < nworkers; i++) {
+	Worker *victim = &workers[(start+i) % nworkers];
+	if (victim != w && (task = take(victim, 1)) != NULL)
+	    return task;
+    }
+    return NULL;
+}
+
+/*************************************************************************/
+
+/* Run a task we've taken from a queue. */
+
+static void run_task(Worker *w, SchedTask *task)
+{
+    int state;
+
+    atomic_set(&task->state, TASK_RUNNING);
+    task->run(task);
+    state = TASK_RUNNING;
+    if (atomic_cas(&task->state, state, TASK_IDLE)) {
+	if (atomic_add(&nactive, -1) == 0) {
+	    pthread_mutex_lock(&sleep_lock);
+	    pthread_cond_broadcast(&idle_cond);
+	    pthread_mutex_unlock(&sleep_lock);
+	}
+    } else {
+	/* Woken while it ran.  It goes to the back of our queue, so it
+	 * doesn't hold up the tasks already waiting there, or to whichever
+	 * idle worker steals it first. */
+	atomic_set(&task->state, TASK_QUEUED);
+	push(w, task);
+    }
+}
+
+/*************************************************************************/
+
+static void *worker_main(void *arg)
+{
+    Worker *w = arg;
+    SchedTask *task;
+    sigset_t sigs;
+
+    /* Signals are for the thread which started us. */
+    sigfillset(&sigs);
+    pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+    self = w;
+
+    for (;;) {
+	if ((task = find_task(w)) != NULL) {
+	    run_task(w, task);
+	    continue;
+	}
+	pthread_mutex_lock(&sleep_lock);
+	atomic_add(&nsleeping, 1);
+	if (!stopping && !atomic_get(&nqueued))
+	    pthread_cond_wait(&sleep_cond, &sleep_lock);
+	atomic_add(&nsleeping, -1);
+	if (stopping && !atomic_get(&nqueued)) {
+	    pthread_mutex_unlock(&sleep_lock);
+	    break;
+	}
+	pthread_mutex_unlock(&sleep_lock);
+    }
+    return NULL;
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Start @nthreads worker threads, or one for each CPU if @nthreads is zero
+ * or negative.  Return 0 on success, -1 on failure with errno set. */
+
+int sched_start(int nthreads)
+{
+    int i, err;
+
+    if (nthreads <= 0)
+	nthreads = sched_ncpus();
+    if (!(workers = calloc(nthreads, sizeof(*workers))))
+	return -1;
+    stopping = 0;
+    for (i = 0; i < nthreads; i++) {
+	pthread_mutex_init(&workers[i].lock, NULL);
+	workers[i].seed = i+1;
+    }
+    /* Workers look at each other's queues as soon as they start, so they
+     * all need to be set up first. */
+    nworkers = nthreads;
+    for (i = 0; i < nthreads; i++) {
+	err = pthread_create(&workers[i].thread, NULL, worker_main,
+			     &workers[i]);
+	if (err) {
+	    nworkers = i;
+	    sched_stop();
+	    errno = err;
+	    return -1;
+	}
+    }
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Wait for all queued tasks to finish, then stop the worker threads. */
+
+void sched_stop(void)
+{
+    int i;
+
+    pthread_mutex_lock(&sleep_lock);
+    stopping = 1;
+    pthread_cond_broadcast(&sleep_cond);
+    pthread_mutex_unlock(&sleep_lock);
+    for (i = 0; i < nworkers; i++)
+	pthread_join(workers[i].thread, NULL);
+    for (i = 0; i < nworkers; i++) {
+	pthread_mutex_destroy(&workers[i].lock);
+	free(workers[i].queue);
+    }
+    free(workers);
+    workers = NULL;
+    nworkers = 0;
+}
+
+/*************************************************************************/
+
+/* Make sure a task runs (again) soon.  May be called from any thread. */
+
+void sched_wake(SchedTask *task)
+{
+    Worker *w;
+    int state;
+
+    for (;;) {
+	state = atomic_get(&task->state);
+	if (state == TASK_IDLE) {
+	    if (atomic_cas(&task->state, state, TASK_QUEUED))
+		break;
+	} else if (state == TASK_RUNNING) {
+	    if (atomic_cas(&task->state, state, TASK_RERUN))
+		return;
+	} else {
+	    return;  /* Already going to run */
+	}
+    }
+    atomic_add(&nactive, 1);
+    w = self;
+    if (!w)
+	w = &workers[__atomic_fetch_add(&next_worker, 1, __ATOMIC_RELAXED)
+		     % nworkers];
+    push(w, task);
+}
+
+/*************************************************************************/
+
+/* Wait until no tasks are queued or running. */
+
+void sched_wait_idle(void)
+{
+    pthread_mutex_lock(&sleep_lock);
+    while (atomic_get(&nactive))
+	pthread_cond_wait(&idle_cond, &sleep_lock);
+    pthread_mutex_unlock(&sleep_lock);
+}
+
+/*************************************************************************/
+
+/* Return the number of CPUs available, and at least 1. */
+
+int sched_ncpus(void)
+{
+    long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+    return n > 0 ? (int) n : 1;
+}
+
+/*************************************************************************/
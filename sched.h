@@ -0,0 +1,46 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Worker thread pool declarations.
+ */
+
+#ifndef SCHED_H
+#define SCHED_H
+
+/*************************************************************************/
+
+/* Sequentially consistent operations on ints shared between threads.
+ * atomic_add() returns the new value; atomic_cas() sets *@p to @new if it
+ * equals the variable @old, and otherwise stores its value in @old. */
+
+#define atomic_get(p)		__atomic_load_n((p), __ATOMIC_SEQ_CST)
+#define atomic_set(p,v)		__atomic_store_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_add(p,v)		__atomic_add_fetch((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_swap(p,v)	__atomic_exchange_n((p), (v), __ATOMIC_SEQ_CST)
+#define atomic_cas(p,old,new)	__atomic_compare_exchange_n((p), &(old), \
+				    (new), 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)
+
+/*************************************************************************/
+
+/* A piece of work which can be run on any worker thread, but never on two
+ * at once.  Tasks are woken rather than queued: waking a task which is
+ * already waiting to run does nothing, and waking one which is running
+ * makes it run again once it finishes, so no wakeup is ever lost.  The
+ * state field belongs to the scheduler; set it to zero before first use.
+ */
+
+typedef struct SchedTask SchedTask;
+struct SchedTask {
+    void (*run)(SchedTask *task);
+    int state;
+};
+
+extern int sched_start(int nthreads);
+extern void sched_stop(void);
+extern void sched_wake(SchedTask *task);
+extern void sched_wait_idle(void);
+extern int sched_ncpus(void);
+
+/*************************************************************************/
+
+#endif	/* SCHED_H */
@@ -4,7 +4,6 @@
  * Tetrinet server code
  */
 
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -16,33 +15,156 @@
  * reason to not use glibc. */
 /* #include <netinet/protocols.h> */
 #include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/wait.h>
 #include <unistd.h>
 #include "tetrinet.h"
 #include "tetris.h"
+#include "field.h"
+#include "reactor.h"
+#include "msg.h"
+#include "lobby.h"
+#include "netlog.h"
+#include "query.h"
+#include "record.h"
+#include "sched.h"
 #include "server.h"
 #include "sockets.h"
+#include "timer.h"
 
 /*************************************************************************/
 
 static int linuxmode = 0;  /* 1: don't try to be compatible with Windows */
 static int ipv6_only = 0;  /* 1: only use IPv6 (when available) */
-
+static int nrooms = 1;     /* Number of game rooms */
+static int nthreads = 0;   /* Worker threads to run rooms on (0: one per CPU) */
+static int nprocs = 1;     /* Server processes sharing the port */
+static int use_uring = 0;  /* 1: do network I/O with io_uring if we can */
+static int stats = 0;      /* 1: report how much work was done on exit */
+static char *log_file;     /* Where to log network traffic, if anywhere */
+static char *record_dir;   /* Where to record games, if anywhere */
+static int keyframe_secs = 10;  /* Seconds between keyframes in recordings */
+static int query_port = 0; /* Port to answer server browsers on, if any */
+static int skill_buckets = 1;  /* Groups of players kept apart by points */
+
+static int started = 0;   /* Set once the startup-only settings are read */
 static int quit = 0;
+static int reload = 0;     /* Set on SIGHUP to re-read the config file */
 
-static int listen_sock = -1;
+static int proc_num = 0;   /* Which of the server processes we are */
+static int listen_sock = -1, query_sock = -1;
 #ifdef HAVE_IPV6
-static int listen_sock6 = -1;
+static int listen_sock6 = -1, query_sock6 = -1;
 #endif
-static int player_socks[6] = {-1,-1,-1,-1,-1,-1};
-static unsigned char player_ips[6][4];
-static int player_modes[6];
+static sigset_t wait_sigs; /* Signal mask to use while waiting for input */
+static long fields_relayed;  /* Field updates passed on, for stats */
+static long pongs, pong_usec;  /* Pings answered and their total time, ditto */
+static char piecebuf[101], specialbuf[101];  /* Frequencies for "newgame" */
+
+/* We re-use a lot of variables from the main code.  The game settings are
+ * shared by all of a process's rooms, and may only be used with this held. */
+static pthread_mutex_t global_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* The winlist is shared by all rooms in all server processes, so it lives
+ * in memory mapped before the processes are forked.  Changes are made with
+ * the lock held, and seq is odd while they're being made.  Anyone can read
+ * the winlist without taking the lock: copy it, and if seq was odd or has
+ * changed in the meantime, try again.  So sending out the winlist never
+ * waits for anything, and everyone sees the same one.
+ */
+
+typedef struct {
+    unsigned int seq;
+    pthread_mutex_t lock;	/* Shared between processes */
+    WinInfo winlist[MAXWINLIST];
+} SharedWinlist;
+
+static SharedWinlist *shared;
+
+/*************************************************************************/
+
+/* A new connection, before it has a room: it is its own task until the
+ * player has logged in and been given a place by the lobby, waiting there
+ * for as long as it takes.  Like query connections, these are never
+ * freed, only put back in the free list, since the reactor may wake one a
+ * last time after its connection has gone to a room.
+ */
 
-/* Which players have already lost in the current game? */
-static int player_lost[6];
+typedef struct Newcomer Newcomer;
+struct Newcomer {
+    SchedTask task;		/* Must be first */
+    LobbyEntry entry;
+    Newcomer *next_free;
+    int fd;			/* -1 while free (fd and in_room are
+				 *    changed under newcomer_lock) */
+    unsigned char ip[4];
+    int logged_in;		/* Is the login line in buf, decrypted? */
+    int in_room;		/* Handed over to its room?  Kept set
+				 *    until the entry is reused */
+    char buf[1024];		/* What they have sent so far */
+    int len;
+};
+
+static pthread_mutex_t newcomer_lock = PTHREAD_MUTEX_INITIALIZER;
+static Newcomer *free_newcomers;
 
-/* We re-use a lot of variables from the main code */
+/*************************************************************************/
+
+/* A game room: up to six players playing against each other.  Each room is
+ * a task for the worker threads, woken whenever one of its players has
+ * sent something, so only one thread at a time ever looks at a room and the
+ * game logic needs no locks.  The fields at the end are the exception; new
+ * players use them to hand themselves over.
+ */
+
+typedef struct {
+    SchedTask task;		/* Must be first */
+    int player_socks[6];	/* -1: free; ~(fd+1): not yet registered */
+    int player_modes[6];
+    int player_lost[6];		/* Which players have already lost in the
+				 *    current game? (order of losing) */
+    char *players[6];
+    char *teams[6];
+    int team_ids[6];		/* See intern_teams() */
+    unsigned int not_team[6];	/* Bitmask of the other players not on each
+				 *    player's team */
+    int levels[6];
+    unsigned int pingable;	/* Players who take "ping" */
+    int rtt[6];			/* Smoothed round trip times in microseconds
+				 *    (0 if not known yet) */
+    int clock_offset[6];	/* Smoothed offsets of their clocks from ours
+				 *    in milliseconds */
+    Timer timer;		/* Wakes the room when one of these is due: */
+    int64_t next_ping;		/*    the next round of pings */
+    int64_t newgame_at[6];	/*    "newgame" held back (see start_game()) */
+    int64_t timer_due;		/* When the timer is set for, 0 if not set */
+    char settings[1024];	/* What to send with "newgame" */
+    char *msg;			/* Message being encoded (see msg_start()) */
+    int msg_fd;			/* Connection whose output it's in, or -1 */
+    unsigned int msg_to;	/* Players still to get a copy */
+    int msg_record;		/* Whether it goes in the game's recording */
+    char msgbuf[MSG_MAX];	/* For when it isn't in anyone's output */
+    int playing_game;
+    int game_paused;
+    uint32_t game_seed;		/* Random seed for the current game */
+    Recorder *recorder;		/* Records its games, if "recorddir" is set */
+    Field fields[6];		/* Each player's field, for the recording */
+    char inbuf[6][1024];	/* Partial lines read from each player */
+    int inlen[6];
+    int id;			/* Number among all processes' rooms, from 0 */
+    int query_players;		/* Number of players and state last given */
+    int query_state;		/*    to query_room() */
+
+    pthread_mutex_t lock;	/* Protects incoming[] */
+    Newcomer *incoming[6];	/* Players given places here by the lobby */
+    int nincoming;
+    int send_winlist;		/* Set to have the winlist sent to everyone */
+} Room;
+
+static Room *rooms;
 
 /*************************************************************************/
 /*************************************************************************/
@@ -66,20 +188,100 @@ int xtoi(const char *buf)
 
 /*************************************************************************/
 
-/* Return a string containing the winlist in a format suitable for sending
- * to clients.
+/* Set up the shared winlist.  Return 0 on success, -1 on failure. */
+
+static int winlist_init(void)
+{
+    pthread_mutexattr_t attr;
+
+    shared = mmap(NULL, sizeof(*shared), PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (shared == MAP_FAILED) {
+	shared = NULL;
+	return -1;
+    }
+    pthread_mutexattr_init(&attr);
+    pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+    pthread_mutex_init(&shared->lock, &attr);
+    pthread_mutexattr_destroy(&attr);
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Start changing the winlist. */
+
+static void winlist_lock(void)
+{
+    if (pthread_mutex_lock(&shared->lock) == EOWNERDEAD) {
+	/* A process died halfway through a change.  What it left behind is
+	 * the best winlist we have, so let readers see it again. */
+	pthread_mutex_consistent(&shared->lock);
+	if (shared->seq & 1)
+	    atomic_add(&shared->seq, 1);
+    }
+    atomic_add(&shared->seq, 1);
+}
+
+/* Finish changing the winlist. */
+
+static void winlist_unlock(void)
+{
+    atomic_add(&shared->seq, 1);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/* Finish changing the winlist and save it with the settings.  No other
+ * change, and no reload of the file, can come in between: the lock is
+ * only let go once the file is written, though readers see the new
+ * winlist straight away.  Locks global_lock, so it must not be held. */
+
+static void winlist_save(void)
+{
+    atomic_add(&shared->seq, 1);
+    pthread_mutex_lock(&global_lock);
+    write_config();
+    pthread_mutex_unlock(&global_lock);
+    pthread_mutex_unlock(&shared->lock);
+}
+
+/* Copy the winlist to @list without locking it. */
+
+static void winlist_copy(WinInfo *list)
+{
+    unsigned int seq;
+
+    for (;;) {
+	seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+	if (!(seq & 1)) {
+	    memcpy(list, shared->winlist, sizeof(shared->winlist));
+	    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+	    if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq)
+		break;
+	}
+	sched_yield();
+    }
+}
+
+/*************************************************************************/
+
+/* Store the winlist in @buf, in a format suitable for sending to clients,
+ * and return @buf.
  */
 
-static char *winlist_str()
+static char *winlist_str(char *buf, int size)
 {
-    static char buf[1024];
+    WinInfo winlist[MAXWINLIST];
     char *s;
     int i;
 
+    winlist_copy(winlist);
     s = buf;
-    for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
-	s += snprintf(s, sizeof(buf)-(s-buf),
-			linuxmode ? " %c%s;%d;%d" : " %c%s;%d",
+    *s = 0;
+    for (i = 0; i < MAXWINLIST && *winlist[i].name && s-buf < size; i++) {
+	s += snprintf(s, size-(s-buf),
+			atomic_get(&linuxmode) ? " %c%s;%d;%d" : " %c%s;%d",
 			winlist[i].team ? 't' : 'p',
 			winlist[i].name, winlist[i].points, winlist[i].games);
     }
@@ -89,10 +291,34 @@ static char *winlist_str()
 /*************************************************************************/
 /*************************************************************************/
 
-/* Read the configuration file. */
+/* Rebuild the frequency tables and their "newgame" forms after the
+ * frequencies change.  Whether the totals are valid is checked when a game
+ * is started, so that the players can be told.
+ */
+
+static void update_freqs(void)
+{
+    int i;
+
+    build_freq_tables();
+    for (i = 0; i < 100; i++) {
+	piecebuf[i] = '1' + piece_table.slot[i];
+	specialbuf[i] = '1' + special_table.slot[i];
+    }
+    piecebuf[100] = specialbuf[100] = 0;
+}
+
+/*************************************************************************/
+
+/* Read the configuration file, and the winlist in it if @with_winlist is
+ * set.  The caller must hold global_lock if other threads are running, and
+ * if reading the winlist, be changing it (see winlist_lock()) if other
+ * threads or processes are running.  The winlist lock must be taken first.
+ */
 
-void read_config(void)
+void read_config(int with_winlist)
 {
+    WinInfo *winlist = shared->winlist;
     char buf[1024], *s, *t;
     FILE *f;
     int i;
@@ -113,6 +339,41 @@ void read_config(void)
 	} else if (strcmp(s, "ipv6_only") == 0) {
 	    if ((s = strtok(NULL, " ")))
 		ipv6_only = atoi(s);
+	} else if (strcmp(s, "rooms") == 0) {
+	    /* These can only be set up at startup. */
+	    if ((s = strtok(NULL, " ")) && !started)
+		nrooms = atoi(s) > 0 ? atoi(s) : 1;
+	} else if (strcmp(s, "threads") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		nthreads = atoi(s);
+	} else if (strcmp(s, "processes") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		nprocs = atoi(s) > 0 ? atoi(s) : 1;
+	} else if (strcmp(s, "iouring") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		use_uring = atoi(s);
+	} else if (strcmp(s, "stats") == 0) {
+	    if ((s = strtok(NULL, " ")))
+		stats = atoi(s);
+	} else if (strcmp(s, "log") == 0) {
+	    if ((s = strtok(NULL, " \r\n")) && !started) {
+		free(log_file);
+		log_file = strdup(s);
+	    }
+	} else if (strcmp(s, "recorddir") == 0) {
+	    if ((s = strtok(NULL, " \r\n")) && !started) {
+		free(record_dir);
+		record_dir = strdup(s);
+	    }
+	} else if (strcmp(s, "keyframe") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		keyframe_secs = atoi(s) > 0 ? atoi(s) : 1;
+	} else if (strcmp(s, "queryport") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		query_port = atoi(s);
+	} else if (strcmp(s, "skillbuckets") == 0) {
+	    if ((s = strtok(NULL, " ")) && !started)
+		skill_buckets = atoi(s) > 0 ? atoi(s) : 1;
 	} else if (strcmp(s, "averagelevels") == 0) {
 	    if ((s = strtok(NULL, " ")))
 		level_average = atoi(s);
@@ -145,7 +406,7 @@ void read_config(void)
 	    i = 0;
 	    while (i < 9 && (s = strtok(NULL, " ")))
 		specialfreq[i++] = atoi(s);
-	} else if (strcmp(s, "winlist") == 0) {
+	} else if (strcmp(s, "winlist") == 0 && with_winlist) {
 	    i = 0;
 	    while (i < MAXWINLIST && (s = strtok(NULL, " "))) {
 		t = strchr(s, ';');
@@ -178,20 +439,33 @@ void read_config(void)
 
 /*************************************************************************/
 
-/* Re-write the configuration file. */
+/* Re-write the configuration file.  The new file is written under a
+ * temporary name and then renamed, so that several threads or processes
+ * writing it at once each leave a complete file.  The caller must hold
+ * global_lock if other threads are running; to save a change to the
+ * winlist, use winlist_save().
+ */
 
 void write_config(void)
 {
-    char buf[1024], *s;
+    WinInfo winlist[MAXWINLIST];
+    char buf[1024], tmpname[1024], *s;
     FILE *f;
-    int i;
+    int i, fd;
 
     s = getenv("HOME");
     if (!s)
 	s = "/etc";
     snprintf(buf, sizeof(buf), "%s/.tetrinet", s);
-    if (!(f = fopen(buf, "w")))
+    snprintf(tmpname, sizeof(tmpname), "%s/.tetrinet.XXXXXX", s);
+    if ((fd = mkstemp(tmpname)) < 0)
+	return;
+    if (!(f = fdopen(fd, "w"))) {
+	close(fd);
+	unlink(tmpname);
 	return;
+    }
+    winlist_copy(winlist);
 
     fprintf(f, "winlist");
     for (i = 0; i < MAXSAVEWINLIST && *winlist[i].name; i++) {
@@ -223,81 +497,344 @@ void write_config(void)
 
     fprintf(f, "linuxmode %d\n", linuxmode);
     fprintf(f, "ipv6_only %d\n", ipv6_only);
-
-    fclose(f);
+    fprintf(f, "rooms %d\n", nrooms);
+    fprintf(f, "threads %d\n", nthreads);
+    fprintf(f, "processes %d\n", nprocs);
+    fprintf(f, "iouring %d\n", use_uring);
+    fprintf(f, "stats %d\n", stats);
+    if (log_file)
+	fprintf(f, "log %s\n", log_file);
+    if (record_dir)
+	fprintf(f, "recorddir %s\n", record_dir);
+    fprintf(f, "keyframe %d\n", keyframe_secs);
+    fprintf(f, "queryport %d\n", query_port);
+    fprintf(f, "skillbuckets %d\n", skill_buckets);
+
+    if (fclose(f) != 0 || rename(tmpname, buf) != 0)
+	unlink(tmpname);
 }
 
 /*************************************************************************/
 /*************************************************************************/
 
-/* Send a message to a single player. */
+/* Recipients of a message, as a bitmask of player numbers. */
+
+#define PLAYER(n)	(1 << ((n)-1))
+#define ALL_PLAYERS	0x3F
+#define OTHERS(n)	(ALL_PLAYERS & ~PLAYER(n))
+
+/* Start a message to the players in @to: return a buffer of MSG_MAX bytes
+ * for one of the msg_*() encoders to write it into, and pass the length
+ * it returns to msg_send().  The message is written straight into the
+ * output of the first of them, and copied from there to the rest.
+ * Messages are collected and only actually sent when the room finishes
+ * running (see room_flush()).  Those for more than one player are part of
+ * the game, and are recorded if it is being recorded.
+ */
 
-static void send_to(int player, const char *format, ...)
+static char *msg_start(Room *room, unsigned int to)
 {
-    va_list args;
-    char buf[1024];
+    int i, fd;
+
+    room->msg = room->msgbuf;
+    room->msg_fd = -1;
+    room->msg_to = to;
+    room->msg_record = (to & (to-1)) != 0;
+    for (i = 0; i < 6; i++) {
+	if ((to & 1<<i) && (fd = room->player_socks[i]) >= 0) {
+	    char *p = reactor_reserve(fd, MSG_MAX);
+	    if (p) {
+		room->msg = p;
+		room->msg_fd = fd;
+		room->msg_to &= ~(1<<i);
+	    }
+	    break;
+	}
+    }
+    return room->msg;
+}
+
+/* Send the @len-byte message started with msg_start(). */
+
+static void msg_send(Room *room, int len)
+{
+    int i;
 
-    va_start(args, format);
-    vsnprintf(buf, sizeof(buf), format, args);
-    if (player_socks[player-1] >= 0)
-	sockprintf(player_socks[player-1], "%s", buf);
+    if (room->msg_fd >= 0) {
+	reactor_commit(room->msg_fd, len);
+	if (log)
+	    netlog_record(NETLOG_SEND, room->msg_fd, room->msg, len-1);
+    }
+    for (i = 0; i < 6; i++) {
+	if ((room->msg_to & 1<<i) && room->player_socks[i] >= 0) {
+	    reactor_send(room->player_socks[i], room->msg, len);
+	    if (log) {
+		netlog_record(NETLOG_SEND, room->player_socks[i], room->msg,
+			      len-1);
+	    }
+	}
+    }
+    if (room->msg_record)
+	record_line(room->recorder, room->msg, len-1);
 }
 
 /*************************************************************************/
 
-/* Send a message to all players. */
+/* Recompute the room's team IDs and masks after a team has changed. */
 
-static void send_to_all(const char *format, ...)
+static void update_teams(Room *room)
 {
-    va_list args;
-    char buf[1024];
-    int i;
+    int i, j;
 
-    va_start(args, format);
-    vsnprintf(buf, sizeof(buf), format, args);
+    intern_teams(room->teams, room->team_ids);
     for (i = 0; i < 6; i++) {
-	if (player_socks[i] >= 0)
-	    sockprintf(player_socks[i], "%s", buf);
+	room->not_team[i] = 0;
+	for (j = 0; j < 6; j++) {
+	    if (j != i && (!room->team_ids[i]
+			   || room->team_ids[j] != room->team_ids[i]))
+		room->not_team[i] |= 1<<j;
+	}
     }
 }
 
+/*************************************************************************/
 /*************************************************************************/
 
-/* Send a message to all players but the given one. */
+/* Apply a field update from a player ("f" without the player number) to
+ * the room's copy of their field.  Positions off the field are ignored. */
 
-static void send_to_all_but(int player, const char *format, ...)
+static void update_field(Field *f, const char *s)
 {
-    va_list args;
-    char buf[1024];
+    int tile = 0, x, y;
+
+    if (*s >= '0') {
+	field_decode(f, s);
+	return;
+    }
+    for (; *s; s++) {
+	if (*s < '0') {
+	    tile = *s - '!';
+	} else if (s[1]) {
+	    x = s[0] - '3';
+	    y = (*++s) - '3';
+	    if (x >= 0 && x < FIELD_WIDTH && y >= 0 && y < FIELD_HEIGHT)
+		(*f)[y][x] = tile;
+	}
+    }
+}
+
+/* Record a keyframe of the current game. */
+
+static void record_state(Room *room)
+{
+    RecKeyframe k;
     int i;
 
-    va_start(args, format);
-    vsnprintf(buf, sizeof(buf), format, args);
+    memcpy(k.fields, room->fields, sizeof(k.fields));
     for (i = 0; i < 6; i++) {
-	if (i+1 != player && player_socks[i] >= 0)
-	    sockprintf(player_socks[i], "%s", buf);
+	k.levels[i] = room->levels[i] < 0 ? 0
+		    : room->levels[i] > 255 ? 255 : room->levels[i];
+	k.lost[i] = room->player_lost[i];
+    }
+    record_keyframe(room->recorder, &k);
+}
+
+/* Start recording a game which has just started with the given settings,
+ * along with who is playing it. */
+
+static void record_game(Room *room, const char *settings)
+{
+    char *buf = room->msgbuf;
+    int i;
+
+    record_start(room->recorder, room->game_seed, settings);
+    memset(room->fields, 0, sizeof(room->fields));
+    for (i = 1; i <= 6; i++) {
+	if (!room->players[i-1])
+	    continue;
+	record_line(room->recorder, buf,
+		    msg_playerjoin(buf, i, room->players[i-1]) - 1);
+	if (room->teams[i-1]) {
+	    record_line(room->recorder, buf,
+			msg_team(buf, i, room->teams[i-1]) - 1);
+	}
     }
+    record_state(room);
 }
 
+/*************************************************************************/
 /*************************************************************************/
 
-/* Send a message to all players but those on the same team as the given
- * player.
- */
+/* Clients which take our "ping" extension (see msg.h) are pinged every
+ * PING_INTERVAL, and their answers give us their round trip times and how
+ * far their clocks are from ours, both smoothed the way TCP smooths its
+ * round trip time.  Everything here is done by the room itself, woken by
+ * its timer when something is due. */
+
+#define PING_INTERVAL	5000	/* Milliseconds between pings */
+#define MAX_START_DELAY	500	/* Longest "newgame" is held back, in ms */
 
-static void send_to_all_but_team(int player, const char *format, ...)
+/* Return the time on the monotonic clock in microseconds. */
+
+static int64_t now_usec(void)
 {
-    va_list args;
-    char buf[1024];
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*************************************************************************/
+
+static void send_ping(Room *room, int player, int64_t now)
+{
+    msg_send(room, msg_ping(msg_start(room, PLAYER(player)),
+			    (int) (now & 0x7FFFFFFF)));
+}
+
+/* Take note of a player's "pong", with the @stamp from our "ping" and the
+ * time on their @clock. */
+
+static void got_pong(Room *room, int player, int stamp, int clock)
+{
+    struct timespec ts;
+    long long ms;
+    int rtt, offset;
+
+    if (!(room->pingable & PLAYER(player)))
+	return;
+    rtt = (now_usec() - stamp) & 0x7FFFFFFF;
+    if (rtt > 60000000)
+	return;  /* Not one of ours */
+    if (!rtt)
+	rtt = 1;
+    /* Their clock was read halfway through the round trip. */
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ms = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - rtt / 2000;
+    offset = (clock - ms) & 0x7FFFFFFF;
+    if (offset >= 0x40000000)
+	offset -= 0x80000000;
+    if (room->rtt[player-1]) {
+	room->rtt[player-1] += (rtt - room->rtt[player-1]) / 8;
+	room->clock_offset[player-1] +=
+	    (offset - room->clock_offset[player-1]) / 8;
+    } else {
+	room->rtt[player-1] = rtt;
+	room->clock_offset[player-1] = offset;
+    }
+    atomic_add(&pongs, 1);
+    atomic_add(&pong_usec, rtt);
+}
+
+/* Tell a player everyone's round trip time and clock offset, for the
+ * "/ping" partyline command. */
+
+static void report_pings(Room *room, int to)
+{
+    char buf[256];
+    int i, rtt;
+
+    for (i = 1; i <= 6; i++) {
+	if (!room->players[i-1])
+	    continue;
+	rtt = room->rtt[i-1];
+	if (!(room->pingable & PLAYER(i))) {
+	    snprintf(buf, sizeof(buf), "%s: doesn't answer pings",
+		     room->players[i-1]);
+	} else if (!rtt) {
+	    snprintf(buf, sizeof(buf), "%s: no answer yet",
+		     room->players[i-1]);
+	} else {
+	    snprintf(buf, sizeof(buf),
+		     "%s: %d.%d ms round trip, clock %+d ms from ours",
+		     room->players[i-1], rtt / 1000, rtt / 100 % 10,
+		     room->clock_offset[i-1]);
+	}
+	msg_send(room, msg_pline(msg_start(room, PLAYER(to)), 0, buf));
+    }
+}
+
+/*************************************************************************/
+
+static void send_newgame(Room *room, int player)
+{
+    msg_send(room, msg_newgame(msg_start(room, PLAYER(player)),
+			       room->player_modes[player-1], room->settings));
+}
+
+/* Send "newgame" with the given settings to everyone, timed so that as
+ * near as we can tell it reaches them all at the same moment, and the
+ * delay before their first piece runs out for all of them together.
+ * Each is held back by however much less time it takes to reach them
+ * than the furthest player (half the difference in round trip times).
+ * Players who don't answer pings get it straight away. */
+
+static void start_game(Room *room, const char *settings)
+{
+    int64_t now = now_usec();
+    int i, delay, max = 0;
+
+    snprintf(room->settings, sizeof(room->settings), "%s", settings);
+    for (i = 0; i < 6; i++) {
+	if (room->player_socks[i] >= 0 && room->rtt[i] > max)
+	    max = room->rtt[i];
+    }
+    if (max > MAX_START_DELAY*2000)
+	max = MAX_START_DELAY*2000;
+    for (i = 1; i <= 6; i++) {
+	if (room->player_socks[i-1] < 0)
+	    continue;
+	delay = 0;
+	if (room->rtt[i-1] && room->rtt[i-1] < max)
+	    delay = (max - room->rtt[i-1]) / 2;
+	if (delay < TIMER_TICK*1000)
+	    send_newgame(room, i);
+	else
+	    room->newgame_at[i-1] = now + delay;
+    }
+}
+
+/*************************************************************************/
+
+/* Do whatever the room's timer was for: send any "newgame"s held back
+ * which are now due, and pings if it's time.  Then set the timer for
+ * whatever is next. */
+
+static void run_timers(Room *room)
+{
+    int64_t now = now_usec(), next = 0;
     int i;
-    char *team = teams[player-1];
 
-    va_start(args, format);
-    vsnprintf(buf, sizeof(buf), format, args);
     for (i = 0; i < 6; i++) {
-	if (i+1 != player && player_socks[i] >= 0 &&
-			(!team || !teams[i] || strcmp(teams[i], team) != 0))
-	    sockprintf(player_socks[i], "%s", buf);
+	if (!room->newgame_at[i])
+	    continue;
+	if (room->newgame_at[i] <= now) {
+	    room->newgame_at[i] = 0;
+	    send_newgame(room, i+1);
+	} else if (!next || room->newgame_at[i] < next) {
+	    next = room->newgame_at[i];
+	}
+    }
+    if (room->pingable) {
+	if (room->next_ping <= now) {
+	    for (i = 1; i <= 6; i++) {
+		if (room->pingable & PLAYER(i))
+		    send_ping(room, i, now);
+	    }
+	    room->next_ping = now + PING_INTERVAL*1000;
+	}
+	if (!next || room->next_ping < next)
+	    next = room->next_ping;
+    }
+    /* A timer which has fired must be set again even if it's for the same
+     * time, in case it fired a little before that time. */
+    if (next != room->timer_due
+     || (next && !timer_pending(&room->timer))) {
+	if (next)
+	    timer_add(&room->timer, &room->task, (next - now + 999) / 1000);
+	else
+	    timer_cancel(&room->timer);
+	room->timer_due = next;
     }
 }
 
@@ -305,21 +842,21 @@ static void send_to_all_but_team(int player, const char *format, ...)
 /*************************************************************************/
 
 /* Add points to a given player's [team's] winlist entry, or make a new one
- * if they rank.
+ * if they rank.  The caller must be changing the winlist.
  */
 
-static void add_points(int player, int points)
+static void add_points(Room *room, int player, int points)
 {
+    WinInfo *winlist = shared->winlist;
+    char *name = room->players[player-1], *team = room->teams[player-1];
     int i;
 
-    if (!players[player-1])
+    if (!name)
 	return;
     for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
-	if (!winlist[i].team && !teams[player-1]
-	 && strcmp(winlist[i].name, players[player-1]) == 0)
+	if (!winlist[i].team && !team && strcmp(winlist[i].name, name) == 0)
 	    break;
-	if (winlist[i].team && teams[player-1]
-	 && strcmp(winlist[i].name, teams[player-1]) == 0)
+	if (winlist[i].team && team && strcasecmp(winlist[i].name, team) == 0)
 	    break;
     }
     if (i == MAXWINLIST) {
@@ -329,12 +866,12 @@ static void add_points(int player, int points)
     if (i == MAXWINLIST)
 	return;
     if (!*winlist[i].name) {
-	if (teams[player-1]) {
-	    strncpy(winlist[i].name, teams[player-1], sizeof(winlist[i].name)-1);
+	if (team) {
+	    strncpy(winlist[i].name, team, sizeof(winlist[i].name)-1);
 	    winlist[i].name[sizeof(winlist[i].name)-1] = 0;
 	    winlist[i].team = 1;
 	} else {
-	    strncpy(winlist[i].name, players[player-1], sizeof(winlist[i].name)-1);
+	    strncpy(winlist[i].name, name, sizeof(winlist[i].name)-1);
 	    winlist[i].name[sizeof(winlist[i].name)-1] = 0;
 	    winlist[i].team = 0;
 	}
@@ -344,20 +881,21 @@ static void add_points(int player, int points)
 
 /*************************************************************************/
 
-/* Add a game to a given player's [team's] winlist entry. */
+/* Add a game to a given player's [team's] winlist entry.  The caller must
+ * be changing the winlist. */
 
-static void add_game(int player)
+static void add_game(Room *room, int player)
 {
+    WinInfo *winlist = shared->winlist;
+    char *name = room->players[player-1], *team = room->teams[player-1];
     int i;
 
-    if (!players[player-1])
+    if (!name)
 	return;
     for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
-	if (!winlist[i].team && !teams[player-1]
-	 && strcmp(winlist[i].name, players[player-1]) == 0)
+	if (!winlist[i].team && !team && strcmp(winlist[i].name, name) == 0)
 	    break;
-	if (winlist[i].team && teams[player-1]
-	 && strcmp(winlist[i].name, teams[player-1]) == 0)
+	if (winlist[i].team && team && strcasecmp(winlist[i].name, team) == 0)
 	    break;
     }
     if (i == MAXWINLIST || !*winlist[i].name)
@@ -367,10 +905,11 @@ static void add_game(int player)
 
 /*************************************************************************/
 
-/* Sort the winlist. */
+/* Sort the winlist.  The caller must be changing the winlist. */
 
 static void sort_winlist()
 {
+    WinInfo *winlist = shared->winlist;
     int i, j, best, bestindex;
 
     for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
@@ -395,11 +934,13 @@ static void sort_winlist()
 
 /* Take care of a player losing (which may end the game). */
 
-static void player_loses(int player)
+static void player_loses(Room *room, int player)
 {
-    int i, j, order, end = 1, winner = -1, second = -1, third = -1;
+    int *team_ids = room->team_ids, *player_lost = room->player_lost;
+    char buf[1024];
+    int i, order, end = 1, winner = -1, second = -1, third = -1;
 
-    if (player < 1 || player > 6 || player_socks[player-1] < 0)
+    if (player < 1 || player > 6 || room->player_socks[player-1] < 0)
 	return;
     order = 0;
     for (i = 1; i <= 6; i++) {
@@ -408,71 +949,71 @@ static void player_loses(int player)
     }
     player_lost[player-1] = order+1;
     for (i = 1; i <= 6; i++) {
-	if (player_socks[i-1] >= 0 && !player_lost[i-1]) {
+	if (room->player_socks[i-1] >= 0 && !player_lost[i-1]) {
 	    if (winner < 0) {
 		winner = i;
-	    } else if (!teams[winner-1] || !teams[i-1]
-			|| strcasecmp(teams[winner-1],teams[i-1]) != 0) {
+	    } else if (!team_ids[winner-1]
+			|| team_ids[i-1] != team_ids[winner-1]) {
 		end = 0;
 		break;
 	    }
 	}
     }
     if (end) {
-	send_to_all("endgame");
-	playing_game = 0;
+	msg_send(room, msg_endgame(msg_start(room, ALL_PLAYERS)));
+	room->playing_game = 0;
+	memset(room->newgame_at, 0, sizeof(room->newgame_at));
 	/* Catch the case where no players are left (1-player game) */
+	if (winner > 0)
+	    msg_send(room, msg_playerwon(msg_start(room, ALL_PLAYERS), winner));
+	record_end(room->recorder);
+	winlist_lock();
 	if (winner > 0) {
-	    send_to_all("playerwon %d", winner);
-	    add_points(winner, 3);
+	    add_points(room, winner, 3);
 	    order = 0;
 	    for (i = 1; i <= 6; i++) {
 		if (player_lost[i-1] > order
-			&& (!teams[winner-1] || !teams[i-1]
-			    || strcasecmp(teams[winner-1],teams[i-1]) != 0)) {
+			&& (room->not_team[winner-1] & 1<<(i-1))) {
 		    order = player_lost[i-1];
 		    second = i;
 		}
 	    }
 	    if (order) {
-		add_points(second, 2);
+		add_points(room, second, 2);
 		player_lost[second-1] = 0;
 	    }
 	    order = 0;
 	    for (i = 1; i <= 6; i++) {
 		if (player_lost[i-1] > order
-			&& (!teams[winner-1] || !teams[i-1]
-			    || strcasecmp(teams[winner-1],teams[i-1]) != 0)
-			&& (!teams[second-1] || !teams[i-1]
-			    || strcasecmp(teams[second-1],teams[i-1]) != 0)) {
+			&& (room->not_team[winner-1] & 1<<(i-1))
+			&& (room->not_team[second-1] & 1<<(i-1))) {
 		    order = player_lost[i-1];
 		    third = i;
 		}
 	    }
 	    if (order)
-		add_points(third, 1);
+		add_points(room, third, 1);
 	    for (i = 1; i <= 6; i++) {
-		if (teams[i-1]) {
-		    for (j = 1; j < i; j++) {
-			if (teams[j-1] && strcasecmp(teams[i-1],teams[j-1])==0)
-			    break;
-		    }
-		    if (j < i)
-			continue;
-		}
-		if (player_socks[i-1] >= 0)
-		    add_game(i);
+		/* Count each team only once, for its first player */
+		if (team_ids[i-1] && team_ids[i-1] != i)
+		    continue;
+		if (room->player_socks[i-1] >= 0)
+		    add_game(room, i);
 	    }
 	}
 	sort_winlist();
-	write_config();
-	send_to_all("winlist %s", winlist_str());
+	winlist_save();
+	msg_send(room, msg_winlist(msg_start(room, ALL_PLAYERS),
+				   winlist_str(buf, sizeof(buf))));
     }
     /* One more possibility: the only player playing left the game, which
      * means there are now no players left. */
-    if (!players[0] && !players[1] && !players[2] && !players[3]
-                    && !players[4] && !players[5])
-	playing_game = 0;
+    for (i = 0; i < 6 && !room->players[i]; i++)
+	;
+    if (i == 6) {
+	room->playing_game = 0;
+	record_end(room->recorder);
+    }
 }
 
 /*************************************************************************/
@@ -482,197 +1023,232 @@ static void player_loses(int player)
  * effect.  Return 0 if the command is unknown (or bad syntax), else 1.
  */
 
-static int server_parse(int player, char *buf)
+static int server_parse(Room *room, int player, char *buf)
 {
-    char *cmd, *s, *t;
+    char *cmd, *s, *t, *save, msg[1024];
     int i, tetrifast = 0;
 
-    cmd = strtok(buf, " ");
+    cmd = strtok_r(buf, " ", &save);
 
     if (!cmd) {
 	return 1;
 
     } else if (strcmp(cmd, "tetrisstart") == 0) {
 newplayer:
-	s = strtok(NULL, " ");
-	t = strtok(NULL, " ");
+	s = strtok_r(NULL, " ", &save);
+	t = strtok_r(NULL, " ", &save);
 	if (!t)
 	    return 0;
+	t = strtok_r(NULL, " ", &save);  /* Extensions asked for */
 	for (i = 1; i <= 6; i++) {
-	    if (players[i-1] && strcasecmp(s, players[i-1]) == 0) {
-		send_to(player, "noconnecting Nickname already exists on server!");
+	    if (room->players[i-1] && strcasecmp(s, room->players[i-1]) == 0) {
+		msg_send(room, msg_noconnecting(msg_start(room, PLAYER(player)),
+					"Nickname already exists on server!"));
 		return 0;
 	    }
 	}
-	players[player-1] = strdup(s);
-	if (teams[player-1])
-	    free(teams[player-1]);
-	teams[player-1] = NULL;
-	player_modes[player-1] = tetrifast;
-	send_to(player, "%s %d", tetrifast ? ")#)(!@(*3" : "playernum", player);
-	send_to(player, "winlist %s", winlist_str());
+	room->players[player-1] = strdup(s);
+	if (room->teams[player-1])
+	    free(room->teams[player-1]);
+	room->teams[player-1] = NULL;
+	update_teams(room);
+	room->player_modes[player-1] = tetrifast;
+	msg_send(room, msg_playernum(msg_start(room, PLAYER(player)), player,
+				     tetrifast));
+	msg_send(room, msg_winlist(msg_start(room, PLAYER(player)),
+				   winlist_str(msg, sizeof(msg))));
 	for (i = 1; i <= 6; i++) {
-	    if (i != player && players[i-1]) {
-		send_to(player, "playerjoin %d %s", i, players[i-1]);
-		send_to(player, "team %d %s", i, teams[i-1] ? teams[i-1] : "");
+	    if (i != player && room->players[i-1]) {
+		msg_send(room, msg_playerjoin(msg_start(room, PLAYER(player)), i,
+					      room->players[i-1]));
+		msg_send(room, msg_team(msg_start(room, PLAYER(player)), i,
+					room->teams[i-1]));
 	    }
 	}
-	if (playing_game) {
-	    send_to(player, "ingame");
-	    player_lost[player-1] = 1;
+	if (room->playing_game) {
+	    msg_send(room, msg_ingame(msg_start(room, PLAYER(player))));
+	    room->player_lost[player-1] = 1;
+	}
+	msg_send(room, msg_playerjoin(msg_start(room, OTHERS(player)), player,
+				      room->players[player-1]));
+	room->rtt[player-1] = 0;
+	room->clock_offset[player-1] = 0;
+	if (t && strcmp(t, "ping") == 0) {
+	    int64_t now = now_usec();
+	    if (!room->pingable)  /* Start the round of pings from now */
+		room->next_ping = now + PING_INTERVAL*1000;
+	    room->pingable |= PLAYER(player);
+	    send_ping(room, player, now);
+	} else {
+	    room->pingable &= ~PLAYER(player);
 	}
-	send_to_all_but(player, "playerjoin %d %s", player, players[player-1]);
 
     } else if (strcmp(cmd, "tetrifaster") == 0) {
 	tetrifast = 1;
 	goto newplayer;
 
     } else if (strcmp(cmd, "team") == 0) {
-	s = strtok(NULL, " ");
-	t = strtok(NULL, "");
+	s = strtok_r(NULL, " ", &save);
+	t = strtok_r(NULL, "", &save);
 	if (!s || atoi(s) != player)
 	    return 0;
-	if (teams[player])
-	    free(teams[player]);
+	if (room->teams[player-1])
+	    free(room->teams[player-1]);
 	if (t)
-	    teams[player] = strdup(t);
+	    room->teams[player-1] = strdup(t);
 	else
-	    teams[player] = NULL;
-	send_to_all_but(player, "team %d %s", player, t ? t : "");
+	    room->teams[player-1] = NULL;
+	update_teams(room);
+	msg_send(room, msg_team(msg_start(room, OTHERS(player)), player, t));
 
     } else if (strcmp(cmd, "pline") == 0) {
-	s = strtok(NULL, " ");
-	t = strtok(NULL, "");
+	s = strtok_r(NULL, " ", &save);
+	t = strtok_r(NULL, "", &save);
 	if (!s || atoi(s) != player)
 	    return 0;
 	if (!t)
 	    t = "";
-	send_to_all_but(player, "pline %d %s", player, t);
+	if (strcasecmp(t, "/ping") == 0) {
+	    report_pings(room, player);
+	    return 1;
+	}
+	msg_send(room, msg_pline(msg_start(room, OTHERS(player)), player, t));
 
     } else if (strcmp(cmd, "plineact") == 0) {
-	s = strtok(NULL, " ");
-	t = strtok(NULL, "");
+	s = strtok_r(NULL, " ", &save);
+	t = strtok_r(NULL, "", &save);
 	if (!s || atoi(s) != player)
 	    return 0;
 	if (!t)
 	    t = "";
-	send_to_all_but(player, "plineact %d %s", player, t);
+	msg_send(room, msg_plineact(msg_start(room, OTHERS(player)), player, t));
 
     } else if (strcmp(cmd, "startgame") == 0) {
-	int total;
-	char piecebuf[101], specialbuf[101];
+	const char *error = NULL;
 
 	for (i = 1; i < player; i++) {
-	    if (player_socks[i-1] >= 0)
+	    if (room->player_socks[i-1] >= 0)
 		return 1;
 	}
-	s = strtok(NULL, " ");
-	t = strtok(NULL, " ");
+	s = strtok_r(NULL, " ", &save);
+	t = strtok_r(NULL, " ", &save);
 	if (!s)
 	    return 1;
 	i = atoi(s);
-	if ((i && playing_game) || (!i && !playing_game))
+	if ((i && room->playing_game) || (!i && !room->playing_game))
 	    return 1;
 	if (!i) {  /* end game */
-	    send_to_all("endgame");
-	    playing_game = 0;
-	    return 1;
-	}
-	total = 0;
-	for (i = 0; i < 7; i++) {
-	    if (piecefreq[i])
-		memset(piecebuf+total, '1'+i, piecefreq[i]);
-	    total += piecefreq[i];
-	}
-	piecebuf[100] = 0;
-	if (total != 100) {
-	    send_to_all("plineact 0 cannot start game: Piece frequencies do not total 100 percent!");
-	    return 1;
-	}
-	total = 0;
-	for (i = 0; i < 9; i++) {
-	    if (specialfreq[i])
-		memset(specialbuf+total, '1'+i, specialfreq[i]);
-	    total += specialfreq[i];
-	}
-	specialbuf[100] = 0;
-	if (total != 100) {
-	    send_to_all("plineact 0 cannot start game: Special frequencies do not total 100 percent!");
+	    msg_send(room, msg_endgame(msg_start(room, ALL_PLAYERS)));
+	    room->playing_game = 0;
+	    memset(room->newgame_at, 0, sizeof(room->newgame_at));
+	    record_end(room->recorder);
 	    return 1;
 	}
-	playing_game = 1;
-	game_paused = 0;
-	for (i = 1; i <= 6; i++) {
-	    if (player_socks[i-1] < 0)
-		continue;
+	room->game_seed = rng_entropy();
+	/* The settings can change under us, so take a copy. */
+	pthread_mutex_lock(&global_lock);
+	if (piece_table.total != 100)
+	    error = "cannot start game: Piece frequencies do not total 100 percent!";
+	else if (special_table.total != 100)
+	    error = "cannot start game: Special frequencies do not total 100 percent!";
+	else
 	    /* XXX First parameter is stack height */
-	    send_to(i, "%s %d %d %d %d %d %d %d %s %s %d %d",
-			player_modes[i-1] ? "*******" : "newgame",
+	    snprintf(msg, sizeof(msg), linuxmode
+				? "%d %d %d %d %d %d %d %s %s %d %d %u"
+				: "%d %d %d %d %d %d %d %s %s %d %d",
 			0, initial_level, lines_per_level, level_inc,
 			special_lines, special_count, special_capacity,
-			piecebuf, specialbuf, level_average, old_mode);
+			piecebuf, specialbuf, level_average, old_mode,
+			room->game_seed);
+	pthread_mutex_unlock(&global_lock);
+	if (error) {
+	    msg_send(room, msg_plineact(msg_start(room, ALL_PLAYERS), 0, error));
+	    return 1;
 	}
-	memset(player_lost, 0, sizeof(player_lost));
+	room->playing_game = 1;
+	room->game_paused = 0;
+	start_game(room, msg);
+	memset(room->player_lost, 0, sizeof(room->player_lost));
+	if (room->recorder)
+	    record_game(room, msg);
 
     } else if (strcmp(cmd, "pause") == 0) {
-	if (!playing_game)
+	if (!room->playing_game)
 	    return 1;
-	s = strtok(NULL, " ");
+	s = strtok_r(NULL, " ", &save);
 	if (!s)
 	    return 1;
 	i = atoi(s);
 	if (i)
 	    i = 1;	/* to make sure it's not anything else */
-	if ((i && game_paused) || (!i && !game_paused))
+	if ((i && room->game_paused) || (!i && !room->game_paused))
 	    return 1;
-	game_paused = i;
-	send_to_all("pause %d", i);
+	room->game_paused = i;
+	msg_send(room, msg_pause(msg_start(room, ALL_PLAYERS), i));
 
     } else if (strcmp(cmd, "playerlost") == 0) {
-	if (!(s = strtok(NULL, " ")) || atoi(s) != player)
+	if (!(s = strtok_r(NULL, " ", &save)) || atoi(s) != player)
 	    return 1;
-	player_loses(player);
+	if (room->recorder) {
+	    record_line(room->recorder, room->msgbuf,
+			msg_playerlost(room->msgbuf, player) - 1);
+	}
+	player_loses(room, player);
 
     } else if (strcmp(cmd, "f") == 0) {   /* field */
-	if (!(s = strtok(NULL, " ")) || atoi(s) != player)
+	if (!(s = strtok_r(NULL, " ", &save)) || atoi(s) != player)
 	    return 1;
-	if (!(s = strtok(NULL, "")))
+	if (!(s = strtok_r(NULL, "", &save)))
 	    s = "";
-	send_to_all_but(player, "f %d %s", player, s);
+	if (room->recorder)
+	    update_field(&room->fields[player-1], s);
+	msg_send(room, msg_f(msg_start(room, OTHERS(player)), player, s));
+	atomic_add(&fields_relayed, 1);
 
     } else if (strcmp(cmd, "lvl") == 0) {
-	if (!(s = strtok(NULL, " ")) || atoi(s) != player)
+	if (!(s = strtok_r(NULL, " ", &save)) || atoi(s) != player)
 	    return 1;
-	if (!(s = strtok(NULL, " ")))
+	if (!(s = strtok_r(NULL, " ", &save)))
 	    return 1;
-	levels[player] = atoi(s);
-	send_to_all_but(player, "lvl %d %d", player, levels[player]);
+	room->levels[player-1] = atoi(s);
+	msg_send(room, msg_lvl(msg_start(room, OTHERS(player)), player,
+				room->levels[player-1]));
 
     } else if (strcmp(cmd, "sb") == 0) {
 	int from, to;
 	char *type;
 
-	if (!(s = strtok(NULL, " ")))
+	if (!(s = strtok_r(NULL, " ", &save)))
 	    return 1;
 	to = atoi(s);
-	if (!(type = strtok(NULL, " ")))
+	if (!(type = strtok_r(NULL, " ", &save)))
 	    return 1;
-	if (!(s = strtok(NULL, " ")))
+	if (!(s = strtok_r(NULL, " ", &save)))
 	    return 1;
 	from = atoi(s);
 	if (from != player)
 	    return 1;
-	if (to < 0 || to > 6 || player_socks[to-1] < 0 || player_lost[to-1])
+	if (to < 0 || to > 6 || (to > 0 && (room->player_socks[to-1] < 0
+					    || room->player_lost[to-1])))
 	    return 1;
 	if (to == 0)
-	    send_to_all_but_team(player, "sb %d %s %d", to, type, from);
+	    msg_start(room, room->not_team[player-1]);
 	else
-	    send_to_all_but(player, "sb %d %s %d", to, type, from);
+	    msg_start(room, OTHERS(player));
+	msg_send(room, msg_sb(room->msg, to, type, from));
 
     } else if (strcmp(cmd, "gmsg") == 0) {
-	if (!(s = strtok(NULL, "")))
+	if (!(s = strtok_r(NULL, "", &save)))
+	    return 1;
+	msg_send(room, msg_gmsg(msg_start(room, ALL_PLAYERS), s));
+
+    } else if (strcmp(cmd, "pong") == 0) {
+	if (!(s = strtok_r(NULL, " ", &save)) || atoi(s) != player)
 	    return 1;
-	send_to_all("gmsg %s", s);
+	if (!(s = strtok_r(NULL, " ", &save))
+	 || !(t = strtok_r(NULL, " ", &save)))
+	    return 1;
+	got_pong(room, player, atoi(s), atoi(t));
 
     } else {  /* unrecognized command */
 	return 0;
@@ -688,124 +1264,85 @@ newplayer:
 static void sigcatcher(int sig)
 {
     if (sig == SIGHUP) {
-	read_config();
+	reload = 1;
 	signal(SIGHUP, sigcatcher);
-	send_to_all("winlist %s", winlist_str());
     } else if (sig == SIGTERM || sig == SIGINT) {
 	quit = 1;
 	signal(sig, SIG_IGN);
     }
+    /* SIGCHLD just wakes up the parent of several server processes. */
 }
 
 /*************************************************************************/
 
-/* Returns 0 on success, desired program exit code on failure */
+/* Re-read the configuration file after a SIGHUP, and have every room send
+ * out the winlist.  With several processes, the parent has already read
+ * the shared winlist in again, and reading it once more in each process
+ * could undo a change saved in between, so only the settings are read. */
 
-static int init()
+static void reload_config(void)
+{
+    int i, with_winlist = (nprocs == 1);
+
+    if (with_winlist)
+	winlist_lock();
+    pthread_mutex_lock(&global_lock);
+    read_config(with_winlist);
+    update_freqs();
+    pthread_mutex_unlock(&global_lock);
+    if (with_winlist)
+	winlist_unlock();
+    for (i = 0; i < nrooms; i++) {
+	atomic_set(&rooms[i].send_winlist, 1);
+	sched_wake(&rooms[i].task);
+    }
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Wake the players the lobby has just given places to. */
+
+static void wake_given(LobbyEntry **given, int n)
 {
-    struct sockaddr_in sin;
-#ifdef HAVE_IPV6
-    struct sockaddr_in6 sin6;
-#endif
     int i;
 
-    /* Set up some sensible defaults */
-    *winlist[0].name = 0;
-    old_mode = 1;
-    initial_level = 1;
-    lines_per_level = 2;
-    level_inc = 1;
-    level_average = 1;
-    special_lines = 1;
-    special_count = 1;
-    special_capacity = 18;
-    piecefreq[0] = 14;
-    piecefreq[1] = 14;
-    piecefreq[2] = 15;
-    piecefreq[3] = 14;
-    piecefreq[4] = 14;
-    piecefreq[5] = 14;
-    piecefreq[6] = 15;
-    specialfreq[0] = 18;
-    specialfreq[1] = 18;
-    specialfreq[2] = 3;
-    specialfreq[3] = 12;
-    specialfreq[4] = 0;
-    specialfreq[5] = 16;
-    specialfreq[6] = 3;
-    specialfreq[7] = 12;
-    specialfreq[8] = 18;
+    for (i = 0; i < n; i++)
+	sched_wake(given[i]->task);
+}
 
-    /* (Try to) read the config file */
-    read_config();
+/*************************************************************************/
 
-    /* Catch some signals */
-    signal(SIGHUP, sigcatcher);
-    signal(SIGINT, sigcatcher);
-    signal(SIGTERM, sigcatcher);
+/* Drop a player from a room, closing their connection, and let the lobby
+ * have their place. */
 
-    /* Set up a listen socket */
-    if (!ipv6_only)
-	listen_sock = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_sock >= 0){
-	i = 1;
-	if (setsockopt(listen_sock,SOL_SOCKET,SO_REUSEADDR,&i,sizeof(i))==0) {
-	    memset(&sin, 0, sizeof(sin));
-	    sin.sin_family = AF_INET;
-	    sin.sin_port = htons(31457);
-	    if (bind(listen_sock, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
-		if (listen(listen_sock, 5) == 0) {
-		    goto ipv4_success;
-		}
-	    }
+static void drop_player(Room *room, int i)
+{
+    LobbyEntry *given[LOBBY_ROOM_SIZE];
+    int s = room->player_socks[i];
+
+    reactor_close(s < 0 ? ~s - 1 : s);
+    room->player_socks[i] = -1;
+    room->inlen[i] = 0;
+    room->pingable &= ~PLAYER(i+1);
+    room->rtt[i] = 0;
+    room->newgame_at[i] = 0;
+    if (room->players[i]) {
+	msg_send(room, msg_playerleave(msg_start(room, ALL_PLAYERS), i+1));
+	if (room->playing_game)
+	    player_loses(room, i+1);
+	free(room->players[i]);
+	room->players[i] = NULL;
+	if (room->teams[i]) {
+	    free(room->teams[i]);
+	    room->teams[i] = NULL;
+	    update_teams(room);
 	}
-	i = errno;
-	close(listen_sock);
-	errno = i;
-	listen_sock = -1;
     }
-  ipv4_success:
+    wake_given(given, lobby_release(room - rooms, given));
+}
 
-#ifdef HAVE_IPV6
-    /* Set up an IPv6 listen socket if possible */
-    listen_sock6 = socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-    if (listen_sock6 >= 0) {
-	i = 1;
-	if (setsockopt(listen_sock6,SOL_SOCKET,SO_REUSEADDR,&i,sizeof(i))==0) {
-	    memset(&sin6, 0, sizeof(sin6));
-	    sin6.sin6_family = AF_INET6;
-	    sin6.sin6_port = htons(31457);
-	    if (bind(listen_sock6,(struct sockaddr *)&sin6,sizeof(sin6))==0) {
-		if (listen(listen_sock6, 5) == 0) {
-		    goto ipv6_success;
-		}
-	    }
-	}
-	i = errno;
-	close(listen_sock6);
-	errno = i;
-	listen_sock6 = -1;
-    }
-  ipv6_success:
-#else  /* !HAVE_IPV6 */
-    if (ipv6_only) {
-	fprintf(stderr,"ipv6_only specified but IPv6 support not available\n");
-	return 1;
-    }
-#endif  /* HAVE_IPV6 */
-
-    if (listen_sock < 0
-#ifdef HAVE_IPV6
-     && listen_sock6 < 0
-#endif
-    ) {
-	return 1;
-    }
-
-    return 0;
-}
-
-/*************************************************************************/
+/*************************************************************************/
 
 static void
 decrypt_message(char *buf, char *newbuf, char *iphashbuf)
@@ -826,178 +1363,776 @@ decrypt_message(char *buf, char *newbuf, char *iphashbuf)
     newbuf[j/2-1] = 0;
 }
 
-static void check_sockets()
+/*************************************************************************/
+/*************************************************************************/
+
+/* Put a newcomer back in the free list, once its connection has gone to a
+ * room or been closed.  in_room is left as it is until accept_player()
+ * reuses the entry, so that a stale wake can't take it for a newcomer
+ * still reading. */
+
+static void free_newcomer(Newcomer *nc)
 {
-    fd_set fds;
-    int i, fd, maxfd;
+    pthread_mutex_lock(&newcomer_lock);
+    nc->fd = -1;
+    nc->next_free = free_newcomers;
+    free_newcomers = nc;
+    pthread_mutex_unlock(&newcomer_lock);
+}
 
-    FD_ZERO(&fds);
-    if (listen_sock >= 0)
-	FD_SET(listen_sock, &fds);
-    maxfd = listen_sock;
-#ifdef HAVE_IPV6
-    if (listen_sock6 >= 0)
-	FD_SET(listen_sock6, &fds);
-    if (listen_sock6 > maxfd)
-	maxfd = listen_sock6;
-#endif
-    for (i = 0; i < 6; i++) {
-	if (player_socks[i] != -1) {
-	    if (player_socks[i] < 0)
-		fd = (~player_socks[i]) - 1;
-	    else
-		fd = player_socks[i];
-	    FD_SET(fd, &fds);
-	    if (fd > maxfd)
-		maxfd = fd;
-	}
-    }
+/* Close a newcomer's connection, giving up their place in the lobby. */
 
-    if (select(maxfd+1, &fds, NULL, NULL, NULL) <= 0)
-	return;
+static void drop_newcomer(Newcomer *nc)
+{
+    LobbyEntry *given[LOBBY_ROOM_SIZE];
 
-    if (listen_sock >= 0 && FD_ISSET(listen_sock, &fds)) {
-	struct sockaddr_in sin;
-	int len = sizeof(sin);
-	fd = accept(listen_sock, (struct sockaddr *)&sin, &len);
-	if (fd >= 0) {
-	    for (i = 0; i < 6 && player_socks[i] != -1; i++)
-		;
-	    if (i == 6) {
-		sockprintf(fd, "noconnecting Too many players on server!");
-		close(fd);
-	    } else {
-		player_socks[i] = ~(fd+1);
-		memcpy(player_ips[i], &sin.sin_addr, 4);
-	    }
-	}
-    } /* if (FD_ISSET(listen_sock)) */
+    if (nc->logged_in)
+	wake_given(given, lobby_cancel(&nc->entry, given));
+    reactor_close(nc->fd);
+    free_newcomer(nc);
+}
 
-#ifdef HAVE_IPV6
-    if (listen_sock6 >= 0 && FD_ISSET(listen_sock6, &fds)) {
-	struct sockaddr_in6 sin6;
-	int len = sizeof(sin6);
-	fd = accept(listen_sock6, (struct sockaddr *)&sin6, &len);
-	if (fd >= 0) {
-	    for (i = 0; i < 6 && player_socks[i] != -1; i++)
-		;
-	    if (i == 6) {
-		sockprintf(fd, "noconnecting Too many players on server!");
-		close(fd);
-	    } else {
-		player_socks[i] = ~(fd+1);
-		memcpy(player_ips[i], (char *)(&sin6.sin6_addr)+12, 4);
+/*************************************************************************/
+
+/* Return whether @buf starts like a login line. */
+
+static int is_login(const char *buf)
+{
+    return strncmp(buf, "tetrisstart ", 12) == 0
+	|| strncmp(buf, "tetrifaster ", 12) == 0;
+}
+
+/* Return the lobby key for a player logging in as @nick: their game mode,
+ * and which skill bucket their winlist points put them in.  Bucket 0 is
+ * for players not on the winlist (or with no points), then 1 for 1 point,
+ * 2 for 2-3, 3 for 4-7 and so on, with the last taking everyone above.
+ */
+
+static int lobby_key(const char *nick, int tetrifast)
+{
+    WinInfo winlist[MAXWINLIST];
+    int i, points, bucket = 0;
+
+    if (skill_buckets > 1) {
+	winlist_copy(winlist);
+	for (i = 0; i < MAXWINLIST && *winlist[i].name; i++) {
+	    if (!winlist[i].team && strcasecmp(winlist[i].name, nick) == 0)
+		break;
+	}
+	if (i < MAXWINLIST && *winlist[i].name) {
+	    points = winlist[i].points;
+	    while (points > 0 && bucket < skill_buckets-1) {
+		bucket++;
+		points >>= 1;
 	    }
 	}
-    } /* if (FD_ISSET(listen_sock6)) */
-#endif
+    }
+    return tetrifast * skill_buckets + bucket;
+}
 
-    for (i = 0; i < 6; i++) {
-	char buf[1024];
+/* Decrypt a newcomer's login line, the first @len bytes of its buffer
+ * (followed by 0xFF), in place.  Return the player's lobby key, or -1 if
+ * it isn't a login line.
+ */
 
-	if (player_socks[i] == -1)
-	    continue;
-	if (player_socks[i] < 0)
-	    fd = (~player_socks[i]) - 1;
-	else
-	    fd = player_socks[i];
-	if (!FD_ISSET(fd, &fds))
-	    continue;
-	sgets(buf, sizeof(buf), fd);
-
-	if (player_socks[i] < 0) {
-	    /* Our extension: the client can give up on the meaningless
-	     * encryption completely. */
-	    if (strncmp(buf,"tetrisstart ",12) != 0) {
-		/* Messy decoding stuff */
-		char iphashbuf[16], newbuf[1024];
-		unsigned char *ip;
+static int newcomer_login(Newcomer *nc, int len)
+{
+    char *buf = nc->buf, nick[sizeof(((WinInfo *)0)->name)];
+    int n;
+
+    buf[len] = 0;
+    /* Our extension: the client can give up on the meaningless
+     * encryption completely. */
+    if (!is_login(buf)) {
+	/* Messy decoding stuff */
+	char iphashbuf[16], newbuf[1024];
+	unsigned char *ip = nc->ip;
 #ifndef NO_BRUTE_FORCE_DECRYPTION
-		int hashval;
+	int hashval;
 #endif
 
-		if (strlen(buf) < 2*13) {  /* "tetrisstart " + initial byte */
-		    close(fd);
-		    player_socks[i] = -1;
-		    continue;
-		}
+	if (len < 2*13)  /* "tetrisstart " + initial byte */
+	    return -1;
 
-		ip = player_ips[i];
-		sprintf(iphashbuf, "%d",
-			ip[0]*54 + ip[1]*41 + ip[2]*29 + ip[3]*17);
-		decrypt_message(buf, newbuf, iphashbuf);
-		if(strncmp(newbuf,"tetrisstart ",12) == 0)
-		    goto cryptok;
+	sprintf(iphashbuf, "%d", ip[0]*54 + ip[1]*41 + ip[2]*29 + ip[3]*17);
+	decrypt_message(buf, newbuf, iphashbuf);
+	if (is_login(newbuf))
+	    goto cryptok;
 
 #ifndef NO_BRUTE_FORCE_DECRYPTION
-		/* The IP-based crypt does not work for clients behind NAT. So
-		 * help them by brute-forcing the crypt. This should not be
-		 * even noticeable unless you are running this under ucLinux on
-		 * some XT machine. */
-		for (hashval = 0; hashval < 35956; hashval++) {
-		    sprintf(iphashbuf, "%d", hashval);
-		    decrypt_message(buf, newbuf, iphashbuf);
-		    if(strncmp(newbuf,"tetrisstart ",12) == 0)
-			goto cryptok;
-		} /* for (hashval) */
+	/* The IP-based crypt does not work for clients behind NAT. So
+	 * help them by brute-forcing the crypt. This should not be
+	 * even noticeable unless you are running this under ucLinux on
+	 * some XT machine. */
+	for (hashval = 0; hashval < 35956; hashval++) {
+	    sprintf(iphashbuf, "%d", hashval);
+	    decrypt_message(buf, newbuf, iphashbuf);
+	    if (is_login(newbuf))
+		goto cryptok;
+	} /* for (hashval) */
 #endif
 
-		if (strncmp(newbuf, "tetrisstart ", 12) != 0) {
-		    close(fd);
-		    player_socks[i] = -1;
-		    continue;
-		}
+	return -1;
 
 cryptok:
-		/* Buffers should be the same size, but let's be paranoid */
-		strncpy(buf, newbuf, sizeof(buf));
-		buf[sizeof(buf)-1] = 0;
-	    } /* if encrypted */
-	    player_socks[i] = fd;  /* Has now registered */
-	} /* if client not registered */
-
-	if (!server_parse(i+1, buf)) {
-	    close(fd);
-	    player_socks[i] = -1;
-	    if (players[i]) {
-		send_to_all("playerleave %d", i+1);
-		if (playing_game)
-		    player_loses(i+1);
-		free(players[i]);
-		players[i] = NULL;
-		if (teams[i]) {
-		    free(teams[i]);
-		    teams[i] = NULL;
-		}
+	/* The decrypted line is half the length of the original; move
+	 * whatever was sent after it up behind it. */
+	n = strlen(newbuf);
+	memcpy(buf, newbuf, n+1);
+	memmove(buf+n+1, buf+len+1, nc->len - (len+1));
+	nc->len -= len - n;
+	len = n;
+    } /* if encrypted */
+
+    n = strcspn(buf+12, " ");
+    if (n >= sizeof(nick))
+	n = sizeof(nick) - 1;
+    memcpy(nick, buf+12, n);
+    nick[n] = 0;
+    buf[len] = 0xFF;
+    return lobby_key(nick, buf[5] == 'f');
+}
+
+/*************************************************************************/
+
+/* Run a newcomer: read their login line, ask the lobby for a place, and
+ * once they have one, hand them over to their room.  While they wait they
+ * are only watched for going away (or sending far too much).
+ */
+
+static void newcomer_run(SchedTask *task)
+{
+    Newcomer *nc = (Newcomer *) task;
+    int fd, n, key;
+    char *end;
+    Room *room;
+
+    /* The reactor may still wake us after we have gone to a room or been
+     * put back in the free list, so check both together. */
+    pthread_mutex_lock(&newcomer_lock);
+    fd = nc->in_room ? -1 : nc->fd;
+    pthread_mutex_unlock(&newcomer_lock);
+    if (fd < 0)
+	return;  /* Already finished with */
+    for (;;) {
+	n = reactor_recv(fd, nc->buf + nc->len, sizeof(nc->buf) - nc->len);
+	if (n < 0)
+	    break;  /* Wait for more */
+	if (n == 0 || (nc->len += n) == sizeof(nc->buf)) {
+	    drop_newcomer(nc);
+	    return;
+	}
+	if (!nc->logged_in && (end = memchr(nc->buf, 0xFF, nc->len))) {
+	    if ((key = newcomer_login(nc, end - nc->buf)) < 0) {
+		drop_newcomer(nc);
+		return;
 	    }
+	    nc->logged_in = 1;
+	    lobby_join(&nc->entry, key);
 	}
-    } /* for each player socket */
+    }
+    if (!nc->logged_in || (n = atomic_get(&nc->entry.room)) < 0)
+	return;
+
+    /* The room frees us once it has taken everything over, so nothing
+     * here can be touched afterwards.  If handing the connection over
+     * fails, the room will find that out when it reads from it. */
+    pthread_mutex_lock(&newcomer_lock);
+    nc->in_room = 1;
+    pthread_mutex_unlock(&newcomer_lock);
+    room = &rooms[n];
+    reactor_give(fd, &room->task);
+    pthread_mutex_lock(&room->lock);
+    room->incoming[room->nincoming++] = nc;
+    pthread_mutex_unlock(&room->lock);
+    sched_wake(&room->task);
 }
 
 /*************************************************************************/
 
-#ifdef SERVER_ONLY
-int main()
+/* Handle a line from the player in slot @i of a room.  Return 1 if the
+ * player is still connected afterwards, 0 if they were dropped.
+ */
+
+static int player_line(Room *room, int i, char *buf)
+{
+    int s = room->player_socks[i];
+
+    if (log)
+	netlog_record(NETLOG_RECV, s < 0 ? ~s - 1 : s, buf, strlen(buf));
+    if (s < 0)  /* The login line, decrypted by newcomer_run() */
+	room->player_socks[i] = ~s - 1;  /* Registered */
+
+    if (!server_parse(room, i+1, buf)) {
+	drop_player(room, i);
+	return 0;
+    }
+    if (record_keyframe_due(room->recorder))
+	record_state(room);
+    return 1;
+}
+
+/*************************************************************************/
+
+/* Read and handle everything the player in slot @i of a room has sent,
+ * starting with anything already in their input buffer. */
+
+static void read_player(Room *room, int i)
+{
+    char *buf = room->inbuf[i], *line, *end;
+    int s, n;
+
+    for (;;) {
+	line = buf;
+	while ((end = memchr(line, 0xFF, buf + room->inlen[i] - line))) {
+	    *end = 0;
+	    if (!player_line(room, i, line))
+		return;
+	    line = end+1;
+	}
+	n = buf + room->inlen[i] - line;
+	if (n == sizeof(room->inbuf[i])) {
+	    /* Too long to be a real line; just take what we have, like
+	     * sgets() would. */
+	    buf[n-1] = 0;
+	    if (!player_line(room, i, buf))
+		return;
+	    n = 0;
+	}
+	memmove(buf, line, n);
+	room->inlen[i] = n;
+
+	s = room->player_socks[i];
+	n = reactor_recv(s < 0 ? ~s - 1 : s, buf + room->inlen[i],
+			 sizeof(room->inbuf[i]) - room->inlen[i]);
+	if (n < 0)
+	    return;
+	if (n == 0) {
+	    drop_player(room, i);
+	    return;
+	}
+	room->inlen[i] += n;
+    }
+}
+
+/*************************************************************************/
+
+/* Send everything the room has to say to its players. */
+
+static void room_flush(Room *room)
+{
+    int i, s;
+
+    for (i = 0; i < 6; i++) {
+	if ((s = room->player_socks[i]) != -1)
+	    reactor_flush(s < 0 ? ~s - 1 : s);
+    }
+}
+
+/*************************************************************************/
+
+/* Tell the query port how many players the room has and what it's doing,
+ * if that has changed. */
+
+static void update_query(Room *room)
+{
+    int i, n = 0, state;
+
+    for (i = 0; i < 6; i++) {
+	if (room->players[i])
+	    n++;
+    }
+    state = !room->playing_game ? QUERY_IDLE
+	  : room->game_paused ? QUERY_PAUSED : QUERY_PLAYING;
+    if (n != room->query_players || state != room->query_state) {
+	room->query_players = n;
+	room->query_state = state;
+	query_room(room->id, n, state);
+    }
+}
+
+/*************************************************************************/
+
+/* Run a room: take over any newly connected players, deal with whatever
+ * all of its players have sent and anything its timer was for, and send
+ * out the replies.  We may only be woken once for several lines of input,
+ * so each player's is read dry.
+ */
+
+static void room_run(SchedTask *task)
+{
+    Room *room = (Room *) task;
+    Newcomer *incoming[6];
+    int i, j, n;
+    char buf[1024];
+
+    pthread_mutex_lock(&room->lock);
+    n = room->nincoming;
+    memcpy(incoming, room->incoming, n * sizeof(*incoming));
+    room->nincoming = 0;
+    pthread_mutex_unlock(&room->lock);
+    for (j = 0; j < n; j++) {
+	for (i = 0; i < 6 && room->player_socks[i] != -1; i++)
+	    ;
+	room->player_socks[i] = ~(incoming[j]->fd+1);
+	memcpy(room->inbuf[i], incoming[j]->buf, incoming[j]->len);
+	room->inlen[i] = incoming[j]->len;
+	free_newcomer(incoming[j]);
+    }
+
+    if (atomic_swap(&room->send_winlist, 0))
+	msg_send(room, msg_winlist(msg_start(room, ALL_PLAYERS),
+				   winlist_str(buf, sizeof(buf))));
+
+    for (i = 0; i < 6; i++) {
+	if (room->player_socks[i] != -1)
+	    read_player(room, i);
+    }
+    run_timers(room);
+    update_query(room);
+    room_flush(room);
+}
+
+/*************************************************************************/
+
+/* Set up an empty room. */
+
+static void room_init(Room *room)
+{
+    int i;
+
+    memset(room, 0, sizeof(*room));
+    room->task.run = room_run;
+    for (i = 0; i < 6; i++)
+	room->player_socks[i] = -1;
+    update_teams(room);
+    pthread_mutex_init(&room->lock, NULL);
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Set up the settings and the winlist.  Returns 0 on success, desired
+ * program exit code on failure. */
+
+static int init()
+{
+    sigset_t sigs;
+
+    /* Set up some sensible defaults */
+    old_mode = 1;
+    initial_level = 1;
+    lines_per_level = 2;
+    level_inc = 1;
+    level_average = 1;
+    special_lines = 1;
+    special_count = 1;
+    special_capacity = 18;
+    piecefreq[0] = 14;
+    piecefreq[1] = 14;
+    piecefreq[2] = 15;
+    piecefreq[3] = 14;
+    piecefreq[4] = 14;
+    piecefreq[5] = 14;
+    piecefreq[6] = 15;
+    specialfreq[0] = 18;
+    specialfreq[1] = 18;
+    specialfreq[2] = 3;
+    specialfreq[3] = 12;
+    specialfreq[4] = 0;
+    specialfreq[5] = 16;
+    specialfreq[6] = 3;
+    specialfreq[7] = 12;
+    specialfreq[8] = 18;
+
+    /* (Try to) read the config file, into a winlist shared with any other
+     * server processes we start */
+    if (winlist_init() < 0) {
+	perror("mmap()");
+	return 1;
+    }
+    read_config(1);
+    started = 1;
+    update_freqs();
+    field_init();
+    if (query_port && query_init(nprocs * nrooms) < 0) {
+	perror("mmap()");
+	return 1;
+    }
+
+    /* Catch some signals.  They are only let through while we're waiting
+     * for something to happen, so that the worker threads never see them
+     * and the main loop always notices them. */
+    signal(SIGHUP, sigcatcher);
+    signal(SIGINT, sigcatcher);
+    signal(SIGTERM, sigcatcher);
+    signal(SIGCHLD, sigcatcher);
+    /* A player going away shows up as an error reading or writing. */
+    signal(SIGPIPE, SIG_IGN);
+    sigemptyset(&sigs);
+    sigaddset(&sigs, SIGHUP);
+    sigaddset(&sigs, SIGINT);
+    sigaddset(&sigs, SIGTERM);
+    sigaddset(&sigs, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &sigs, &wait_sigs);
+
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Take a newly accepted connection, which finds itself a room once the
+ * player has logged in. */
+
+static void accept_player(int fd)
+{
+#ifdef HAVE_IPV6
+    struct sockaddr_in6 sa;
 #else
-int server_main()
+    struct sockaddr_in sa;
+#endif
+    socklen_t len = sizeof(sa);
+    Newcomer *nc;
+
+    if (getpeername(fd, (struct sockaddr *)&sa, &len) < 0) {
+	close(fd);
+	return;
+    }
+    pthread_mutex_lock(&newcomer_lock);
+    if ((nc = free_newcomers))
+	free_newcomers = nc->next_free;
+    pthread_mutex_unlock(&newcomer_lock);
+    if (!nc) {
+	if (!(nc = calloc(1, sizeof(*nc)))) {
+	    close(fd);
+	    return;
+	}
+	nc->task.run = newcomer_run;
+	nc->entry.task = &nc->task;
+    }
+#ifdef HAVE_IPV6
+    if (((struct sockaddr *)&sa)->sa_family == AF_INET6)
+	memcpy(nc->ip, (char *)(&sa.sin6_addr)+12, 4);
+    else
+#endif
+	memcpy(nc->ip, &((struct sockaddr_in *)&sa)->sin_addr, 4);
+    pthread_mutex_lock(&newcomer_lock);
+    nc->len = nc->logged_in = nc->in_room = 0;
+    nc->fd = fd;
+    pthread_mutex_unlock(&newcomer_lock);
+    if (reactor_add(fd, &nc->task) < 0) {
+	close(fd);
+	free_newcomer(nc);
+    }
+}
+
+/*************************************************************************/
+
+/* Open a socket of the given address family listening on @port.  Return
+ * the socket, or -1 on failure (with errno set). */
+
+static int open_listener(int family, int port)
+{
+    struct sockaddr_in sin;
+#ifdef HAVE_IPV6
+    struct sockaddr_in6 sin6;
+#endif
+    struct sockaddr *sa = (struct sockaddr *)&sin;
+    socklen_t len = sizeof(sin);
+    int sock, i = 1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_port = htons(port);
+#ifdef HAVE_IPV6
+    if (family == AF_INET6) {
+	memset(&sin6, 0, sizeof(sin6));
+	sin6.sin6_family = AF_INET6;
+	sin6.sin6_port = htons(port);
+	sa = (struct sockaddr *)&sin6;
+	len = sizeof(sin6);
+    }
 #endif
+    if ((sock = socket(family, SOCK_STREAM, IPPROTO_TCP)) < 0)
+	return -1;
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &i, sizeof(i)) == 0
+     && (nprocs == 1 || setsockopt(sock, SOL_SOCKET, SO_REUSEPORT,
+				   &i, sizeof(i)) == 0)
+     && bind(sock, sa, len) == 0
+     && listen(sock, SOMAXCONN) == 0) {
+	return sock;
+    }
+    i = errno;
+    close(sock);
+    errno = i;
+    return -1;
+}
+
+/*************************************************************************/
+
+/* Set up this process's listen sockets, rooms and worker threads.  When
+ * there are several server processes, each has its own listen sockets
+ * bound to the same port with SO_REUSEPORT, and the kernel shares new
+ * connections out between them.  Returns 0 on success, desired program
+ * exit code on failure.
+ */
+
+static int start_server()
 {
     int i;
 
-    if ((i = init()) != 0)
+    /* Set up the listen sockets, IPv6 if possible */
+    if (!ipv6_only)
+	listen_sock = open_listener(AF_INET, 31457);
+#ifdef HAVE_IPV6
+    listen_sock6 = open_listener(AF_INET6, 31457);
+#else  /* !HAVE_IPV6 */
+    if (ipv6_only) {
+	fprintf(stderr,"ipv6_only specified but IPv6 support not available\n");
+	return 1;
+    }
+#endif  /* HAVE_IPV6 */
+
+    if (listen_sock < 0
+#ifdef HAVE_IPV6
+     && listen_sock6 < 0
+#endif
+    ) {
+	return 1;
+    }
+
+    if (query_port) {
+	if (!ipv6_only)
+	    query_sock = open_listener(AF_INET, query_port);
+#ifdef HAVE_IPV6
+	query_sock6 = open_listener(AF_INET6, query_port);
+#endif
+	if (query_sock < 0
+#ifdef HAVE_IPV6
+	 && query_sock6 < 0
+#endif
+	) {
+	    perror("queryport");
+	}
+    }
+
+    /* Watch the listen sockets; player sockets are added as they connect,
+     * to wake their room. */
+    i = reactor_init(use_uring ? REACTOR_URING : REACTOR_EPOLL);
+    if (i < 0) {
+	perror("reactor_init()");
+	return 1;
+    }
+    if (use_uring && i != REACTOR_URING)
+	fprintf(stderr, "io_uring not available, using %s\n", reactor_name());
+    if (listen_sock >= 0)
+	reactor_listen(listen_sock, accept_player);
+    if (query_sock >= 0)
+	reactor_listen(query_sock, query_accept);
+#ifdef HAVE_IPV6
+    if (listen_sock6 >= 0)
+	reactor_listen(listen_sock6, accept_player);
+    if (query_sock6 >= 0)
+	reactor_listen(query_sock6, query_accept);
+#endif
+    if ((i = timer_init()) < 0 || reactor_timer(i, timer_run) < 0) {
+	perror("timer_init()");
+	return 1;
+    }
+
+    /* Set up the rooms, the lobby which finds players places in them
+     * (with a key for each game mode and skill bucket), and the threads
+     * to run them */
+    if (!(rooms = malloc(nrooms * sizeof(*rooms)))
+     || lobby_init(nrooms, 2 * skill_buckets) < 0) {
+	perror("malloc()");
+	return 1;
+    }
+    for (i = 0; i < nrooms; i++) {
+	room_init(&rooms[i]);
+	/* If we're taking over from a process which crashed, its rooms
+	 * have been emptied. */
+	rooms[i].id = proc_num * nrooms + i;
+	update_query(&rooms[i]);
+    }
+    if (record_dir) {
+	if (record_init(record_dir, keyframe_secs) < 0) {
+	    perror(record_dir);
+	} else {
+	    for (i = 0; i < nrooms; i++)
+		rooms[i].recorder = record_new(i+1);
+	}
+    }
+    if (sched_start(nthreads) < 0) {
+	perror("sched_start()");
+	return 1;
+    }
+
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Run a server process until we're told to quit. */
+
+static int serve()
+{
+    int i, j;
+
+    /* Before the worker threads start, so they see it's open. */
+    if (log_file) {
+	if (netlog_open(log_file) == 0)
+	    log = 1;
+	else
+	    perror(log_file);
+    }
+    if ((i = start_server()) != 0)
 	return i;
-    while (!quit)
-	check_sockets();
-    write_config();
+    while (!quit) {
+	reactor_wait(&wait_sigs);
+	if (reload) {
+	    reload = 0;
+	    reload_config();
+	}
+    }
+    sched_stop();
+    record_stop();
+    netlog_close();
+    /* Other processes may still be saving theirs. */
+    winlist_lock();
+    winlist_save();
     if (listen_sock >= 0)
 	close(listen_sock);
+    if (query_sock >= 0)
+	close(query_sock);
 #ifdef HAVE_IPV6
     if (listen_sock6 >= 0)
 	close(listen_sock6);
+    if (query_sock6 >= 0)
+	close(query_sock6);
 #endif
-    for (i = 0; i < 6; i++)
-	close(player_socks[i]);
+    for (i = 0; i < nrooms; i++) {
+	for (j = 0; j < 6; j++) {
+	    int s = rooms[i].player_socks[j];
+	    if (s != -1)
+		disconn(s < 0 ? ~s - 1 : s);
+	}
+    }
+    if (stats) {
+	fprintf(stderr, "%s: %ld field updates relayed, %ld system calls"
+		" for network I/O\n", reactor_name(), fields_relayed,
+		reactor_syscalls);
+	if (pongs) {
+	    fprintf(stderr, "%ld pings answered, average round trip %.1f ms\n",
+		    pongs, pong_usec / 1000.0 / pongs);
+	}
+	if (query_port)
+	    fprintf(stderr, "%ld queries answered\n", queries_answered);
+	fprintf(stderr, "%ld players waited in the lobby\n", lobby_waited);
+    }
     return 0;
 }
 
 /*************************************************************************/
+
+/* Start server process number @num.  Return its process ID, or 0 on
+ * failure. */
+
+static pid_t spawn(int num)
+{
+    pid_t pid = fork();
+
+    if (pid < 0) {
+	perror("fork()");
+	return 0;
+    } else if (pid == 0) {
+	signal(SIGCHLD, SIG_DFL);
+	proc_num = num;
+	exit(serve());
+    }
+    return pid;
+}
+
+/*************************************************************************/
+
+/* Run nprocs server processes, passing on signals to them and replacing
+ * any which crash, until they have all exited.  Return the exit code of
+ * the last one to fail, or 0.
+ */
+
+static int prefork()
+{
+    pid_t *pids, pid;
+    int i, n, status, killed = 0, exitcode = 0;
+
+    if (!(pids = calloc(nprocs, sizeof(*pids)))) {
+	perror("calloc()");
+	return 1;
+    }
+    for (i = 0; i < nprocs; i++)
+	pids[i] = spawn(i);
+    for (;;) {
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+	    for (i = 0; i < nprocs && pids[i] != pid; i++)
+		;
+	    if (i == nprocs)
+		continue;
+	    pids[i] = 0;
+	    if (WIFSIGNALED(status) && !quit) {
+		fprintf(stderr, "Server process %d killed by signal %d,"
+			" restarting\n", (int) pid, WTERMSIG(status));
+		pids[i] = spawn(i);
+	    } else if (WIFEXITED(status) && WEXITSTATUS(status)) {
+		exitcode = WEXITSTATUS(status);
+	    }
+	}
+	for (i = n = 0; i < nprocs; i++) {
+	    if (pids[i])
+		n++;
+	}
+	if (!n)
+	    break;
+	if (quit && !killed) {
+	    for (i = 0; i < nprocs; i++) {
+		if (pids[i])
+		    kill(pids[i], SIGTERM);
+	    }
+	    killed = 1;
+	}
+	if (reload) {
+	    /* Re-read the settings here too, so that a process started to
+	     * replace one which crashed gets the current ones. */
+	    reload = 0;
+	    winlist_lock();
+	    read_config(1);
+	    winlist_unlock();
+	    update_freqs();
+	    for (i = 0; i < nprocs; i++) {
+		if (pids[i])
+		    kill(pids[i], SIGHUP);
+	    }
+	}
+	sigsuspend(&wait_sigs);
+    }
+    free(pids);
+    return exitcode;
+}
+
+/*************************************************************************/
+
+#ifdef SERVER_ONLY
+int main()
+#else
+int server_main()
+#endif
+{
+    int i;
+
+    if ((i = init()) != 0)
+	return i;
+    if (nprocs > 1)
+	return prefork();
+    return serve();
+}
+
+/*************************************************************************/
@@ -1,7 +1,7 @@
 #ifndef SERVER_H
 #define SERVER_H
 
-extern void read_config(void);
+extern void read_config(int with_winlist);
 extern void write_config(void);
 extern int server_main(void);
 
@@ -4,7 +4,6 @@
  * Socket routines.
  */
 
-#include <stdarg.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
@@ -12,115 +11,147 @@
 #include <netdb.h>
 #include <netinet/in.h>
 #include <sys/socket.h>
-#include <sys/time.h>
 #include <unistd.h>
 #include <string.h>
+#include "netlog.h"
 #include "sockets.h"
 #include "tetrinet.h"
 
-static FILE *logfile;
-
 /*************************************************************************/
 
-static int lastchar = EOF;
+/* Input buffers, one per socket, so that we can read whatever the other
+ * side has sent with one system call and hand it out a line at a time.
+ * sockbufs[] is indexed by file descriptor and grows as needed.
+ */
+
+#define SOCKBUF_SIZE	4096
+
+typedef struct {
+    int pos, len;	/* Next unread byte and end of data in data[] */
+    unsigned char data[SOCKBUF_SIZE];
+} SockBuf;
+
+static SockBuf **sockbufs;
+static int sockbufs_size;
+
+/* Return the buffer for a socket, creating it if necessary. */
+
+static SockBuf *get_sockbuf(int s)
+{
+    if (s >= sockbufs_size) {
+	int newsize = s+16;
+	SockBuf **new = realloc(sockbufs, newsize * sizeof(*sockbufs));
+	if (!new)
+	    return NULL;
+	memset(new+sockbufs_size, 0,
+	       (newsize-sockbufs_size) * sizeof(*sockbufs));
+	sockbufs = new;
+	sockbufs_size = newsize;
+    }
+    if (!sockbufs[s] && (sockbufs[s] = malloc(sizeof(SockBuf))) != NULL)
+	sockbufs[s]->pos = sockbufs[s]->len = 0;
+    return sockbufs[s];
+}
+
+/* Refill an empty buffer from its socket.  Return the number of bytes
+ * read, or 0 (with the buffer still empty) on error or end of file. */
+
+static int fill_sockbuf(SockBuf *b, int s)
+{
+    int n = read(s, b->data, sizeof(b->data));
+
+    b->pos = 0;
+    b->len = n>0 ? n : 0;
+    return b->len;
+}
+
+/*************************************************************************/
 
 int sgetc(int s)
 {
-    int c;
-    char ch;
+    SockBuf *b = get_sockbuf(s);
 
-    if (lastchar != EOF) {
-	c = lastchar;
-	lastchar = EOF;
-	return c;
-    }
-    if (read(s, &ch, 1) != 1)
+    if (!b || (b->pos >= b->len && !fill_sockbuf(b, s)))
 	return EOF;
-    c = ch & 0xFF;
-    return c;
+    return b->data[b->pos++];
 }
 
 int sungetc(int c, int s)
 {
-    return lastchar = c;
+    SockBuf *b = get_sockbuf(s);
+
+    if (!b || b->pos == 0)
+	return EOF;
+    b->data[--b->pos] = c;
+    return c;
 }
 
 /*************************************************************************/
 
-/* Read a string, stopping with (and discarding) 0xFF as line terminator.
- * If connection was broken, return NULL.
+/* Return whether a complete line from the given socket is waiting in its
+ * buffer, so that sgets() can return it without blocking.  Callers which
+ * wait for sockets to become readable must check this too, since data
+ * already buffered will not make the socket readable again.
  */
 
-char *sgets(char *buf, int len, int s)
+int spending(int s)
 {
-    int c;
-    unsigned char *ptr = (unsigned char *) buf;
+    SockBuf *b;
 
-    if (len == 0)
-	return NULL;
-    c = sgetc(s);
-    while (--len && (*ptr++ = c) != 0xFF && (c = sgetc(s)) >= 0)
-	;
-    if (c < 0)
-	return NULL;
-    if (c == 0xFF)
-	ptr--;
-    *ptr = 0;
-    if (log) {
-	if (!logfile)
-	    logfile = fopen(logname, "a");
-	if (logfile) {
-	    struct timeval tv;
-	    gettimeofday(&tv, NULL);
-	    fprintf(logfile, "[%d.%03d] <<< %s\n",
-			(int) tv.tv_sec, (int) tv.tv_usec/1000, buf);
-	    fflush(logfile);
-	}
-    }
-    return buf;
+    if (s < 0 || s >= sockbufs_size || !(b = sockbufs[s]))
+	return 0;
+    return memchr(b->data + b->pos, 0xFF, b->len - b->pos) != NULL;
 }
 
 /*************************************************************************/
 
-/* Adds a 0xFF line terminator. */
+/* Read a string, stopping with (and discarding) 0xFF as line terminator.
+ * If connection was broken, return NULL.
+ */
 
-int sputs(const char *str, int s)
+char *sgets(char *buf, int len, int s)
 {
-    unsigned char c = 0xFF;
-    int n = 0;
-
-    if (log) {
-	if (!logfile)
-	    logfile = fopen(logname, "a");
-	if (logfile) {
-	    struct timeval tv;
-	    gettimeofday(&tv, NULL);
-	    fprintf(logfile, "[%d.%03d] >>> %s\n",
-			(int) tv.tv_sec, (int) tv.tv_usec/1000, str);
+    SockBuf *b = get_sockbuf(s);
+    unsigned char *ptr = (unsigned char *) buf, *start, *end;
+    int n;
+
+    if (len == 0 || !b)
+	return NULL;
+    while (--len) {
+	if (b->pos >= b->len && !fill_sockbuf(b, s))
+	    return NULL;
+	start = b->data + b->pos;
+	n = b->len - b->pos;
+	end = memchr(start, 0xFF, n);
+	if (end)
+	    n = end - start;
+	if (n > len)
+	    n = len;
+	memcpy(ptr, start, n);
+	ptr += n;
+	len -= n-1;
+	b->pos += n;
+	if (end && start+n == end) {
+	    b->pos++;	/* Skip the terminator */
+	    break;
 	}
     }
-    if (*str != 0) {
-	n = write(s, str, strlen(str));
-	if (n <= 0)
-	    return n;
-    }
-    if (write(s, &c, 1) <= 0)
-	return n;
-    return n+1;
+    *ptr = 0;
+    if (log)
+	netlog_record(NETLOG_RECV, s, buf, (char *) ptr - buf);
+    return buf;
 }
 
 /*************************************************************************/
 
-/* Adds a 0xFF line terminator. */
+/* Send a line of @len bytes which already has its 0xFF terminator, as
+ * built by the msg_*() encoders.  Returns the number of bytes written. */
 
-int sockprintf(int s, const char *fmt, ...)
+int sputline(const char *buf, int len, int s)
 {
-    va_list args;
-    char buf[16384];	/* Really huge, to try and avoid truncation */
-
-    va_start(args, fmt);
-    vsnprintf(buf, sizeof(buf), fmt, args);
-    return sputs(buf, s);
+    if (log)
+	netlog_record(NETLOG_SEND, s, buf, len-1);
+    return write(s, buf, len);
 }
 
 /*************************************************************************/
@@ -200,6 +231,10 @@ void disconn(int s)
 {
     shutdown(s, 2);
     close(s);
+    if (s >= 0 && s < sockbufs_size) {
+	free(sockbufs[s]);
+	sockbufs[s] = NULL;
+    }
 }
 
 /*************************************************************************/
@@ -9,9 +9,9 @@
 
 extern int sgetc(int s);
 extern int sungetc(int c, int s);
+extern int spending(int s);
 extern char *sgets(char *buf, int len, int s);
-extern int sputs(const char *buf, int len);
-extern int sockprintf(int s, const char *fmt, ...);
+extern int sputline(const char *buf, int len, int s);
 extern int conn(const char *host, int port, char ipbuf[4]);
 extern void disconn(int s);
 
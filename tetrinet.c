@@ -13,9 +13,13 @@
 #include <errno.h>
 #include "tetrinet.h"
 #include "io.h"
+#include "event.h"
 #include "server.h"
+#include "msg.h"
+#include "netlog.h"
 #include "sockets.h"
 #include "tetris.h"
+#include "field.h"
 #include "version.h"
 
 /*************************************************************************/
@@ -27,6 +31,13 @@ int windows_mode = 0;	/* Try to be just like the Windows version? */
 int noslide = 0;	/* Disallow piece sliding? */
 int tetrifast = 0;	/* TetriFast mode? */
 int cast_shadow = 1;	/* Make pieces cast shadow? */
+int max_latency = 10;	/* Milliseconds to spend on server input before
+			 * updating the screen */
+int max_fps = 30;	/* Maximum screen updates per second (0 = no limit) */
+int show_stats = 0;	/* Print drawing statistics on exit? */
+int scrollback = 1000;	/* Messages to keep in each text buffer */
+int esc_delay = 100;	/* Milliseconds to wait for the rest of an escape
+			 * sequence */
 
 int my_playernum = -1;	/* What player number are we? */
 char *my_nick;		/* And what is our nick? */
@@ -35,6 +46,7 @@ int server_sock;	/* Socket for server communication */
 int dispmode;		/* Current display mode */
 char *players[6];	/* Player names (NULL for no such player) */
 char *teams[6];		/* Team names (NULL for not on a team) */
+int team_ids[6];	/* Team of each player (0 for none); see intern_teams() */
 int playing_game;	/* Are we currently playing a game? */
 int not_playing_game;	/* Are we currently watching people play a game? */
 int game_paused;	/* Is the game currently paused? */
@@ -44,65 +56,40 @@ Interface *io;		/* Input/output routines */
 /*************************************************************************/
 /*************************************************************************/
 
+/* Give each player in @teams a small team ID in @ids, so that teammates
+ * can be found by comparing integers: 0 for a player not on a team, or
+ * else the number (1-6) of the first player on the same team.  Team names
+ * are compared without regard to case.  Call this whenever a team changes.
+ */
+
+void intern_teams(char * const *teams, int *ids)
+{
+    int i, j;
+
+    for (i = 0; i < 6; i++) {
+	ids[i] = 0;
+	if (!teams[i])
+	    continue;
+	for (j = 0; j < i; j++) {
+	    if (teams[j] && strcasecmp(teams[i], teams[j]) == 0)
+		break;
+	}
+	ids[i] = j < i ? ids[j] : i+1;
+    }
+}
+
+/*************************************************************************/
+
 #ifndef SERVER_ONLY
 
 /*************************************************************************/
 
-/* Output message to a message buffer, possibly decoding the text attributes
- * tetrinet code. */
+/* Output message to a message buffer.  Any TetriNET text attribute codes
+ * in the message are decoded by the frontend when it draws the text. */
 
 void msg_text(int bufnum, const unsigned char *s)
 {
-    /* Stolen from gtetrinet: (leading space <=> undefined) */
-    static enum tattr map[32] = {
-	 0, /* N/A */
-	 TATTR_CBLACK,
-	TATTR_BOLD,
-	TATTR_CCYAN | TATTR_CXBRIGHT,
-	TATTR_CBLACK,
-	TATTR_CBLUE | TATTR_CXBRIGHT,
-	TATTR_CGREY,
-	 TATTR_CBLACK,
-	TATTR_CMAGENTA,
-	 TATTR_CBLACK,
-	 TATTR_CBLACK,
-	TATTR_CBLACK | TATTR_CXBRIGHT,
-	TATTR_CGREEN,
-	 TATTR_CBLACK,
-	TATTR_CGREEN | TATTR_CXBRIGHT,
-	TATTR_CGREY,
-	TATTR_CRED,
-	TATTR_CBLUE,
-	TATTR_CBROWN,
-	TATTR_CMAGENTA | TATTR_CXBRIGHT,
-	TATTR_CRED | TATTR_CXBRIGHT,
-	TATTR_CGREY,
-	TATTR_ITALIC,
-	TATTR_CCYAN,
-	TATTR_CGREY | TATTR_CXBRIGHT,
-	TATTR_CBROWN | TATTR_CXBRIGHT,
-	 TATTR_CBLACK,
-	 TATTR_CBLACK,
-	 TATTR_CBLACK,
-	 TATTR_CBLACK,
-	 TATTR_CBLACK,
-	TATTR_UNDERLINE,
-    };
-    unsigned char tb[1024], *t;
-
-    for (t = tb; *s && t - tb < 1024; t++, s++) {
-	if (*s == 0xFF) {
-	    *t = TATTR_RESET + 1;
-	} else if (*s < 32) {
-	    *t = map[(int) *s] + 1;
-	} else {
-	    *t = *s;
-	}
-    }
-    if (t - tb >= 1024) t = &tb[1023];
-    *t = 0;
-
-    io->draw_text(bufnum, tb);
+    io->draw_text(bufnum, (const char *) s);
 }
 
 
@@ -174,6 +161,7 @@ void parse(char *buf)
 	if (teams[player]) {
 	    free(teams[player]);
 	    teams[player] = NULL;
+	    intern_teams(teams, team_ids);
 	}
 	snprintf(buf, sizeof(buf), "*** %s is Now Playing", t);
 	msg_text(BUFFER_PLINE, buf);
@@ -214,6 +202,7 @@ void parse(char *buf)
 	    teams[player] = strdup(t);
 	else
 	    teams[player] = NULL;
+	intern_teams(teams, team_ids);
 	if (t)
 	    snprintf(buf, sizeof(buf), "*** %s is Now on Team %s", players[player], t);
 	else
@@ -304,10 +293,16 @@ void parse(char *buf)
 	    level_average = atoi(s);
 	if ((s = strtok(NULL, " ")))
 	    old_mode = atoi(s);
+	/* Servers in Linux mode also send the game's random seed. */
+	if ((s = strtok(NULL, " ")))
+	    seed_game(strtoul(s, NULL, 10));
+	else
+	    seed_game(rng_entropy());
 	lines = 0;
 	for (i = 0; i < 6; i++)
 	    levels[i] = initial_level;
 	memset(&fields[my_playernum-1], 0, sizeof(Field));
+	mark_dirty(my_playernum, ALL_ROWS);
 	specials[0] = -1;
 	io->clear_text(BUFFER_GMSG);
 	io->clear_text(BUFFER_ATTDEF);
@@ -325,15 +320,16 @@ void parse(char *buf)
 	int x, y;
 	char buf[1024], *s;
 
-	s = buf + sprintf(buf, "f %d ", my_playernum);
 	for (y = 0; y < FIELD_HEIGHT; y++) {
-	    for (x = 0; x < FIELD_WIDTH; x++) {
-		fields[my_playernum-1][y][x] = rand()%5 + 1;
-		*s++ = '0' + fields[my_playernum-1][y][x];
-	    }
+	    for (x = 0; x < FIELD_WIDTH; x++)
+		fields[my_playernum-1][y][x] = rng_range(&game_rng, 5) + 1;
 	}
-	*s = 0;
-	sputs(buf, server_sock);
+	s = msg_put_int(msg_put_str(buf, "f "), my_playernum);
+	*s++ = ' ';
+	field_encode(&fields[my_playernum-1], s);
+	s += FIELD_CELLS;
+	mark_dirty(my_playernum, ALL_ROWS);
+	sputline(buf, msg_end(buf, s), server_sock);
 	playing_game = 0;
 	not_playing_game = 1;
 
@@ -349,14 +345,17 @@ void parse(char *buf)
 	}
 
     } else if (strcmp(cmd, "endgame") == 0) {
+	int i;
+
 	playing_game = 0;
 	not_playing_game = 0;
 	memset(fields, 0, sizeof(fields));
+	for (i = 1; i <= 6; i++)
+	    mark_dirty(i, ALL_ROWS);
 	specials[0] = -1;
 	io->clear_text(BUFFER_ATTDEF);
 	msg_text(BUFFER_PLINE, "*** The Game Has Ended");
 	if (dispmode == MODE_FIELDS) {
-	    int i;
 	    io->draw_own_field();
 	    for (i = 1; i <= 6; i++) {
 		if (i != my_playernum)
@@ -391,24 +390,12 @@ void parse(char *buf)
 	    return;
 	if (*s >= '0') {
 	    /* Set field directly */
-	    char *ptr = (char *) fields[player];
-	    while (*s) {
-		if (*s <= '5')
-		    *ptr++ = (*s++) - '0';
-		else switch (*s++) {
-		    case 'a': *ptr++ = 6 + SPECIAL_A; break;
-		    case 'b': *ptr++ = 6 + SPECIAL_B; break;
-		    case 'c': *ptr++ = 6 + SPECIAL_C; break;
-		    case 'g': *ptr++ = 6 + SPECIAL_G; break;
-		    case 'n': *ptr++ = 6 + SPECIAL_N; break;
-		    case 'o': *ptr++ = 6 + SPECIAL_O; break;
-		    case 'q': *ptr++ = 6 + SPECIAL_Q; break;
-		    case 'r': *ptr++ = 6 + SPECIAL_R; break;
-		    case 's': *ptr++ = 6 + SPECIAL_S; break;
-		}
-	    }
+	    field_decode(&fields[player], s);
+	    mark_dirty(player+1, ALL_ROWS);
 	} else {
 	    /* Set specific locations on field */
+	    int rows = 0;
+
 	    tile = 0;
 	    while (*s) {
 		if (*s < '0') {
@@ -417,9 +404,11 @@ void parse(char *buf)
 		    x = *s - '3';
 		    y = (*++s) - '3';
 		    fields[player][y][x] = tile;
+		    rows |= ROW(y);
 		}
 		s++;
 	    }
+	    mark_dirty(player+1, rows);
 	}
 	if (player == my_playernum-1)
 	    io->draw_own_field();
@@ -454,6 +443,19 @@ void parse(char *buf)
 	    return;
 	msg_text(BUFFER_GMSG, s);
 
+    } else if (strcmp(cmd, "ping") == 0) {
+	/* Our extension: answer at once, with the time on our clock. */
+	char msg[MSG_MAX];
+	struct timespec ts;
+	long long ms;
+
+	if (!(s = strtok(NULL, " ")))
+	    return;
+	clock_gettime(CLOCK_REALTIME, &ts);
+	ms = (long long) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+	sputline(msg, msg_pong(msg, my_playernum, atoi(s),
+			       (int) (ms & 0x7FFFFFFF)), server_sock);
+
     }
 }
 
@@ -542,40 +544,45 @@ void partyline_move(int how)
 
 void partyline_enter(void)
 {
-    char buf[1024];
+    char buf[1024], msg[MSG_MAX];
 
     if (*partyline_buffer) {
 	if (strncasecmp(partyline_buffer, "/me ", 4) == 0) {
-	    sockprintf(server_sock, "plineact %d %s", my_playernum, partyline_buffer+4);
+	    sputline(msg, msg_plineact(msg, my_playernum, partyline_buffer+4),
+		     server_sock);
 	    snprintf(buf, sizeof(buf), "* %s %s", players[my_playernum-1], partyline_buffer+4);
 	    msg_text(BUFFER_PLINE, buf);
 	} else if (strcasecmp(partyline_buffer, "/start") == 0) {
-	    sockprintf(server_sock, "startgame 1 %d", my_playernum);
+	    sputline(msg, msg_startgame(msg, 1, my_playernum), server_sock);
 	} else if (strcasecmp(partyline_buffer, "/end") == 0) {
-	    sockprintf(server_sock, "startgame 0 %d", my_playernum);
+	    sputline(msg, msg_startgame(msg, 0, my_playernum), server_sock);
 	} else if (strcasecmp(partyline_buffer, "/pause") == 0) {
-	    sockprintf(server_sock, "pause 1 %d", my_playernum);
+	    sputline(msg, msg_pause_from(msg, 1, my_playernum), server_sock);
 	} else if (strcasecmp(partyline_buffer, "/unpause") == 0) {
-	    sockprintf(server_sock, "pause 0 %d", my_playernum);
+	    sputline(msg, msg_pause_from(msg, 0, my_playernum), server_sock);
 	} else if (strncasecmp(partyline_buffer, "/team", 5) == 0) {
 	    if (strlen(partyline_buffer) == 5)
 		strcpy(partyline_buffer+5, " ");  /* make it "/team " */
-	    sockprintf(server_sock, "team %d %s", my_playernum, partyline_buffer+6);
+	    sputline(msg, msg_team(msg, my_playernum, partyline_buffer+6),
+		     server_sock);
 	    if (partyline_buffer[6]) {
 		if (teams[my_playernum-1])
 		    free(teams[my_playernum-1]);
 		teams[my_playernum-1] = strdup(partyline_buffer+6);
+		intern_teams(teams, team_ids);
 		snprintf(buf, sizeof(buf), "*** %s is Now on Team %s", players[my_playernum-1], partyline_buffer+6);
 		msg_text(BUFFER_PLINE, buf);
 	    } else {
 		if (teams[my_playernum-1])
 		    free(teams[my_playernum-1]);
 		teams[my_playernum-1] = NULL;
+		intern_teams(teams, team_ids);
 		snprintf(buf, sizeof(buf), "*** %s is Now Alone", players[my_playernum-1]);
 		msg_text(BUFFER_PLINE, buf);
 	    }
 	} else {
-	    sockprintf(server_sock, "pline %d %s", my_playernum, partyline_buffer);
+	    sputline(msg, msg_pline(msg, my_playernum, partyline_buffer),
+		     server_sock);
 	    if (*partyline_buffer != '/'
 		|| partyline_buffer[1] == 0 || partyline_buffer[1] == ' ') {
 		/* We do not show server-side commands. */
@@ -602,12 +609,25 @@ void help()
 "Usage: tetrinet [OPTION]... NICK SERVER\n"
 "\n"
 "Options (see README for details):\n"
+"  -ansi        Draw the screen with ANSI escape sequences instead of\n"
+"               curses.\n"
+"  -escdelay <ms>\n"
+"               Wait up to <ms> milliseconds after the Escape key for the\n"
+"               rest of a function key's code (default 100).\n"
 "  -fancy       Use \"fancy\" TTY graphics.\n"
 "  -fast        Connect to the server in the tetrifast mode.\n"
+"  -fps <n>     Update the screen at most <n> times a second, except in\n"
+"               response to keys (default 30; 0 means no limit).\n"
+"  -latency <ms>\n"
+"               Update the screen at least every <ms> milliseconds while\n"
+"               handling a burst of server messages (default 10).\n"
 "  -log <file>  Log network traffic to the given file.\n"
 "  -noshadow    Do not make the pieces cast shadow.\n"
 "  -noslide     Do not allow pieces to \"slide\" after being dropped\n"
 "               with the spacebar.\n"
+"  -scrollback <n>\n"
+"               Remember the last <n> messages in each text window\n"
+"               (default 1000).\n"
 "  -server      Start the server instead of the client.\n"
 "  -shadow      Make the pieces cast shadow. Can speed up gameplay\n"
 "               considerably, but it can be considered as cheating by\n"
@@ -615,6 +635,7 @@ void help()
 "  -slide       Opposite of -noslide; allows pieces to \"slide\" after\n"
 "               being dropped.  If both -slide and -noslide are given,\n"
 "               -slide takes precedence.\n"
+"  -stats       Print screen drawing statistics on exit.\n"
 "  -windows     Behave as much like the Windows version of Tetrinet as\n"
 "               possible. Implies -noslide and -noshadow.\n"
 	   );
@@ -643,8 +664,9 @@ int init(int ac, char **av)
 	io = &tty_interface; */
     io=&tty_interface;  /* because Xwin isn't done yet */
 
-    srand(time(NULL));
+    seed_game(rng_entropy());
     init_shapes();
+    field_init();
 
     for (i = 1; i < ac; i++) {
 	if (*av[i] == '-') {
@@ -653,8 +675,31 @@ int init(int ac, char **av)
 		start_server = 1;
 	    } else
 #endif
-	    if (strcmp(av[i], "-fancy") == 0) {
+	    if (strcmp(av[i], "-ansi") == 0) {
+		io = &ansi_interface;
+	    } else if (strcmp(av[i], "-escdelay") == 0) {
+		i++;
+		if (i >= ac) {
+		    fprintf(stderr, "Option -escdelay requires an argument\n");
+		    return 1;
+		}
+		esc_delay = atoi(av[i]);
+	    } else if (strcmp(av[i], "-fancy") == 0) {
 		fancy = 1;
+	    } else if (strcmp(av[i], "-fps") == 0) {
+		i++;
+		if (i >= ac) {
+		    fprintf(stderr, "Option -fps requires an argument\n");
+		    return 1;
+		}
+		max_fps = atoi(av[i]);
+	    } else if (strcmp(av[i], "-latency") == 0) {
+		i++;
+		if (i >= ac) {
+		    fprintf(stderr, "Option -latency requires an argument\n");
+		    return 1;
+		}
+		max_latency = atoi(av[i]);
 	    } else if (strcmp(av[i], "-log") == 0) {
 		log = 1;
 		i++;
@@ -663,12 +708,21 @@ int init(int ac, char **av)
 		    return 1;
 		}
 		logname = av[i];
+	    } else if (strcmp(av[i], "-scrollback") == 0) {
+		i++;
+		if (i >= ac) {
+		    fprintf(stderr, "Option -scrollback requires an argument\n");
+		    return 1;
+		}
+		scrollback = atoi(av[i]);
 	    } else if (strcmp(av[i], "-noslide") == 0) {
 		noslide = 1;
 	    } else if (strcmp(av[i], "-noshadow") == 0) {
 		cast_shadow = 0;
 	    } else if (strcmp(av[i], "-shadow") == 0) {
 		cast_shadow = 1;
+	    } else if (strcmp(av[i], "-stats") == 0) {
+		show_stats = 1;
 	    } else if (strcmp(av[i], "-slide") == 0) {
 		slide = 1;
 	    } else if (strcmp(av[i], "-windows") == 0) {
@@ -704,12 +758,19 @@ int init(int ac, char **av)
     if (strlen(nick) > 63)  /* put a reasonable limit on nick length */
 	nick[63] = 0;
 
+    if (log && netlog_open(logname) < 0) {
+	fprintf(stderr, "Couldn't open log file %s: %s\n",
+		logname, strerror(errno));
+	log = 0;
+    }
     if ((server_sock = conn(server, 31457, ip)) < 0) {
 	fprintf(stderr, "Couldn't connect to server %s: %s\n",
 		server, strerror(errno));
 	return 1;
     }
-    sprintf(nickmsg, "tetri%s %s 1.13", tetrifast ? "faster" : "sstart", nick);
+    /* "ping" asks for our ping extension; other servers ignore it. */
+    sprintf(nickmsg, "tetri%s %s 1.13 ping", tetrifast ? "faster" : "sstart",
+	    nick);
     sprintf(iphashbuf, "%d", ip[0]*54 + ip[1]*41 + ip[2]*29 + ip[3]*17);
     /* buf[0] does not need to be initialized for this algorithm */
     len = strlen(nickmsg);
@@ -718,7 +779,7 @@ int init(int ac, char **av)
     len++;
     for (i = 0; i < len; i++)
 	sprintf(nickmsg+i*2, "%02X", buf[i] & 0xFF);
-    sputs(nickmsg, server_sock);
+    sputline(nickmsg, msg_end(nickmsg, nickmsg+len*2), server_sock);
 
     do {
 	if (!sgets(buf, sizeof(buf), server_sock)) {
@@ -728,7 +789,13 @@ int init(int ac, char **av)
 	}
 	parse(buf);
     } while (my_playernum < 0);
-    sockprintf(server_sock, "team %d ", my_playernum);
+    sputline(buf, msg_team(buf, my_playernum, ""), server_sock);
+
+    if (event_init() < 0) {
+	perror("Couldn't set up event loop");
+	disconn(server_sock);
+	return 1;
+    }
 
     players[my_playernum-1] = strdup(nick);
     dispmode = MODE_PARTYLINE;
@@ -740,74 +807,123 @@ int init(int ac, char **av)
 
 /*************************************************************************/
 
+/* Handle the lines the server has sent us, until we run out or until
+ * max_latency milliseconds have passed, whichever comes first; anything
+ * left over is handled on the next pass through the main loop.  Return 0
+ * if the server closed the connection, else 1.
+ */
+
+static int read_server(void)
+{
+    char buf[1024];
+    struct timespec start, now;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+	if (!sgets(buf, sizeof(buf), server_sock)) {
+	    msg_text(BUFFER_PLINE, "*** Disconnected from Server");
+	    return 0;
+	}
+	parse(buf);
+	if (!spending(server_sock))
+	    break;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+    } while ((now.tv_sec - start.tv_sec) * 1000
+	     + (now.tv_nsec - start.tv_nsec) / 1000000 < max_latency);
+    return 1;
+}
+
+/*************************************************************************/
+
+/* Handle a keystroke.  Return 0 if the user asked to quit, else 1. */
+
+static int handle_key(int c)
+{
+    if (c == 12) {  /* Ctrl-L */
+	io->screen_redraw();
+    } else if (c == K_F10) {
+	return 0;
+    } else if (c == K_F1) {
+	if (dispmode != MODE_FIELDS) {
+	    dispmode = MODE_FIELDS;
+	    io->setup_fields();
+	}
+    } else if (c == K_F2) {
+	if (dispmode != MODE_PARTYLINE) {
+	    dispmode = MODE_PARTYLINE;
+	    io->setup_partyline();
+	}
+    } else if (c == K_F3) {
+	if (dispmode != MODE_WINLIST) {
+	    dispmode = MODE_WINLIST;
+	    io->setup_winlist();
+	}
+    } else if (dispmode == MODE_FIELDS) {
+	tetris_input(c);
+    } else if (dispmode == MODE_PARTYLINE) {
+	if (c == 8 || c == 127)   /* Backspace or Delete */
+	    partyline_backspace();
+	else if (c == 4)    /* Ctrl-D */
+	    partyline_delete();
+	else if (c == 21)   /* Ctrl-U */
+	    partyline_kill();
+	else if (c == '\r' || c == '\n')
+	    partyline_enter();
+	else if (c == K_LEFT)
+	    partyline_move(-1);
+	else if (c == K_RIGHT)
+	    partyline_move(1);
+	else if (c == 1)    /* Ctrl-A */
+	    partyline_move(-2);
+	else if (c == 5)    /* Ctrl-E */
+	    partyline_move(2);
+	else if (c == K_PGUP)
+	    io->scroll_text(BUFFER_PLINE, 1);
+	else if (c == K_PGDN)
+	    io->scroll_text(BUFFER_PLINE, -1);
+	else if (c >= 1 && c <= 0xFF)
+	    partyline_input(c);
+    }
+    return 1;
+}
+
+/*************************************************************************/
+
 int main(int ac, char **av)
 {
-    int i;
+    int i, ready;
 
     if ((i = init(ac, av)) != 0)
 	return i;
 
     for (;;) {
-	int timeout;
-	if (playing_game && !game_paused)
-	    timeout = tetris_timeout();
-	else
-	    timeout = -1;
-	i = io->wait_for_input(timeout);
-	if (i == -1) {
-	    char buf[1024];
-	    if (sgets(buf, sizeof(buf), server_sock))
-		parse(buf);
-	    else {
-		msg_text(BUFFER_PLINE, "*** Disconnected from Server");
+	ready = io->wait_for_input(playing_game && !game_paused
+				   ? tetris_deadline() : NULL);
+
+	/* Apply everything that's waiting, then update the screen once. */
+	io->screen_hold();
+	if (ready & INPUT_SERVER) {
+	    if (!read_server())
 		break;
+	}
+	if (ready & INPUT_KEY) {
+	    while ((i = io->read_key()) >= 0) {
+		if (!handle_key(i))
+		    break;
 	    }
-	} else if (i == -2) {
-	    tetris_timeout_action();
-	} else if (i == 12) {  /* Ctrl-L */
-	    io->screen_redraw();
-	} else if (i == K_F10) {
-	    break;  /* out of main loop */
-	} else if (i == K_F1) {
-	    if (dispmode != MODE_FIELDS) {
-		dispmode = MODE_FIELDS;
-		io->setup_fields();
-	    }
-	} else if (i == K_F2) {
-	    if (dispmode != MODE_PARTYLINE) {
-		dispmode = MODE_PARTYLINE;
-		io->setup_partyline();
-	    }
-	} else if (i == K_F3) {
-	    if (dispmode != MODE_WINLIST) {
-		dispmode = MODE_WINLIST;
-		io->setup_winlist();
-	    }
-	} else if (dispmode == MODE_FIELDS) {
-	    tetris_input(i);
-	} else if (dispmode == MODE_PARTYLINE) {
-	    if (i == 8 || i == 127)   /* Backspace or Delete */
-		partyline_backspace();
-	    else if (i == 4)    /* Ctrl-D */
-		partyline_delete();
-	    else if (i == 21)   /* Ctrl-U */
-		partyline_kill();
-	    else if (i == '\r' || i == '\n')
-		partyline_enter();
-	    else if (i == K_LEFT)
-		partyline_move(-1);
-	    else if (i == K_RIGHT)
-		partyline_move(1);
-	    else if (i == 1)    /* Ctrl-A */
-		partyline_move(-2);
-	    else if (i == 5)    /* Ctrl-E */
-		partyline_move(2);
-	    else if (i >= 1 && i <= 0xFF)
-		partyline_input(i);
+	    if (i >= 0)
+		break;  /* out of main loop */
 	}
+	/* Other events may have paused the game or moved the deadline. */
+	if ((ready & INPUT_TIMER) && playing_game && !game_paused
+	 && tetris_timeout() == 0)
+	    tetris_timeout_action();
+	io->screen_flush(ready & INPUT_KEY);
     }
+    io->screen_flush(1);
 
     disconn(server_sock);
+    netlog_close();
     return 0;
 }
 
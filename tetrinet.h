@@ -64,6 +64,8 @@ typedef struct {
 #define K_F10		0x10D
 #define K_F11		0x10E
 #define K_F12		0x10F
+#define K_PGUP		0x110
+#define K_PGDN		0x111
 
 /* For function keys that don't correspond to something above, i.e. that we
  * don't care about: */
@@ -80,6 +82,11 @@ extern int windows_mode;
 extern int noslide;
 extern int tetrifast;
 extern int cast_shadow;
+extern int max_latency;
+extern int max_fps;
+extern int show_stats;
+extern int esc_delay;
+extern int scrollback;
 
 extern int my_playernum;
 extern WinInfo winlist[MAXWINLIST];
@@ -87,12 +94,15 @@ extern int server_sock;
 extern int dispmode;
 extern char *players[6];
 extern char *teams[6];
+extern int team_ids[6];
 extern int playing_game;
 extern int not_playing_game;
 extern int game_paused;
 
 extern Interface *io;
 
+extern void intern_teams(char * const *teams, int *ids);
+
 /*************************************************************************/
 
 #endif
@@ -7,16 +7,20 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
 #include "tetrinet.h"
 #include "tetris.h"
+#include "field.h"
 #include "io.h"
+#include "msg.h"
 #include "sockets.h"
 
 /*************************************************************************/
 
 int piecefreq[7];	/* Frequency (percentage) for each block type */
 int specialfreq[9];	/* Frequency for each special type */
+FreqTable piece_table;	/* piecefreq[] as a lookup table */
+FreqTable special_table; /* specialfreq[] as a lookup table */
 int old_mode;		/* Old mode? (i.e. Gameboy-style) */
 int initial_level;	/* Initial level */
 int lines_per_level;	/* Number of lines per level-up */
@@ -28,11 +32,13 @@ int special_capacity;	/* Capacity of special block inventory */
 
 Field fields[6];	/* Current field states */
 int levels[6];		/* Current levels */
+int dirty_rows[6];	/* Rows of each field changed since it was drawn */
 int lines;		/* Lines completed (by us) */
 signed char specials[MAX_SPECIALS] = {-1}; /* Special block inventory */
 int next_piece;		/* Next piece to fall */
+Rng game_rng;		/* Random numbers for this game */
 
-static struct timeval timeout;	/* Time of next action */
+static struct timespec timeout;	/* Time of next action (monotonic) */
 int current_piece;	/* Current piece number */
 int current_rotation;	/* Current rotation value */
 int current_x;		/* Current X position */
@@ -43,10 +49,58 @@ static int last_special;	/* Last line for which we added a special */
 
 /*************************************************************************/
 
+/* Expand @n frequencies into a lookup table.  If they add up to less than
+ * 100, the last entry gets the remaining slots, as it did when pieces were
+ * chosen by walking the frequency list; any excess is ignored.  Either way
+ * table->total records the real sum, so callers can reject bad settings.
+ */
+
+void build_freq_table(FreqTable *table, const int *freq, int n)
+{
+    int i, total = 0, len;
+
+    for (i = 0; i < n; i++) {
+	len = freq[i] > 0 ? freq[i] : 0;
+	if (total < 100)
+	    memset(table->slot + total, i, len < 100-total ? len : 100-total);
+	total += len;
+    }
+    if (total < 100)
+	memset(table->slot + total, n-1, 100-total);
+    table->total = total;
+}
+
+/* Rebuild both tables after piecefreq[] or specialfreq[] changes.  This
+ * must be done before a game starts. */
+
+void build_freq_tables(void)
+{
+    build_freq_table(&piece_table, piecefreq, 7);
+    build_freq_table(&special_table, specialfreq, 9);
+}
+
+/*************************************************************************/
+
 #ifndef SERVER_ONLY
 
 /*************************************************************************/
 
+static int send_dirty;	/* Rows of our field changed since it was sent */
+
+/* Record that the given rows of a player's field have changed, so that
+ * the frontend and send_field() only need to look at those rows.  Every
+ * change to a field must go through here.
+ */
+
+void mark_dirty(int player, int rows)
+{
+    dirty_rows[player-1] |= rows;
+    if (player == my_playernum)
+	send_dirty |= rows;
+}
+
+/*************************************************************************/
+
 /* The array of piece shapes.  It is organized as:
  *	- 7 pieces
  *	  - 4 rows
@@ -193,18 +247,62 @@ int get_shape(int piece, int rotation, char buf[4][4])
 /*************************************************************************/
 /*************************************************************************/
 
-/* Return the number of milliseconds of delay between piece drops for the
+static int delays[101];	/* Drop delay in microseconds for each level */
+
+/* Fill in the delay table.  Each level is 69/70 as slow as the one before,
+ * rounded to the millisecond at each step as the original client did.
+ */
+
+static void init_delays(void)
+{
+    int level, delay = 1000;
+
+    for (level = 1; level <= 100; level++) {
+	delays[level] = delay * 1000;
+	delay = (delay*69+35)/70;   /* multiply by 69/70 and round */
+    }
+}
+
+/*************************************************************************/
+
+/* Return the number of microseconds of delay between piece drops for the
  * current level.
  */
 
 static int level_delay()
 {
     int level = levels[my_playernum-1];
-    int delay = 1000;
 
-    while (--level)
-	delay = (delay*69+35)/70;   /* multiply by 69/70 and round */
-    return delay;
+    if (level < 1)
+	level = 1;
+    else if (level > 100)
+	level = 100;
+    return delays[level];
+}
+
+/*************************************************************************/
+
+/* Set the time of the next action to @usec microseconds after @base, or to
+ * the current time if @base is NULL.  If that time has already passed, we
+ * are running late; schedule the action for now rather than trying to
+ * catch up with a burst of drops.
+ */
+
+static void set_timeout(const struct timespec *base, int usec)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    timeout = base ? *base : now;
+    timeout.tv_sec += usec / 1000000;
+    timeout.tv_nsec += (long)(usec % 1000000) * 1000;
+    if (timeout.tv_nsec >= 1000000000) {
+	timeout.tv_sec++;
+	timeout.tv_nsec -= 1000000000;
+    }
+    if (timeout.tv_sec < now.tv_sec
+     || (timeout.tv_sec == now.tv_sec && timeout.tv_nsec < now.tv_nsec))
+	timeout = now;
 }
 
 /*************************************************************************/
@@ -255,7 +353,7 @@ static void draw_piece(int draw)
     int x = current_x - piecedata[current_piece][current_rotation].hot_x;
     int y = current_y - piecedata[current_piece][current_rotation].hot_y;
     char *shape = (char *) piecedata[current_piece][current_rotation].shape;
-    int i, j;
+    int i, j, rows = 0;
 
     for (j = 0; j < 4; j++) {
 	if (y+j < 0) {
@@ -263,10 +361,13 @@ static void draw_piece(int draw)
 	    continue;
 	}
 	for (i = 0; i < 4; i++) {
-	    if (*shape++)
+	    if (*shape++) {
 		(*f)[y+j][x+i] = c;
+		rows |= ROW(y+j);
+	    }
 	}
     }
+    mark_dirty(my_playernum, rows);
 }
 
 /*************************************************************************/
@@ -276,7 +377,7 @@ static void draw_piece(int draw)
 static int clear_lines(int add_specials)
 {
     Field *f = &fields[my_playernum-1];
-    int x, y, count = 0, i, j, k;
+    int x, y, count = 0, i, j, k, rows = 0;
     int new_specials[9];
 
     for (y = 0; y < FIELD_HEIGHT; y++) {
@@ -308,8 +409,10 @@ static int clear_lines(int add_specials)
 	    if (y > 0)
 		memmove((*f)[1], (*f)[0], FIELD_WIDTH*y);
 	    memset((*f)[0], 0, FIELD_WIDTH);
+	    rows |= ROW(y+1) - 1;	/* This row and everything above it */
 	}
     }
+    mark_dirty(my_playernum, rows);
 
     if (add_specials) {
 	int pos = 0;
@@ -318,7 +421,7 @@ static int clear_lines(int add_specials)
 	for (i = 0; i < count && pos < special_capacity; i++) {
 	    for (j = 0; j < 9 && pos < special_capacity; j++) {
 		for (k = 0; k < new_specials[j] && pos < special_capacity; k++){
-		    if (windows_mode && rand()%2) {
+		    if (windows_mode && rng_range(&game_rng, 2)) {
 			memmove(specials+1, specials, pos);
 			specials[0] = j;
 			pos++;
@@ -345,7 +448,7 @@ static int clear_lines(int add_specials)
 static void place_specials(int num)
 {
     Field *f = &fields[my_playernum-1];
-    int nblocks = 0, left;
+    int nblocks = 0, left, rows = 0;
     int x, y, tries;
 
     for (y = 0; y < FIELD_HEIGHT; y++) {
@@ -363,78 +466,80 @@ static void place_specials(int num)
 	    for (x = 0; left > 0 && x < FIELD_WIDTH; x++) {
 		if ((*f)[y][x] > 5 || (*f)[y][x] == 0)
 		    continue;
-		if (rand() % nblocks < num) {
-		    int which = 0, n = rand() % 100;
-		    while (n >= specialfreq[which]) {
-			n -= specialfreq[which];
-			which++;
-		    }
-		    (*f)[y][x] = 6 + which;
+		if (rng_range(&game_rng, nblocks) < num) {
+		    (*f)[y][x] = 6 + pick_special(&game_rng);
+		    rows |= ROW(y);
 		    left--;
 		}
 	    }
 	}
 	tries--;
     }
+    mark_dirty(my_playernum, rows);
 }
 
 /*************************************************************************/
 
 /* Send the new field, either as differences from the given old field or
  * (if more efficient) as a complete field.  If oldfield is NULL, always
- * send the complete field.
+ * send the complete field.  Only the rows marked dirty since the last call
+ * can differ from the old field, so those are the only ones we look at.
  */
 
 static void send_field(Field *oldfield)
 {
     Field *f = &fields[my_playernum-1];
-    int i, x, y, diff = 0;
+    const char *cells = (const char *) f;
+    int i, rows, diff, len;
+    unsigned short changed[FIELD_CELLS];  /* Cells which differ */
+    int count[15];	/* Number of changed cells of each tile type */
+    char *pos[15];	/* Where the next cell of each type goes in buf */
     char buf[512], *s;
 
-    if (oldfield) {
-	for (y = 0; y < FIELD_HEIGHT; y++) {
-	    for (x = 0; x < FIELD_WIDTH; x++) {
-		if ((*f)[y][x] != (*oldfield)[y][x])
-		    diff++;
-	    }
+    rows = send_dirty;
+    send_dirty = 0;
+    if (oldfield)
+	diff = field_diff(f, oldfield, rows, changed);
+    else
+	diff = FIELD_CELLS;
+    s = msg_put_int(msg_put_str(buf, "f "), my_playernum);
+    *s++ = ' ';
+    len = 0;
+    if (diff < FIELD_CELLS/2) {
+	memset(count, 0, sizeof(count));
+	for (i = 0; i < diff; i++) {
+	    int tile = cells[changed[i]];
+	    if (tile >= 0 && tile < 15)
+		count[tile]++;
+	}
+	for (i = 0; i < 15; i++) {
+	    if (count[i])
+		len += 1 + count[i]*2;
 	}
-    } else {
-	diff = FIELD_WIDTH * FIELD_HEIGHT;
     }
-    if (diff < (FIELD_WIDTH*FIELD_HEIGHT)/2) {
-	s = buf + sprintf(buf, "f %d ", my_playernum);
+    if (diff < FIELD_CELLS/2 && len <= FIELD_CELLS) {
+	/* Lay out a bucket for each tile type that changed, then drop the
+	 * changed cells into their buckets.  The cells come back from
+	 * field_diff() in order, so each bucket comes out in order too. */
 	for (i = 0; i < 15; i++) {
-	    int seen = 0;   /* Have we seen a difference of this block? */
-	    for (y = 0; y < FIELD_HEIGHT; y++) {
-		for (x = 0; x < FIELD_WIDTH; x++) {
-		    if ((*f)[y][x] == i && (*f)[y][x] != (*oldfield)[y][x]) {
-			if (!seen) {
-			    *s++ = i + '!';
-			    seen = 1;
-			}
-			*s++ = x + '3';
-			*s++ = y + '3';
-		    }
-		} /* for x */
-	    } /* for y */
-	} /* for i (each tile type) */
-    } /* difference check */
-    /* -4 below is to adjust for "f %d " */
-    if (diff >= (FIELD_WIDTH*FIELD_HEIGHT)/2
-				|| strlen(buf)-4 > FIELD_WIDTH*FIELD_HEIGHT) {
-	static const char specials[] = "acnrsbgqo";
-	s = buf + sprintf(buf, "f %d ", my_playernum);
-	for (y = 0; y < FIELD_HEIGHT; y++) {
-	    for (x = 0; x < FIELD_WIDTH; x++) {
-		if ((*f)[y][x] > 5)
-		    *s++ = specials[(*f)[y][x]-6];
-		else
-		    *s++ = (*f)[y][x] + '0';
+	    if (count[i]) {
+		*s++ = i + '!';
+		pos[i] = s;
+		s += count[i]*2;
 	    }
 	}
+	for (i = 0; i < diff; i++) {
+	    int tile = cells[changed[i]];
+	    if (tile >= 0 && tile < 15) {
+		*pos[tile]++ = changed[i] % FIELD_WIDTH + '3';
+		*pos[tile]++ = changed[i] / FIELD_WIDTH + '3';
+	    }
+	}
+    } else {
+	field_encode(f, s);
+	s += FIELD_CELLS;
     }
-    *s = 0;
-    sputs(buf, server_sock);
+    sputline(buf, msg_end(buf, s), server_sock);
 }
 
 /*************************************************************************/
@@ -444,16 +549,10 @@ static void send_field(Field *oldfield)
 
 void new_piece(void)
 {
-    int n;
     PieceData *pd;
 
     current_piece = next_piece;
-    n = rand() % 100;
-    next_piece = 0;
-    while (n >= piecefreq[next_piece] && next_piece < 6) {
-	n -= piecefreq[next_piece];
-	next_piece++;
-    }
+    next_piece = pick_piece(&game_rng);
     current_rotation = 0;
     pd = &piecedata[current_piece][current_rotation];
     current_x = 6;
@@ -464,13 +563,15 @@ void new_piece(void)
 	    current_x += 2;
 	    if (piece_overlaps(-1, -1, -1)) {
 		Field *f = &fields[my_playernum-1];
+		char msg[MSG_MAX];
 		int x, y;
 		for (y = 0; y < FIELD_HEIGHT; y++) {
 		    for (x = 0; x < FIELD_WIDTH; x++)
-			(*f)[y][x] = rand()%5 + 1;
+			(*f)[y][x] = rng_range(&game_rng, 5) + 1;
 		}
+		mark_dirty(my_playernum, ALL_ROWS);
 		send_field(NULL);
-		sockprintf(server_sock, "playerlost %d", my_playernum);
+		sputline(msg, msg_playerlost(msg, my_playernum), server_sock);
 		playing_game = 0;
 		not_playing_game = 1;
 	    }
@@ -479,10 +580,7 @@ void new_piece(void)
     draw_piece(1);
     io->draw_status();
     io->draw_own_field();
-    gettimeofday(&timeout, NULL);
-    timeout.tv_usec += level_delay() * 1000;
-    timeout.tv_sec += timeout.tv_usec / 1000000;
-    timeout.tv_usec %= 1000000;
+    set_timeout(NULL, level_delay());
     piece_waiting = 0;
 }
 
@@ -506,14 +604,11 @@ void step_down(void)
 	current_y++;
 	draw_piece(1);
 	io->draw_own_field();
-	gettimeofday(&timeout, NULL);
-	timeout.tv_usec += level_delay() * 1000;
-	timeout.tv_sec += timeout.tv_usec / 1000000;
-	timeout.tv_usec %= 1000000;
+	set_timeout(NULL, level_delay());
     } else {
 	int completed, level, nspecials;
 	Field oldfield;
-	char buf[16];
+	char buf[16], msg[MSG_MAX];
 
 	memcpy(&oldfield, f, sizeof(oldfield));
 	draw_piece(1);
@@ -524,8 +619,8 @@ void step_down(void)
 	if (old_mode && completed > 1) {
 	    if (completed < 4)
 		completed--;
-	    sockprintf(server_sock, "sb 0 cs%d %d", completed, my_playernum);
 	    sprintf(buf, "cs%d", completed);
+	    sputline(msg, msg_sb(msg, 0, buf, my_playernum), server_sock);
 	    io->draw_attdef(buf, my_playernum, 0);
 	}
 	level = initial_level + (lines / lines_per_level) * level_inc;
@@ -533,7 +628,7 @@ void step_down(void)
 	    level = 100;
 	levels[my_playernum] = level;
 	if (completed > 0) {
-	    sockprintf(server_sock, "lvl %d %d", my_playernum, level);
+	    sputline(msg, msg_lvl(msg, my_playernum, level), server_sock);
 	    io->draw_status();
 	}
 	nspecials = (lines - last_special) / special_lines;
@@ -543,10 +638,7 @@ void step_down(void)
 	io->draw_own_field();
 	send_field(&oldfield);
 	piece_waiting = 1;
-	gettimeofday(&timeout, NULL);
-	timeout.tv_usec += tetrifast ? 0 : 600000;
-	timeout.tv_sec += timeout.tv_usec / 1000000;
-	timeout.tv_usec %= 1000000;
+	set_timeout(NULL, tetrifast ? 0 : 600000);
     }
 }
 
@@ -558,7 +650,7 @@ void do_special(const char *type, int from, int to)
 {
     Field *f = &fields[my_playernum-1];
     Field oldfield;
-    int x, y;
+    int x, y, rows = 0;
 
     io->draw_attdef(type, from, to);
 
@@ -576,37 +668,41 @@ void do_special(const char *type, int from, int to)
 	int nlines = atoi(type+2);
 
 	/* Don't add lines from a team member */
-	if (!teams[my_playernum-1]
-	 || !teams[from-1]
-	 || strcmp(teams[my_playernum-1],teams[from-1]) != 0
+	if (!team_ids[my_playernum-1]
+	 || team_ids[my_playernum-1] != team_ids[from-1]
 	) {
 	    while (nlines--) {
 		memmove((*f)[0], (*f)[1], FIELD_WIDTH*(FIELD_HEIGHT-1));
 		for (x = 0; x < FIELD_WIDTH; x++)
-		    (*f)[21][x] = 1 + rand()%5;
-		(*f)[FIELD_HEIGHT-1][rand()%FIELD_WIDTH] = 0;
+		    (*f)[21][x] = 1 + rng_range(&game_rng, 5);
+		(*f)[FIELD_HEIGHT-1][rng_range(&game_rng, FIELD_WIDTH)] = 0;
+		rows = ALL_ROWS;
 	    }
 	}
 
     } else if (*type == 'a') {
 	memmove((*f)[0], (*f)[1], FIELD_WIDTH*(FIELD_HEIGHT-1));
 	for (x = 0; x < FIELD_WIDTH; x++)
-	    (*f)[21][x] = 1 + rand()%5;
-	(*f)[FIELD_HEIGHT-1][rand()%FIELD_WIDTH] = 0;
-	(*f)[FIELD_HEIGHT-1][rand()%FIELD_WIDTH] = 0;
-	(*f)[FIELD_HEIGHT-1][rand()%FIELD_WIDTH] = 0;
+	    (*f)[21][x] = 1 + rng_range(&game_rng, 5);
+	(*f)[FIELD_HEIGHT-1][rng_range(&game_rng, FIELD_WIDTH)] = 0;
+	(*f)[FIELD_HEIGHT-1][rng_range(&game_rng, FIELD_WIDTH)] = 0;
+	(*f)[FIELD_HEIGHT-1][rng_range(&game_rng, FIELD_WIDTH)] = 0;
+	rows = ALL_ROWS;
 
     } else if (*type == 'b') {
 	for (y = 0; y < FIELD_HEIGHT; y++) {
 	    for (x = 0; x < FIELD_WIDTH; x++) {
-		if ((*f)[y][x] > 5)
-		    (*f)[y][x] = rand()%5 + 1;
+		if ((*f)[y][x] > 5) {
+		    (*f)[y][x] = rng_range(&game_rng, 5) + 1;
+		    rows |= ROW(y);
+		}
 	    }
 	}
 
     } else if (*type == 'c') {
 	memmove((*f)[1], (*f)[0], FIELD_WIDTH*(FIELD_HEIGHT-1));
 	memset((*f)[0], 0, FIELD_WIDTH);
+	rows = ALL_ROWS;
 
     } else if (*type == 'g') {
 	for (x = 0; x < FIELD_WIDTH; x++) {
@@ -627,10 +723,12 @@ void do_special(const char *type, int from, int to)
 		    y--;
 	    }
 	}
+	rows = ALL_ROWS;
 	clear_lines(0);
 
     } else if (*type == 'n') {
 	memset(*f, 0, FIELD_WIDTH*FIELD_HEIGHT);
+	rows = ALL_ROWS;
 
     } else if (*type == 'o') {
 	int tries, x2, y2, xnew, ynew;
@@ -650,8 +748,8 @@ void do_special(const char *type, int from, int to)
 			    continue;
 			tries = 10;
 			while (tries--) {
-			    xnew = random() % FIELD_WIDTH;
-			    ynew = FIELD_HEIGHT-1 - random()%16;
+			    xnew = rng_range(&game_rng, FIELD_WIDTH);
+			    ynew = FIELD_HEIGHT-1 - rng_range(&game_rng, 16);
 			    if (windows_mode || !(*f)[ynew][xnew]) {
 				(*f)[ynew][xnew] = (*f)[y2][x2];
 				break;
@@ -662,11 +760,14 @@ void do_special(const char *type, int from, int to)
 		}
 	    }
 	}
+	rows = ALL_ROWS;
 	clear_lines(0);
 
     } else if (*type == 'q') {
 	for (y = 0; y < FIELD_HEIGHT; y++) {
-	    int r = rand()%3 - 1;
+	    int r = rng_range(&game_rng, 3) - 1;
+	    if (r != 0)
+		rows |= ROW(y);
 	    if (r < 0) {
 		int save = (*f)[y][0];
 		memmove((*f)[y], (*f)[y]+1, FIELD_WIDTH-1);
@@ -688,10 +789,11 @@ void do_special(const char *type, int from, int to)
 	int i;
 
 	for (i = 0; i < 10; i++) {
-	    x = rand() % FIELD_WIDTH;
-	    y = rand() % FIELD_HEIGHT;
+	    x = rng_range(&game_rng, FIELD_WIDTH);
+	    y = rng_range(&game_rng, FIELD_HEIGHT);
 	    if ((*f)[y][x] != 0) {
 		(*f)[y][x] = 0;
+		rows |= ROW(y);
 		break;
 	    }
 	}
@@ -704,6 +806,8 @@ void do_special(const char *type, int from, int to)
 	memcpy(fields[to-1], temp, sizeof(Field));
 	if (from == my_playernum || to == my_playernum)
 	    memset(fields[my_playernum-1], 0, 6*FIELD_WIDTH);
+	mark_dirty(from, ALL_ROWS);
+	mark_dirty(to, ALL_ROWS);
 	if (from != my_playernum)
 	    io->draw_other_field(from);
 	if (to != my_playernum)
@@ -711,6 +815,7 @@ void do_special(const char *type, int from, int to)
 
     }
 
+    mark_dirty(my_playernum, rows);
     send_field(&oldfield);
 
     if (!piece_waiting) {
@@ -795,10 +900,14 @@ static void gmsg_move(int how)
 static void gmsg_enter(void)
 {
     if (*gmsg_buffer) {
+	char msg[MSG_MAX];
+
 	if (strncasecmp(gmsg_buffer, "/me ", 4) == 0)
-	    sockprintf(server_sock, "gmsg * %s %s", players[my_playernum-1], gmsg_buffer+4);
+	    sputline(msg, msg_gmsg_from(msg, players[my_playernum-1],
+					gmsg_buffer+4, 1), server_sock);
 	else
-	    sockprintf(server_sock, "gmsg <%s> %s", players[my_playernum-1], gmsg_buffer);
+	    sputline(msg, msg_gmsg_from(msg, players[my_playernum-1],
+					gmsg_buffer, 0), server_sock);
 	gmsg_pos = 0;
 	*gmsg_buffer = 0;
     }
@@ -810,37 +919,52 @@ static void gmsg_enter(void)
 /*************************************************************************/
 /*************************************************************************/
 
+/* Seed the random number generator for a new game.  Each player draws
+ * from their own stream of the same seed, so anyone who knows the seed can
+ * replay any player's pieces and specials.
+ */
+
+void seed_game(uint32_t seed)
+{
+    rng_seed(&game_rng, seed, my_playernum);
+}
+
+/*************************************************************************/
+
 /* Set up for a new game. */
 
 void new_game(void)
 {
-    int n;
-
-    gettimeofday(&timeout, NULL);
-    timeout.tv_usec += 1200000;
-    timeout.tv_sec += timeout.tv_usec / 1000000;
-    timeout.tv_usec %= 1000000;
+    build_freq_tables();
+    if (!delays[1])
+	init_delays();
+    set_timeout(NULL, 1200000);
     piece_waiting = 1;
-    n = rand() % 100;
-    next_piece = 0;
-    while (n >= piecefreq[next_piece] && next_piece < 6) {
-	n -= piecefreq[next_piece];
-	next_piece++;
-    }
+    next_piece = pick_piece(&game_rng);
+}
+
+/*************************************************************************/
+
+/* Return the time (on the CLOCK_MONOTONIC clock) at which we want to do
+ * something next. */
+
+const struct timespec *tetris_deadline(void)
+{
+    return &timeout;
 }
 
 /*************************************************************************/
 
-/* Return the number of milliseconds until we want to do something. */
+/* Return the number of microseconds until we want to do something. */
 
 int tetris_timeout(void)
 {
-    struct timeval tv;
-    int t;
+    struct timespec now;
+    long t;
 
-    gettimeofday(&tv, NULL);
-    t = (timeout.tv_sec - tv.tv_sec) * 1000
-      + (timeout.tv_usec-tv.tv_usec) / 1000;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    t = (timeout.tv_sec - now.tv_sec) * 1000000
+      + (timeout.tv_nsec - now.tv_nsec + 999) / 1000;
     return t<0 ? 0 : t;
 }
 
@@ -850,10 +974,16 @@ int tetris_timeout(void)
 
 void tetris_timeout_action(void)
 {
+    struct timespec due = timeout;
+
     if (piece_waiting)
 	new_piece();
     else
 	step_down();
+    /* Schedule the next drop from when this one was due, not from now, so
+     * that the time spent handling it doesn't slow the piece down. */
+    if (!piece_waiting)
+	set_timeout(&due, level_delay());
 }
 
 /*************************************************************************/
@@ -1012,17 +1142,16 @@ void tetris_input(int c)
       case '4':
       case '5':
       case '6': {
-	char buf[2];
+	char buf[2], msg[MSG_MAX];
 
 	c -= '0';
 	if (!players[c-1])
 	    break;
 	if (specials[0] == -1)
 	    break;
-	sockprintf(server_sock, "sb %d %c %d",
-			c, special_chars[(int) specials[0]], my_playernum);
 	buf[0] = special_chars[(int) specials[0]];
 	buf[1] = 0;
+	sputline(msg, msg_sb(msg, c, buf, my_playernum), server_sock);
 	do_special(buf, my_playernum, c);
 	if (special_capacity > 1)
 	    memmove(specials, specials+1, special_capacity-1);
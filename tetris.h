@@ -7,6 +7,10 @@
 #ifndef TETRIS_H
 #define TETRIS_H
 
+#ifndef RNG_H
+# include "rng.h"
+#endif
+
 /*************************************************************************/
 
 #define PIECE_BAR	0	/* Straight bar */
@@ -31,15 +35,32 @@
 
 #define MAX_SPECIALS	64
 
+/* Sets of field rows are kept as bitmasks, with bit y set for row y. */
+#define ROW(y)		(1 << (y))
+#define ALL_ROWS	((1 << FIELD_HEIGHT) - 1)
+
+/* A piece or special frequency table expanded to one slot per percent, so
+ * that choosing one is a single lookup. */
+typedef struct {
+    signed char slot[100];	/* Piece or special number for each percent */
+    int total;			/* Sum of the frequencies; 100 if valid */
+} FreqTable;
+
+#define pick_piece(rng)		(piece_table.slot[rng_range(rng, 100)])
+#define pick_special(rng)	(special_table.slot[rng_range(rng, 100)])
+
 extern int piecefreq[7], specialfreq[9];
+extern FreqTable piece_table, special_table;
 extern int old_mode;
 extern int initial_level, lines_per_level, level_inc, level_average;
 extern int special_lines, special_count, special_capacity;
 extern Field fields[6];
 extern int levels[6];
+extern int dirty_rows[6];
 extern int lines;
 extern signed char specials[MAX_SPECIALS];
 extern int next_piece;
+extern Rng game_rng;
 extern int current_x, current_y;
 
 
@@ -55,15 +76,22 @@ PieceData piecedata[7][4];
 extern int current_piece, current_rotation;
 
 
+extern void build_freq_table(FreqTable *table, const int *freq, int n);
+extern void build_freq_tables(void);
+
 extern void init_shapes(void);
 extern int get_shape(int piece, int rotation, char buf[4][4]);
 
+extern void mark_dirty(int player, int rows);
+
+extern void seed_game(uint32_t seed);
 extern void new_game(void);
 
 extern void new_piece(void);
 extern void step_down(void);
 extern void do_special(const char *type, int from, int to);
 
+extern const struct timespec *tetris_deadline(void);
 extern int tetris_timeout(void);
 extern void tetris_timeout_action(void);
 extern void tetris_input(int c);
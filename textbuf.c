@@ -0,0 +1,238 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Text scrollback for the partyline, game message and attack/defense
+ * windows.  See textbuf.h for how messages are stored.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "io.h"
+#include "textbuf.h"
+
+/*************************************************************************/
+
+/* Set up a ring to hold up to @maxmsgs messages.  Return 0 on success, -1
+ * if out of memory. */
+
+int textring_init(TextRing *ring, int maxmsgs)
+{
+    if (maxmsgs < 1)
+	maxmsgs = 1;
+    ring->maxmsgs = maxmsgs;
+    /* Room for an average of 80 characters a message, and always for at
+     * least one long one. */
+    ring->size = maxmsgs * 81 + 1024;
+    ring->data = malloc(ring->size);
+    ring->msgs = malloc(maxmsgs * sizeof(*ring->msgs));
+    if (!ring->data || !ring->msgs) {
+	free(ring->data);
+	free(ring->msgs);
+	ring->data = NULL;
+	ring->msgs = NULL;
+	return -1;
+    }
+    textring_clear(ring);
+    return 0;
+}
+
+/*************************************************************************/
+
+/* Remove all messages from a ring. */
+
+void textring_clear(TextRing *ring)
+{
+    ring->first = ring->count = 0;
+    ring->end = 0;
+}
+
+/*************************************************************************/
+
+/* Add a message to a ring, dropping the oldest ones to make room. */
+
+void textring_add(TextRing *ring, const char *s)
+{
+    int len = strlen(s) + 1, skip, pos, room;
+
+    if (len > ring->size/2)
+	len = ring->size/2;
+    if (!ring->count)
+	ring->end = 0;
+    /* Messages aren't split across the end of the buffer; if this one
+     * won't fit there, leave the rest of the buffer unused and start again
+     * from the beginning. */
+    if (ring->end + len > ring->size) {
+	skip = ring->size - ring->end;
+	pos = 0;
+    } else {
+	skip = 0;
+	pos = ring->end;
+    }
+    for (;;) {
+	if (!ring->count)
+	    break;
+	room = (ring->msgs[ring->first] - ring->end + ring->size) % ring->size;
+	if (room >= skip + len && ring->count < ring->maxmsgs)
+	    break;
+	ring->first = (ring->first + 1) % ring->maxmsgs;
+	ring->count--;
+    }
+    memcpy(ring->data + pos, s, len-1);
+    ring->data[pos + len-1] = 0;
+    ring->msgs[(ring->first + ring->count) % ring->maxmsgs] = pos;
+    ring->count++;
+    ring->end = pos + len;
+}
+
+/*************************************************************************/
+
+/* Return the @n'th newest message in a ring (0 is the newest), or NULL if
+ * there are not that many. */
+
+const char *textring_get(const TextRing *ring, int n)
+{
+    if (n < 0 || n >= ring->count)
+	return NULL;
+    return ring->data
+	 + ring->msgs[(ring->first + ring->count-1 - n) % ring->maxmsgs];
+}
+
+/*************************************************************************/
+
+/* Attribute codes used in messages, as in gtetrinet; 0xFF also resets all
+ * attributes.  (Leading space <=> undefined) */
+
+static const unsigned char codes[32] = {
+     0, /* N/A */
+     TATTR_CBLACK,
+    TATTR_BOLD,
+    TATTR_CCYAN | TATTR_CXBRIGHT,
+    TATTR_CBLACK,
+    TATTR_CBLUE | TATTR_CXBRIGHT,
+    TATTR_CGREY,
+     TATTR_CBLACK,
+    TATTR_CMAGENTA,
+     TATTR_CBLACK,
+     TATTR_CBLACK,
+    TATTR_CBLACK | TATTR_CXBRIGHT,
+    TATTR_CGREEN,
+     TATTR_CBLACK,
+    TATTR_CGREEN | TATTR_CXBRIGHT,
+    TATTR_CGREY,
+    TATTR_CRED,
+    TATTR_CBLUE,
+    TATTR_CBROWN,
+    TATTR_CMAGENTA | TATTR_CXBRIGHT,
+    TATTR_CRED | TATTR_CXBRIGHT,
+    TATTR_CGREY,
+    TATTR_ITALIC,
+    TATTR_CCYAN,
+    TATTR_CGREY | TATTR_CXBRIGHT,
+    TATTR_CBROWN | TATTR_CXBRIGHT,
+     TATTR_CBLACK,
+     TATTR_CBLACK,
+     TATTR_CBLACK,
+     TATTR_CBLACK,
+     TATTR_CBLACK,
+    TATTR_UNDERLINE,
+};
+
+#define IS_CODE(c)	((c) < 32 || (c) == 0xFF)
+
+/* Return the TEXT_* attributes @attr changed by attribute code @c. */
+
+static int apply_code(int attr, unsigned char c)
+{
+    int t;
+
+    if (c == 0xFF)
+	return 0;
+    t = codes[c];
+    if (t < TATTR_CMAX)
+	return (attr & ~TEXT_COLOR) | TEXT_HASCOLOR | t;
+    switch (t) {
+	case TATTR_BOLD:      return attr | TEXT_BOLD;
+	case TATTR_ITALIC:    return attr | TEXT_ITALIC;
+	case TATTR_UNDERLINE: return attr | TEXT_UNDERLINE;
+	default:              return 0;
+    }
+}
+
+/*************************************************************************/
+
+/* Decode the attribute codes in @s and break it into lines no wider than
+ * @width, at spaces where possible; lines after the first are indented by
+ * two spaces.  Store the result in @wrap and return the number of lines.
+ * Each character is looked at no more than twice, once to find where the
+ * line ends and once to build its spans, so this takes linear time however
+ * long the message is.
+ */
+
+int text_wrap(const char *s, int width, TextWrap *wrap)
+{
+    const unsigned char *p = (const unsigned char *) s, *q, *end, *space;
+    int attr = 0, indent = 0, avail, col, in_space;
+    TextLine *line;
+    TextSpan *span;
+
+    wrap->nlines = wrap->nspans = 0;
+    while (*p == ' ')
+	p++;
+    do {
+	/* Find where this line ends: at the end of the message if it all
+	 * fits, else at the last run of spaces that fits, else wherever
+	 * the width runs out. */
+	avail = width - indent > 0 ? width - indent : 1;
+	col = in_space = 0;
+	space = NULL;
+	for (q = p; *q; q++) {
+	    if (IS_CODE(*q))
+		continue;
+	    if (col == avail)
+		break;
+	    if (*q == ' ' && !in_space)
+		space = q;
+	    in_space = (*q == ' ');
+	    col++;
+	}
+	if (!*q)
+	    end = q;
+	else if (*q == ' ')
+	    end = in_space ? space : q;
+	else if (space)
+	    end = space;
+	else
+	    end = q;
+
+	/* Build the line's spans. */
+	line = &wrap->line[wrap->nlines++];
+	line->indent = indent;
+	line->first = wrap->nspans;
+	line->nspans = 0;
+	span = NULL;
+	for (; p < end; p++) {
+	    if (IS_CODE(*p)) {
+		attr = apply_code(attr, *p);
+		span = NULL;
+	    } else if (span) {
+		span->len++;
+	    } else if (wrap->nspans < TEXT_MAXSPANS) {
+		span = &wrap->span[wrap->nspans++];
+		span->s = (const char *) p;
+		span->len = 1;
+		span->attr = attr;
+		line->nspans++;
+	    }
+	}
+
+	/* Skip the spaces we broke the line at. */
+	for (; *p == ' ' || (*p && IS_CODE(*p)); p++) {
+	    if (*p != ' ')
+		attr = apply_code(attr, *p);
+	}
+	indent = 2;
+    } while (*p && wrap->nlines < TEXT_MAXLINES);
+    return wrap->nlines;
+}
+
+/*************************************************************************/
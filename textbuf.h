@@ -0,0 +1,74 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Text scrollback declarations.
+ */
+
+#ifndef TEXTBUF_H
+#define TEXTBUF_H
+
+/*************************************************************************/
+
+/* A history of text messages.  The messages are stored end to end in a
+ * ring of bytes allocated once, with a second ring of offsets to find
+ * them; adding a message never allocates memory, and drops the oldest
+ * messages if there isn't room.  Messages are kept as they came from the
+ * server, attribute codes and all, and only decoded and wrapped to a
+ * window's width when drawn, so a window can be redrawn at any width. */
+
+typedef struct {
+    char *data;		/* Message text, each one null-terminated */
+    int size;		/* Size of data[] */
+    int end;		/* Offset in data[] just past the newest message */
+    int *msgs;		/* Offsets in data[] of the messages */
+    int maxmsgs;	/* Size of msgs[] */
+    int first;		/* Index in msgs[] of the oldest message */
+    int count;		/* Number of messages stored */
+} TextRing;
+
+/* Attributes of a piece of text, made from the message's attribute codes:
+ * a TATTR_C* color (with TATTR_CXBRIGHT) if TEXT_HASCOLOR is set, and any
+ * of the other flags. */
+
+#define TEXT_COLOR	0x0F
+#define TEXT_HASCOLOR	0x10
+#define TEXT_BOLD	0x20
+#define TEXT_ITALIC	0x40
+#define TEXT_UNDERLINE	0x80
+
+/* A message wrapped to a given width, as lines made up of spans of text
+ * which all have the same attributes.  The spans point into the message
+ * and contain no attribute codes, so they can be drawn as they are. */
+
+typedef struct {
+    const char *s;
+    int len;
+    int attr;		/* TEXT_* */
+} TextSpan;
+
+typedef struct {
+    int indent;		/* Spaces to draw before the first span */
+    int first;		/* Index of the line's first span */
+    int nspans;
+} TextLine;
+
+/* Most lines one message can wrap to, and most spans in all the lines.
+ * Anything past either limit is dropped. */
+#define TEXT_MAXLINES	64
+#define TEXT_MAXSPANS	256
+
+typedef struct {
+    int nlines, nspans;
+    TextLine line[TEXT_MAXLINES];
+    TextSpan span[TEXT_MAXSPANS];
+} TextWrap;
+
+extern int textring_init(TextRing *ring, int maxmsgs);
+extern void textring_add(TextRing *ring, const char *s);
+extern void textring_clear(TextRing *ring);
+extern const char *textring_get(const TextRing *ring, int n);
+extern int text_wrap(const char *s, int width, TextWrap *wrap);
+
+/*************************************************************************/
+
+#endif	/* TEXTBUF_H */
@@ -0,0 +1,170 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server timers.  See timer.h for how they work.
+ */
+
+#include <pthread.h>
+#include <string.h>
+#include <time.h>
+#include <sys/timerfd.h>
+#include "timer.h"
+
+/*************************************************************************/
+
+static pthread_mutex_t wheel_lock = PTHREAD_MUTEX_INITIALIZER;
+static Timer *wheel[TIMER_SLOTS];
+static struct timespec wheel_start;	/* Time of tick 0 */
+static uint64_t last_tick;	/* Last tick whose timers have been run */
+static uint64_t fd_tick;	/* Tick the timerfd is set for */
+static int fd_armed;		/* Is it set at all? */
+static int wheel_fd = -1;
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Return the time since tick 0 in nanoseconds. */
+
+static uint64_t elapsed_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) (ts.tv_sec - wheel_start.tv_sec) * 1000000000
+	   + (ts.tv_nsec - wheel_start.tv_nsec);
+}
+
+static uint64_t current_tick(void)
+{
+    return elapsed_ns() / (TIMER_TICK * 1000000);
+}
+
+/* Set the timerfd to fire at the start of @tick, or if @set is zero, not
+ * at all.  The caller must hold wheel_lock. */
+
+static void set_fd(int set, uint64_t tick)
+{
+    struct itimerspec its;
+    uint64_t ms = tick * TIMER_TICK;
+
+    memset(&its, 0, sizeof(its));
+    if (set) {
+	its.it_value.tv_sec = wheel_start.tv_sec + ms / 1000;
+	its.it_value.tv_nsec = wheel_start.tv_nsec + (ms % 1000) * 1000000;
+	if (its.it_value.tv_nsec >= 1000000000) {
+	    its.it_value.tv_sec++;
+	    its.it_value.tv_nsec -= 1000000000;
+	}
+    }
+    timerfd_settime(wheel_fd, TFD_TIMER_ABSTIME, &its, NULL);
+    fd_armed = set;
+    fd_tick = tick;
+}
+
+static void unlink_timer(Timer *t)
+{
+    if (t->prev) {
+	if (t->next)
+	    t->next->prev = t->prev;
+	*t->prev = t->next;
+	t->prev = NULL;
+    }
+}
+
+/*************************************************************************/
+/*************************************************************************/
+
+/* Set up the timer wheel.  Return a timerfd for the reactor to watch,
+ * calling timer_run() when it fires, or -1 on error. */
+
+int timer_init(void)
+{
+    clock_gettime(CLOCK_MONOTONIC, &wheel_start);
+    wheel_fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    return wheel_fd;
+}
+
+/*************************************************************************/
+
+/* Wake @task in @ms milliseconds (rounded up to the start of the next
+ * tick, so never early).  If the timer was already set, it is moved. */
+
+void timer_add(Timer *t, SchedTask *task, int ms)
+{
+    uint64_t expires;
+
+    pthread_mutex_lock(&wheel_lock);
+    unlink_timer(t);
+    expires = (elapsed_ns() + (uint64_t) ms * 1000000
+	       + TIMER_TICK*1000000 - 1) / (TIMER_TICK * 1000000);
+    if (expires <= last_tick)
+	expires = last_tick + 1;
+    t->task = task;
+    t->expires = expires;
+    t->prev = &wheel[expires & (TIMER_SLOTS-1)];
+    t->next = *t->prev;
+    if (t->next)
+	t->next->prev = &t->next;
+    *t->prev = t;
+    if (!fd_armed || expires < fd_tick)
+	set_fd(1, expires);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/*************************************************************************/
+
+void timer_cancel(Timer *t)
+{
+    pthread_mutex_lock(&wheel_lock);
+    unlink_timer(t);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/*************************************************************************/
+
+/* Return whether a timer is set and hasn't fired yet. */
+
+int timer_pending(Timer *t)
+{
+    int pending;
+
+    pthread_mutex_lock(&wheel_lock);
+    pending = t->prev != NULL;
+    pthread_mutex_unlock(&wheel_lock);
+    return pending;
+}
+
+/*************************************************************************/
+
+/* Wake the tasks of all timers which have expired, and set the timerfd
+ * for the next to go.  Only the reactor's thread may call this. */
+
+void timer_run(void)
+{
+    uint64_t now, tick;
+    Timer *t, *next;
+    int i, n;
+
+    pthread_mutex_lock(&wheel_lock);
+    now = current_tick();
+    n = now - last_tick < TIMER_SLOTS ? now - last_tick : TIMER_SLOTS;
+    for (tick = last_tick+1; n > 0; tick++, n--) {
+	for (t = wheel[tick & (TIMER_SLOTS-1)]; t; t = next) {
+	    next = t->next;
+	    if (t->expires <= now) {
+		unlink_timer(t);
+		sched_wake(t->task);
+	    }
+	}
+    }
+    last_tick = now;
+
+    /* The first list with anything in it may only have timers for later
+     * times round the ring, but then we just look again. */
+    for (i = 1; i <= TIMER_SLOTS && !wheel[(now+i) & (TIMER_SLOTS-1)]; i++)
+	;
+    set_fd(i <= TIMER_SLOTS, now+i);
+    pthread_mutex_unlock(&wheel_lock);
+}
+
+/*************************************************************************/
@@ -0,0 +1,44 @@
+/* Tetrinet for Linux, by Andrew Church <achurch@achurch.org>
+ * This program is public domain.
+ *
+ * Server timer declarations.
+ */
+
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+#include "sched.h"
+
+/*************************************************************************/
+
+/* A timer wakes a task once a given time has passed; the task works out
+ * for itself what was due.  Timers are kept in a timer wheel: a ring of
+ * TIMER_SLOTS lists, one for each TIMER_TICK milliseconds, with each timer
+ * in the list for the tick it expires on.  (Timers further off than the
+ * ring reaches wait in their list until it comes round to them.)  Setting
+ * or cancelling a timer takes constant time, from any thread, and running
+ * them only means looking at the lists for the ticks which have passed.
+ * The reactor does that when the descriptor returned by timer_init(), a
+ * timerfd set for the next tick with anything in it, fires.
+ */
+
+#define TIMER_TICK	1	/* Milliseconds */
+#define TIMER_SLOTS	8192	/* Must be a power of 2 */
+
+typedef struct Timer Timer;
+struct Timer {
+    Timer *next, **prev;	/* prev is NULL if the timer isn't set */
+    SchedTask *task;
+    uint64_t expires;		/* Tick it expires on */
+};
+
+extern int timer_init(void);
+extern void timer_add(Timer *timer, SchedTask *task, int ms);
+extern void timer_cancel(Timer *timer);
+extern int timer_pending(Timer *timer);
+extern void timer_run(void);
+
+/*************************************************************************/
+
+#endif	/* TIMER_H */
@@ -13,10 +13,14 @@
 #include <curses.h>
 #include <errno.h>
 #include <signal.h>
+#include <time.h>
 #include <sys/time.h>
 #include "tetrinet.h"
 #include "tetris.h"
 #include "io.h"
+#include "event.h"
+#include "keys.h"
+#include "textbuf.h"
 
 /*************************************************************************/
 
@@ -34,82 +38,62 @@
 /******************************* Input stuff *****************************/
 /*************************************************************************/
 
-/* Return either an ASCII code 0-255, a K_* value, or -1 if server input is
- * waiting.  Return -2 if we run out of time with no input.
+/* Is output being held (see screen_hold())?  Was a refresh skipped?  When
+ * did we last update the terminal? */
+static int screen_held, refresh_pending;
+static struct timespec last_frame;
+
+/* Statistics for -stats: screen updates, field cells drawn in all and
+ * since the last update, and the most drawn for any one update. */
+static long frames, cells_drawn, frame_cells, max_frame_cells;
+
+/*************************************************************************/
+
+/* Return in @ts the earliest time we may next update the terminal. */
+
+static void next_frame(struct timespec *ts)
+{
+    *ts = last_frame;
+    if (max_fps > 0) {
+	ts->tv_nsec += 1000000000 / max_fps;
+	ts->tv_sec += ts->tv_nsec / 1000000000;
+	ts->tv_nsec %= 1000000000;
+    }
+}
+
+/*************************************************************************/
+
+/* Wait for keyboard or server input or for the deadline to pass, and
+ * return the INPUT_* flags for whatever is ready.  If there are changes
+ * waiting for the next frame, wake up in time to draw them too, and
+ * likewise if there's an escape sequence to finish decoding.
  */
 
-static int wait_for_input(int msec)
+static int wait_for_input(const struct timespec *deadline)
 {
-    fd_set fds;
-    struct timeval tv;
-    int c;
-    static int escape = 0;
-
-    FD_ZERO(&fds);
-    FD_SET(0, &fds);
-    FD_SET(server_sock, &fds);
-    tv.tv_sec = msec/1000;
-    tv.tv_usec = (msec*1000) % 1000000;
-    while (select(server_sock+1, &fds, NULL, NULL, msec<0 ? NULL : &tv) < 0) {
-	if (errno != EINTR)
-	    perror("Warning: select() failed");
+    struct timespec frame;
+    const struct timespec *esc = key_deadline();
+    int ready;
+
+    if (refresh_pending) {
+	next_frame(&frame);
+	deadline = event_earliest(deadline, &frame);
     }
-    if (FD_ISSET(0, &fds)) {
-	c = getch();
-	if (!escape && c == 27) {	/* Escape */
-	    escape = 1;
-	    c = wait_for_input(1000);
-	    escape = 0;
-	    if (c < 0)
-		return 27;
-	    else
-		return c;
-	}
-	if (c == KEY_UP)
-	    return K_UP;
-	else if (c == KEY_DOWN)
-	    return K_DOWN;
-	else if (c == KEY_LEFT)
-	    return K_LEFT;
-	else if (c == KEY_RIGHT)
-	    return K_RIGHT;
-	else if (c == KEY_F(1) || c == ('1'|0x80) || (escape && c == '1'))
-	    return K_F1;
-	else if (c == KEY_F(2) || c == ('2'|0x80) || (escape && c == '2'))
-	    return K_F2;
-	else if (c == KEY_F(3) || c == ('3'|0x80) || (escape && c == '3'))
-	    return K_F3;
-	else if (c == KEY_F(4) || c == ('4'|0x80) || (escape && c == '4'))
-	    return K_F4;
-	else if (c == KEY_F(5) || c == ('5'|0x80) || (escape && c == '5'))
-	    return K_F5;
-	else if (c == KEY_F(6) || c == ('6'|0x80) || (escape && c == '6'))
-	    return K_F6;
-	else if (c == KEY_F(7) || c == ('7'|0x80) || (escape && c == '7'))
-	    return K_F7;
-	else if (c == KEY_F(8) || c == ('8'|0x80) || (escape && c == '8'))
-	    return K_F8;
-	else if (c == KEY_F(9) || c == ('9'|0x80) || (escape && c == '9'))
-	    return K_F9;
-	else if (c == KEY_F(10) || c == ('0'|0x80) || (escape && c == '0'))
-	    return K_F10;
-	else if (c == KEY_F(11))
-	    return K_F11;
-	else if (c == KEY_F(12))
-	    return K_F12;
-	else if (c == KEY_BACKSPACE)
-	    return 8;
-	else if (c >= 0x0100)
-	    return K_INVALID;
-	else if (c == 7)   /* ^G */
-	    return 27;  /* Escape */
-	else
-	    return c;
-    } /* if (FD_ISSET(0, &fds)) */
-    else if (FD_ISSET(server_sock, &fds))
-	return -1;
-    else
-	return -2;	/* out of time */
+    ready = event_wait(event_earliest(deadline, esc));
+    if (esc)
+	ready |= INPUT_KEY;
+    return ready;
+}
+
+/*************************************************************************/
+
+/* Return the next key pressed as an ASCII code 0-255 or a K_* value, or -1
+ * if there are no more keys waiting.
+ */
+
+static int read_key(void)
+{
+    return key_read(0);
 }
 
 /*************************************************************************/
@@ -128,9 +112,10 @@ static int has_color;
 
 typedef struct {
     int x, y, width, height;
-    int line;
+    int line;		/* Window line to draw the next line of text on */
+    int scroll;		/* Number of lines scrolled back from the newest */
     WINDOW *win;	/* NULL if not currently displayed */
-    char **text;
+    TextRing text;
 } TextBuffer;
 
 static TextBuffer plinebuf, gmsgbuf, attdefbuf;
@@ -153,6 +138,12 @@ static void screen_cleanup()
     wrefresh(stdscr);
     endwin();
     printf("\n");
+    if (show_stats) {
+	printf("%ld screen updates, %ld field cells drawn"
+	       " (%.1f per update, at most %ld)\n",
+	       frames, cells_drawn,
+	       frames ? (double) cells_drawn / frames : 0.0, max_frame_cells);
+    }
 }
 
 /*************************************************************************/
@@ -180,38 +171,60 @@ static void sighandler(int sig)
 /*************************************************************************/
 /*************************************************************************/
 
-#define MAXCOLORS	256
+/* Color attributes for each foreground/background pair of the eight basic
+ * colors, and curses attributes for each TEXT_* value; both are filled in
+ * by init_colors(). */
 
-static int colors[MAXCOLORS][2] = { {-1,-1} };
+static long color_pairs[8][8];
+static long text_attrs[256];
 
 /* Return a color attribute value. */
 
-static long getcolor(int fg, int bg)
-{
-    int i;
+#define getcolor(fg,bg)	(color_pairs[(fg)][(bg)])
 
-    if (colors[0][0] < 0) {
-	start_color();
-	memset(colors, -1, sizeof(colors));
-	colors[0][0] = COLOR_WHITE;
-	colors[0][1] = -1;
-    }
-    if (fg == COLOR_WHITE && bg == COLOR_BLACK)
-	return COLOR_PAIR(0);
-    for (i = 1; i < MAXCOLORS; i++) {
-	if (colors[i][0] == fg && colors[i][1] == bg)
-	    return COLOR_PAIR(i);
-    }
-    for (i = 1; i < MAXCOLORS; i++) {
-	if (colors[i][0] < 0) {
-	    if (init_pair(i, fg, bg) == ERR)
-		continue;
-	    colors[i][0] = fg;
-	    colors[i][1] = bg;
-	    return COLOR_PAIR(i);
+/* Allocate a color pair for every combination of colors, and work out the
+ * attributes for text.  White on black is pair 0, the terminal's default;
+ * if the terminal doesn't have enough pairs for all of them, the ones left
+ * over are drawn in the default colors.
+ */
+
+static void init_colors(void)
+{
+    static const int cmap[8] = {
+	COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
+	COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE,
+    };
+    int fg, bg, pair, attr, c;
+    long a;
+
+    for (fg = 0; fg < 8; fg++) {
+	for (bg = 0; bg < 8; bg++) {
+	    pair = fg*8 + bg;
+	    if (pair == COLOR_WHITE*8 + COLOR_BLACK)
+		pair = 0;
+	    else if (pair == 0)
+		pair = COLOR_WHITE*8 + COLOR_BLACK;
+	    color_pairs[fg][bg] = 0;
+	    if (has_color && (pair == 0 || (pair < COLOR_PAIRS
+					    && init_pair(pair, fg, bg) != ERR)))
+		color_pairs[fg][bg] = COLOR_PAIR(pair);
 	}
     }
-    return -1;
+
+    for (attr = 0; attr < 256; attr++) {
+	a = A_NORMAL;
+	c = attr & TEXT_COLOR;
+	if (attr & TEXT_HASCOLOR)
+	    a |= getcolor(c == 0 ? COLOR_WHITE : cmap[c % 8], COLOR_BLACK)
+	       | (A_BOLD * (c / 8));
+	if (attr & TEXT_BOLD)
+	    a |= A_BOLD;
+	if (attr & TEXT_ITALIC)
+	    a |= A_STANDOUT;
+	if (attr & TEXT_UNDERLINE)
+	    a |= A_UNDERLINE;
+	text_attrs[attr] = a;
+    }
 }
 
 /*************************************************************************/
@@ -228,11 +241,14 @@ static void screen_setup(void)
     initscr();
     cbreak();
     noecho();
-    nodelay(stdscr, TRUE);
     keypad(stdscr, TRUE);
+    /* Keys are read and decoded by key_read(), not getch(), so don't let
+     * curses look at the input while it's drawing. */
+    typeahead(-1);
     leaveok(stdscr, TRUE);
     if ((has_color = has_colors()))
 	start_color();
+    init_colors();
     getmaxyx(stdscr, scrheight, scrwidth);
     scrwidth--;  /* Don't draw in last column--this can cause scroll */
 
@@ -245,6 +261,12 @@ static void screen_setup(void)
 	exit(1);
     }
 
+    /* Set up the text buffers' histories.  If there's not enough memory,
+     * the buffers just stay empty. */
+    textring_init(&plinebuf.text, scrollback);
+    textring_init(&gmsgbuf.text, scrollback);
+    textring_init(&attdefbuf.text, scrollback);
+
     /* Cancel all this when we exit. */
     atexit(screen_cleanup);
 
@@ -273,6 +295,17 @@ static void screen_setup(void)
 
 static void screen_refresh(void)
 {
+    if (screen_held) {
+	refresh_pending = 1;
+	return;
+    }
+    refresh_pending = 0;
+    clock_gettime(CLOCK_MONOTONIC, &last_frame);
+    frames++;
+    cells_drawn += frame_cells;
+    if (frame_cells > max_frame_cells)
+	max_frame_cells = frame_cells;
+    frame_cells = 0;
     if (gmsg_inputwin)
 	touchline(stdscr, gmsg_inputpos, gmsg_inputheight);
     if (plinebuf.win)
@@ -295,113 +328,115 @@ static void screen_redraw(void)
     screen_refresh();
 }
 
+/*************************************************************************/
+
+/* Hold and release terminal output.  Released output is sent at most
+ * max_fps times a second; until the next frame is due it stays held, and
+ * wait_for_input() wakes us up to send it.  Urgent output (such as our own
+ * piece moving in response to a key) is sent straight away.
+ */
+
+static void screen_hold(void)
+{
+    screen_held = 1;
+}
+
+static void screen_flush(int urgent)
+{
+    struct timespec now, frame;
+
+    if (!refresh_pending) {
+	screen_held = 0;
+	return;
+    }
+    if (!urgent) {
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	next_frame(&frame);
+	if (now.tv_sec < frame.tv_sec
+	 || (now.tv_sec == frame.tv_sec && now.tv_nsec < frame.tv_nsec))
+	    return;
+    }
+    screen_held = 0;
+    screen_refresh();
+}
+
 /*************************************************************************/
 /************************* Text buffer routines **************************/
 /*************************************************************************/
 
-/* Put a line of text in a text buffer. */
+/* Draw line @n of a wrapped message on the given line of a text buffer's
+ * window. */
+
+static void draw_line(TextBuffer *buf, int y, const TextWrap *wrap, int n)
+{
+    const TextLine *line = &wrap->line[n];
+    const TextSpan *span = &wrap->span[line->first];
+    int i, len, x = line->indent;
+
+    for (i = 0; i < line->nspans && x < buf->width; i++, span++) {
+	len = span->len < buf->width - x ? span->len : buf->width - x;
+	wattrset(buf->win, text_attrs[span->attr & 0xFF]);
+	mvwaddnstr(buf->win, y, x, span->s, len);
+	x += len;
+    }
+    wattrset(buf->win, A_NORMAL);
+}
+
+/*************************************************************************/
+
+/* Put line @n of a wrapped message at the bottom of a text buffer's
+ * window. */
 
-static void outline(TextBuffer *buf, const unsigned char *s)
+static void outline(TextBuffer *buf, const TextWrap *wrap, int n)
 {
     if (buf->line == buf->height) {
-	if (buf->win)
-	    scroll(buf->win);
-	memmove(buf->text, buf->text+1, (buf->height-1) * sizeof(char *));
+	scroll(buf->win);
 	buf->line--;
     }
-    if (buf->win) {
-	int i, x = 0, l = strlen(s);
-
-	for (i = 0; i < l; i++) {
-	    unsigned char c = s[i] - 1;
-
-	    if (c < TATTR_MAX) {
-		static const int cmap[8] = {
-		    COLOR_BLACK, COLOR_RED, COLOR_GREEN, COLOR_YELLOW,
-		    COLOR_BLUE, COLOR_MAGENTA, COLOR_CYAN, COLOR_WHITE,
-		};
-
-		switch (c) {
-		    case TATTR_RESET:
-			wattrset(buf->win, A_NORMAL);
-			break;
-		    case TATTR_BOLD:
-			wattron(buf->win, A_BOLD);
-			break;
-		    case TATTR_ITALIC:
-			wattron(buf->win, A_STANDOUT);
-			break;
-		    case TATTR_UNDERLINE:
-			wattron(buf->win, A_UNDERLINE);
-			break;
-		    default:
-			assert(c < TATTR_CMAX);
-			wattron(buf->win, getcolor(c == 0 ? COLOR_WHITE : cmap[c % 8], COLOR_BLACK)
-			                  | (A_BOLD * (c / 8)));
-			break;
-		}
+    draw_line(buf, buf->line, wrap, n);
+    buf->line++;
+}
 
-	    } else {
-		mvwaddch(buf->win, buf->line, x++, c + 1);
-	    }
-	}
+/*************************************************************************/
+
+/* Return the text buffer for a BUFFER_* number, or NULL if none. */
 
-	wattrset(buf->win, A_NORMAL);
+static TextBuffer *get_textbuf(int bufnum)
+{
+    switch (bufnum) {
+	case BUFFER_PLINE:  return &plinebuf;
+	case BUFFER_GMSG:   return &gmsgbuf;
+	case BUFFER_ATTDEF: return &attdefbuf;
+	default:            return NULL;
     }
-    if (s != (const unsigned char *) buf->text[buf->line])   /* check for restoring display */
-	buf->text[buf->line] = strdup(s);
-    buf->line++;
 }
 
+/*************************************************************************/
+
 static void draw_text(int bufnum, const char *s)
 {
-    char str[1024];	/* hopefully scrwidth < 1024 */
-    const char *t;
-    int indent = 0;
+    TextWrap wrap;
+    int i, n;
     int x = 0, y = 0;
     TextBuffer *buf;
 
-    switch (bufnum) {
-	case BUFFER_PLINE:  buf = &plinebuf;  break;
-	case BUFFER_GMSG:   buf = &gmsgbuf;   break;
-	case BUFFER_ATTDEF: buf = &attdefbuf; break;
-	default: return;
-    }
-    if (!buf->text)
+    if (!(buf = get_textbuf(bufnum)) || !buf->text.data)
+	return;
+    textring_add(&buf->text, s);
+    if (!buf->win)
+	return;
+    n = text_wrap(s, buf->width, &wrap);
+    if (buf->scroll) {
+	/* Leave the window showing what it was. */
+	buf->scroll += n;
 	return;
-    if (buf->win) {
-	getyx(stdscr, y, x);
-	attrset(getcolor(COLOR_WHITE, COLOR_BLACK));
-    }
-    while (*s && isspace(*s))
-	s++;
-    while (strlen(s) > buf->width - indent) {
-	t = s + buf->width - indent;
-	while (t >= s && !isspace(*t))
-	    t--;
-	while (t >= s && isspace(*t))
-	    t--;
-	t++;
-	if (t < s)
-	    t = s + buf->width - indent;
-	if (indent > 0)
-	    sprintf(str, "%*s", indent, "");
-	strncpy(str+indent, s, t-s);
-	str[t-s+indent] = 0;
-	outline(buf, str);
-	indent = 2;
-	while (isspace(*t))
-	    t++;
-	s = t;
-    }
-    if (indent > 0)
-	sprintf(str, "%*s", indent, "");
-    strcpy(str+indent, s);
-    outline(buf, str);
-    if (buf->win) {
-	move(y, x);
-	screen_refresh();
     }
+    getyx(stdscr, y, x);
+    attrset(getcolor(COLOR_WHITE, COLOR_BLACK));
+    for (i = 0; i < n; i++)
+	outline(buf, &wrap, i);
+    move(y, x);
+    screen_refresh();
 }
 
 /*************************************************************************/
@@ -411,23 +446,13 @@ static void draw_text(int bufnum, const char *s)
 static void clear_text(int bufnum)
 {
     TextBuffer *buf;
-    int i;
 
-    switch (bufnum) {
-	case BUFFER_PLINE:  buf = &plinebuf;  break;
-	case BUFFER_GMSG:   buf = &gmsgbuf;   break;
-	case BUFFER_ATTDEF: buf = &attdefbuf; break;
-	default: return;
-    }
-    if (buf->text) {
-	for (i = 0; i < buf->height; i++) {
-	    if (buf->text[i]) {
-		free(buf->text[i]);
-		buf->text[i] = NULL;
-	    }
-	}
-	buf->line = 0;
-    }
+    if (!(buf = get_textbuf(bufnum)))
+	return;
+    if (buf->text.data)
+	textring_clear(&buf->text);
+    buf->line = 0;
+    buf->scroll = 0;
     if (buf->win) {
 	werase(buf->win);
 	screen_refresh();
@@ -436,13 +461,59 @@ static void clear_text(int bufnum)
 
 /*************************************************************************/
 
-/* Restore the contents of the given text buffer. */
+/* Redraw the window for the given text buffer from its history, wrapping
+ * the messages to the window's current width and leaving out the newest
+ * buf->scroll lines.
+ */
 
 static void restore_text(TextBuffer *buf)
 {
+    TextWrap wrap;
+    const char *s;
+    int total = 0, first, oldest, i, n;
+
+    werase(buf->win);
     buf->line = 0;
-    while (buf->line < buf->height && buf->text[buf->line])
-	outline(buf, buf->text[buf->line]);
+    /* Find how many lines the messages we need take up... */
+    for (oldest = 0; total < buf->height + buf->scroll; oldest++) {
+	if (!(s = textring_get(&buf->text, oldest)))
+	    break;
+	total += text_wrap(s, buf->width, &wrap);
+    }
+    if (buf->scroll > total - buf->height)
+	buf->scroll = total > buf->height ? total - buf->height : 0;
+    first = total - buf->height - buf->scroll;
+    /* ...and draw them, oldest first. */
+    total = 0;
+    while (--oldest >= 0) {
+	n = text_wrap(textring_get(&buf->text, oldest), buf->width, &wrap);
+	for (i = 0; i < n && buf->line < buf->height; i++, total++) {
+	    if (total >= first)
+		outline(buf, &wrap, i);
+	}
+    }
+}
+
+/*************************************************************************/
+
+/* Scroll a text buffer back or forward through its history. */
+
+static void scroll_text(int bufnum, int pages)
+{
+    TextBuffer *buf;
+    int x, y;
+
+    if (!(buf = get_textbuf(bufnum)) || !buf->text.data)
+	return;
+    buf->scroll += pages * (buf->height > 2 ? buf->height - 1 : 1);
+    if (buf->scroll < 0)
+	buf->scroll = 0;
+    if (buf->win) {
+	getyx(stdscr, y, x);
+	restore_text(buf);
+	move(y, x);
+	screen_refresh();
+    }
 }
 
 /*************************************************************************/
@@ -463,9 +534,7 @@ static void open_textwin(TextBuffer *buf)
 	buf->win = subwin(stdscr, buf->height, buf->width, buf->y, buf->x);
 	scrollok(buf->win, TRUE);
     }
-    if (!buf->text)
-	buf->text = calloc(buf->height, sizeof(char *));
-    else
+    if (buf->text.data)
 	restore_text(buf);
 }
 
@@ -514,6 +583,12 @@ static int tile_chars[15] =
 /* Are we redrawing the entire display? */
 static int field_redraw = 0;
 
+/* What each field and the next piece box showed when last drawn, so that
+ * only cells which have changed need to be drawn again.  These are only
+ * valid when field_redraw is zero. */
+static Field shown_fields[6];
+static char shown_next[4][4];
+
 /*************************************************************************/
 /*************************************************************************/
 
@@ -530,7 +605,7 @@ static void setup_fields(void)
     int i, j, x, y, base, delta, attdefbot;
     char buf[32];
 
-    if (!(tile_chars[0] & A_ATTRIBUTES)) {
+    if (!(tile_chars[1] & A_ATTRIBUTES)) {
 	for (i = 1; i < 15; i++)
 	    tile_chars[i] |= A_BOLD;
 	tile_chars[1] |= getcolor(COLOR_BLUE, COLOR_BLUE);
@@ -541,6 +616,9 @@ static void setup_fields(void)
     }
 
     field_redraw = 1;
+    /* The status isn't drawn between games, so the next piece box may be
+     * drawn again some time after the screen is cleared. */
+    memset(shown_next, -1, sizeof(shown_next));
     leaveok(stdscr, TRUE);
     close_textwin(&plinebuf);
     clear();
@@ -702,25 +780,35 @@ static void setup_fields(void)
 
 /*************************************************************************/
 
-/* Display the player's own field. */
+/* Display the player's own field.  Only rows which have changed since the
+ * last time are drawn, unless we're redrawing the entire display.
+ */
 
 static void draw_own_field(void)
 {
-    int x, y, x0, y0;
+    int x, y, x0, y0, rows;
     Field *f = &fields[my_playernum-1];
-    int shadow[4] = { -1, -1, -1, -1 };
+    Field *shown = &shown_fields[my_playernum-1];
 
     if (dispmode != MODE_FIELDS)
 	return;
 
+    rows = field_redraw ? ALL_ROWS : dirty_rows[my_playernum-1];
+    dirty_rows[my_playernum-1] = 0;
     x0 = own_coord[0]+1;
     y0 = own_coord[1];
     for (y = 0; y < 22; y++) {
+	if (!(rows & ROW(y)))
+	    continue;
         for (x = 0; x < 12; x++) {
             int c = tile_chars[(int) (*f)[y][x]];
 
+	    if (!field_redraw && (*shown)[y][x] == (*f)[y][x])
+		continue;
+	    (*shown)[y][x] = (*f)[y][x];
             mvaddch((y0+y), x0+x*2, c);
             addch(c);
+	    frame_cells++;
         }
     }
     if (gmsg_inputwin) {
@@ -736,25 +824,35 @@ static void draw_own_field(void)
 
 /*************************************************************************/
 
-/* Display another player's field. */
+/* Display another player's field.  As with our own field, only changed
+ * rows are drawn.
+ */
 
 static void draw_other_field(int player)
 {
-    int x, y, x0, y0;
-    Field *f;
+    int x, y, x0, y0, rows;
+    Field *f, *shown;
 
     if (dispmode != MODE_FIELDS)
 	return;
     f = &fields[player-1];
+    shown = &shown_fields[player-1];
+    rows = field_redraw ? ALL_ROWS : dirty_rows[player-1];
+    dirty_rows[player-1] = 0;
     if (player > my_playernum)
 	player--;
     player--;
     x0 = other_coord[player][0]+1;
     y0 = other_coord[player][1];
     for (y = 0; y < 22; y++) {
-	move(y0+y, x0);
+	if (!(rows & ROW(y)))
+	    continue;
 	for (x = 0; x < 12; x++) {
-	    addch(tile_chars[(int) (*f)[y][x]]);
+	    if (!field_redraw && (*shown)[y][x] == (*f)[y][x])
+		continue;
+	    (*shown)[y][x] = (*f)[y][x];
+	    mvaddch(y0+y, x0+x, tile_chars[(int) (*f)[y][x]]);
+	    frame_cells++;
 	}
     }
     if (gmsg_inputwin) {
@@ -787,9 +885,11 @@ static void draw_status(void)
     y = wide_screen ? alt_next_coord[1] : next_coord[1];
     if (get_shape(next_piece, 0, shape) == 0) {
 	for (j = 0; j < 4; j++) {
-	    if (!wide_screen)
-		move(y+j, x);
 	    for (i = 0; i < 4; i++) {
+		if (!field_redraw && shown_next[j][i] == shape[j][i])
+		    continue;
+		shown_next[j][i] = shape[j][i];
+		frame_cells++;
 		if (wide_screen) {
 		    move(y+j*2, x+i*2);
 		    addch(tile_chars[(int) shape[j][i]]);
@@ -798,7 +898,7 @@ static void draw_status(void)
 		    addch(tile_chars[(int) shape[j][i]]);
 		    addch(tile_chars[(int) shape[j][i]]);
 		} else
-		    addch(tile_chars[(int) shape[j][i]]);
+		    mvaddch(y+j, x+i, tile_chars[(int) shape[j][i]]);
 	    }
 	}
     }
@@ -1086,13 +1186,17 @@ static void setup_winlist(void)
 Interface tty_interface = {
 
     wait_for_input,
+    read_key,
 
     screen_setup,
     screen_refresh,
     screen_redraw,
+    screen_hold,
+    screen_flush,
 
     draw_text,
     clear_text,
+    scroll_text,
 
     setup_fields,
     draw_own_field,